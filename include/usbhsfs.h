@@ -13,6 +13,7 @@
 #ifndef __USBHSFS_H__
 #define __USBHSFS_H__
 
+#include <sys/types.h>
 #include <switch.h>
 
 #ifdef __cplusplus
@@ -29,6 +30,10 @@ extern "C" {
                                     ((x) == UsbHsFsDeviceFileSystemType_exFAT ? "exFAT" : ((x) == UsbHsFsDeviceFileSystemType_NTFS  ? "NTFS"  : ((x) == UsbHsFsDeviceFileSystemType_EXT2  ? "EXT2"  : \
                                     ((x) == UsbHsFsDeviceFileSystemType_EXT3  ? "EXT3"  : ((x) == UsbHsFsDeviceFileSystemType_EXT4  ? "EXT4"  : "Invalid"))))))))
 
+/// Sparse volume image magic word ("USIM") and format version. Used with UsbHsFsSparseImageHeader.
+#define LIBUSBHSFS_SPARSE_IMAGE_MAGIC   0x4D495355
+#define LIBUSBHSFS_SPARSE_IMAGE_VERSION 1
+
 /// Used to identify the filesystem type from a mounted filesystem (e.g. filesize limitations, etc.).
 typedef enum {
     UsbHsFsDeviceFileSystemType_Invalid = 0,
@@ -55,14 +60,40 @@ typedef enum {
     UsbHsFsMountFlags_ShowSystemFiles             = BIT(5), ///< NTFS only. System file entries are returned while enumerating directories.
     UsbHsFsMountFlags_IgnoreFileReadOnlyAttribute = BIT(6), ///< NTFS only. Allows writing to files even if they are marked as read-only.
     UsbHsFsMountFlags_IgnoreHibernation           = BIT(7), ///< NTFS only. Filesystem is mounted even if it's in a hibernated state. The saved Windows session is completely lost.
+    UsbHsFsMountFlags_CacheFileHandles            = BIT(8), ///< Recently closed read-only file handles are kept open and reused if the same file is opened again as read-only. Cached handles are released after a write, truncate, unlink or rename operation on the same path.
+    UsbHsFsMountFlags_RelativeAccessTimes         = BIT(9), ///< NTFS only. Requires UsbHsFsMountFlags_UpdateAccessTimes. Access times are only updated if they're older than the last modification/change time, or more than a day old.
 
     ///< Pre-generated bitmasks provided for convenience.
-    UsbHsFsMountFlags_Default                     = (UsbHsFsMountFlags_ShowHiddenFiles | UsbHsFsMountFlags_UpdateAccessTimes | UsbHsFsMountFlags_ReplayJournal),
+    UsbHsFsMountFlags_Default                     = (UsbHsFsMountFlags_ShowHiddenFiles | UsbHsFsMountFlags_UpdateAccessTimes | UsbHsFsMountFlags_RelativeAccessTimes | UsbHsFsMountFlags_ReplayJournal),
     UsbHsFsMountFlags_SuperUser                   = (UsbHsFsMountFlags_IgnoreFileReadOnlyAttribute | UsbHsFsMountFlags_ShowSystemFiles | UsbHsFsMountFlags_Default),
     UsbHsFsMountFlags_Force                       = (UsbHsFsMountFlags_IgnoreHibernation | UsbHsFsMountFlags_Default),
-    UsbHsFsMountFlags_All                         = (UsbHsFsMountFlags_IgnoreHibernation | (UsbHsFsMountFlags_IgnoreHibernation - 1))
+    UsbHsFsMountFlags_All                         = (UsbHsFsMountFlags_RelativeAccessTimes | (UsbHsFsMountFlags_RelativeAccessTimes - 1))
 } UsbHsFsMountFlags;
 
+/// USB Mass Storage device quirks. Used with usbHsFsAddDeviceQuirks().
+/// Known-bad devices can skip commands that would fail anyway, while known-good devices can skip probing steps altogether.
+typedef enum {
+    UsbHsFsDeviceQuirks_None               = 0,      ///< No quirks.
+    UsbHsFsDeviceQuirks_NoGetMaxLun        = BIT(0), ///< Don't send Get Max LUN requests. A single LUN is assumed.
+    UsbHsFsDeviceQuirks_NoVpdInquiry       = BIT(1), ///< Don't send Unit Serial Number VPD Inquiry commands. The serial number from the standard Inquiry data is used instead.
+    UsbHsFsDeviceQuirks_NoModeSense6       = BIT(2), ///< Don't send Mode Sense (6) commands. Mode Sense (10) is used right away.
+    UsbHsFsDeviceQuirks_NoModeSense        = BIT(3), ///< Don't send Mode Sense commands at all. LUNs are assumed to be writable without FUA support.
+    UsbHsFsDeviceQuirks_NoFua              = BIT(4), ///< Never use Force Unit Access, even if LUNs claim to support it.
+    UsbHsFsDeviceQuirks_TestUnitReadyDelay = BIT(5), ///< Wait one second before sending Test Unit Ready commands while starting LUNs (e.g. slow spin-up).
+    UsbHsFsDeviceQuirks_NoWarmStart        = BIT(6), ///< Always perform a bus reset on this device at startup, without trying a BOT mass storage reset first.
+    UsbHsFsDeviceQuirks_NoBusReset         = BIT(7), ///< Never reset this device at startup. Only use it with devices known to recover on their own.
+
+    ///< Pre-generated bitmasks provided for convenience.
+    UsbHsFsDeviceQuirks_All                = (UsbHsFsDeviceQuirks_NoBusReset | (UsbHsFsDeviceQuirks_NoBusReset - 1))
+} UsbHsFsDeviceQuirks;
+
+/// I/O priority classes. Used with usbHsFsSetThreadIoPriority().
+typedef enum {
+    UsbHsFsIoPriority_Interactive = 0,  ///< Default. Suitable for latency-sensitive operations (e.g. directory listings, media playback).
+    UsbHsFsIoPriority_Bulk        = 1,  ///< Suitable for background transfers (e.g. file copies). Yields to pending interactive operations on the same drive.
+    UsbHsFsIoPriority_Count       = 2   ///< Total values supported by this enum.
+} UsbHsFsIoPriority;
+
 /// Struct used to list filesystems that have been mounted as virtual devices via devoptab.
 /// Everything but the manufacturer, product_name and name fields is empty/zeroed-out under SX OS.
 typedef struct {
@@ -70,6 +101,8 @@ typedef struct {
     u8 lun;                 ///< Logical unit. Internal use.
     u32 fs_idx;             ///< Filesystem index. Internal use.
     bool write_protect;     ///< Set to true if the logical unit is protected against write operations.
+    bool write_cache;       ///< Set to true if the volatile write cache from the logical unit is enabled (WCE bit from the Caching mode page).
+    bool read_cache;        ///< Set to true unless the read cache from the logical unit is disabled (RCD bit from the Caching mode page).
     u16 vid;                ///< Vendor ID. Retrieved from the device descriptor. Useful if you wish to implement a filter in your application.
     u16 pid;                ///< Product ID. Retrieved from the device descriptor. Useful if you wish to implement a filter in your application.
     char manufacturer[64];  ///< UTF-8 encoded manufacturer string. Retrieved from SCSI Inquiry data or the USB device descriptor. May be empty.
@@ -84,6 +117,100 @@ typedef struct {
 /// Used with usbHsFsSetPopulateCallback().
 typedef void (*UsbHsFsPopulateCb)(const UsbHsFsDevice *devices, u32 device_count, void *user_data);
 
+/// I/O vector used with usbHsFsReadFileVectored() and usbHsFsWriteFileVectored().
+typedef struct {
+    void *data;             ///< Pointer to the data buffer for this segment.
+    size_t size;            ///< Size of the data buffer for this segment, in bytes. Zero-sized segments are skipped.
+} UsbHsFsIoVector;
+
+/// Raw block I/O request types. Used with UsbHsFsRawRequest.
+typedef enum {
+    UsbHsFsRawRequestType_Read  = 0,    ///< Read logical blocks into the data buffer.
+    UsbHsFsRawRequestType_Write = 1     ///< Write logical blocks from the data buffer.
+} UsbHsFsRawRequestType;
+
+/// Raw block I/O request status values. Used with UsbHsFsRawRequest.
+typedef enum {
+    UsbHsFsRawRequestStatus_Pending   = 0,  ///< The request is queued or being processed.
+    UsbHsFsRawRequestStatus_Success   = 1,  ///< The request was successfully processed.
+    UsbHsFsRawRequestStatus_Failed    = 2,  ///< An I/O error occurred, or the logical unit is no longer available.
+    UsbHsFsRawRequestStatus_Denied    = 3,  ///< Write request targeting a write-protected logical unit, or a logical unit with mounted volumes.
+    UsbHsFsRawRequestStatus_Cancelled = 4   ///< The raw block I/O handle was closed before the request could be processed.
+} UsbHsFsRawRequestStatus;
+
+/// Raw block I/O request. Used with usbHsFsRawSubmitRequest().
+/// Both the request and its data buffer must remain valid, and must not be modified, while the request is pending.
+typedef struct {
+    u8 type;                ///< UsbHsFsRawRequestType.
+    u8 status;              ///< UsbHsFsRawRequestStatus. Set by the library. Read it with usbHsFsRawGetRequestStatus() while the request may still be pending.
+    u32 block_count;        ///< Number of logical blocks to transfer. Must be non-zero.
+    u64 block_addr;         ///< Starting logical block address.
+    void *buf;              ///< Data buffer. Must be at least `block_count * block_length` bytes long.
+    UEvent *event;          ///< Optional user-mode event, signaled once the request is no longer pending. May be NULL.
+    void *user_data;        ///< Free for use by the caller.
+} UsbHsFsRawRequest;
+
+/// Opaque raw block I/O handle. Returned by usbHsFsRawOpenLogicalUnit().
+typedef struct UsbHsFsRawLogicalUnit UsbHsFsRawLogicalUnit;
+
+/// Object pool types. Used with usbHsFsSetObjectPoolCapacity() and usbHsFsGetObjectPoolStats().
+typedef enum {
+    UsbHsFsObjectPoolType_FileState     = 0,    ///< Cached file handle states. Each object is large enough to hold a file state from any supported filesystem.
+    UsbHsFsObjectPoolType_DirEntryBatch = 1,    ///< Directory entry batches (16 KiB each). Used to hold directory listings from NTFS volumes.
+    UsbHsFsObjectPoolType_NameBuffer    = 2,    ///< Path and filename buffers. Used for FAT long filename working buffers and cached file handle paths.
+    UsbHsFsObjectPoolType_ScratchBuffer = 3,    ///< Scratch buffers (8 KiB each). Used for partition table parsing and unaligned NTFS I/O.
+    UsbHsFsObjectPoolType_Count         = 4     ///< Total values supported by this enum.
+} UsbHsFsObjectPoolType;
+
+/// Object pool allocation statistics. Retrieved by usbHsFsGetObjectPoolStats().
+typedef struct {
+    u32 object_size;        ///< Object size, in bytes.
+    u32 capacity;           ///< Number of preallocated objects.
+    u32 in_use;             ///< Number of preallocated objects currently in use.
+    u32 peak_in_use;        ///< Max number of preallocated objects in use at the same time.
+    u64 alloc_count;        ///< Total number of allocations requested from this pool.
+    u64 heap_alloc_count;   ///< Number of allocations served by the heap because all preallocated objects were in use. If non-zero, consider increasing the pool capacity.
+} UsbHsFsObjectPoolStats;
+
+/// Memory budget categories. Used with UsbHsFsMemoryUsage.
+typedef enum {
+    UsbHsFsMemoryCategory_TransferBuffers = 0,  ///< Dedicated USB transfer buffers (one per drive).
+    UsbHsFsMemoryCategory_VolumeContexts  = 1,  ///< Per-volume filesystem objects. NTFS and EXT volumes are charged using a fixed estimate of the memory used by their filesystem libraries.
+    UsbHsFsMemoryCategory_VolumeCaches    = 2,  ///< Per-volume caches (e.g. file handle caches). Skipped altogether if they don't fit within the memory budget.
+    UsbHsFsMemoryCategory_ObjectPools     = 3,  ///< Preallocated object pool storage. Pools that don't fit within the memory budget are disabled.
+    UsbHsFsMemoryCategory_Count           = 4   ///< Total values supported by this enum.
+} UsbHsFsMemoryCategory;
+
+/// Memory usage report. Retrieved by usbHsFsGetMemoryUsage().
+typedef struct {
+    u64 budget;                                             ///< Memory budget, in bytes. Zero if unlimited.
+    u64 in_use;                                             ///< Memory currently charged against the budget, in bytes.
+    u64 peak_in_use;                                        ///< Max amount of memory charged against the budget at the same time, in bytes.
+    u64 category_in_use[UsbHsFsMemoryCategory_Count];       ///< Memory currently charged against the budget, in bytes, per UsbHsFsMemoryCategory.
+    u32 xfer_buf_size;                                      ///< Size of the USB transfer buffer assigned to each drive, in bytes.
+    u32 refused_count;                                      ///< Number of allocations refused because they would have exceeded the memory budget.
+} UsbHsFsMemoryUsage;
+
+/// Sparse volume image header. Written by usbHsFsCreateSparseVolumeImage(). All fields are stored in little endian byte order.
+/// It's followed by `extent_count` UsbHsFsSparseImageExtent entries sorted by offset, and then by the data from each extent, in the same order.
+/// Volume areas not covered by any extent hold unallocated space. They may be zero-filled, or skipped altogether, when restoring the image.
+typedef struct {
+    u32 magic;              ///< LIBUSBHSFS_SPARSE_IMAGE_MAGIC.
+    u32 version;            ///< LIBUSBHSFS_SPARSE_IMAGE_VERSION.
+    u32 block_length;       ///< Logical block length from the logical unit the volume belongs to. All extent offsets and sizes are aligned to this value.
+    u32 extent_count;       ///< Number of extents.
+    u64 volume_size;        ///< Volume size, in bytes.
+    u64 data_size;          ///< Sum of all extent sizes, in bytes.
+    u8 fs_type;             ///< UsbHsFsDeviceFileSystemType.
+    u8 reserved[0x7];
+} UsbHsFsSparseImageHeader;
+
+/// Sparse volume image extent. Used with UsbHsFsSparseImageHeader.
+typedef struct {
+    u64 offset;             ///< Offset relative to the start of the volume, in bytes.
+    u64 size;               ///< Extent size, in bytes.
+} UsbHsFsSparseImageExtent;
+
 /// Initializes the USB Mass Storage Host interface.
 /// `event_idx` represents the event index to use with usbHsCreateInterfaceAvailableEvent() / usbHsDestroyInterfaceAvailableEvent(). Must be within the [0, 2] range.
 /// If you're not using any usb:hs interface available events on your own, set this value to 0. If running under SX OS, this value will be ignored.
@@ -163,6 +290,14 @@ u32 usbHsFsGetMountedDeviceCount(void);
 /// This function has no effect at all under SX OS.
 bool usbHsFsUnmountDevice(const UsbHsFsDevice *device, bool signal_status_event);
 
+/// Formats the logical unit referenced by the provided UsbHsFsDevice entry, creating a single partition that spans the whole logical unit (MBR, or GPT if it holds more than 2^32 blocks).
+/// `fs_type` must be either UsbHsFsDeviceFileSystemType_FAT32 or UsbHsFsDeviceFileSystemType_exFAT. `cluster_size` must be a power of two, or zero to automatically choose a cluster size.
+/// All filesystems from the logical unit are unmounted beforehand, and all data stored in it is lost. The new volume is mounted right away if the format operation succeeds.
+/// Filesystem metadata areas are cleared using Write Same commands if the logical unit supports them, which is much faster than writing zeros on large drives.
+/// The user-mode status change event returned by usbHsFsGetStatusChangeUserEvent() is always fired, and the user callback set with usbHsFsSetPopulateCallback() is executed (if available).
+/// This function has no effect at all under SX OS.
+bool usbHsFsFormatDevice(const UsbHsFsDevice *device, u8 fs_type, u32 cluster_size);
+
 /// Returns a bitmask with the current filesystem mount flags.
 /// Can be used even if the USB Mass Storage Host interface hasn't been initialized.
 /// This function has no effect at all under SX OS.
@@ -173,6 +308,150 @@ u32 usbHsFsGetFileSystemMountFlags(void);
 /// This function has no effect at all under SX OS.
 void usbHsFsSetFileSystemMountFlags(u32 flags);
 
+/// Returns the current EXT journal commit interval, in seconds.
+/// Can be used even if the USB Mass Storage Host interface hasn't been initialized.
+/// This function has no effect at all under SX OS, or if the ISC build of the library is used.
+u32 usbHsFsGetExtJournalCommitInterval(void);
+
+/// Sets the EXT journal commit interval, in seconds, which will be used for all subsequent EXT mount operations. Similar to the `commit=` mount option from Linux.
+/// If non-zero, metadata, journal and partially written data blocks from writable EXT volumes are kept in the block cache and committed to the UMS device in a single batch once the interval elapses, fsync() is called,
+/// the block cache fills up or the volume is unmounted. A value of zero (default) disables this behaviour, committing each metadata-changing operation right away.
+/// Can be used even if the USB Mass Storage Host interface hasn't been initialized.
+/// This function has no effect at all under SX OS, or if the ISC build of the library is used.
+void usbHsFsSetExtJournalCommitInterval(u32 seconds);
+
+/// Enables a persistent drive cache stored at the provided SD card path (e.g. "/switch/app/usbhsfs.cache"). A NULL pointer or an empty string disables it.
+/// The drive cache holds device strings, SCSI identity data and partition layouts from previously mounted LUNs, keyed by VID, PID, USB serial number and LUN index.
+/// Drives with a matching cache entry skip some of the steps needed to mount them, which speeds things up considerably for drives that are frequently reconnected.
+/// Cached partition layouts are only used if the LUN capacity and all partition table blocks still match, and each cached volume is inspected before being mounted.
+/// Drives without a USB serial number string are never cached. The drive cache file is written to whenever cached data changes, as well as by usbHsFsExit().
+/// Can be used even if the USB Mass Storage Host interface hasn't been initialized. This function has no effect at all under SX OS.
+bool usbHsFsSetDriveCacheFilePath(const char *path);
+
+/// Returns true if drive write caching is enabled. See usbHsFsSetDriveWriteCache().
+/// Can be used even if the USB Mass Storage Host interface hasn't been initialized. This function has no effect at all under SX OS.
+bool usbHsFsGetDriveWriteCache(void);
+
+/// Enables or disables drive write caching for all logical units started afterwards. Disabled by default.
+/// If enabled, logical units with a disabled volatile write cache get it enabled via a Mode Select command. The previous setting is restored by the drive after a power cycle.
+/// Data is then written without Force Unit Access, and the write cache is flushed on fsync(), file close and unmount operations, as well as when stopping the logical unit.
+/// This greatly improves write speeds with USB bridges that ship with a disabled write cache, but cached data may be lost if the drive is unplugged without being unmounted first.
+/// Can be used even if the USB Mass Storage Host interface hasn't been initialized. This function has no effect at all under SX OS.
+void usbHsFsSetDriveWriteCache(bool enable);
+
+/// Adds an entry to the device quirks table, or replaces an existing entry with the same VID and PID. A PID of zero matches all devices from the provided VID.
+/// `quirks` is a UsbHsFsDeviceQuirks bitmask. If non-zero, `max_block_count` overrides the max number of logical blocks transferred by a single Read/Write command.
+/// Entries added with this function take precedence over the built-in ones. They only affect devices initialized afterwards.
+/// Can be used even if the USB Mass Storage Host interface hasn't been initialized. This function has no effect at all under SX OS.
+bool usbHsFsAddDeviceQuirks(u16 vid, u16 pid, u32 quirks, u32 max_block_count);
+
+/// Sets the number of objects preallocated by usbHsFsInitialize() for the provided object pool type. A capacity of zero disables the pool.
+/// Object pools keep frequently allocated file states and buffers in a few contiguous memory blocks, which reduces both heap fragmentation and allocation latency.
+/// Allocations are served by the heap whenever all preallocated objects are in use. Default capacities: 16 file states, 4 directory entry batches, 16 name buffers and 8 scratch buffers.
+/// Must be called before usbHsFsInitialize(). Returns false if the interface has already been initialized, or if the provided pool type is invalid.
+bool usbHsFsSetObjectPoolCapacity(UsbHsFsObjectPoolType type, u32 capacity);
+
+/// Retrieves allocation statistics for the provided object pool type. Statistics are reset by usbHsFsInitialize().
+bool usbHsFsGetObjectPoolStats(UsbHsFsObjectPoolType type, UsbHsFsObjectPoolStats *out_stats);
+
+/// Sets a library-wide memory budget, in bytes. A value of zero (default) removes the limit.
+/// The budget is apportioned across the USB transfer buffers from all drives, per-volume filesystem objects and caches, and preallocated object pools.
+/// Transfer buffers (8 MiB each by default) are shrunk down to 256 KiB as more drives are connected, and grown back as drives are removed. Some room is always left for the volumes from each drive.
+/// Drives and volumes that don't fit within the budget aren't initialized or mounted at all, and optional caches are skipped.
+/// Must be called before usbHsFsInitialize(). Returns false if the interface has already been initialized.
+/// This function has no effect at all under SX OS.
+bool usbHsFsSetMemoryBudget(u64 budget);
+
+/// Retrieves a report about the memory charged against the library-wide memory budget. Memory usage is tracked even if no budget has been set.
+bool usbHsFsGetMemoryUsage(UsbHsFsMemoryUsage *out_usage);
+
+/// Preallocates storage space for the file referenced by the provided file descriptor, up to `size` bytes from the start of the file.
+/// The file size isn't modified, but sequential writes up to `size` bytes will no longer need to allocate any blocks, which greatly reduces both fragmentation and metadata writes.
+/// The file descriptor must have been opened for writing. Returns false if an error occurs, with `errno` set accordingly (e.g. ENOTSUP if the underlying filesystem doesn't support this operation).
+/// Only EXT filesystems (extent-based files) are supported at this moment. This function has no effect at all under SX OS, or if the ISC build of the library is used.
+bool usbHsFsPreallocateFile(int fd, u64 size);
+
+/// Sets a final file size hint for the next file opened for writing by the calling thread. Equivalent to calling usbHsFsPreallocateFile() right after opening the file.
+/// The hint is consumed by the next open() call with write access on a UMS filesystem made by the calling thread, regardless of its outcome. A value of zero clears the hint.
+/// Only EXT filesystems are supported at this moment. This function has no effect at all under SX OS, or if the ISC build of the library is used.
+void usbHsFsSetFileSizeHint(u64 size);
+
+/// Reads up to `size` bytes from the file referenced by the provided file descriptor, starting at `offset`. Equivalent to POSIX pread().
+/// The file position of the file descriptor isn't used nor modified, which makes it possible for multiple threads to read from different offsets of the same file descriptor without having to serialize seek + read call pairs.
+/// Returns the number of bytes read (which may be lower than `size` if EOF is reached), or -1 if an error occurs, with `errno` set accordingly.
+/// This function has no effect at all under SX OS (ENOTSUP is returned).
+ssize_t usbHsFsReadFileAt(int fd, void *buf, size_t size, u64 offset);
+
+/// Writes `size` bytes to the file referenced by the provided file descriptor, starting at `offset`. Equivalent to POSIX pwrite(), even if the file descriptor was opened with O_APPEND.
+/// The file position of the file descriptor isn't used nor modified. Returns the number of bytes written, or -1 if an error occurs, with `errno` set accordingly.
+/// This function has no effect at all under SX OS (ENOTSUP is returned).
+ssize_t usbHsFsWriteFileAt(int fd, const void *buf, size_t size, u64 offset);
+
+/// Vectored version of usbHsFsReadFileAt(). Equivalent to POSIX preadv(). Segments from the provided UsbHsFsIoVector array are filled in order using contiguous file data starting at `offset`.
+/// All segments are processed while holding the drive lock only once.
+ssize_t usbHsFsReadFileVectored(int fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset);
+
+/// Vectored version of usbHsFsWriteFileAt(). Equivalent to POSIX pwritev(). Segments from the provided UsbHsFsIoVector array are written in order as contiguous file data starting at `offset`.
+/// All segments are processed while holding the drive lock only once.
+ssize_t usbHsFsWriteFileVectored(int fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset);
+
+/// Copies a file using large transfer buffers. Both paths may point to any devoptab device (e.g. "ums0:/file.bin" and "sdmc:/file.bin").
+/// Reading from the source file and writing to the destination file are overlapped using a background thread, which greatly speeds up drive-to-drive copies.
+/// The destination file is created if it doesn't exist, or truncated if it does. Fails with EINVAL if both paths point to the same file, or if that can't be determined. Whenever possible, storage space for the destination file is preallocated beforehand.
+/// Both threads use the I/O priority class from the calling thread. Returns false if an error occurs, with `errno` set accordingly. The destination file is removed in that case.
+/// This function needs to allocate two USB transfer buffers (16 MiB total).
+bool usbHsFsCopyFile(const char *src_path, const char *dst_path);
+
+/// Creates a sparse image from the volume referenced by the provided UsbHsFsDevice entry. `dst_path` may point to any devoptab device (e.g. "sdmc:/backup.img").
+/// Only allocated space is imaged. It's enumerated using the FAT (FAT12/16/32), the allocation bitmap (exFAT), $Bitmap (NTFS) or the block bitmaps (EXT). Filesystem metadata areas are always imaged.
+/// The image file holds a UsbHsFsSparseImageHeader, followed by the extent table and the extent data. Reading from the drive and writing to the image file are overlapped using a background thread.
+/// Pending metadata is committed beforehand, but the volume must not be written to while the image is being created. Otherwise, the resulting image may be inconsistent.
+/// Both threads use the I/O priority class from the calling thread. Returns false if an error occurs, with `errno` set accordingly. The image file is removed in that case.
+/// This function needs to allocate two USB transfer buffers (16 MiB total). This function has no effect at all under SX OS (ENOTSUP is returned).
+bool usbHsFsCreateSparseVolumeImage(const UsbHsFsDevice *device, const char *dst_path);
+
+/// Returns the I/O priority class used by the calling thread. Defaults to UsbHsFsIoPriority_Interactive.
+UsbHsFsIoPriority usbHsFsGetThreadIoPriority(void);
+
+/// Sets the I/O priority class used by the calling thread for all operations on UMS filesystems.
+/// Whenever multiple threads are waiting to access the same drive, threads using UsbHsFsIoPriority_Interactive are served first. Threads using UsbHsFsIoPriority_Bulk
+/// are only held back for a limited amount of time, which prevents them from starving. This function has no effect at all under SX OS.
+void usbHsFsSetThreadIoPriority(UsbHsFsIoPriority priority);
+
+/************************************************************************************************
+ *                                  Raw block I/O functions                                     *
+ *                                                                                              *
+ * Provide direct access to the logical blocks from a logical unit, which is useful for disk    *
+ * imaging, backup and verification tools. Requests are queued and processed in submission      *
+ * order by a background worker thread, which merges consecutive requests of the same type      *
+ * that target contiguous logical blocks into larger SCSI commands.                             *
+ *                                                                                              *
+ * Filesystems mounted from the logical unit remain available. Because of this, write requests  *
+ * are always denied while the logical unit has mounted volumes.                                *
+ *                                                                                              *
+ * None of these functions are available under SX OS.                                           *
+ ************************************************************************************************/
+
+/// Opens the logical unit a UsbHsFsDevice entry belongs to for raw block I/O. Multiple handles may be opened for the same logical unit.
+/// A background worker thread is created for the new handle. It uses the I/O priority class from the calling thread. Returns NULL if an error occurs.
+UsbHsFsRawLogicalUnit *usbHsFsRawOpenLogicalUnit(const UsbHsFsDevice *device);
+
+/// Closes a raw block I/O handle. Queued requests are cancelled, and the request being processed (if any) is waited on.
+void usbHsFsRawCloseLogicalUnit(UsbHsFsRawLogicalUnit *raw_lun);
+
+/// Retrieves the logical block length (in bytes) and the logical block count from the logical unit referenced by the provided raw block I/O handle. Either pointer may be NULL.
+void usbHsFsRawGetLogicalUnitGeometry(UsbHsFsRawLogicalUnit *raw_lun, u32 *out_block_length, u64 *out_block_count);
+
+/// Queues a raw block I/O request, then returns right away. Up to 64 requests may be pending at any given time for each raw block I/O handle.
+/// Returns false if the request is invalid (e.g. out of bounds), or if the queue is full. The request isn't queued in that case, and its status is left untouched.
+bool usbHsFsRawSubmitRequest(UsbHsFsRawLogicalUnit *raw_lun, UsbHsFsRawRequest *request);
+
+/// Returns the current UsbHsFsRawRequestStatus value from the provided request. Safe to use while the request is still pending.
+UsbHsFsRawRequestStatus usbHsFsRawGetRequestStatus(const UsbHsFsRawRequest *request);
+
+/// Waits until all requests submitted through the provided raw block I/O handle are no longer pending.
+void usbHsFsRawWaitIdle(UsbHsFsRawLogicalUnit *raw_lun);
+
 #ifdef __cplusplus
 }
 #endif
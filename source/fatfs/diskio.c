@@ -111,7 +111,8 @@ DRESULT ff_disk_ioctl (
         switch(cmd)
         {
             case CTRL_SYNC:
-                ret = RES_OK;
+                /* Flush the write cache from the LUN, if needed. */
+                ret = (usbHsFsScsiSynchronizeLogicalUnitCache(lun_ctx) ? RES_OK : RES_ERROR);
                 break;
             case GET_SECTOR_COUNT:
                 *(LBA_t*)buff = lun_ctx->block_count;
@@ -121,6 +122,13 @@ DRESULT ff_disk_ioctl (
                 *(WORD*)buff = lun_ctx->block_length;
                 ret = RES_OK;
                 break;
+            case CTRL_ZERO:
+            {
+                /* Zero out the provided sector range (inclusive), using Write Same commands if possible. */
+                LBA_t *range = (LBA_t*)buff;
+                ret = (usbHsFsScsiZeroLogicalUnitBlocks(lun_ctx, range[0], range[1] - range[0] + 1) ? RES_OK : RES_ERROR);
+                break;
+            }
             default:
                 break;
         }
@@ -55,6 +55,9 @@ DRESULT ff_disk_ioctl (BYTE pdrv, BYTE cmd, void* buff);
 #define CTRL_EJECT			7	/* Eject media */
 #define CTRL_FORMAT			8	/* Create physical format on the media */
 
+/* Custom command (Used by ff_mkfs) */
+#define CTRL_ZERO			30	/* Fill the block of sectors with zeros (LBA_t[2]: first and last sector) */
+
 /* MMC/SDC specific ioctl command */
 #define MMC_GET_TYPE		10	/* Get card type */
 #define MMC_GET_CSD			11	/* Get CSD */
@@ -252,7 +252,7 @@
 #if FF_MAX_SS == FF_MIN_SS
 #define SS(fs)	((UINT)FF_MAX_SS)	/* Fixed sector size */
 #else
-#define SS(fs)	((fs)->ssize)	/* Variable sector size */
+#define SS(fs)	((UINT)1 << (fs)->ssize_log2)	/* Variable sector size. Expressed as a shift, so divisions and modulos by the sector size compile down to shifts and masks */
 #endif
 
 
@@ -269,12 +269,18 @@
 
 /* File lock controls */
 #if FF_FS_LOCK
-typedef struct {
-	FATFS* fs;		/* Object ID 1, volume (NULL:blank entry) */
-	DWORD clu;		/* Object ID 2, containing directory (0:root) */
-	DWORD ofs;		/* Object ID 3, offset in the directory */
+#if FF_FS_LOCK & (FF_FS_LOCK - 1)
+#error FF_FS_LOCK must be a power of 2
+#endif
+#define FS_LOCK_MIN	((FF_FS_LOCK < 64) ? FF_FS_LOCK : 64)	/* Initial size of the per-volume open object table */
+typedef struct _FILESEM {
+	DWORD clu;		/* Object ID 1, containing directory (0:root) */
+	DWORD ofs;		/* Object ID 2, offset in the directory */
 	UINT ctr;		/* Object open counter, 0:none, 0x01..0xFF:read mode open count, 0x100:write mode */
+	UINT next;		/* Next entry in the same hash chain or in the free entry list (index number origin from 1, 0:none) */
 } FILESEM;
+
+static int enq_share (FATFS* fs);
 #endif
 
 
@@ -451,12 +457,9 @@ typedef struct {
 static FATFS *FatFs[FF_VOLUMES];	/* Pointer to the filesystem objects (logical drives) */
 static WORD Fsid;					/* Filesystem mount ID */
 
-#if FF_FS_LOCK
-static FILESEM Files[FF_FS_LOCK];	/* Open object lock semaphores */
-#if FF_FS_REENTRANT
-static volatile BYTE SysLock;		/* System lock flag to protect Files[] (0:no mutex, 1:unlocked, 2:locked) */
-static volatile BYTE SysLockVolume;	/* Volume id who is locking Files[] */
-#endif
+#if FF_FS_LOCK && FF_FS_REENTRANT
+static volatile BYTE SysLock;		/* System lock flag (0:no mutex, 1:unlocked, 2:locked) */
+static volatile BYTE SysLockVolume;	/* Volume id who is locking the system */
 #endif
 
 
@@ -517,6 +520,7 @@ static WCHAR LfnBuf[FF_MAX_LFN + 1];		/* LFN working buffer */
 #define FREE_NAMBUF()	ff_memfree(lfn)
 #endif
 #define MAX_MALLOC	0x8000	/* Must be >=FF_MAX_SS */
+#define MAX_DIR_RA	0x10000	/* Size of the exFAT directory read-ahead buffer. Must be >=FF_MAX_SS */
 
 #else
 #error Wrong setting of FF_USE_LFN
@@ -907,40 +911,97 @@ static void unlock_volume (
 /*-----------------------------------------------------------------------*/
 /* File shareing control functions                                       */
 /*-----------------------------------------------------------------------*/
+/* Each volume holds its own open object table. Semaphores are allocated */
+/* on demand and looked up through a hash table, so their index numbers  */
+/* (lock IDs) never change when the table is grown.                      */
+
+static UINT hash_share (	/* Get the hash chain head index of an object */
+	FATFS* fs,		/* Filesystem object */
+	DWORD clu,		/* Containing directory */
+	DWORD ofs		/* Offset in the directory */
+)
+{
+	DWORD h;
+
+
+	h = clu * 0x9E3779B1 + ofs / SZDIRE;
+	h ^= h >> 16;
+	return (UINT)(h & (fs->lock_cnt - 1));
+}
+
+
+static UINT find_share (	/* Find an object in the open object table and returns its index (0:not opened) */
+	DIR* dp			/* Directory object pointing the object to find */
+)
+{
+	FATFS *fs = dp->obj.fs;
+	UINT i;
+
+
+	if (fs->lock_cnt == 0) return 0;	/* No object has been opened yet */
+	for (i = fs->lock_hash[hash_share(fs, dp->obj.sclust, dp->dptr)]; i; i = fs->locks[i - 1].next) {
+		if (fs->locks[i - 1].clu == dp->obj.sclust && fs->locks[i - 1].ofs == dp->dptr) break;
+	}
+	return i;
+}
+
 
 static FRESULT chk_share (	/* Check if the file can be accessed */
 	DIR* dp,		/* Directory object pointing the file to be checked */
 	int acc			/* Desired access type (0:Read mode open, 1:Write mode open, 2:Delete or rename) */
 )
 {
-	UINT i, be;
+	UINT i;
 
-	/* Search open object table for the object */
-	be = 0;
-	for (i = 0; i < FF_FS_LOCK; i++) {
-		if (Files[i].fs) {	/* Existing entry */
-			if (Files[i].fs == dp->obj.fs &&	 	/* Check if the object matches with an open object */
-				Files[i].clu == dp->obj.sclust &&
-				Files[i].ofs == dp->dptr) break;
-		} else {			/* Blank entry */
-			be = 1;
-		}
-	}
-	if (i == FF_FS_LOCK) {	/* The object has not been opened */
-		return (!be && acc != 2) ? FR_TOO_MANY_OPEN_FILES : FR_OK;	/* Is there a blank entry for new object? */
+
+	i = find_share(dp);		/* Search open object table for the object */
+	if (i == 0) {	/* The object has not been opened */
+		return (acc != 2 && !enq_share(dp->obj.fs)) ? FR_TOO_MANY_OPEN_FILES : FR_OK;	/* Is there a blank entry for new object? */
 	}
 
 	/* The object was opened. Reject any open against writing file and all write mode open */
-	return (acc != 0 || Files[i].ctr == 0x100) ? FR_LOCKED : FR_OK;
+	return (acc != 0 || dp->obj.fs->locks[i - 1].ctr == 0x100) ? FR_LOCKED : FR_OK;
 }
 
 
-static int enq_share (void)	/* Check if an entry is available for a new object */
+static int enq_share (	/* Check if an entry is available for a new object, growing the table if needed */
+	FATFS* fs		/* Filesystem object */
+)
 {
-	UINT i;
-
-	for (i = 0; i < FF_FS_LOCK && Files[i].fs; i++) ;	/* Find a free entry */
-	return (i == FF_FS_LOCK) ? 0 : 1;
+	FILESEM *locks;
+	UINT i, h, n, ncnt;
+
+
+	if (fs->lock_free) return 1;	/* There is a free entry */
+
+	/* All entries are in use. Double the table size, up to FF_FS_LOCK entries */
+	n = fs->lock_cnt;
+	ncnt = n ? n * 2 : FS_LOCK_MIN;
+	if (ncnt > FF_FS_LOCK) return 0;
+	locks = ff_memalloc(ncnt * (sizeof (FILESEM) + sizeof (UINT)));
+	if (!locks) return 0;
+	if (n) {
+		memcpy(locks, fs->locks, n * sizeof (FILESEM));
+		ff_memfree(fs->locks);
+	}
+	fs->locks = locks;
+	fs->lock_hash = (UINT*)(locks + ncnt);
+	fs->lock_cnt = ncnt;
+	memset(fs->lock_hash, 0, ncnt * sizeof (UINT));
+
+	/* Rebuild the hash chains (all existing entries are in use) and the free entry list */
+	for (i = ncnt; i > 0; i--) {
+		if (i > n) {
+			locks[i - 1].ctr = 0;
+			locks[i - 1].next = fs->lock_free;
+			fs->lock_free = i;
+		} else {
+			h = hash_share(fs, locks[i - 1].clu, locks[i - 1].ofs);
+			locks[i - 1].next = fs->lock_hash[h];
+			fs->lock_hash[h] = i;
+		}
+	}
+	return 1;
 }
 
 
@@ -949,53 +1010,57 @@ static UINT inc_share (	/* Increment object open counter and returns its index (
 	int acc		/* Desired access (0:Read, 1:Write, 2:Delete/Rename) */
 )
 {
-	UINT i;
-
+	FATFS *fs = dp->obj.fs;
+	FILESEM *sem;
+	UINT i, h;
 
-	for (i = 0; i < FF_FS_LOCK; i++) {	/* Find the object */
-		if (Files[i].fs == dp->obj.fs
-		 && Files[i].clu == dp->obj.sclust
-		 && Files[i].ofs == dp->dptr) break;
-	}
 
-	if (i == FF_FS_LOCK) {			/* Not opened. Register it as new. */
-		for (i = 0; i < FF_FS_LOCK && Files[i].fs; i++) ;	/* Find a free entry */
-		if (i == FF_FS_LOCK) return 0;	/* No free entry to register (int err) */
-		Files[i].fs = dp->obj.fs;
-		Files[i].clu = dp->obj.sclust;
-		Files[i].ofs = dp->dptr;
-		Files[i].ctr = 0;
+	i = find_share(dp);				/* Find the object */
+	if (i == 0) {					/* Not opened. Register it as new. */
+		if (!enq_share(fs)) return 0;	/* No free entry to register (int err) */
+		i = fs->lock_free;
+		sem = &fs->locks[i - 1];
+		fs->lock_free = sem->next;
+		sem->clu = dp->obj.sclust;
+		sem->ofs = dp->dptr;
+		sem->ctr = 0;
+		h = hash_share(fs, sem->clu, sem->ofs);
+		sem->next = fs->lock_hash[h];
+		fs->lock_hash[h] = i;
 	}
+	sem = &fs->locks[i - 1];
 
-	if (acc >= 1 && Files[i].ctr) return 0;	/* Access violation (int err) */
+	if (acc >= 1 && sem->ctr) return 0;	/* Access violation (int err) */
 
-	Files[i].ctr = acc ? 0x100 : Files[i].ctr + 1;	/* Set semaphore value */
+	sem->ctr = acc ? 0x100 : sem->ctr + 1;	/* Set semaphore value */
 
-	return i + 1;	/* Index number origin from 1 */
+	return i;	/* Index number origin from 1 */
 }
 
 
 static FRESULT dec_share (	/* Decrement object open counter */
+	FATFS* fs,		/* Filesystem object */
 	UINT i			/* Semaphore index (1..) */
 )
 {
-	UINT n;
-	FRESULT res;
+	FILESEM *sem;
+	UINT n, *p;
 
 
-	if (--i < FF_FS_LOCK) {	/* Index number origin from 0 */
-		n = Files[i].ctr;
-		if (n == 0x100) n = 0;	/* If write mode open, delete the object semaphore */
-		if (n > 0) n--;			/* Decrement read mode open count */
-		Files[i].ctr = n;
-		if (n == 0) {			/* Delete the object semaphore if open count becomes zero */
-			Files[i].fs = 0;	/* Free the entry <<<If this memory write operation is not in atomic, FF_FS_REENTRANT == 1 and FF_VOLUMES > 1, there is a potential error in this process >>> */
-		}
-		res = FR_OK;
-	} else {
-		res = FR_INT_ERR;		/* Invalid index number */
+	if (--i >= fs->lock_cnt) return FR_INT_ERR;	/* Invalid index number (index number origin from 0) */
+
+	sem = &fs->locks[i];
+	n = sem->ctr;
+	if (n == 0x100) n = 0;	/* If write mode open, delete the object semaphore */
+	if (n > 0) n--;			/* Decrement read mode open count */
+	sem->ctr = n;
+	if (n == 0) {			/* Delete the object semaphore if open count becomes zero */
+		for (p = &fs->lock_hash[hash_share(fs, sem->clu, sem->ofs)]; *p && *p != i + 1; p = &fs->locks[*p - 1].next) ;
+		if (*p) *p = sem->next;	/* Unlink it from its hash chain */
+		sem->next = fs->lock_free;	/* Put it back into the free entry list */
+		fs->lock_free = i + 1;
 	}
-	return res;
+	return FR_OK;
 }
 
 
@@ -1003,11 +1068,10 @@ static void clear_share (	/* Clear all lock entries of the volume */
 	FATFS* fs
 )
 {
-	UINT i;
-
-	for (i = 0; i < FF_FS_LOCK; i++) {
-		if (Files[i].fs == fs) Files[i].fs = 0;
-	}
+	ff_memfree(fs->locks);	/* The table is allocated again on demand */
+	fs->locks = 0;
+	fs->lock_hash = 0;
+	fs->lock_cnt = fs->lock_free = 0;
 }
 
 #endif	/* FF_FS_LOCK */
@@ -2308,6 +2372,73 @@ static FRESULT dir_read (
 
 
 
+#if FF_FS_EXFAT && FF_USE_LFN == 3
+/*-----------------------------------------------------------------------*/
+/* exFAT: Move window with directory read-ahead                          */
+/*-----------------------------------------------------------------------*/
+
+typedef struct {
+	BYTE*	buf;	/* Read-ahead buffer (null:not allocated yet) */
+	UINT	szb;	/* Size of the read-ahead buffer [sectors] (0:not available) */
+	UINT	next;	/* Number of sectors to read on the next refill */
+	LBA_t	sect;	/* First sector held by the read-ahead buffer */
+	UINT	cnt;	/* Number of sectors held by the read-ahead buffer (0:empty) */
+} DIRRA;
+
+static FRESULT move_window_ra (	/* Returns FR_OK or FR_DISK_ERR */
+	FATFS* fs,		/* Filesystem object */
+	LBA_t sect,		/* Directory sector LBA to make appearance in the fs->win[] */
+	DIRRA* ra		/* Read-ahead state (only valid within a single directory search) */
+)
+{
+	FRESULT res;
+	UINT n;
+
+
+	if (sect == fs->winsect || sect < fs->database || ra->szb == 0) return move_window(fs, sect);	/* No read-ahead needed or available */
+
+	if (sect - ra->sect >= ra->cnt) {	/* Sector not held by the read-ahead buffer? */
+		if (!ra->buf) {		/* Allocate the read-ahead buffer on first use */
+			for (n = MAX_DIR_RA; n > SS(fs) && (ra->buf = ff_memalloc(n)) == 0; n /= 2) ;
+			if (!ra->buf) {
+				ra->szb = 0;
+				return move_window(fs, sect);
+			}
+			ra->szb = n / SS(fs);
+		}
+		n = fs->csize - (UINT)((sect - fs->database) & (fs->csize - 1));	/* Sectors left in the cluster */
+		if (n > ra->next) n = ra->next;
+		if (n > ra->szb) n = ra->szb;
+		if (n <= 1) return move_window(fs, sect);
+		res = sync_window(fs);		/* Make sure the disk is up to date before reading ahead */
+		if (res != FR_OK) return res;
+		ra->cnt = 0;
+		if (ff_disk_read(fs->pdrv, ra->buf, sect, n) != RES_OK) return move_window(fs, sect);
+		ra->sect = sect; ra->cnt = n;
+		if (ra->next < ra->szb) ra->next *= 2;	/* Ramp up the read-ahead size while the search goes on */
+	}
+
+	if (!fs->ro_flag) {		/* Flush the window */
+		res = sync_window(fs);
+		if (res != FR_OK) return res;
+	}
+	memcpy(fs->win, ra->buf + (UINT)(sect - ra->sect) * SS(fs), SS(fs));	/* Fill sector window from the read-ahead buffer */
+	fs->winsect = sect;
+	return FR_OK;
+}
+
+#define DEF_DIRRA		DIRRA ra = { 0, 1, 4, 0, 0 }
+#define MOVE_DIR_WINDOW(fs, sect)	move_window_ra(fs, sect, &ra)
+#define FREE_DIRRA()	ff_memfree(ra.buf)
+#elif FF_FS_EXFAT
+#define DEF_DIRRA
+#define MOVE_DIR_WINDOW(fs, sect)	move_window(fs, sect)
+#define FREE_DIRRA()
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Directory handling - Find an object in the directory                  */
 /*-----------------------------------------------------------------------*/
@@ -2327,21 +2458,55 @@ static FRESULT dir_find (	/* FR_OK(0):succeeded, !=0:error */
 	if (res != FR_OK) return res;
 #if FF_FS_EXFAT
 	if (fs->fs_type == FS_EXFAT) {	/* On the exFAT volume */
-		BYTE nc;
-		UINT di, ni;
+		BYTE nc, ns;
+		UINT di, ni, nlen;
+		DWORD dptr, clust;
+		LBA_t sect;
+		BYTE *dir;
 		WORD hash = xname_sum(fs->lfnbuf);		/* Hash value of the name to find */
+		DEF_DIRRA;
 
-		while ((res = DIR_READ_FILE(dp)) == FR_OK) {	/* Read an item */
-#if FF_MAX_LFN < 255
-			if (fs->dirbuf[XDIR_NumName] > FF_MAX_LFN) continue;		/* Skip comparison if inaccessible object name */
-#endif
-			if (ld_word(fs->dirbuf + XDIR_NameHash) != hash) continue;	/* Skip comparison if hash mismatched */
-			for (nc = fs->dirbuf[XDIR_NumName], di = SZDIRE * 2, ni = 0; nc; nc--, di += 2, ni++) {	/* Compare the name */
-				if ((di % SZDIRE) == 0) di += 2;
-				if (ff_wtoupper(ld_word(fs->dirbuf + di)) != ff_wtoupper(fs->lfnbuf[ni])) break;
+		for (nlen = 0; fs->lfnbuf[nlen]; nlen++) ;	/* Length of the name to find */
+		res = FR_NO_FILE;
+		while (dp->sect) {
+			res = MOVE_DIR_WINDOW(fs, dp->sect);
+			if (res != FR_OK) break;
+			c = dp->dir[XDIR_Type];
+			if (c == 0) { res = FR_NO_FILE; break; }	/* Reached to end of the directory */
+			if (c == ET_FILEDIR) {		/* Start of a file entry block? */
+				ns = dp->dir[XDIR_NumSec];	/* Number of secondary entries */
+				if (ns < 2 || ns > 18) { res = FR_INT_ERR; break; }
+				dptr = dp->dptr; clust = dp->clust; sect = dp->sect; dir = dp->dir;	/* Save location of the block */
+
+				/* Check the stream extension entry first. Name entries are only loaded if both the name length and hash match */
+				res = dir_next(dp, 0);
+				if (res == FR_NO_FILE) res = FR_INT_ERR;	/* It cannot be */
+				if (res != FR_OK) break;
+				res = MOVE_DIR_WINDOW(fs, dp->sect);
+				if (res != FR_OK) break;
+				if (dp->dir[XDIR_Type] != ET_STREAM) { res = FR_INT_ERR; break; }	/* Invalid order */
+				if (dp->dir[XDIR_NumName - SZDIRE] == nlen && ld_word(dp->dir + XDIR_NameHash - SZDIRE) == hash) {	/* XDIR_* offsets are relative to the entry block */
+					dp->dptr = dptr; dp->clust = clust; dp->sect = sect; dp->dir = dir;	/* Rewind to the top of the block */
+					dp->blk_ofs = dptr;
+					res = load_xdir(dp);	/* Load the entry block */
+					if (res != FR_OK) break;
+					dp->obj.attr = fs->dirbuf[XDIR_Attr] & AM_MASK;	/* Get attribute */
+					for (nc = fs->dirbuf[XDIR_NumName], di = SZDIRE * 2, ni = 0; nc; nc--, di += 2, ni++) {	/* Compare the name */
+						if ((di % SZDIRE) == 0) di += 2;
+						if (ff_wtoupper(ld_word(fs->dirbuf + di)) != ff_wtoupper(fs->lfnbuf[ni])) break;
+					}
+					if (nc == 0 && !fs->lfnbuf[ni]) break;	/* Name matched? */
+				} else {
+					while (--ns && (res = dir_next(dp, 0)) == FR_OK) ;	/* Skip the file name entries without loading them */
+					if (res == FR_NO_FILE) res = FR_INT_ERR;	/* It cannot be */
+					if (res != FR_OK) break;
+				}
 			}
-			if (nc == 0 && !fs->lfnbuf[ni]) break;	/* Name matched? */
+			res = dir_next(dp, 0);	/* Next entry */
+			if (res != FR_OK) break;
 		}
+		if (res != FR_OK) dp->sect = 0;		/* Terminate the read operation on error or EOT */
+		FREE_DIRRA();
 		return res;
 	}
 #endif
@@ -3155,8 +3320,9 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 		return FR_WRITE_PROTECTED;
 	}
 #if FF_MAX_SS != FF_MIN_SS				/* Get sector size (multiple sector size cfg only) */
-	if (ff_disk_ioctl(fs->pdrv, GET_SECTOR_SIZE, &SS(fs)) != RES_OK) return FR_DISK_ERR;
-	if (SS(fs) > FF_MAX_SS || SS(fs) < FF_MIN_SS || (SS(fs) & (SS(fs) - 1))) return FR_DISK_ERR;
+	if (ff_disk_ioctl(fs->pdrv, GET_SECTOR_SIZE, &fs->ssize) != RES_OK) return FR_DISK_ERR;
+	if (fs->ssize > FF_MAX_SS || fs->ssize < FF_MIN_SS || (fs->ssize & (fs->ssize - 1))) return FR_DISK_ERR;
+	fs->ssize_log2 = (BYTE)__builtin_ctz(fs->ssize);
 #endif
 
 	bsect = fs->winsect;					/* Volume offset in the hosting physical drive */
@@ -3174,7 +3340,7 @@ static FRESULT mount_volume (	/* FR_OK(0): successful, !=0: an error occurred */
 
 		if (ld_word(fs->win + BPB_FSVerEx) != 0x100) return FR_NO_FILESYSTEM;	/* Check exFAT version (must be version 1.0) */
 
-		if (1 << fs->win[BPB_BytsPerSecEx] != SS(fs)) {	/* (BPB_BytsPerSecEx must be equal to the physical sector size) */
+		if ((UINT)1 << fs->win[BPB_BytsPerSecEx] != SS(fs)) {	/* (BPB_BytsPerSecEx must be equal to the physical sector size) */
 			return FR_NO_FILESYSTEM;
 		}
 
@@ -3471,7 +3637,7 @@ FRESULT ff_open (
 				if (res != FR_OK) {					/* No file, create new */
 					if (res == FR_NO_FILE) {		/* There is no file to open, create a new entry */
 #if FF_FS_LOCK
-						res = enq_share() ? dir_register(&dj) : FR_TOO_MANY_OPEN_FILES;
+						res = enq_share(fs) ? dir_register(&dj) : FR_TOO_MANY_OPEN_FILES;
 #else
 						res = dir_register(&dj);
 #endif
@@ -3606,7 +3772,7 @@ FRESULT ff_open (
 						}
 					}
 #if FF_FS_LOCK
-					if (res != FR_OK) dec_share(fp->obj.lockid); /* Decrement file open counter if seek failed */
+					if (res != FR_OK) dec_share(fs, fp->obj.lockid); /* Decrement file open counter if seek failed */
 #endif
 				}
 			}
@@ -3951,7 +4117,7 @@ FRESULT ff_close (
 
 		if (res == FR_OK) {
 #if FF_FS_LOCK
-			res = dec_share(fp->obj.lockid);		/* Decrement file open counter */
+			res = dec_share(fs, fp->obj.lockid);		/* Decrement file open counter */
 			if (res == FR_OK) fp->obj.fs = 0;	/* Invalidate file object */
 #else
 			fp->obj.fs = 0;	/* Invalidate file object */
@@ -4122,6 +4288,46 @@ FRESULT ff_lseek (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Restore Saved File Read/Write Pointer                                 */
+/*-----------------------------------------------------------------------*/
+/* Puts back a file pointer previously saved from fptr/clust/sect without
+/  following the cluster chain, which f_lseek() would need to do from the
+/  top of the file for any backward seek. Used by positional I/O calls. */
+
+FRESULT ff_setpos (
+	FIL* fp,		/* Pointer to the file object */
+	FSIZE_t ofs,	/* Saved file pointer (fp->fptr) */
+	DWORD clst,		/* Saved current cluster (fp->clust) */
+	LBA_t sect		/* Saved sector cached in fp->buf (fp->sect) */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+
+
+	res = validate(&fp->obj, &fs);		/* Check validity of the file object */
+	if (res == FR_OK) res = (FRESULT)fp->err;
+	if (res != FR_OK) LEAVE_FF(fs, res);
+
+	fp->fptr = ofs;
+	fp->clust = clst;
+	if (ofs % SS(fs) && sect != fp->sect) {	/* Refill sector cache if the pointer lies within a sector that is no longer cached */
+#if !FF_FS_TINY
+		if (!fs->ro_flag && (fp->flag & FA_DIRTY)) {		/* Write-back dirty sector cache */
+			if (ff_disk_write(fs->pdrv, fp->buf, fp->sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);
+			fp->flag &= (BYTE)~FA_DIRTY;
+		}
+		if (ff_disk_read(fs->pdrv, fp->buf, sect, 1) != RES_OK) ABORT(fs, FR_DISK_ERR);	/* Fill sector cache */
+#endif
+		fp->sect = sect;
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
 #if FF_FS_MINIMIZE <= 1
 /*-----------------------------------------------------------------------*/
 /* Create a Directory Object                                             */
@@ -4204,7 +4410,7 @@ FRESULT ff_closedir (
 	res = validate(&dp->obj, &fs);	/* Check validity of the file object */
 	if (res == FR_OK) {
 #if FF_FS_LOCK
-		if (dp->obj.lockid) res = dec_share(dp->obj.lockid);	/* Decrement sub-directory open counter */
+		if (dp->obj.lockid) res = dec_share(fs, dp->obj.lockid);	/* Decrement sub-directory open counter */
 		if (res == FR_OK) dp->obj.fs = 0;	/* Invalidate directory object */
 #else
 		dp->obj.fs = 0;	/* Invalidate directory object */
@@ -4437,6 +4643,78 @@ FRESULT ff_getfree (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Enumerate Allocated Clusters                                          */
+/*-----------------------------------------------------------------------*/
+/* Scans the FAT (or the allocation bitmap on exFAT) and calls func() once
+/  for each run of allocated clusters, in ascending order. Used to image
+/  volumes without reading free space. */
+
+FRESULT ff_getalloc (
+	const TCHAR* path,					/* Logical drive number */
+	void (*func)(DWORD,DWORD,void*),	/* Callback function (start cluster, number of clusters, user data) */
+	void* arg							/* User data passed to func() */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD clst, stat, scl = 0, ncl = 0;
+	FFOBJID obj;
+#if FF_FS_EXFAT
+	LBA_t sect;
+	UINT i = 0;
+	BYTE bm = 0;
+#endif
+
+
+	/* Get logical drive */
+	res = mount_volume(&path, &fs, 0);
+	if (res == FR_OK) {
+		obj.fs = fs;
+#if FF_FS_EXFAT
+		sect = fs->bitbase;		/* Bitmap sector (exFAT) */
+#endif
+		for (clst = 2; clst < fs->n_fatent; clst++) {
+#if FF_FS_EXFAT
+			if (fs->fs_type == FS_EXFAT) {	/* exFAT: Get bit from the allocation bitmap */
+				if ((clst - 2) % 8 == 0) {	/* New byte? */
+					if (i == 0) {	/* New sector? */
+						res = move_window(fs, sect++);
+						if (res != FR_OK) break;
+					}
+					bm = fs->win[i];
+					i = (i + 1) % SS(fs);
+				}
+				stat = bm & 1;
+				bm >>= 1;
+			} else
+#endif
+			{	/* FAT12/16/32: Get FAT entry */
+				stat = get_fat(&obj, clst);
+				if (stat == 0xFFFFFFFF) {
+					res = FR_DISK_ERR; break;
+				}
+				if (stat == 1) {
+					res = FR_INT_ERR; break;
+				}
+			}
+			if (stat != 0) {	/* Allocated cluster: extend current run */
+				if (ncl == 0) scl = clst;
+				ncl++;
+			} else if (ncl != 0) {	/* Free cluster: report current run */
+				func(scl, ncl, arg);
+				ncl = 0;
+			}
+		}
+		if (res == FR_OK && ncl != 0) func(scl, ncl, arg);	/* Report last run */
+	}
+
+	LEAVE_FF(fs, res);
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Truncate File                                                         */
 /*-----------------------------------------------------------------------*/
@@ -5251,6 +5529,559 @@ FRESULT ff_forward (
 
 
 
+#if FF_USE_MKFS
+/*-----------------------------------------------------------------------*/
+/* Create FAT32/exFAT Volume (with sub-functions)                        */
+/*-----------------------------------------------------------------------*/
+
+#define N_SEC_TRACK 63			/* Sectors per track for determination of drive CHS */
+#define PART_ALIGN	0x100000	/* Alignment of the partition start [byte] */
+#define GPT_ITEMS	128			/* Number of GPT table size (>=128, sector aligned) */
+#define GUID_MS_Basic	"\xA2\xA0\xD0\xEB\xE5\xB9\x33\x44\x87\xC0\x68\xB6\xB7\x26\x99\xC7"
+
+
+/* Calculate CRC32 in bytewise */
+static DWORD crc32 (	/* Returns next CRC value */
+	DWORD crc,			/* Current CRC value */
+	BYTE d				/* A byte to be processed */
+)
+{
+	BYTE b;
+
+
+	for (b = 1; b; b <<= 1) {
+		crc ^= (d & b) ? 1 : 0;
+		crc = (crc & 1) ? crc >> 1 ^ 0xEDB88320 : crc >> 1;
+	}
+	return crc;
+}
+
+
+/* Generate random value */
+static DWORD make_rand (
+	DWORD seed,		/* Seed value */
+	BYTE *buff,		/* Output buffer */
+	UINT n			/* Data length */
+)
+{
+	UINT r;
+
+
+	if (seed == 0) seed = 1;
+	do {
+		for (r = 0; r < 8; r++) seed = seed & 1 ? seed >> 1 ^ 0xA3000000 : seed >> 1;	/* Shift 8 bits the 32-bit LFSR */
+		*buff++ = (BYTE)seed;
+	} while (--n);
+	return seed;
+}
+
+
+#if FF_FS_EXFAT
+/* exFAT: Calculate checksum of a VBR sector or the up-case table */
+static DWORD xsum32 (	/* Returns 32-bit checksum */
+	BYTE  dat,			/* Byte to be calculated (byte-by-byte processing) */
+	DWORD sum			/* Previous sum value */
+)
+{
+	sum = ((sum & 1) ? 0x80000000 : 0) + (sum >> 1) + dat;
+	return sum;
+}
+#endif
+
+
+/* Fill a block of sectors with zeros. The storage device does it by itself if it supports CTRL_ZERO. */
+static FRESULT zero_sectors (
+	BYTE pdrv,		/* Physical drive number */
+	LBA_t sect,		/* Start sector */
+	LBA_t nsect,	/* Number of sectors */
+	BYTE* buf,		/* Working buffer */
+	UINT sz_buf,	/* Size of working buffer [sector] */
+	WORD ss			/* Sector size [byte] */
+)
+{
+	LBA_t rng[2];
+	DRESULT dres;
+	UINT n;
+
+
+	if (nsect == 0) return FR_OK;
+	rng[0] = sect; rng[1] = sect + nsect - 1;
+	dres = ff_disk_ioctl(pdrv, CTRL_ZERO, rng);
+	if (dres == RES_OK) return FR_OK;
+	if (dres != RES_PARERR) return FR_DISK_ERR;	/* Failed to zero the sectors (not just an unsupported command) */
+
+	memset(buf, 0, (size_t)sz_buf * ss);		/* Fall back to writing a zero-filled buffer */
+	do {
+		n = (nsect > sz_buf) ? sz_buf : (UINT)nsect;
+		if (ff_disk_write(pdrv, buf, sect, n) != RES_OK) return FR_DISK_ERR;
+		sect += n; nsect -= n;
+	} while (nsect);
+	return FR_OK;
+}
+
+
+/* Create a partition table (MBR or GPT) with a single partition covering the whole drive */
+static FRESULT create_partition (
+	BYTE pdrv,			/* Physical drive number */
+	LBA_t sz_drv,		/* Drive size [sector] */
+	WORD ss,			/* Sector size [byte] */
+	BYTE sys,			/* System ID of the partition (for only MBR) */
+	LBA_t* b_part,		/* Returns the partition start sector */
+	LBA_t* sz_part,		/* Returns the partition size [sector] */
+	BYTE* buf,			/* Working buffer */
+	UINT sz_buf			/* Size of working buffer [sector] */
+)
+{
+	UINT i, cy;
+	DWORD align, bcc, rnd, sz_ptbl, sz_drv32, nxt_alloc32, sz_part32;
+	BYTE *pte;
+	BYTE hd, n_hd, sc, n_sc;
+	FRESULT res;
+#if FF_LBA64
+	QWORD top_bpt;
+#endif
+
+
+	align = PART_ALIGN / ss;			/* Partition alignment [sector] */
+	if (sz_drv < (LBA_t)align * 2) return FR_MKFS_ABORTED;	/* Too small drive? */
+
+#if FF_LBA64
+	if (sz_drv > 0xFFFFFFFF) {	/* Create the partition in GPT format (the drive can't be described by MBR) */
+		rnd = (DWORD)sz_drv + GET_FATTIME();	/* Random seed */
+		sz_ptbl = GPT_ITEMS * SZ_GPTE / ss;	/* Size of partition table [sector] */
+		top_bpt = sz_drv - sz_ptbl - 1;		/* Backup partition table start sector */
+		*b_part = align;					/* Partition start sector (it's always behind the primary partition table) */
+		*sz_part = top_bpt - align;			/* Partition size (up to the backup partition table) */
+
+		bcc = 0xFFFFFFFF;
+		for (i = 0; i < sz_ptbl; i++) {		/* Create the partition table */
+			memset(buf, 0, ss);
+			if (i == 0) {					/* The first entry holds the partition */
+				memcpy(buf + GPTE_PtGuid, GUID_MS_Basic, 16);			/* Partition type GUID (Microsoft Basic Data) */
+				rnd = make_rand(rnd, buf + GPTE_UpGuid, 16);			/* Unique partition GUID */
+				st_qword(buf + GPTE_FstLba, *b_part);					/* Partition start sector */
+				st_qword(buf + GPTE_LstLba, *b_part + *sz_part - 1);	/* Partition end sector */
+			}
+			for (cy = 0; cy < ss; bcc = crc32(bcc, buf[cy++])) ;	/* Calculate table check sum */
+			if (ff_disk_write(pdrv, buf, 2 + i, 1) != RES_OK) return FR_DISK_ERR;			/* Write to primary table */
+			if (ff_disk_write(pdrv, buf, top_bpt + i, 1) != RES_OK) return FR_DISK_ERR;	/* Write to secondary table */
+		}
+
+		/* Create primary GPT header */
+		memset(buf, 0, ss);
+		memcpy(buf + GPTH_Sign, "EFI PART" "\0\0\1\0" "\x5C\0\0", 16);	/* Signature, version (1.0) and size (92) */
+		st_dword(buf + GPTH_PtBcc, ~bcc);				/* Table check sum */
+		st_qword(buf + GPTH_CurLba, 1);					/* LBA of this header */
+		st_qword(buf + GPTH_BakLba, sz_drv - 1);		/* LBA of secondary header */
+		st_qword(buf + GPTH_FstLba, 2 + sz_ptbl);		/* LBA of first allocatable sector */
+		st_qword(buf + GPTH_LstLba, top_bpt - 1);		/* LBA of last allocatable sector */
+		st_dword(buf + GPTH_PteSize, SZ_GPTE);			/* Size of a table entry */
+		st_dword(buf + GPTH_PtNum, GPT_ITEMS);			/* Number of table entries */
+		st_dword(buf + GPTH_PtOfs, 2);					/* LBA of this table */
+		rnd = make_rand(rnd, buf + GPTH_DskGuid, 16);	/* Disk GUID */
+		for (i = 0, bcc = 0xFFFFFFFF; i < 92; bcc = crc32(bcc, buf[i++])) ;	/* Calculate header check sum */
+		st_dword(buf + GPTH_Bcc, ~bcc);					/* Header check sum */
+		if (ff_disk_write(pdrv, buf, 1, 1) != RES_OK) return FR_DISK_ERR;
+
+		/* Create secondary GPT header */
+		st_qword(buf + GPTH_CurLba, sz_drv - 1);		/* LBA of this header */
+		st_qword(buf + GPTH_BakLba, 1);					/* LBA of primary header */
+		st_qword(buf + GPTH_PtOfs, top_bpt);			/* LBA of this table */
+		st_dword(buf + GPTH_Bcc, 0);
+		for (i = 0, bcc = 0xFFFFFFFF; i < 92; bcc = crc32(bcc, buf[i++])) ;	/* Calculate header check sum */
+		st_dword(buf + GPTH_Bcc, ~bcc);					/* Header check sum */
+		if (ff_disk_write(pdrv, buf, sz_drv - 1, 1) != RES_OK) return FR_DISK_ERR;
+
+		/* Clear the gap between the primary partition table and the partition */
+		res = zero_sectors(pdrv, 2 + sz_ptbl, *b_part - (2 + sz_ptbl), buf, sz_buf, ss);
+		if (res != FR_OK) return res;
+
+		/* Create protective MBR */
+		memset(buf, 0, ss);
+		pte = buf + MBR_Table;
+		pte[PTE_StSec] = 2;								/* Start CHS (0/0/2) */
+		pte[PTE_System] = 0xEE;							/* System ID (GPT protective) */
+		pte[PTE_EdHead] = 0xFE; pte[PTE_EdSec] = 0xFF; pte[PTE_EdCyl] = 0xFF;	/* End CHS (not representable) */
+		st_dword(pte + PTE_StLba, 1);					/* Start LBA */
+		st_dword(pte + PTE_SizLba, 0xFFFFFFFF);			/* Number of sectors */
+		st_word(buf + BS_55AA, 0xAA55);
+		if (ff_disk_write(pdrv, buf, 0, 1) != RES_OK) return FR_DISK_ERR;
+
+	} else
+#endif
+	{	/* Create the partition in MBR format */
+		sz_drv32 = (DWORD)sz_drv;
+		nxt_alloc32 = align;			/* Partition start sector */
+		sz_part32 = sz_drv32 - nxt_alloc32;	/* Partition size */
+		n_sc = N_SEC_TRACK;				/* Determine drive CHS without any consideration of the drive geometry */
+		for (n_hd = 8; n_hd != 0 && sz_drv32 / n_hd / n_sc > 1024; n_hd *= 2) ;
+		if (n_hd == 0) n_hd = 255;		/* Number of heads needs to be <256 */
+
+		/* Clear the gap between the MBR and the partition (this also wipes out a stale primary GPT), as well as a stale secondary GPT header */
+		res = zero_sectors(pdrv, 1, nxt_alloc32 - 1, buf, sz_buf, ss);
+		if (res == FR_OK) res = zero_sectors(pdrv, sz_drv32 - 1, 1, buf, sz_buf, ss);
+		if (res != FR_OK) return res;
+
+		memset(buf, 0, ss);				/* Clear MBR */
+		pte = buf + MBR_Table;			/* Partition table in the MBR */
+		st_dword(pte + PTE_StLba, nxt_alloc32);	/* Start LBA */
+		st_dword(pte + PTE_SizLba, sz_part32);	/* Number of sectors */
+		pte[PTE_System] = sys;					/* System type */
+
+		cy = (UINT)(nxt_alloc32 / n_sc / n_hd);	/* Start cylinder */
+		hd = (BYTE)(nxt_alloc32 / n_sc % n_hd);	/* Start head */
+		sc = (BYTE)(nxt_alloc32 % n_sc + 1);	/* Start sector */
+		if (cy > 1023) { cy = 1023; hd = 254; sc = 63; }	/* Clip to the max CHS value */
+		pte[PTE_StHead] = hd;
+		pte[PTE_StSec] = (BYTE)((cy >> 2 & 0xC0) | sc);
+		pte[PTE_StCyl] = (BYTE)cy;
+
+		cy = (UINT)((nxt_alloc32 + sz_part32 - 1) / n_sc / n_hd);	/* End cylinder */
+		hd = (BYTE)((nxt_alloc32 + sz_part32 - 1) / n_sc % n_hd);	/* End head */
+		sc = (BYTE)((nxt_alloc32 + sz_part32 - 1) % n_sc + 1);		/* End sector */
+		if (cy > 1023) { cy = 1023; hd = 254; sc = 63; }	/* Clip to the max CHS value */
+		pte[PTE_EdHead] = hd;
+		pte[PTE_EdSec] = (BYTE)((cy >> 2 & 0xC0) | sc);
+		pte[PTE_EdCyl] = (BYTE)cy;
+
+		st_word(buf + BS_55AA, 0xAA55);		/* MBR signature */
+		if (ff_disk_write(pdrv, buf, 0, 1) != RES_OK) return FR_DISK_ERR;	/* Write it to the MBR */
+
+		*b_part = nxt_alloc32;
+		*sz_part = sz_part32;
+	}
+
+	return FR_OK;
+}
+
+
+
+FRESULT ff_mkfs (
+	BYTE pdrv,				/* Physical drive number */
+	const MKFS_PARM* opt,	/* Format options */
+	void* work,				/* Pointer to working buffer */
+	UINT len				/* Size of working buffer [byte] */
+)
+{
+	static const WORD cst32[] = {1, 2, 4, 8, 16, 32, 0};	/* Cluster size boundary for FAT32 volume (128Ks unit) */
+	BYTE fsopt, fsty, *buf;
+	WORD ss;	/* Sector size */
+	DWORD sz_buf, sz_blk, sz_au, sz_rsv, sz_fat, n_clst, pau, n, vsn;
+	LBA_t sz_drv, sz_vol, b_vol, b_fat, b_data;
+	UINT n_fat, i;
+	DSTATUS ds;
+	FRESULT res;
+
+
+	/* Check physical drive status */
+	ds = ff_disk_initialize(pdrv);
+	if (ds & STA_NOINIT) return FR_NOT_READY;
+	if (ds & STA_PROTECT) return FR_WRITE_PROTECTED;
+
+	/* Check format options */
+	if (!opt || !work) return FR_INVALID_PARAMETER;
+	fsopt = opt->fmt & (FM_FAT32 | FM_EXFAT | FM_SFD);
+	if ((fsopt & (FM_FAT32 | FM_EXFAT)) == FM_FAT32) {
+		fsty = FS_FAT32;
+		n_fat = (opt->n_fat >= 1 && opt->n_fat <= 2) ? opt->n_fat : 1;	/* Number of FATs */
+#if FF_FS_EXFAT
+	} else if ((fsopt & (FM_FAT32 | FM_EXFAT)) == FM_EXFAT) {
+		fsty = FS_EXFAT;
+		n_fat = 1;		/* exFAT volumes always have a single FAT */
+#endif
+	} else {
+		return FR_INVALID_PARAMETER;
+	}
+
+	/* Get physical drive parameters (sz_drv, sz_blk and ss) */
+	sz_blk = opt->align;
+	if (sz_blk == 0 && ff_disk_ioctl(pdrv, GET_BLOCK_SIZE, &sz_blk) != RES_OK) sz_blk = 1;
+	if (sz_blk == 0 || sz_blk > 0x8000 || (sz_blk & (sz_blk - 1))) sz_blk = 1;	/* Use sector alignment if the block size is invalid */
+#if FF_MAX_SS != FF_MIN_SS
+	if (ff_disk_ioctl(pdrv, GET_SECTOR_SIZE, &ss) != RES_OK) return FR_DISK_ERR;
+	if (ss > FF_MAX_SS || ss < FF_MIN_SS || (ss & (ss - 1))) return FR_DISK_ERR;
+#else
+	ss = FF_MAX_SS;
+#endif
+	if (ff_disk_ioctl(pdrv, GET_SECTOR_COUNT, &sz_drv) != RES_OK) return FR_DISK_ERR;
+
+	/* Check the cluster size */
+	sz_au = opt->au_size;
+	if (sz_au != 0) {
+		if (sz_au & (sz_au - 1)) return FR_INVALID_PARAMETER;	/* Not a power of 2 */
+		sz_au /= ss;
+		if (sz_au == 0) sz_au = 1;
+		if (sz_au > (fsty == FS_EXFAT ? 0x2000000 / ss : 128)) return FR_INVALID_PARAMETER;	/* Too large cluster size */
+	}
+
+	/* Set working buffer */
+	buf = (BYTE*)work;
+	sz_buf = len / ss;
+	if (sz_buf == 0) return FR_NOT_ENOUGH_CORE;
+
+	/* Determine where the volume is to be located */
+	if (fsopt & FM_SFD) {	/* Volume at the start of the drive, without a partition table */
+		b_vol = 0; sz_vol = sz_drv;
+	} else {				/* Volume in a single partition covering the whole drive */
+		res = create_partition(pdrv, sz_drv, ss, (fsty == FS_EXFAT) ? 0x07 : 0x0C, &b_vol, &sz_vol, buf, sz_buf);
+		if (res != FR_OK) return res;
+	}
+	if (sz_vol < 128) return FR_MKFS_ABORTED;	/* Check if volume size is >= 128s */
+	vsn = (DWORD)sz_vol + GET_FATTIME();		/* VSN generated from current time and partition size */
+
+#if FF_FS_EXFAT
+	if (fsty == FS_EXFAT) {	/* Create an exFAT volume */
+		DWORD szb_bit, szb_case, sum, nbit, clu, clen[3];
+		WCHAR ch, si;
+		UINT j, st;
+		LBA_t sect;
+
+		if (sz_vol < 0x1000) return FR_MKFS_ABORTED;	/* Too small volume for exFAT? */
+
+		/* Determine FAT location, data location and number of clusters */
+		if (sz_au == 0) {	/* AU auto-selection */
+			sz_au = 8;
+			if (sz_vol >= 0x80000) sz_au = 64;		/* >= 512Ks */
+			if (sz_vol >= 0x4000000) sz_au = 256;	/* >= 64Ms */
+		}
+		b_fat = b_vol + 32;										/* FAT start at offset 32 */
+		sz_fat = (DWORD)((sz_vol / sz_au + 2) * 4 + ss - 1) / ss;	/* Number of FAT sectors */
+		b_data = (b_fat + sz_fat + sz_blk - 1) & ~((LBA_t)sz_blk - 1);	/* Align data area to the erase block boundary */
+		if (b_data - b_vol >= sz_vol / 2) return FR_MKFS_ABORTED;	/* Too small volume? */
+		n_clst = (DWORD)((sz_vol - (b_data - b_vol)) / sz_au);	/* Number of clusters */
+		if (n_clst < 16) return FR_MKFS_ABORTED;				/* Too few clusters? */
+		if (n_clst > MAX_EXFAT) return FR_MKFS_ABORTED;		/* Too many clusters? */
+
+		szb_bit = (n_clst + 7) / 8;								/* Size of allocation bitmap */
+		clen[0] = (szb_bit + sz_au * ss - 1) / (sz_au * ss);	/* Number of allocation bitmap clusters */
+
+		/* Clear the boot region and the FAT area in a single run */
+		res = zero_sectors(pdrv, b_vol, b_data - b_vol, buf, sz_buf, ss);
+		if (res != FR_OK) return res;
+
+		/* Create a compressed up-case table */
+		sect = b_data + sz_au * clen[0];	/* Table start sector */
+		sum = 0;							/* Table checksum to be stored in the 82 entry */
+		st = 0; si = 0; i = 0; j = 0; szb_case = 0;
+		do {
+			switch (st) {
+			case 0:
+				ch = (WCHAR)ff_wtoupper(si);	/* Get an up-case char */
+				if (ch != si) {
+					si++; break;		/* Store the up-case char if exist */
+				}
+				for (j = 1; (WCHAR)(si + j) && (WCHAR)(si + j) == ff_wtoupper((WCHAR)(si + j)); j++) ;	/* Get run length of no-case block */
+				if (j >= 128) {
+					ch = 0xFFFF; st = 2; break;	/* Compress the no-case block if run is >= 128 chars */
+				}
+				st = 1;			/* Do not compress short run */
+				/* FALLTHROUGH */
+			case 1:
+				ch = si++;		/* Fill the short run */
+				if (--j == 0) st = 0;
+				break;
+
+			default:
+				ch = (WCHAR)j; si += (WCHAR)j;	/* Number of chars to skip */
+				st = 0;
+			}
+			sum = xsum32(buf[i + 0] = (BYTE)ch, sum);	/* Put it into the write buffer */
+			sum = xsum32(buf[i + 1] = (BYTE)(ch >> 8), sum);
+			i += 2; szb_case += 2;
+			if (si == 0 || i == sz_buf * ss) {		/* Write buffered data when buffer full or end of process */
+				n = (i + ss - 1) / ss;
+				if (ff_disk_write(pdrv, buf, sect, n) != RES_OK) return FR_DISK_ERR;
+				sect += n; i = 0;
+			}
+		} while (si);
+		clen[1] = (szb_case + sz_au * ss - 1) / (sz_au * ss);	/* Number of up-case table clusters */
+		clen[2] = 1;	/* Number of root directory clusters */
+
+		/* Initialize the allocation bitmap. Only the sectors holding the bits of the clusters in-use by system (bitmap, up-case and root-dir) are written after clearing it. */
+		res = zero_sectors(pdrv, b_data, (szb_bit + ss - 1) / ss, buf, sz_buf, ss);
+		if (res != FR_OK) return res;
+		sect = b_data;
+		nbit = clen[0] + clen[1] + clen[2];
+		do {
+			memset(buf, 0, sz_buf * ss);				/* Initialize bitmap buffer */
+			for (i = 0; nbit != 0 && i / 8 < sz_buf * ss; buf[i / 8] |= 1 << (i % 8), i++, nbit--) ;	/* Mark used clusters */
+			n = (i + ss * 8 - 1) / (ss * 8);			/* Write the buffered data */
+			if (ff_disk_write(pdrv, buf, sect, n) != RES_OK) return FR_DISK_ERR;
+			sect += n;
+		} while (nbit);
+
+		/* Initialize the FAT. The FAT area has already been cleared, so only the sectors holding the chains are written. */
+		sect = b_fat;
+		j = nbit = clu = 0;
+		do {
+			memset(buf, 0, sz_buf * ss); i = 0;	/* Clear work area and reset write offset */
+			if (clu == 0) {	/* Initialize FAT [0] and FAT[1] */
+				st_dword(buf + i, 0xFFFFFFF8); i += 4; clu++;
+				st_dword(buf + i, 0xFFFFFFFF); i += 4; clu++;
+			}
+			do {			/* Create chains of bitmap, up-case and root directory */
+				while (nbit != 0 && i < sz_buf * ss) {	/* Create a chain */
+					st_dword(buf + i, (nbit > 1) ? clu + 1 : 0xFFFFFFFF);
+					i += 4; clu++; nbit--;
+				}
+				if (nbit == 0 && j < 3) nbit = clen[j++];	/* Get next chain length */
+			} while (nbit != 0 && i < sz_buf * ss);
+			n = (i + ss - 1) / ss;		/* Write the buffered data */
+			if (ff_disk_write(pdrv, buf, sect, n) != RES_OK) return FR_DISK_ERR;
+			sect += n;
+		} while (nbit != 0 || j < 3);
+
+		/* Initialize the root directory */
+		sect = b_data + sz_au * (clen[0] + clen[1]);	/* Start of the root directory */
+		res = zero_sectors(pdrv, sect, sz_au, buf, sz_buf, ss);
+		if (res != FR_OK) return res;
+		memset(buf, 0, ss);
+		buf[SZDIRE * 0 + 0] = ET_VLABEL;				/* Volume label entry (no label) */
+		buf[SZDIRE * 1 + 0] = ET_BITMAP;				/* Bitmap entry */
+		st_dword(buf + SZDIRE * 1 + 20, 2);				/*  cluster */
+		st_dword(buf + SZDIRE * 1 + 24, szb_bit);		/*  size */
+		buf[SZDIRE * 2 + 0] = ET_UPCASE;				/* Up-case table entry */
+		st_dword(buf + SZDIRE * 2 + 4, sum);			/*  sum */
+		st_dword(buf + SZDIRE * 2 + 20, 2 + clen[0]);	/*  cluster */
+		st_dword(buf + SZDIRE * 2 + 24, szb_case);		/*  size */
+		if (ff_disk_write(pdrv, buf, sect, 1) != RES_OK) return FR_DISK_ERR;
+
+		/* Create two set of the exFAT VBR blocks */
+		sect = b_vol;
+		for (n = 0; n < 2; n++) {
+			/* Main record (+0) */
+			memset(buf, 0, ss);
+			memcpy(buf + BS_JmpBoot, "\xEB\x76\x90" "EXFAT   ", 11);	/* Boot jump code (x86), OEM name */
+			st_qword(buf + BPB_VolOfsEx, b_vol);					/* Volume offset in the physical drive [sector] */
+			st_qword(buf + BPB_TotSecEx, sz_vol);					/* Volume size [sector] */
+			st_dword(buf + BPB_FatOfsEx, (DWORD)(b_fat - b_vol));	/* FAT offset [sector] */
+			st_dword(buf + BPB_FatSzEx, sz_fat);					/* FAT size [sector] */
+			st_dword(buf + BPB_DataOfsEx, (DWORD)(b_data - b_vol));	/* Data offset [sector] */
+			st_dword(buf + BPB_NumClusEx, n_clst);					/* Number of clusters */
+			st_dword(buf + BPB_RootClusEx, 2 + clen[0] + clen[1]);	/* Root dir cluster # */
+			st_dword(buf + BPB_VolIDEx, vsn);						/* VSN */
+			st_word(buf + BPB_FSVerEx, 0x100);						/* Filesystem version (1.00) */
+			for (buf[BPB_BytsPerSecEx] = 0, i = ss; i >>= 1; buf[BPB_BytsPerSecEx]++) ;	/* Log2 of sector size [byte] */
+			for (buf[BPB_SecPerClusEx] = 0, i = sz_au; i >>= 1; buf[BPB_SecPerClusEx]++) ;	/* Log2 of cluster size [sector] */
+			buf[BPB_NumFATsEx] = 1;					/* Number of FATs */
+			buf[BPB_DrvNumEx] = 0x80;				/* Drive number (for int13) */
+			st_word(buf + BS_BootCodeEx, 0xFEEB);	/* Boot code (x86) */
+			st_word(buf + BS_55AA, 0xAA55);			/* Signature (placed here regardless of sector size) */
+			for (i = sum = 0; i < ss; i++) {		/* VBR checksum */
+				if (i != BPB_VolFlagEx && i != BPB_VolFlagEx + 1 && i != BPB_PercInUseEx) sum = xsum32(buf[i], sum);
+			}
+			if (ff_disk_write(pdrv, buf, sect++, 1) != RES_OK) return FR_DISK_ERR;
+			/* Extended bootstrap record (+1..+8) */
+			memset(buf, 0, ss);
+			st_word(buf + ss - 2, 0xAA55);	/* Signature (placed at end of sector) */
+			for (j = 1; j < 9; j++) {
+				for (i = 0; i < ss; sum = xsum32(buf[i++], sum)) ;	/* VBR checksum */
+				if (ff_disk_write(pdrv, buf, sect++, 1) != RES_OK) return FR_DISK_ERR;
+			}
+			/* OEM/Reserved record (+9..+10) */
+			memset(buf, 0, ss);
+			for ( ; j < 11; j++) {
+				for (i = 0; i < ss; sum = xsum32(buf[i++], sum)) ;	/* VBR checksum */
+				if (ff_disk_write(pdrv, buf, sect++, 1) != RES_OK) return FR_DISK_ERR;
+			}
+			/* Sum record (+11) */
+			for (i = 0; i < ss; i += 4) st_dword(buf + i, sum);		/* Fill with checksum value */
+			if (ff_disk_write(pdrv, buf, sect++, 1) != RES_OK) return FR_DISK_ERR;
+		}
+
+	} else
+#endif	/* FF_FS_EXFAT */
+	{	/* Create a FAT32 volume */
+		if (sz_vol > 0xFFFFFFFF) return FR_MKFS_ABORTED;	/* Too large volume for FAT32? */
+
+		do {
+			pau = sz_au;
+			if (pau == 0) {	/* AU auto-selection */
+				n = (DWORD)sz_vol / 0x20000;	/* Volume size in unit of 128KS */
+				for (i = 0, pau = 1; cst32[i] && cst32[i] <= n; i++, pau <<= 1) ;	/* Get from table */
+			}
+			n_clst = (DWORD)sz_vol / pau;				/* Number of clusters */
+			sz_fat = (n_clst * 4 + 8 + ss - 1) / ss;	/* FAT size [sector] */
+			sz_rsv = 32;								/* Number of reserved sectors */
+			b_fat = b_vol + sz_rsv;						/* FAT base */
+			b_data = b_fat + (LBA_t)sz_fat * n_fat;		/* Data base */
+
+			/* Align data area to erase block boundary (for flash memory media) by moving the FAT */
+			n = (DWORD)(((b_data + sz_blk - 1) & ~((LBA_t)sz_blk - 1)) - b_data);	/* Sectors to next nearest from current data base */
+			sz_rsv += n; b_fat += n; b_data += n;
+
+			/* Determine number of clusters and final check of validity of the FAT sub-type */
+			if (sz_vol < b_data + pau * 16 - b_vol) return FR_MKFS_ABORTED;	/* Too small volume? */
+			n_clst = ((DWORD)sz_vol - sz_rsv - sz_fat * n_fat) / pau;
+			if (n_clst > MAX_FAT32) {	/* Too many clusters for FAT32? */
+				if (opt->au_size == 0 && pau < 128) { sz_au = pau * 2; continue; }	/* Adjust cluster size and retry */
+				return FR_MKFS_ABORTED;
+			}
+			if (n_clst <= MAX_FAT16) {	/* Too few clusters for FAT32? */
+				if (opt->au_size == 0 && pau > 1) { sz_au = pau / 2; continue; }	/* Adjust cluster size and retry */
+				return FR_MKFS_ABORTED;
+			}
+			break;
+		} while (1);
+
+		/* Clear the reserved area, the FATs and the root directory (first cluster of the data area) in a single run */
+		res = zero_sectors(pdrv, b_vol, b_data - b_vol + pau, buf, sz_buf, ss);
+		if (res != FR_OK) return res;
+
+		/* Create FAT VBR */
+		memset(buf, 0, ss);
+		memcpy(buf + BS_JmpBoot, "\xEB\xFE\x90" "MSDOS5.0", 11);	/* Boot jump code (x86), OEM name */
+		st_word(buf + BPB_BytsPerSec, ss);				/* Sector size [byte] */
+		buf[BPB_SecPerClus] = (BYTE)pau;				/* Cluster size [sector] */
+		st_word(buf + BPB_RsvdSecCnt, (WORD)sz_rsv);	/* Size of reserved area */
+		buf[BPB_NumFATs] = (BYTE)n_fat;					/* Number of FATs */
+		st_dword(buf + BPB_TotSec32, (DWORD)sz_vol);	/* Volume size in 32-bit LBA */
+		buf[BPB_Media] = 0xF8;							/* Media descriptor byte */
+		st_word(buf + BPB_SecPerTrk, 63);				/* Number of sectors per track (for int13) */
+		st_word(buf + BPB_NumHeads, 255);				/* Number of heads (for int13) */
+		st_dword(buf + BPB_HiddSec, (DWORD)b_vol);		/* Volume offset in the physical drive [sector] */
+		st_dword(buf + BS_VolID32, vsn);				/* VSN */
+		st_dword(buf + BPB_FATSz32, sz_fat);			/* FAT size [sector] */
+		st_dword(buf + BPB_RootClus32, 2);				/* Root directory cluster # (2) */
+		st_word(buf + BPB_FSInfo32, 1);					/* Offset of FSINFO sector (VBR + 1) */
+		st_word(buf + BPB_BkBootSec32, 6);				/* Offset of backup VBR (VBR + 6) */
+		buf[BS_DrvNum32] = 0x80;						/* Drive number (for int13) */
+		buf[BS_BootSig32] = 0x29;						/* Extended boot signature */
+		memcpy(buf + BS_VolLab32, "NO NAME    " "FAT32   ", 19);	/* Volume label, FAT signature */
+		st_word(buf + BS_BootCode32, 0xFEEB);			/* Boot code (x86) */
+		st_word(buf + BS_55AA, 0xAA55);					/* Signature (offset is fixed here regardless of sector size) */
+		if (ff_disk_write(pdrv, buf, b_vol, 1) != RES_OK) return FR_DISK_ERR;	/* Write it to the VBR sector */
+		if (ff_disk_write(pdrv, buf, b_vol + 6, 1) != RES_OK) return FR_DISK_ERR;	/* Write backup VBR (VBR + 6) */
+
+		/* Create FSINFO record */
+		memset(buf, 0, ss);
+		st_dword(buf + FSI_LeadSig, 0x41615252);
+		st_dword(buf + FSI_StrucSig, 0x61417272);
+		st_dword(buf + FSI_Free_Count, n_clst - 1);	/* Number of free clusters */
+		st_dword(buf + FSI_Nxt_Free, 2);			/* Last allocated cluster# */
+		st_word(buf + BS_55AA, 0xAA55);
+		if (ff_disk_write(pdrv, buf, b_vol + 7, 1) != RES_OK) return FR_DISK_ERR;	/* Write backup FSINFO (VBR + 7) */
+		if (ff_disk_write(pdrv, buf, b_vol + 1, 1) != RES_OK) return FR_DISK_ERR;	/* Write original FSINFO (VBR + 1) */
+
+		/* Initialize the FATs. The FAT area has already been cleared, so only the first sector of each FAT is written. */
+		memset(buf, 0, ss);
+		st_dword(buf + 0, 0x0FFFFFF8);	/* FAT[0] */
+		st_dword(buf + 4, 0xFFFFFFFF);	/* FAT[1] */
+		st_dword(buf + 8, 0x0FFFFFFF);	/* FAT[2] (root directory) */
+		for (i = 0; i < n_fat; i++) {
+			if (ff_disk_write(pdrv, buf, b_fat + (LBA_t)sz_fat * i, 1) != RES_OK) return FR_DISK_ERR;
+		}
+	}
+
+	if (ff_disk_ioctl(pdrv, CTRL_SYNC, 0) != RES_OK) return FR_DISK_ERR;
+
+	return FR_OK;
+}
+
+#endif /* FF_USE_MKFS */
+
+
+
 #if FF_USE_STRFUNC
 #if FF_USE_LFN && FF_LFN_UNICODE && (FF_STRF_ENCODE < 0 || FF_STRF_ENCODE > 3)
 #error Wrong FF_STRF_ENCODE setting
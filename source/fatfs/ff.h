@@ -126,6 +126,7 @@ typedef struct {
 	WORD	csize;			/* Cluster size [sectors] */
 #if FF_MAX_SS != FF_MIN_SS
 	WORD	ssize;			/* Sector size (512, 1024, 2048 or 4096) */
+	BYTE	ssize_log2;		/* Sector size shift (9 to 12), set at mount time */
 #endif
 #if FF_USE_LFN
 	WCHAR*	lfnbuf;			/* LFN working buffer */
@@ -149,6 +150,12 @@ typedef struct {
 	LBA_t	database;		/* Data base sector */
 #if FF_FS_EXFAT
 	LBA_t	bitbase;		/* Allocation bitmap base sector */
+#endif
+#if FF_FS_LOCK
+	struct _FILESEM* locks;	/* Open object table (allocated on demand, up to FF_FS_LOCK entries) */
+	UINT*	lock_hash;		/* Hash chain heads of the open object table (lock_cnt entries) */
+	UINT	lock_cnt;		/* Number of entries in the open object table (0:not allocated) */
+	UINT	lock_free;		/* Head of the free entry list (index number origin from 1, 0:none) */
 #endif
 	LBA_t	winsect;		/* Current sector appearing in the win[] */
 	BYTE	win[FF_MAX_SS];	/* Disk access window for Directory, FAT (and file data at tiny cfg) */
@@ -173,7 +180,7 @@ typedef struct {
 	DWORD	c_ofs;			/* Offset in the containing directory (valid when file object and sclust != 0) */
 #endif
 #if FF_FS_LOCK
-	UINT	lockid;			/* File lock ID origin from 1 (index of file semaphore table Files[]) */
+	UINT	lockid;			/* File lock ID origin from 1 (index of the open object table from the hosting volume) */
 #endif
 } FFOBJID;
 
@@ -236,6 +243,17 @@ typedef struct {
 
 
 
+/* Format parameter structure (MKFS_PARM) */
+
+typedef struct {
+	BYTE fmt;			/* Format option (FM_FAT32 or FM_EXFAT, optionally with FM_SFD) */
+	BYTE n_fat;			/* Number of FATs (FAT32 only) */
+	UINT align;			/* Data area alignment [sector] */
+	DWORD au_size;		/* Cluster size [byte] */
+} MKFS_PARM;
+
+
+
 /* File function return code (FRESULT) */
 
 typedef enum {
@@ -257,7 +275,8 @@ typedef enum {
 	FR_LOCKED,				/* (15) The operation is rejected according to the file sharing policy */
 	FR_NOT_ENOUGH_CORE,		/* (16) LFN working buffer could not be allocated */
 	FR_TOO_MANY_OPEN_FILES,	/* (17) Number of open files > FF_FS_LOCK */
-	FR_INVALID_PARAMETER	/* (18) Given parameter is invalid */
+	FR_INVALID_PARAMETER,	/* (18) Given parameter is invalid */
+	FR_MKFS_ABORTED			/* (19) The ff_mkfs function aborted due to some problem */
 } FRESULT;
 
 
@@ -271,6 +290,7 @@ FRESULT ff_close (FIL* fp);											/* Close an open file object */
 FRESULT ff_read (FIL* fp, void* buff, UINT btr, UINT* br);			/* Read data from the file */
 FRESULT ff_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data to the file */
 FRESULT ff_lseek (FIL* fp, FSIZE_t ofs);								/* Move file pointer of the file object */
+FRESULT ff_setpos (FIL* fp, FSIZE_t ofs, DWORD clst, LBA_t sect);	/* Restore a saved file pointer without following the cluster chain */
 FRESULT ff_truncate (FIL* fp);										/* Truncate the file */
 FRESULT ff_sync (FIL* fp);											/* Flush cached data of the writing file */
 FRESULT ff_opendir (DIR* dp, const TCHAR* path);						/* Open a directory */
@@ -285,11 +305,13 @@ FRESULT ff_stat (const TCHAR* path, FILINFO* fno);					/* Get file status */
 FRESULT ff_chmod (const TCHAR* path, BYTE attr, BYTE mask);			/* Change attribute of a file/dir */
 FRESULT ff_utime (const TCHAR* path, const FILINFO* fno);			/* Change timestamp of a file/dir */
 FRESULT ff_getfree (const TCHAR* path, DWORD* nclst, FATFS** fatfs);	/* Get number of free clusters on the drive */
+FRESULT ff_getalloc (const TCHAR* path, void (*func)(DWORD,DWORD,void*), void* arg);	/* Enumerate runs of allocated clusters on the drive */
 FRESULT ff_getlabel (const TCHAR* path, TCHAR* label, DWORD* vsn);	/* Get volume label */
 FRESULT ff_setlabel (const TCHAR* label);							/* Set volume label */
 FRESULT ff_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
 FRESULT ff_expand (FIL* fp, FSIZE_t fsz, BYTE opt);					/* Allocate a contiguous block to the file */
 FRESULT ff_mount (FATFS* fs, const TCHAR* path, BYTE opt);			/* Mount/Unmount a logical drive */
+FRESULT ff_mkfs (BYTE pdrv, const MKFS_PARM* opt, void* work, UINT len);	/* Create a FAT volume on a physical drive */
 FRESULT ff_setcp (WORD cp);											/* Set current code page */
 int ff_putc (TCHAR c, FIL* fp);										/* Put a character to the file */
 int ff_puts (const TCHAR* str, FIL* cp);								/* Put a string to the file */
@@ -372,6 +394,11 @@ void ff_mutex_give (int vol);		/* Unlock sync object */
 #define	FA_OPEN_ALWAYS		0x10
 #define	FA_OPEN_APPEND		0x30
 
+/* Format options (2nd argument of ff_mkfs) */
+#define FM_FAT32	0x02
+#define FM_EXFAT	0x04
+#define FM_SFD		0x08
+
 /* Fast seek controls (2nd argument of ff_lseek) */
 #define CREATE_LINKMAP	((FSIZE_t)0 - 1)
 
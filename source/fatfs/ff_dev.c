@@ -40,7 +40,7 @@ do { \
                                     bool drive_ctx_valid = usbHsFsManagerIsDriveContextPointerValid(drive_ctx); \
                                     if (!drive_ctx_valid) ff_set_error_and_exit(ENODEV)
 
-#define ff_unlock_drive_ctx         if (drive_ctx_valid) mutexUnlock(&(drive_ctx->mutex))
+#define ff_unlock_drive_ctx         if (drive_ctx_valid) usbHsFsManagerUnlockDriveContext(drive_ctx)
 
 #define ff_return(x)                return (ff_ended_with_error ? -1 : (x))
 #define ff_return_ptr(x)            return (ff_ended_with_error ? NULL : (x))
@@ -74,6 +74,8 @@ static int       ffdev_utimes(struct _reent *r, const char *filename, const stru
 
 static bool ffdev_fixpath(struct _reent *r, const char *path, UsbHsFsDriveLogicalUnitFileSystemContext **fs_ctx, char *outpath);
 
+static ssize_t ffdev_positional_io(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset, bool write);
+
 static void ffdev_fill_stat(struct stat *st, const FILINFO *info);
 
 static int ffdev_translate_error(FRESULT res);
@@ -116,6 +118,28 @@ const devoptab_t *ffdev_get_devoptab()
     return &ffdev_devoptab;
 }
 
+void ffdev_release_file_state(void *fd)
+{
+    FIL *file = (FIL*)fd;
+    if (!file) return;
+
+    /* Close file. */
+    ff_close(file);
+
+    /* Reset file descriptor. */
+    memset(file, 0, sizeof(FIL));
+}
+
+ssize_t ffdev_preadv(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset)
+{
+    return ffdev_positional_io(r, fd, iov, iov_count, offset, false);
+}
+
+ssize_t ffdev_pwritev(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset)
+{
+    return ffdev_positional_io(r, fd, iov, iov_count, offset, true);
+}
+
 static int ffdev_open(struct _reent *r, void *fd, const char *path, int flags, int mode)
 {
     NX_IGNORE_ARG(mode);
@@ -133,6 +157,29 @@ static int ffdev_open(struct _reent *r, void *fd, const char *path, int flags, i
     /* Fix input path. */
     if (!ffdev_fixpath(r, path, &fs_ctx, NULL)) ff_end;
 
+    if (usbHsFsMountIsCacheableFileHandle(fs_ctx, flags))
+    {
+        /* Check if we can reuse a cached file handle. */
+        if (usbHsFsMountAcquireCachedFileHandle(fs_ctx, __usbhsfs_dev_path_buf, file))
+        {
+            /* Rewind file. */
+            res = ff_rewind(file);
+            if (res != FR_OK)
+            {
+                /* Drop the cached file handle. */
+                usbHsFsMountInvalidateCachedFileHandles(fs_ctx, __usbhsfs_dev_path_buf);
+                usbHsFsMountUnregisterFileHandle(fs_ctx, file, false);
+                ffdev_release_file_state(file);
+                ff_set_error(ffdev_translate_error(res));
+            }
+
+            ff_end;
+        }
+    } else {
+        /* Release cached file handles for this file. Otherwise, FatFs won't let us open it. */
+        usbHsFsMountInvalidateCachedFileHandles(fs_ctx, __usbhsfs_dev_path_buf);
+    }
+
     /* Check access mode. */
     switch(flags & O_ACCMODE)
     {
@@ -180,9 +227,22 @@ static int ffdev_open(struct _reent *r, void *fd, const char *path, int flags, i
 
     /* Open file. */
     res = ff_open(file, __usbhsfs_dev_path_buf, ffdev_flags);
-    if (res != FR_OK) ff_set_error(ffdev_translate_error(res));
+    if (res == FR_TOO_MANY_OPEN_FILES && fs_ctx->fh_cache)
+    {
+        /* Release all cached file handles and try again. */
+        usbHsFsMountInvalidateCachedFileHandles(fs_ctx, NULL);
+        res = ff_open(file, __usbhsfs_dev_path_buf, ffdev_flags);
+    }
+
+    if (res != FR_OK) ff_set_error_and_exit(ffdev_translate_error(res));
+
+    /* Register file handle. */
+    usbHsFsMountRegisterFileHandle(fs_ctx, __usbhsfs_dev_path_buf, file, (file->flag & FA_WRITE));
 
 end:
+    /* Consume file size hint. Preallocation isn't supported on FAT volumes. */
+    if ((flags & O_ACCMODE) != O_RDONLY) __usbhsfs_file_size_hint = 0;
+
     ff_unlock_drive_ctx;
     ff_return(0);
 }
@@ -200,6 +260,9 @@ static int ffdev_close(struct _reent *r, void *fd)
 
     USBHSFS_LOG_MSG("Closing file from \"%u:\".", file->obj.fs->pdrv);
 
+    /* Keep the file open if its file handle can be cached. */
+    if (usbHsFsMountUnregisterFileHandle(fs_ctx, file, (file->flag & FA_WRITE))) ff_end;
+
     /* Close file. */
     res = ff_close(file);
     if (res != FR_OK) ff_set_error_and_exit(ffdev_translate_error(res));
@@ -376,6 +439,9 @@ static int ffdev_unlink(struct _reent *r, const char *name)
 
     USBHSFS_LOG_MSG("Deleting \"%s\" (\"%s\").", name, __usbhsfs_dev_path_buf);
 
+    /* Release cached file handles. */
+    usbHsFsMountInvalidateCachedFileHandles(fs_ctx, __usbhsfs_dev_path_buf);
+
     /* Delete file. */
     res = ff_unlink(__usbhsfs_dev_path_buf);
     if (res != FR_OK) ff_set_error(ffdev_translate_error(res));
@@ -438,6 +504,10 @@ static int ffdev_rename(struct _reent *r, const char *oldName, const char *newNa
 
     USBHSFS_LOG_MSG("Renaming \"%s\" (\"%s\") to \"%s\" (\"%s\").", oldName, old_path, newName, new_path);
 
+    /* Release cached file handles. */
+    usbHsFsMountInvalidateCachedFileHandles(fs_ctx, old_path);
+    usbHsFsMountInvalidateCachedFileHandles(fs_ctx, new_path);
+
     /* Rename entry. */
     res = _ff_rename(old_path, new_path);
     if (res != FR_OK) ff_set_error(ffdev_translate_error(res));
@@ -768,6 +838,9 @@ static int ffdev_utimes(struct _reent *r, const char *filename, const struct tim
     USBHSFS_LOG_MSG("Setting last modification time for \"%s\" (\"%s\") to %u-%02u-%02u %02u:%02u:%02u (0x%04X%04X).", filename, __usbhsfs_dev_path_buf, caltime.year, caltime.month, caltime.day, caltime.hour, \
                 caltime.minute, caltime.second, info.fdate, info.ftime);
 
+    /* Release cached file handles. */
+    usbHsFsMountInvalidateCachedFileHandles(fs_ctx, __usbhsfs_dev_path_buf);
+
     /* Change timestamp. */
     res = ff_utime(__usbhsfs_dev_path_buf, &info);
     if (res != FR_OK) ff_set_error(ffdev_translate_error(res));
@@ -779,60 +852,98 @@ end:
 
 static bool ffdev_fixpath(struct _reent *r, const char *path, UsbHsFsDriveLogicalUnitFileSystemContext **fs_ctx, char *outpath)
 {
-    FATFS *fatfs = NULL;
-    const u8 *p = (const u8*)path;
-    ssize_t units = 0;
-    u32 code = 0;
-    size_t len = 0;
-    char name[MOUNT_NAME_LENGTH] = {0}, *outptr = (outpath ? outpath : __usbhsfs_dev_path_buf), *cwd = NULL;
+    char *outptr = (outpath ? outpath : __usbhsfs_dev_path_buf);
+    int res = 0;
 
     ff_declare_error_state;
 
-    if (!r || !path || !*path || !fs_ctx || !*fs_ctx || !(fatfs = (*fs_ctx)->fatfs) || !(cwd = (*fs_ctx)->cwd)) ff_set_error_and_exit(EINVAL);
+    if (!r || !path || !*path || !fs_ctx || !*fs_ctx || !(*fs_ctx)->fatfs) ff_set_error_and_exit(EINVAL);
 
     USBHSFS_LOG_MSG("Input path: \"%s\".", path);
 
-    /* Generate FatFs mount name ID. */
-    sprintf(name, "%u:", fatfs->pdrv);
+    /* Generate fixed path. */
+    res = usbHsFsMountNormalizePath(*fs_ctx, path, outptr);
+    if (res) ff_set_error_and_exit(res);
 
-    /* Move the path pointer to the start of the actual path. */
-    do {
-        units = decode_utf8(&code, p);
-        if (units < 0) ff_set_error_and_exit(EILSEQ);
-        p += units;
-    } while(code >= ' ' && code != ':');
+    USBHSFS_LOG_MSG("Fixed path: \"%s\".", outptr);
 
-    /* We found a colon; p points to the actual path. */
-    if (code == ':') path = (const char*)p;
+end:
+    ff_return_bool;
+}
 
-    /* Make sure there are no more colons and that the remainder of the string is valid UTF-8. */
-    p = (const u8*)path;
+static ssize_t ffdev_positional_io(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset, bool write)
+{
+    FSIZE_t fptr = 0;
+    DWORD clust = 0;
+    LBA_t sect = 0;
+    bool restore_pos = false;
+    size_t total = 0;
+    FRESULT res = FR_OK;
 
-    do {
-        units = decode_utf8(&code, p);
-        if (units < 0) ff_set_error_and_exit(EILSEQ);
-        if (code == ':') ff_set_error_and_exit(EINVAL);
-        p += units;
-    } while(code >= ' ');
+    ff_declare_error_state;
+    ff_declare_file_state;
+    ff_lock_drive_ctx;
+
+    /* Sanity check. */
+    if (!file || !iov || !iov_count) ff_set_error_and_exit(EINVAL);
 
-    /* Verify fixed path length. */
-    len = (strlen(name) + strlen(path));
-    if (path[0] != '/') len += strlen(cwd);
+    /* Check if the file was opened with the right access mode. */
+    if (!(file->flag & (write ? FA_WRITE : FA_READ))) ff_set_error_and_exit(EBADF);
 
-    if (len >= MAX_PATH_LENGTH) ff_set_error_and_exit(ENAMETOOLONG);
+    USBHSFS_LOG_MSG("%s %u segment(s) %s file in \"%u:\" at offset 0x%lX.", write ? "Writing" : "Reading", iov_count, write ? "to" : "from", file->obj.fs->pdrv, offset);
 
-    /* Generate fixed path. */
-    if (path[0] == '/')
+    /* Save the current file position. It'll be restored later without having to follow the cluster chain from the start of the file. */
+    fptr = file->fptr;
+    clust = file->clust;
+    sect = file->sect;
+    restore_pos = true;
+
+    /* Seek to the requested offset. FatFs clips read-only seeks to the file size, and expands the file for write seeks beyond EOF. */
+    if ((FSIZE_t)offset != fptr)
     {
-        sprintf(outptr, "%s%s", name, path);
-    } else {
-        sprintf(outptr, "%s%s%s", name, cwd, path);
+        res = ff_lseek(file, (FSIZE_t)offset);
+        if (res != FR_OK) ff_set_error_and_exit(ffdev_translate_error(res));
+
+        /* The file can't be expanded if the volume is full. */
+        if (write && ff_tell(file) != (FSIZE_t)offset) ff_set_error_and_exit(ENOSPC);
     }
 
-    USBHSFS_LOG_MSG("Fixed path: \"%s\".", outptr);
+    /* Process I/O vector segments. */
+    for(u32 i = 0; i < iov_count; i++)
+    {
+        u8 *ptr = (u8*)iov[i].data;
+        size_t size = iov[i].size;
+
+        if (!size) continue;
+        if (!ptr) ff_set_error_and_exit(EINVAL);
+
+        while(size)
+        {
+            UINT chunk = (UINT)MIN(size, (size_t)UINT32_MAX), xfer = 0;
+
+            res = (write ? ff_write(file, ptr, chunk, &xfer) : ff_read(file, ptr, chunk, &xfer));
+
+            total += xfer;
+            ptr += xfer;
+            size -= xfer;
+
+            if (res != FR_OK) ff_set_error_and_exit(ffdev_translate_error(res));
+
+            /* Stop right away if EOF was reached or if the volume is full. */
+            if (xfer < chunk) ff_end;
+        }
+    }
 
 end:
-    ff_return_bool;
+    /* Restore the original file position. */
+    if (restore_pos)
+    {
+        res = ff_setpos(file, fptr, clust, sect);
+        if (res != FR_OK && !ff_ended_with_error) ff_set_error(ffdev_translate_error(res));
+    }
+
+    ff_unlock_drive_ctx;
+    ff_return((ssize_t)total);
 }
 
 static void ffdev_fill_stat(struct stat *st, const FILINFO *info)
@@ -14,4 +14,11 @@
 
 const devoptab_t *ffdev_get_devoptab();
 
+/// Closes the provided devoptab file state without locking the drive context it belongs to. Used to release cached file handles.
+void ffdev_release_file_state(void *fd);
+
+/// Positional vectored I/O. The file position from the provided devoptab file state isn't modified.
+ssize_t ffdev_preadv(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset);
+ssize_t ffdev_pwritev(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset);
+
 #endif  /* __FF_DEV_H__ */
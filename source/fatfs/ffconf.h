@@ -25,6 +25,12 @@
 /  ff_findnext(). (0:Disable, 1:Enable 2:Enable with matching altname[] too) */
 
 
+#define FF_USE_MKFS		1
+/* This option switches ff_mkfs() function. (0:Disable or 1:Enable)
+/  Only FAT32 and exFAT volumes can be created. The FAT, allocation bitmap and root
+/  directory are cleared via CTRL_ZERO if ff_disk_ioctl() implements it. */
+
+
 #define FF_USE_FASTSEEK	0
 /* This option switches fast seek function. (0:Disable or 1:Enable) */
 
@@ -216,15 +222,16 @@
 */
 
 
-#define FF_FS_LOCK		64
+#define FF_FS_LOCK		4096
 /* The option FF_FS_LOCK switches file lock function to control duplicated file open
 /  and illegal operation to open objects.
 /
 /  0:  Disable file lock function. To avoid volume corruption, application program
 /      should avoid illegal open, remove and rename to the open objects.
 /  >0: Enable file lock function. The value defines how many files/sub-directories
-/      can be opened simultaneously under file lock control. Note that the file
-/      lock control is independent of re-entrancy. */
+/      can be opened simultaneously under file lock control on each volume. It must be
+/      a power of 2. The open object table of each volume is allocated on demand and
+/      grown as needed. Note that the file lock control is independent of re-entrancy. */
 
 
 #define FF_FS_REENTRANT	0
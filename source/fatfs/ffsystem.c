@@ -11,14 +11,17 @@
 /* Allocate/Free a Memory Block                                           */
 /*------------------------------------------------------------------------*/
 
-#include <stdlib.h>		/* with POSIX API */
+#include "../usbhsfs_utils.h"
+#include "../usbhsfs_pool.h"
 
 
 void* ff_memalloc (	/* Returns pointer to the allocated memory block (null if not enough core) */
 	UINT msize		/* Number of bytes to allocate */
 )
 {
-	return malloc((size_t)msize);	/* Allocate a new memory block */
+	/* LFN working buffers are allocated by every API call that takes a path, so they're served by an object pool. */
+	/* Larger blocks (e.g. cluster buffers) are allocated from the heap by the object pool itself. */
+	return usbHsFsPoolAllocate(UsbHsFsObjectPoolType_NameBuffer, (size_t)msize);
 }
 
 
@@ -26,7 +29,7 @@ void ff_memfree (
 	void* mblock	/* Pointer to the memory block to free (no effect if null) */
 )
 {
-	free(mblock);	/* Free the memory block */
+	usbHsFsPoolFree(UsbHsFsObjectPoolType_NameBuffer, mblock);	/* Free the memory block */
 }
 
 #endif
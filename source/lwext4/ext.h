@@ -17,6 +17,7 @@
 #include <ext4_fs.h>
 #include <ext4_inode.h>
 #include <ext4_journal.h>
+#include <ext4_extent.h>
 
 #include "../usbhsfs_utils.h"
 
@@ -33,6 +34,11 @@ typedef struct _ext_vd {
     u16 fmask;                              ///< Unix style permission mask for file creation.
     u16 dmask;                              ///< Unix style permission mask for directory creation.
     u8 version;                             ///< UsbHsFsDeviceFileSystemType_EXT* value to identify the EXT version.
+    u32 commit_interval;                    ///< Journal commit interval, in seconds. If non-zero, the lwext4 block cache is used in write-back mode.
+    bool write_back;                        ///< Set to true if the lwext4 block cache is operating in write-back mode.
+    u64 last_commit_tick;                   ///< System tick from the last time the block cache contents were committed.
+    struct _ext_file_state *dalloc_files;   ///< Linked list of open files holding a delayed allocation buffer. Managed by ext_dev.c.
+    struct _ext_prealloc *preallocs;        ///< Linked list of files with preallocated data blocks past EOF. Managed by ext_dev.c.
 } ext_vd;
 
 /// Mounts an EXT volume using the provided volume descriptor.
@@ -41,4 +47,9 @@ bool ext_mount(ext_vd *vd);
 /// Unmounts the EXT volume represented by the provided volume descriptor.
 void ext_umount(ext_vd *vd);
 
+/// Commits all dirty blocks (metadata, journal and partially written data blocks) from the block cache of the provided EXT volume, if it's operating in write-back mode.
+/// If `force` is false, the block cache is only flushed if the journal commit interval from the volume descriptor has elapsed.
+/// Returns 0 if successful, or an errno value otherwise.
+int ext_commit(ext_vd *vd, bool force);
+
 #endif  /* __EXT_H__ */
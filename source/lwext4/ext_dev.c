@@ -13,6 +13,8 @@
 
 #include "../usbhsfs_manager.h"
 #include "../usbhsfs_mount.h"
+#include "../usbhsfs_scsi.h"
+#include "../usbhsfs_budget.h"
 
 /* Helper macros. */
 
@@ -39,12 +41,40 @@ do { \
                                     bool drive_ctx_valid = usbHsFsManagerIsDriveContextPointerValid(drive_ctx); \
                                     if (!drive_ctx_valid) ext_set_error_and_exit(ENODEV)
 
-#define ext_unlock_drive_ctx        if (drive_ctx_valid) mutexUnlock(&(drive_ctx->mutex))
+#define ext_unlock_drive_ctx        if (drive_ctx_valid) usbHsFsManagerUnlockDriveContext(drive_ctx)
+
+#define ext_commit_vol_state        if (drive_ctx_valid) ext_commit(fs_ctx->ext, false)
+
+#define ext_file_is_writable(x)     (((x)->flags & O_ACCMODE) != O_RDONLY || ((x)->flags & O_TRUNC))
 
 #define ext_return(x)               return (ext_ended_with_error ? -1 : (x))
 #define ext_return_ptr(x)           return (ext_ended_with_error ? NULL : (x))
 #define ext_return_bool             return (ext_ended_with_error ? false : true)
 
+#define EXT_PREALLOC_CHUNK_BLOCKS   0x8000      /* Max number of logical blocks allocated within a single journal transaction. */
+#define EXT_ZERO_FILL_BUF_SIZE      0x10000
+#define EXT_DALLOC_BUF_SIZE         0x40000     /* 256 KiB. Max amount of dirty data held in memory by each file opened for writing. */
+
+/* Type definitions. */
+
+/// EXT file state.
+typedef struct _ext_file_state {
+    ext4_file file;     ///< lwext4 file object. Must always be the first member, since most devoptab functions use the file state as a lwext4 file object.
+    u8 *dalloc_buf;     ///< Delayed allocation buffer. Holds data appended to the file that hasn't been written to the volume yet. Allocated on demand.
+    u64 dalloc_offset;  ///< File offset for the data held by the delayed allocation buffer. Always matches both the file size and position while data is buffered.
+    u32 dalloc_size;    ///< Amount of data held by the delayed allocation buffer, in bytes.
+    int dalloc_error;   ///< Error from the last time buffered data was written on behalf of another file handle. Reported by the next close() or fsync() call.
+    struct _ext_file_state *dalloc_next;    ///< Next file holding a delayed allocation buffer on the same volume.
+    struct _ext_file_state **dalloc_prev;   ///< Link pointing to this file (either the volume descriptor list head or the `dalloc_next` member from the previous file).
+} ext_file_state;
+
+/// EXT preallocation record. Tracked per inode rather than per file handle, since any file handle may extend the file over the preallocated blocks.
+typedef struct _ext_prealloc {
+    u32 inode;                  ///< Inode number.
+    u64 end;                    ///< End offset for the data blocks allocated by extdev_allocate_blocks(). Blocks past EOF are released when a file handle is closed.
+    struct _ext_prealloc *next; ///< Next record from the same volume.
+} ext_prealloc;
+
 /* Function prototypes. */
 
 static int       extdev_open(struct _reent *r, void *fd, const char *path, int flags, int mode);
@@ -75,6 +105,23 @@ static bool extdev_fixpath(struct _reent *r, const char *path, UsbHsFsDriveLogic
 
 static void extdev_fill_stat(const struct ext4_inode *inode, u32 st_dev, u32 st_ino, u32 st_blksize, struct stat *st);
 
+static ssize_t extdev_positional_io(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset, bool write);
+
+static int extdev_allocate_blocks(ext_vd *vd, ext4_file *file, u64 offset, u64 size);
+static int extdev_zero_fill(ext_vd *vd, ext4_file *file, u64 end);
+static int extdev_release_preallocated_blocks(ext_vd *vd, u32 inode, bool probe);
+static ext_prealloc *extdev_prealloc_get(ext_vd *vd, u32 inode, bool create);
+static void extdev_prealloc_remove(ext_vd *vd, u32 inode);
+static void extdev_release_path(ext_vd *vd, const char *path);
+
+static int extdev_dalloc_write(ext_vd *vd, ext4_file *file, const char *ptr, size_t len, bool *out_buffered);
+static int extdev_dalloc_flush(ext_vd *vd, ext4_file *file);
+static int extdev_dalloc_sync(ext_vd *vd, ext4_file *file);
+static bool extdev_dalloc_flush_inode(ext_vd *vd, u32 inode, ext4_file *skip);
+static void extdev_dalloc_flush_path(ext_vd *vd, const char *path);
+static void extdev_dalloc_reclaim(ext_vd *vd, ext4_file *skip);
+static void extdev_dalloc_free(ext4_file *file);
+
 static int ext_trans_start(struct ext4_fs *ext_fs);
 static int ext_trans_stop(struct ext4_fs *ext_fs);
 static void ext_trans_abort(struct ext4_fs *ext_fs);
@@ -83,7 +130,7 @@ static void ext_trans_abort(struct ext4_fs *ext_fs);
 
 static const devoptab_t extdev_devoptab = {
     .name         = NULL,
-    .structSize   = sizeof(ext4_file),
+    .structSize   = sizeof(ext_file_state),
     .open_r       = extdev_open,
     .close_r      = extdev_close,
     .write_r      = extdev_write,
@@ -103,7 +150,7 @@ static const devoptab_t extdev_devoptab = {
     .dirclose_r   = extdev_dirclose,
     .statvfs_r    = extdev_statvfs,
     .ftruncate_r  = extdev_ftruncate,
-    .fsync_r      = extdev_fsync,       ///< Not supported by lwext4.
+    .fsync_r      = extdev_fsync,
     .deviceData   = NULL,
     .chmod_r      = extdev_chmod,
     .fchmod_r     = extdev_fchmod,
@@ -117,6 +164,46 @@ const devoptab_t *extdev_get_devoptab()
     return &extdev_devoptab;
 }
 
+void extdev_release_file_state(void *fd)
+{
+    ext4_file *file = (ext4_file*)fd;
+    if (!file) return;
+
+    /* Only read-only file handles are cached, so there's never any buffered data at this point. Free the buffer just in case. */
+    extdev_dalloc_free(file);
+
+    /* Close file. */
+    ext4_fclose(file);
+
+    /* Reset file descriptor. */
+    memset(file, 0, sizeof(ext_file_state));
+}
+
+void extdev_release_volume_buffers(ext_vd *vd)
+{
+    if (!vd) return;
+
+    while(vd->dalloc_files)
+    {
+        ext4_file *file = &(vd->dalloc_files->file);
+
+        /* Errors can't be reported at this point. Buffered data is dropped regardless of the result. */
+        if (extdev_dalloc_flush(vd, file)) USBHSFS_LOG_MSG("Failed to write buffered data from file %u!", file->inode);
+
+        extdev_dalloc_free(file);
+    }
+
+    while(vd->preallocs)
+    {
+        u32 inode = vd->preallocs->inode;
+
+        /* Errors can't be reported at this point. The preallocation record is dropped regardless of the result. */
+        if (extdev_release_preallocated_blocks(vd, inode, false)) USBHSFS_LOG_MSG("Failed to release preallocated blocks from file %u!", inode);
+
+        extdev_prealloc_remove(vd, inode);
+    }
+}
+
 static int extdev_open(struct _reent *r, void *fd, const char *path, int flags, int mode)
 {
     NX_IGNORE_ARG(mode);
@@ -133,22 +220,71 @@ static int extdev_open(struct _reent *r, void *fd, const char *path, int flags,
     /* Fix input path. */
     if (!extdev_fixpath(r, path, &fs_ctx, NULL)) ext_end;
 
+    if (usbHsFsMountIsCacheableFileHandle(fs_ctx, flags))
+    {
+        /* Check if we can reuse a cached file handle. */
+        if (usbHsFsMountAcquireCachedFileHandle(fs_ctx, __usbhsfs_dev_path_buf, file))
+        {
+            USBHSFS_LOG_MSG("Reusing cached file handle for \"%s\" (\"%s\").", path, __usbhsfs_dev_path_buf);
+
+            /* Rewind file. */
+            ext4_fseek(file, 0, SEEK_SET);
+            ext_end;
+        }
+    } else {
+        /* Release cached file handles for this file. */
+        usbHsFsMountInvalidateCachedFileHandles(fs_ctx, __usbhsfs_dev_path_buf);
+    }
+
     USBHSFS_LOG_MSG("Opening file \"%s\" (\"%s\") with flags 0x%X.", path, __usbhsfs_dev_path_buf, flags);
 
+    /* Write data buffered by other file handles for this file, if needed. This must be done before a potential truncation takes place. */
+    extdev_dalloc_flush_path(fs_ctx->ext, __usbhsfs_dev_path_buf);
+
     /* Reset file descriptor. */
-    memset(file, 0, sizeof(ext4_file));
+    memset(file, 0, sizeof(ext_file_state));
 
     /* Open file. */
     ret = ext4_fopen2(file, __usbhsfs_dev_path_buf, flags);
-    if (ret) ext_set_error(ret);
+    if (ret) ext_set_error_and_exit(ret);
+
+    /* Register file handle. */
+    usbHsFsMountRegisterFileHandle(fs_ctx, __usbhsfs_dev_path_buf, file, ext_file_is_writable(file));
+
+    if ((flags & O_ACCMODE) != O_RDONLY)
+    {
+        if (flags & O_TRUNC)
+        {
+            /* lwext4 releases all data blocks when truncating the file, including preallocated ones. */
+            extdev_prealloc_remove(fs_ctx->ext, file->inode);
+        } else {
+            /* Release data blocks past EOF left behind by a previous session (e.g. if the drive was removed before the file was closed). */
+            /* Failures aren't fatal - they just keep wasting space on the volume. */
+            ret = extdev_release_preallocated_blocks(fs_ctx->ext, file->inode, true);
+            if (ret) USBHSFS_LOG_MSG("Failed to release stale blocks past EOF from file %u! (%d).", file->inode, ret);
+        }
+    }
+
+    /* Preallocate data blocks if a file size hint was provided by the calling thread. */
+    /* Failures aren't fatal - blocks will just be allocated on demand while writing. */
+    if ((flags & O_ACCMODE) != O_RDONLY && __usbhsfs_file_size_hint)
+    {
+        USBHSFS_LOG_MSG("Preallocating 0x%lX byte(s) for file %u.", __usbhsfs_file_size_hint, file->inode);
+        ret = extdev_allocate_blocks(fs_ctx->ext, file, 0, __usbhsfs_file_size_hint);
+        if (ret) USBHSFS_LOG_MSG("Failed to preallocate blocks for file %u! (%d).", file->inode, ret);
+    }
 
 end:
+    /* Consume file size hint. */
+    if ((flags & O_ACCMODE) != O_RDONLY) __usbhsfs_file_size_hint = 0;
+
     ext_unlock_drive_ctx;
     ext_return(0);
 }
 
 static int extdev_close(struct _reent *r, void *fd)
 {
+    bool write = false;
     int ret = -1;
 
     ext_declare_error_state;
@@ -160,14 +296,37 @@ static int extdev_close(struct _reent *r, void *fd)
 
     USBHSFS_LOG_MSG("Closing file %u.", file->inode);
 
+    write = ext_file_is_writable(file);
+
+    /* Write buffered data. The file is closed regardless of the result. */
+    ret = extdev_dalloc_sync(fs_ctx->ext, file);
+    if (ret) ext_set_error(ret);
+
+    extdev_dalloc_free(file);
+
+    /* Release preallocated blocks that ended up past EOF. The file is closed regardless of the result. */
+    ret = extdev_release_preallocated_blocks(fs_ctx->ext, file->inode, false);
+    if (ret) ext_set_error(ret);
+
+    /* Keep the file open if its file handle can be cached. */
+    if (usbHsFsMountUnregisterFileHandle(fs_ctx, file, write)) ext_end;
+
     /* Close file. */
     ret = ext4_fclose(file);
     if (ret) ext_set_error_and_exit(ret);
 
     /* Reset file descriptor. */
-    memset(file, 0, sizeof(ext4_file));
+    memset(file, 0, sizeof(ext_file_state));
 
 end:
+    /* Free the delayed allocation buffer even if the drive is gone. Its contents are lost at this point anyway. */
+    if (file) extdev_dalloc_free(file);
+
+    ext_commit_vol_state;
+
+    /* Flush the write cache from the LUN, if needed. */
+    if (drive_ctx_valid && write && !usbHsFsScsiSynchronizeLogicalUnitCache(lun_ctx)) ext_set_error(EIO);
+
     ext_unlock_drive_ctx;
     ext_return(0);
 }
@@ -175,6 +334,7 @@ end:
 static ssize_t extdev_write(struct _reent *r, void *fd, const char *ptr, size_t len)
 {
     size_t bw = 0;
+    bool buffered = false;
     int ret = -1;
 
     ext_declare_error_state;
@@ -184,6 +344,9 @@ static ssize_t extdev_write(struct _reent *r, void *fd, const char *ptr, size_t
     /* Sanity check. */
     if (!file || !ptr || !len) ext_set_error_and_exit(EINVAL);
 
+    /* Write data buffered by other file handles for this file, so writes from different file handles reach the file in order. */
+    extdev_dalloc_flush_inode(fs_ctx->ext, file->inode, file);
+
     /* Check if the append flag is enabled. */
     if ((file->flags & O_APPEND) && ext4_ftell(file) != ext4_fsize(file))
     {
@@ -192,13 +355,31 @@ static ssize_t extdev_write(struct _reent *r, void *fd, const char *ptr, size_t
         if (ret) ext_set_error_and_exit(ret);
     }
 
+    /* Make sure preallocated blocks between EOF and the current position don't expose stale data. */
+    if (ext4_ftell(file) > ext4_fsize(file))
+    {
+        ret = extdev_zero_fill(fs_ctx->ext, file, ext4_ftell(file));
+        if (ret) ext_set_error_and_exit(ret);
+    }
+
     USBHSFS_LOG_MSG("Writing 0x%lX byte(s) to file %u at offset 0x%lX.", len, file->inode, ext4_ftell(file));
 
+    /* Try to hold the data in the delayed allocation buffer first. Buffered data is written right away if the new data can't be appended to it. */
+    ret = extdev_dalloc_write(fs_ctx->ext, file, ptr, len, &buffered);
+    if (ret) ext_set_error_and_exit(ret);
+
+    if (buffered)
+    {
+        bw = len;
+        ext_end;
+    }
+
     /* Write file data. */
     ret = ext4_fwrite(file, ptr, len, &bw);
     if (ret) ext_set_error(ret);
 
 end:
+    ext_commit_vol_state;
     ext_unlock_drive_ctx;
     ext_return((ssize_t)bw);
 }
@@ -215,6 +396,12 @@ static ssize_t extdev_read(struct _reent *r, void *fd, char *ptr, size_t len)
     /* Sanity check. */
     if (!file || !ptr || !len) ext_set_error_and_exit(EINVAL);
 
+    /* Write buffered data, including data buffered by other file handles for this file. */
+    ret = extdev_dalloc_flush(fs_ctx->ext, file);
+    if (ret) ext_set_error_and_exit(ret);
+
+    extdev_dalloc_flush_inode(fs_ctx->ext, file->inode, file);
+
     USBHSFS_LOG_MSG("Reading 0x%lX byte(s) from file %u at offset 0x%lX.", len, file->inode, ext4_ftell(file));
 
     /* Read file data. */
@@ -238,6 +425,10 @@ static off_t extdev_seek(struct _reent *r, void *fd, off_t pos, int dir)
     /* Sanity check. */
     if (!file) ext_set_error_and_exit(EINVAL);
 
+    /* Write buffered data. */
+    ret = extdev_dalloc_flush(fs_ctx->ext, file);
+    if (ret) ext_set_error_and_exit(ret);
+
     USBHSFS_LOG_MSG("Seeking 0x%lX byte(s) from current position in file %u.", pos, file->inode);
 
     /* Perform file seek. */
@@ -265,6 +456,12 @@ static int extdev_fstat(struct _reent *r, void *fd, struct stat *st)
     /* Sanity check. */
     if (!file || !st) ext_set_error_and_exit(EINVAL);
 
+    /* Write buffered data, including data buffered by other file handles for this file. */
+    ret = extdev_dalloc_flush(vd, file);
+    if (ret) ext_set_error_and_exit(ret);
+
+    extdev_dalloc_flush_inode(vd, file->inode, file);
+
     /* Get inode reference. */
     ret = ext4_fs_get_inode_ref(vd->bdev->fs, file->inode, &inode_ref);
     if (ret) ext_set_error_and_exit(ret);
@@ -303,6 +500,13 @@ static int extdev_stat(struct _reent *r, const char *file, struct stat *st)
     ret = ext4_raw_inode_fill(__usbhsfs_dev_path_buf, &inode_num, &inode);
     if (ret) ext_set_error_and_exit(ret);
 
+    /* Write data buffered by open file handles for this file, if needed. Reload the inode afterwards. */
+    if (extdev_dalloc_flush_inode(fs_ctx->ext, inode_num, NULL))
+    {
+        ret = ext4_raw_inode_fill(__usbhsfs_dev_path_buf, &inode_num, &inode);
+        if (ret) ext_set_error_and_exit(ret);
+    }
+
     /* Fill stat info. */
     extdev_fill_stat(&inode, fs_ctx->device_id, inode_num, vd->bdev->lg_bsize, st);
 
@@ -330,6 +534,7 @@ static int extdev_link(struct _reent *r, const char *existing, const char *newLi
     if (ret) ext_set_error(ret);
 
 end:
+    ext_commit_vol_state;
     ext_unlock_drive_ctx;
     ext_return(0);
 }
@@ -346,11 +551,18 @@ static int extdev_unlink(struct _reent *r, const char *name)
 
     USBHSFS_LOG_MSG("Deleting \"%s\" (\"%s\").", name, __usbhsfs_dev_path_buf);
 
+    /* Release cached file handles. */
+    usbHsFsMountInvalidateCachedFileHandles(fs_ctx, __usbhsfs_dev_path_buf);
+
+    /* Write data buffered by open file handles for this file and release its preallocated blocks. Neither must outlive the inode. */
+    extdev_release_path(fs_ctx->ext, __usbhsfs_dev_path_buf);
+
     /* Delete file. */
     ret = ext4_fremove(__usbhsfs_dev_path_buf);
     if (ret) ext_set_error(ret);
 
 end:
+    ext_commit_vol_state;
     ext_unlock_drive_ctx;
     ext_return(0);
 }
@@ -408,11 +620,19 @@ static int extdev_rename(struct _reent *r, const char *oldName, const char *newN
 
     USBHSFS_LOG_MSG("Renaming \"%s\" (\"%s\") to \"%s\" (\"%s\").", oldName, old_path, newName, new_path);
 
+    /* Release cached file handles. */
+    usbHsFsMountInvalidateCachedFileHandles(fs_ctx, old_path);
+    usbHsFsMountInvalidateCachedFileHandles(fs_ctx, new_path);
+
+    /* Write data buffered by open file handles for the file being replaced, if any, and release its preallocated blocks. Neither must outlive the inode. */
+    extdev_release_path(fs_ctx->ext, new_path);
+
     /* Rename entry. */
     ret = ext4_frename(old_path, new_path);
     if (ret) ext_set_error(ret);
 
 end:
+    ext_commit_vol_state;
     ext_unlock_drive_ctx;
     ext_return(0);
 }
@@ -436,6 +656,7 @@ static int extdev_mkdir(struct _reent *r, const char *path, int mode)
     if (ret) ext_set_error(ret);
 
 end:
+    ext_commit_vol_state;
     ext_unlock_drive_ctx;
     ext_return(0);
 }
@@ -577,9 +798,7 @@ static int extdev_statvfs(struct _reent *r, const char *path, struct statvfs *bu
 {
     NX_IGNORE_ARG(path);
 
-    char mount_point[CONFIG_EXT4_MAX_MP_NAME + 3] = {0};
-    struct ext4_mount_stats mount_stats = {0};
-    int ret = -1;
+    struct ext4_sblock *sblock = NULL;
 
     ext_declare_error_state;
     ext_lock_drive_ctx;
@@ -588,26 +807,23 @@ static int extdev_statvfs(struct _reent *r, const char *path, struct statvfs *bu
     /* Sanity check. */
     if (!buf) ext_set_error_and_exit(EINVAL);
 
-    /* Generate lwext4 mount point. */
-    sprintf(mount_point, "/%s/", vd->dev_name);
-
-    USBHSFS_LOG_MSG("Getting filesystem stats for \"%s\" (\"%s\").", path, mount_point);
+    USBHSFS_LOG_MSG("Getting filesystem stats for \"%s\" (\"%s\").", path, vd->dev_name);
 
-    /* Get volume information. */
-    ret = ext4_mount_point_stats(mount_point, &mount_stats);
-    if (ret) ext_set_error_and_exit(ret);
+    /* Get EXT superblock. */
+    /* Its counters are kept up to date by lwext4, so there's no need to look up the mount point or load any block group descriptors. */
+    sblock = &(vd->bdev->fs->sb);
 
     /* Fill filesystem stats. */
     memset(buf, 0, sizeof(struct statvfs));
 
-    buf->f_bsize = mount_stats.block_size;
-    buf->f_frsize = mount_stats.block_size;
-    buf->f_blocks = mount_stats.blocks_count;
-    buf->f_bfree = mount_stats.free_blocks_count;
-    buf->f_bavail = mount_stats.free_blocks_count;
-    buf->f_files = mount_stats.inodes_count;
-    buf->f_ffree = mount_stats.free_inodes_count;
-    buf->f_favail = mount_stats.free_inodes_count;
+    buf->f_bsize = ext4_sb_get_block_size(sblock);
+    buf->f_frsize = buf->f_bsize;
+    buf->f_blocks = ext4_sb_get_blocks_cnt(sblock);
+    buf->f_bfree = ext4_sb_get_free_blocks_cnt(sblock);
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = ext4_get32(sblock, inodes_count);
+    buf->f_ffree = ext4_get32(sblock, free_inodes_count);
+    buf->f_favail = buf->f_ffree;
     buf->f_fsid = fs_ctx->device_id;
     buf->f_flag = ST_NOSUID;
     buf->f_namemax = EXT4_DIRECTORY_FILENAME_LEN;
@@ -619,6 +835,7 @@ end:
 
 static int extdev_ftruncate(struct _reent *r, void *fd, off_t len)
 {
+    u64 size = 0;
     int ret = -1;
 
     ext_declare_error_state;
@@ -630,22 +847,62 @@ static int extdev_ftruncate(struct _reent *r, void *fd, off_t len)
 
     USBHSFS_LOG_MSG("Truncating file %u to 0x%lX bytes.", file->inode, len);
 
-    /* Truncate file. */
+    /* Write buffered data, including data buffered by other file handles for this file. */
+    ret = extdev_dalloc_flush(fs_ctx->ext, file);
+    if (ret) ext_set_error_and_exit(ret);
+
+    extdev_dalloc_flush_inode(fs_ctx->ext, file->inode, file);
+
+    /* Make sure preallocated blocks between EOF and the new file size don't expose stale data. */
+    if ((u64)len > ext4_fsize(file))
+    {
+        ret = extdev_zero_fill(fs_ctx->ext, file, (u64)len);
+        if (ret) ext_set_error_and_exit(ret);
+    }
+
+    /* Truncate file. lwext4 releases all data blocks past the new EOF when shrinking a file, including preallocated ones. */
+    size = ext4_fsize(file);
+
     ret = ext4_ftruncate(file, (u64)len);
-    if (ret) ext_set_error(ret);
+    if (ret) ext_set_error_and_exit(ret);
+
+    if ((u64)len < size) extdev_prealloc_remove(fs_ctx->ext, file->inode);
 
 end:
+    ext_commit_vol_state;
     ext_unlock_drive_ctx;
     ext_return(0);
 }
 
 static int extdev_fsync(struct _reent *r, void *fd)
 {
-    NX_IGNORE_ARG(fd);
+    int ret = -1;
+
+    ext_declare_error_state;
+    ext_declare_file_state;
+    ext_lock_drive_ctx;
+    ext_declare_vol_state;
+
+    /* Sanity check. */
+    if (!file) ext_set_error_and_exit(EINVAL);
+
+    USBHSFS_LOG_MSG("Synchronizing data for file %u.", file->inode);
+
+    /* Write data held by the delayed allocation buffer from this file. */
+    ret = extdev_dalloc_sync(vd, file);
+    if (ret) ext_set_error_and_exit(ret);
+
+    /* Commit all dirty blocks from the block cache: metadata, journal blocks and data blocks that were only partially written. */
+    /* lwext4 only bypasses the block cache for data writes covering whole blocks. */
+    ret = ext_commit(vd, true);
+    if (ret) ext_set_error(ret);
 
-    /* Not supported by lwext4. */
-    r->_errno = ENOSYS;
-    return -1;
+    /* Flush the write cache from the LUN, if needed. */
+    if (!ret && !usbHsFsScsiSynchronizeLogicalUnitCache(lun_ctx)) ext_set_error(EIO);
+
+end:
+    ext_unlock_drive_ctx;
+    ext_return(0);
 }
 
 static int extdev_chmod(struct _reent *r, const char *path, mode_t mode)
@@ -665,6 +922,7 @@ static int extdev_chmod(struct _reent *r, const char *path, mode_t mode)
     if (ret) ext_set_error(ret);
 
 end:
+    ext_commit_vol_state;
     ext_unlock_drive_ctx;
     ext_return(0);
 }
@@ -722,6 +980,7 @@ static int extdev_fchmod(struct _reent *r, void *fd, mode_t mode)
     if (ret) ext_set_error(ret);
 
 end:
+    ext_commit_vol_state;
     ext_unlock_drive_ctx;
     ext_return(0);
 }
@@ -766,61 +1025,66 @@ static int extdev_utimes(struct _reent *r, const char *filename, const struct ti
     if (ret) ext_set_error(ret);
 
 end:
+    ext_commit_vol_state;
     ext_unlock_drive_ctx;
     ext_return(0);
 }
 
-static bool extdev_fixpath(struct _reent *r, const char *path, UsbHsFsDriveLogicalUnitFileSystemContext **fs_ctx, char *outpath)
+int extdev_preallocate(struct _reent *r, void *fd, u64 size)
 {
-    ext_vd *vd = NULL;
-    const u8 *p = (const u8*)path;
-    ssize_t units = 0;
-    u32 code = 0;
-    size_t len = 0;
-    char mount_point[CONFIG_EXT4_MAX_MP_NAME + 3] = {0}, *outptr = (outpath ? outpath : __usbhsfs_dev_path_buf), *cwd = NULL;
+    int ret = -1;
 
     ext_declare_error_state;
+    ext_declare_file_state;
+    ext_lock_drive_ctx;
+    ext_declare_vol_state;
 
-    if (!r || !path || !*path || !fs_ctx || !*fs_ctx || !(vd = (*fs_ctx)->ext) || !(cwd = (*fs_ctx)->cwd)) ext_set_error_and_exit(EINVAL);
+    /* Sanity check. */
+    if (!file || !size) ext_set_error_and_exit(EINVAL);
 
-    USBHSFS_LOG_MSG("Input path: \"%s\".", path);
+    /* Make sure the file was opened for writing. */
+    if ((file->flags & O_ACCMODE) == O_RDONLY) ext_set_error_and_exit(EBADF);
+
+    USBHSFS_LOG_MSG("Preallocating 0x%lX byte(s) for file %u.", size, file->inode);
 
-    /* Generate lwext4 mount point. */
-    sprintf(mount_point, "/%s", vd->dev_name);
+    /* Write buffered data. */
+    ret = extdev_dalloc_flush(vd, file);
+    if (ret) ext_set_error_and_exit(ret);
+
+    /* Allocate data blocks. */
+    ret = extdev_allocate_blocks(vd, file, 0, size);
+    if (ret) ext_set_error(ret);
+
+end:
+    ext_commit_vol_state;
+    ext_unlock_drive_ctx;
+    ext_return(0);
+}
 
-    /* Move the path pointer to the start of the actual path. */
-    do {
-        units = decode_utf8(&code, p);
-        if (units < 0) ext_set_error_and_exit(EILSEQ);
-        p += units;
-    } while(code >= ' ' && code != ':');
+ssize_t extdev_preadv(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset)
+{
+    return extdev_positional_io(r, fd, iov, iov_count, offset, false);
+}
 
-    /* We found a colon; p points to the actual path. */
-    if (code == ':') path = (const char*)p;
+ssize_t extdev_pwritev(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset)
+{
+    return extdev_positional_io(r, fd, iov, iov_count, offset, true);
+}
 
-    /* Make sure there are no more colons and that the remainder of the string is valid UTF-8. */
-    p = (const u8*)path;
+static bool extdev_fixpath(struct _reent *r, const char *path, UsbHsFsDriveLogicalUnitFileSystemContext **fs_ctx, char *outpath)
+{
+    char *outptr = (outpath ? outpath : __usbhsfs_dev_path_buf);
+    int res = 0;
 
-    do {
-        units = decode_utf8(&code, p);
-        if (units < 0) ext_set_error_and_exit(EILSEQ);
-        if (code == ':') ext_set_error_and_exit(EINVAL);
-        p += units;
-    } while(code >= ' ');
+    ext_declare_error_state;
 
-    /* Verify fixed path length. */
-    len = (strlen(mount_point) + strlen(path));
-    if (path[0] != '/') len += strlen(cwd);
+    if (!r || !path || !*path || !fs_ctx || !*fs_ctx || !(*fs_ctx)->ext) ext_set_error_and_exit(EINVAL);
 
-    if (len >= MAX_PATH_LENGTH) ext_set_error_and_exit(ENAMETOOLONG);
+    USBHSFS_LOG_MSG("Input path: \"%s\".", path);
 
     /* Generate fixed path. */
-    if (path[0] == '/')
-    {
-        sprintf(outptr, "%s%s", mount_point, path);
-    } else {
-        sprintf(outptr, "%s%s%s", mount_point, cwd, path);
-    }
+    res = usbHsFsMountNormalizePath(*fs_ctx, path, outptr);
+    if (res) ext_set_error_and_exit(res);
 
     USBHSFS_LOG_MSG("Fixed path: \"%s\".", outptr);
 
@@ -854,6 +1118,510 @@ static void extdev_fill_stat(const struct ext4_inode *inode, u32 st_dev, u32 st_
     st->st_ctim.tv_nsec = inode->crtime_extra;
 }
 
+static ssize_t extdev_positional_io(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset, bool write)
+{
+    u64 cur_pos = 0;
+    bool restore_pos = false;
+    size_t total = 0;
+    int ret = -1;
+
+    ext_declare_error_state;
+    ext_declare_file_state;
+    ext_lock_drive_ctx;
+
+    /* Sanity check. */
+    if (!file || !iov || !iov_count || offset > (u64)INT64_MAX) ext_set_error_and_exit(EINVAL);
+
+    /* Check if the file was opened with the right access mode. */
+    if (write && (file->flags & O_ACCMODE) == O_RDONLY) ext_set_error_and_exit(EBADF);
+
+    USBHSFS_LOG_MSG("%s %u segment(s) %s file %u at offset 0x%lX.", write ? "Writing" : "Reading", iov_count, write ? "to" : "from", file->inode, offset);
+
+    /* Write buffered data, including data buffered by other file handles for this file. */
+    ret = extdev_dalloc_flush(fs_ctx->ext, file);
+    if (ret) ext_set_error_and_exit(ret);
+
+    extdev_dalloc_flush_inode(fs_ctx->ext, file->inode, file);
+
+    /* Save the current file position. lwext4 seeks are just a matter of updating the file position, so this is cheap. */
+    cur_pos = ext4_ftell(file);
+    restore_pos = true;
+
+    ret = ext4_fseek(file, (s64)offset, SEEK_SET);
+    if (ret) ext_set_error_and_exit(ret);
+
+    /* Make sure preallocated blocks between EOF and the write offset don't expose stale data. */
+    if (write && offset > ext4_fsize(file))
+    {
+        ret = extdev_zero_fill(fs_ctx->ext, file, offset);
+        if (ret) ext_set_error_and_exit(ret);
+    }
+
+    /* Process I/O vector segments. */
+    for(u32 i = 0; i < iov_count; i++)
+    {
+        size_t xfer = 0;
+
+        if (!iov[i].size) continue;
+        if (!iov[i].data) ext_set_error_and_exit(EINVAL);
+
+        ret = (write ? ext4_fwrite(file, iov[i].data, iov[i].size, &xfer) : ext4_fread(file, iov[i].data, iov[i].size, &xfer));
+        total += xfer;
+        if (ret) ext_set_error_and_exit(ret);
+
+        /* Stop right away if EOF was reached or if the volume is full. */
+        if (xfer < iov[i].size) ext_end;
+    }
+
+end:
+    /* Restore the original file position. */
+    if (restore_pos) ext4_fseek(file, (s64)cur_pos, SEEK_SET);
+
+    if (write) ext_commit_vol_state;
+
+    ext_unlock_drive_ctx;
+    ext_return((ssize_t)total);
+}
+
+static int extdev_allocate_blocks(ext_vd *vd, ext4_file *file, u64 offset, u64 size)
+{
+    ext_prealloc *prealloc = NULL;
+    struct ext4_fs *ext_fs = vd->bdev->fs;
+    struct ext4_sblock *sblock = &(ext_fs->sb);
+    struct ext4_inode_ref inode_ref = {0};
+    u32 block_size = ext4_sb_get_block_size(sblock);
+    u64 block_count = ((offset + size + block_size - 1) / block_size), eof_block_count = ((ext4_fsize(file) + block_size - 1) / block_size);
+    ext4_lblk_t lblk = (ext4_lblk_t)MAX(offset / block_size, eof_block_count), chunk_end = 0, count = 0;
+    ext4_fsblk_t fblock = 0;
+    int ret = 0;
+
+    /* Check if the volume is writable. */
+    if ((vd->flags & UsbHsFsMountFlags_ReadOnly) || ((UsbHsFsDriveLogicalUnitContext*)vd->bdev->bdif->p_user)->write_protect) return EROFS;
+
+    /* Preallocation is only supported on extent-based inodes. */
+    if (!ext4_sb_feature_incom(sblock, EXT4_FINCOM_EXTENTS)) return ENOTSUP;
+
+    /* Make sure we don't go past the maximum logical block number. */
+    if (block_count > EXT_MAX_BLOCKS) return EFBIG;
+
+    /* Get the preallocation record for this file. Blocks must never be allocated past EOF without keeping track of them. */
+    prealloc = extdev_prealloc_get(vd, file->inode, true);
+    if (!prealloc) return ENOMEM;
+
+    /* Only blocks past EOF are allocated. Mapping holes within the file would expose stale data from the volume. */
+    while(lblk < (ext4_lblk_t)block_count)
+    {
+        /* Start journal transfer. Big requests are split across multiple transactions to avoid filling up the journal. */
+        ret = ext_trans_start(ext_fs);
+        if (ret) break;
+
+        /* Get inode reference. */
+        ret = ext4_fs_get_inode_ref(ext_fs, file->inode, &inode_ref);
+        if (ret)
+        {
+            ext_trans_abort(ext_fs);
+            break;
+        }
+
+        if (!ext4_inode_has_flag(inode_ref.inode, EXT4_INODE_FLAG_EXTENTS))
+        {
+            ext4_fs_put_inode_ref(&inode_ref);
+            ext_trans_abort(ext_fs);
+            ret = ENOTSUP;
+            break;
+        }
+
+        /* Allocate (or skip already mapped) logical blocks from the current chunk. */
+        /* lwext4 merges adjacent allocations into the same extent, so sequential allocations end up as a handful of large extents. */
+        chunk_end = (ext4_lblk_t)MIN(block_count, (u64)lblk + EXT_PREALLOC_CHUNK_BLOCKS);
+
+        while(lblk < chunk_end)
+        {
+            count = 0;
+            ret = ext4_extent_get_blocks(&inode_ref, lblk, chunk_end - lblk, &fblock, true, &count);
+            if (ret) break;
+            lblk += (count ? count : 1);
+        }
+
+        /* Put back inode reference. */
+        if (!ret)
+        {
+            ret = ext4_fs_put_inode_ref(&inode_ref);
+        } else {
+            ext4_fs_put_inode_ref(&inode_ref);
+        }
+
+        if (ret)
+        {
+            ext_trans_abort(ext_fs);
+            break;
+        }
+
+        /* Stop journal transfer. */
+        ret = ext_trans_stop(ext_fs);
+        if (ret) break;
+    }
+
+    /* Keep track of the blocks we allocated, even if we failed halfway through. */
+    if (((u64)lblk * block_size) > prealloc->end) prealloc->end = ((u64)lblk * block_size);
+
+    return ret;
+}
+
+static int extdev_zero_fill(ext_vd *vd, ext4_file *file, u64 end)
+{
+    ext_prealloc *prealloc = extdev_prealloc_get(vd, file->inode, false);
+    struct ext4_inode_ref inode_ref = {0};
+    u64 start = 0, cur_pos = ext4_ftell(file), offset = 0;
+    u8 *zero_buf = NULL;
+    size_t bw = 0;
+    int ret = 0;
+
+    /* Only preallocated blocks between EOF and the provided offset need to be zeroed. Holes are always read back as zeroes, so they're left alone. */
+    if (!prealloc) return 0;
+
+    end = MIN(end, prealloc->end);
+
+    /* Get the current file size from the inode. Other file handles for this file may have extended it in the meantime. */
+    ret = ext4_fs_get_inode_ref(vd->bdev->fs, file->inode, &inode_ref);
+    if (ret) return ret;
+
+    start = ext4_inode_get_size(&(vd->bdev->fs->sb), inode_ref.inode);
+
+    ext4_fs_put_inode_ref(&inode_ref);
+
+    if (start >= end) return 0;
+
+    /* Update the cached file size. lwext4 won't let us seek past it. */
+    file->fsize = start;
+
+    /* Allocate zero-filled buffer. */
+    zero_buf = calloc(1, EXT_ZERO_FILL_BUF_SIZE);
+    if (!zero_buf) return ENOMEM;
+
+    /* Seek to EOF. */
+    ret = ext4_fseek(file, (s64)start, SEEK_SET);
+    if (ret) goto end;
+
+    /* Write zeroes. */
+    for(offset = start; offset < end; offset += bw)
+    {
+        ret = ext4_fwrite(file, zero_buf, MIN(end - offset, (u64)EXT_ZERO_FILL_BUF_SIZE), &bw);
+        if (!ret && !bw) ret = EIO;
+        if (ret) break;
+    }
+
+end:
+    /* Restore file position. */
+    ext4_fseek(file, (s64)cur_pos, SEEK_SET);
+
+    free(zero_buf);
+
+    return ret;
+}
+
+static int extdev_release_preallocated_blocks(ext_vd *vd, u32 inode, bool probe)
+{
+    ext_prealloc *prealloc = extdev_prealloc_get(vd, inode, false);
+    struct ext4_fs *ext_fs = vd->bdev->fs;
+    struct ext4_sblock *sblock = &(ext_fs->sb);
+    struct ext4_inode_ref inode_ref = {0};
+    u32 block_size = ext4_sb_get_block_size(sblock), count = 0;
+    u64 eof_block_count = 0;
+    ext4_fsblk_t fblock = 0;
+    bool release = false;
+    int ret = 0;
+
+    /* Check if we need to do anything at all. Blocks past EOF can only be looked for on writable, extent-based volumes. */
+    if (!prealloc && (!probe || (vd->flags & UsbHsFsMountFlags_ReadOnly) || ((UsbHsFsDriveLogicalUnitContext*)vd->bdev->bdif->p_user)->write_protect || \
+        !ext4_sb_feature_incom(sblock, EXT4_FINCOM_EXTENTS))) return 0;
+
+    /* Get inode reference. */
+    ret = ext4_fs_get_inode_ref(ext_fs, inode, &inode_ref);
+    if (ret) return ret;
+
+    eof_block_count = ((ext4_inode_get_size(sblock, inode_ref.inode) + block_size - 1) / block_size);
+
+    if (prealloc)
+    {
+        /* Check if any preallocated blocks are still past EOF. */
+        release = (prealloc->end > (eof_block_count * block_size));
+    } else
+    if (ext4_inode_has_flag(inode_ref.inode, EXT4_INODE_FLAG_EXTENTS) && eof_block_count < EXT_MAX_BLOCKS)
+    {
+        /* Check if the first logical block past EOF is mapped. Preallocated blocks always start right at EOF. */
+        release = (!ext4_extent_get_blocks(&inode_ref, (ext4_lblk_t)eof_block_count, 1, &fblock, false, &count) && fblock);
+    }
+
+    /* Put back inode reference. */
+    ext4_fs_put_inode_ref(&inode_ref);
+
+    if (!release)
+    {
+        extdev_prealloc_remove(vd, inode);
+        return 0;
+    }
+
+    USBHSFS_LOG_MSG("Releasing preallocated blocks past EOF from file %u (starting at 0x%lX).", inode, eof_block_count * block_size);
+
+    /* Start journal transfer. */
+    ret = ext_trans_start(ext_fs);
+    if (ret) return ret;
+
+    /* Get inode reference. */
+    ret = ext4_fs_get_inode_ref(ext_fs, inode, &inode_ref);
+    if (ret)
+    {
+        ext_trans_abort(ext_fs);
+        return ret;
+    }
+
+    /* Remove all data blocks past EOF. The file size is left untouched. */
+    ret = ext4_extent_remove_space(&inode_ref, (ext4_lblk_t)eof_block_count, EXT_MAX_BLOCKS);
+
+    /* Put back inode reference. */
+    if (!ret)
+    {
+        ret = ext4_fs_put_inode_ref(&inode_ref);
+    } else {
+        ext4_fs_put_inode_ref(&inode_ref);
+    }
+
+    if (ret)
+    {
+        ext_trans_abort(ext_fs);
+        return ret;
+    }
+
+    /* Stop journal transfer. */
+    ret = ext_trans_stop(ext_fs);
+    if (!ret) extdev_prealloc_remove(vd, inode);
+
+    return ret;
+}
+
+static ext_prealloc *extdev_prealloc_get(ext_vd *vd, u32 inode, bool create)
+{
+    ext_prealloc *prealloc = vd->preallocs;
+
+    for(; prealloc; prealloc = prealloc->next)
+    {
+        if (prealloc->inode == inode) return prealloc;
+    }
+
+    if (!create) return NULL;
+
+    /* Allocate a new record. */
+    prealloc = calloc(1, sizeof(ext_prealloc));
+    if (!prealloc) return NULL;
+
+    prealloc->inode = inode;
+    prealloc->next = vd->preallocs;
+    vd->preallocs = prealloc;
+
+    return prealloc;
+}
+
+static void extdev_prealloc_remove(ext_vd *vd, u32 inode)
+{
+    ext_prealloc **link = &(vd->preallocs), *cur = NULL;
+
+    while((cur = *link))
+    {
+        if (cur->inode == inode)
+        {
+            *link = cur->next;
+            free(cur);
+            break;
+        }
+
+        link = &(cur->next);
+    }
+}
+
+static void extdev_release_path(ext_vd *vd, const char *path)
+{
+    struct ext4_inode inode = {0};
+    u32 inode_num = 0;
+    int ret = 0;
+
+    if ((!vd->dalloc_files && !vd->preallocs) || ext4_raw_inode_fill(path, &inode_num, &inode)) return;
+
+    extdev_dalloc_flush_inode(vd, inode_num, NULL);
+
+    /* Failures aren't fatal - the blocks are freed along with the inode anyway. */
+    ret = extdev_release_preallocated_blocks(vd, inode_num, false);
+    if (ret) USBHSFS_LOG_MSG("Failed to release preallocated blocks from file %u! (%d).", inode_num, ret);
+}
+
+static int extdev_dalloc_write(ext_vd *vd, ext4_file *file, const char *ptr, size_t len, bool *out_buffered)
+{
+    ext_file_state *state = (ext_file_state*)file;
+    struct ext4_sblock *sblock = &(vd->bdev->fs->sb);
+    u32 block_size = ext4_sb_get_block_size(sblock);
+    u64 block_count = 0;
+    int ret = 0;
+
+    *out_buffered = false;
+
+    /* Only buffer small writes that append data to files opened for writing on writable volumes. */
+    /* Big writes already allocate long runs of blocks, and writes within the file don't need any new blocks at all. */
+    if ((file->flags & O_ACCMODE) == O_RDONLY || len >= EXT_DALLOC_BUF_SIZE || (vd->flags & UsbHsFsMountFlags_ReadOnly) || \
+        ((UsbHsFsDriveLogicalUnitContext*)vd->bdev->bdif->p_user)->write_protect) return extdev_dalloc_flush(vd, file);
+
+    /* The file position and size don't change while data is buffered, so this only needs to be checked if the buffer is empty. */
+    if (!state->dalloc_size && ext4_ftell(file) != ext4_fsize(file)) return 0;
+
+    /* Write buffered data if there's not enough room left for the new data. The file position ends up at EOF afterwards. */
+    if ((state->dalloc_size + len) > EXT_DALLOC_BUF_SIZE)
+    {
+        ret = extdev_dalloc_flush(vd, file);
+        if (ret) return ret;
+    }
+
+    /* Make sure the volume has enough free blocks to hold all buffered data. Running out of space should be reported by the write call itself. */
+    block_count = ((state->dalloc_size + len + block_size - 1) / block_size);
+    if (block_count > ext4_sb_get_free_blocks_cnt(sblock)) return extdev_dalloc_flush(vd, file);
+
+    /* Allocate the delayed allocation buffer, if needed. */
+    if (!state->dalloc_buf)
+    {
+        /* Write and free the buffers from other files on this volume if we're out of memory budget. Plain writes are used if it still doesn't fit. */
+        if (!usbHsFsBudgetReserve(UsbHsFsMemoryCategory_VolumeCaches, EXT_DALLOC_BUF_SIZE))
+        {
+            if (!vd->dalloc_files) return 0;
+
+            extdev_dalloc_reclaim(vd, file);
+            if (!usbHsFsBudgetReserve(UsbHsFsMemoryCategory_VolumeCaches, EXT_DALLOC_BUF_SIZE)) return 0;
+        }
+
+        state->dalloc_buf = malloc(EXT_DALLOC_BUF_SIZE);
+        if (!state->dalloc_buf)
+        {
+            usbHsFsBudgetRelease(UsbHsFsMemoryCategory_VolumeCaches, EXT_DALLOC_BUF_SIZE);
+            return 0;
+        }
+
+        /* Add this file to the list of files holding a delayed allocation buffer. */
+        state->dalloc_next = vd->dalloc_files;
+        state->dalloc_prev = &(vd->dalloc_files);
+        if (vd->dalloc_files) vd->dalloc_files->dalloc_prev = &(state->dalloc_next);
+        vd->dalloc_files = state;
+    }
+
+    /* Buffer data. */
+    if (!state->dalloc_size) state->dalloc_offset = ext4_ftell(file);
+    memcpy(state->dalloc_buf + state->dalloc_size, ptr, len);
+    state->dalloc_size += (u32)len;
+
+    *out_buffered = true;
+
+    return 0;
+}
+
+static int extdev_dalloc_flush(ext_vd *vd, ext4_file *file)
+{
+    ext_file_state *state = (ext_file_state*)file;
+    size_t bw = 0;
+    int ret = 0;
+
+    if (!state->dalloc_size) return 0;
+
+    USBHSFS_LOG_MSG("Flushing 0x%X buffered byte(s) to file %u at offset 0x%lX.", state->dalloc_size, file->inode, state->dalloc_offset);
+
+    /* Allocate all data blocks for the buffered data in one go. lwext4 would otherwise allocate them one by one while writing. */
+    /* Failures aren't fatal - blocks will just be allocated on demand while writing. */
+    ret = extdev_allocate_blocks(vd, file, state->dalloc_offset, state->dalloc_size);
+    if (ret) USBHSFS_LOG_MSG("Failed to allocate blocks for buffered data from file %u! (%d).", file->inode, ret);
+
+    /* Write buffered data. */
+    ret = ext4_fseek(file, (s64)state->dalloc_offset, SEEK_SET);
+    if (!ret) ret = ext4_fwrite(file, state->dalloc_buf, state->dalloc_size, &bw);
+    if (!ret && bw < state->dalloc_size) ret = ENOSPC;
+
+    /* Buffered data is dropped regardless of the result. There's no sensible way to retry a failed write at a later time. */
+    state->dalloc_size = 0;
+
+    return ret;
+}
+
+static int extdev_dalloc_sync(ext_vd *vd, ext4_file *file)
+{
+    ext_file_state *state = (ext_file_state*)file;
+
+    /* Write buffered data. */
+    int ret = extdev_dalloc_flush(vd, file);
+
+    /* Report errors from buffered data written on behalf of other file handles. */
+    if (!ret) ret = state->dalloc_error;
+    state->dalloc_error = 0;
+
+    return ret;
+}
+
+static bool extdev_dalloc_flush_inode(ext_vd *vd, u32 inode, ext4_file *skip)
+{
+    bool flushed = false;
+
+    for(ext_file_state *cur = vd->dalloc_files; cur; cur = cur->dalloc_next)
+    {
+        if (&(cur->file) == skip || cur->file.inode != inode || !cur->dalloc_size) continue;
+
+        /* Errors are reported to the file handle the data belongs to. */
+        int ret = extdev_dalloc_flush(vd, &(cur->file));
+        if (ret && !cur->dalloc_error) cur->dalloc_error = ret;
+
+        flushed = true;
+    }
+
+    return flushed;
+}
+
+static void extdev_dalloc_flush_path(ext_vd *vd, const char *path)
+{
+    struct ext4_inode inode = {0};
+    u32 inode_num = 0;
+
+    if (vd->dalloc_files && !ext4_raw_inode_fill(path, &inode_num, &inode)) extdev_dalloc_flush_inode(vd, inode_num, NULL);
+}
+
+static void extdev_dalloc_reclaim(ext_vd *vd, ext4_file *skip)
+{
+    ext_file_state *cur = vd->dalloc_files, *next = NULL;
+
+    USBHSFS_LOG_MSG("Reclaiming delayed allocation buffers from volume \"%s\".", vd->dev_name);
+
+    for(; cur; cur = next)
+    {
+        next = cur->dalloc_next;
+        if (&(cur->file) == skip) continue;
+
+        /* Errors are reported to the file handle the data belongs to. */
+        int ret = extdev_dalloc_flush(vd, &(cur->file));
+        if (ret && !cur->dalloc_error) cur->dalloc_error = ret;
+
+        extdev_dalloc_free(&(cur->file));
+    }
+}
+
+static void extdev_dalloc_free(ext4_file *file)
+{
+    ext_file_state *state = (ext_file_state*)file;
+    if (!state->dalloc_buf) return;
+
+    free(state->dalloc_buf);
+    usbHsFsBudgetRelease(UsbHsFsMemoryCategory_VolumeCaches, EXT_DALLOC_BUF_SIZE);
+
+    /* Remove this file from the list of files holding a delayed allocation buffer. */
+    if (state->dalloc_prev) *(state->dalloc_prev) = state->dalloc_next;
+    if (state->dalloc_next) state->dalloc_next->dalloc_prev = state->dalloc_prev;
+
+    state->dalloc_buf = NULL;
+    state->dalloc_size = 0;
+    state->dalloc_next = NULL;
+    state->dalloc_prev = NULL;
+}
+
 static int ext_trans_start(struct ext4_fs *ext_fs)
 {
     struct jbd_journal *journal = NULL;
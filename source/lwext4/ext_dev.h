@@ -13,4 +13,21 @@
 
 const devoptab_t *extdev_get_devoptab();
 
+/// Closes the provided devoptab file state without locking the drive context it belongs to. Used to release cached file handles.
+void extdev_release_file_state(void *fd);
+
+/// Writes and frees the delayed allocation buffers from all files opened on the provided EXT volume, and releases preallocated data blocks past EOF.
+/// Must be called before unmounting it.
+void extdev_release_volume_buffers(ext_vd *vd);
+
+/// Preallocates data blocks for the provided lwext4 file object, up to `size` bytes from the start of the file. The file size isn't modified.
+/// Follows the same calling convention as devoptab functions: `r->deviceData` must point to the filesystem context the file object belongs to.
+/// Returns 0 if successful, or -1 otherwise (with `r->_errno` set accordingly).
+int extdev_preallocate(struct _reent *r, void *fd, u64 size);
+
+/// Positional vectored I/O. The file position from the provided lwext4 file object isn't modified.
+/// Follows the same calling convention as extdev_preallocate().
+ssize_t extdev_preadv(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset);
+ssize_t extdev_pwritev(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset);
+
 #endif  /* __EXT_DEV_H__ */
@@ -71,8 +71,8 @@ struct ext4_blockdev *ext_disk_io_alloc_blockdev(void *p_user, u64 part_lba, u64
     }
 
     /* Fill ext4_blockdev object. */
-    bdev->part_offset = (part_lba * (u64)lun_ctx->block_length);
-    bdev->part_size = (part_size * (u64)lun_ctx->block_length);
+    bdev->part_offset = (part_lba << lun_ctx->block_length_log2);
+    bdev->part_size = (part_size << lun_ctx->block_length_log2);
 
     /* Fill ext4_blockdev_iface object. */
     bdev->bdif->ph_bsize = lun_ctx->block_length;
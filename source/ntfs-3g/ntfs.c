@@ -11,6 +11,8 @@
 
 #include "ntfs.h"
 
+#define NTFS_RELATIME_INTERVAL  ((s64)24 * 60 * 60 * 10000000)  /* 24 hours, in 100-nanosecond intervals. Matches the relatime mount option from Linux. */
+
 /* Type definitions. */
 
 /// NTFS path.
@@ -23,6 +25,8 @@ typedef struct _ntfs_path {
 
 /* Function prototypes. */
 
+static bool ntfs_inode_atime_is_stale(ntfs_inode *ni);
+
 static ntfs_inode *ntfs_inode_open_from_path_reparse(ntfs_vd *vd, const char *path, int reparse_depth);
 
 static void ntfs_split_path(const char *path, ntfs_path *p);
@@ -259,7 +263,16 @@ void ntfs_inode_update_times_filtered(ntfs_vd *vd, ntfs_inode *ni, ntfs_time_upd
     if (!vd || !ni) return;
 
     /* Run the access time update strategy against the volume settings first. */
-    if (!vd->update_access_times) mask &= ~NTFS_UPDATE_ATIME;
+    if (!vd->update_access_times)
+    {
+        mask &= ~NTFS_UPDATE_ATIME;
+    } else
+    if (vd->relative_access_times && mask == NTFS_UPDATE_ATIME && !ntfs_inode_atime_is_stale(ni))
+    {
+        /* Access-only updates are skipped unless the current access time is older than the last modification/change time, or too old. */
+        /* This keeps read-only workloads (e.g. browsing large directory trees) from dirtying MFT records. */
+        mask = 0;
+    }
 
     /* Update entry times. */
     if (mask)
@@ -269,6 +282,14 @@ void ntfs_inode_update_times_filtered(ntfs_vd *vd, ntfs_inode *ni, ntfs_time_upd
     }
 }
 
+static bool ntfs_inode_atime_is_stale(ntfs_inode *ni)
+{
+    s64 atime = sle64_to_cpu(ni->last_access_time);
+    s64 now = sle64_to_cpu(ntfs_current_time());
+
+    return (atime <= sle64_to_cpu(ni->last_data_change_time) || atime <= sle64_to_cpu(ni->last_mft_change_time) || (now - atime) >= NTFS_RELATIME_INTERVAL);
+}
+
 static ntfs_inode *ntfs_inode_open_from_path_reparse(ntfs_vd *vd, const char *path, int reparse_depth)
 {
     ntfs_inode *ni = NULL;
@@ -50,7 +50,9 @@ typedef struct _ntfs_vd {
     u16 fmask;                  ///< Unix style permission mask for file creation.
     u16 dmask;                  ///< Unix style permission mask for directory creation.
     bool update_access_times;   ///< True if file/directory access times should be updated during I/O operations.
+    bool relative_access_times; ///< True if access-only time updates should be skipped unless the current access time is stale (relatime).
     bool ignore_read_only_attr; ///< True if read-only file attributes should be ignored (allows writing to read-only files).
+    u64 data_gen;               ///< Incremented each time file data is modified. Used to invalidate decompressed compression unit caches.
 } ntfs_vd;
 
 #ifdef DEBUG
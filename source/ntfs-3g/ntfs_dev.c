@@ -14,6 +14,9 @@
 
 #include "../usbhsfs_manager.h"
 #include "../usbhsfs_mount.h"
+#include "../usbhsfs_scsi.h"
+#include "../usbhsfs_pool.h"
+#include "../usbhsfs_budget.h"
 
 /* Helper macros. */
 
@@ -40,14 +43,25 @@ do { \
                                     bool drive_ctx_valid = usbHsFsManagerIsDriveContextPointerValid(drive_ctx); \
                                     if (!drive_ctx_valid) ntfs_set_error_and_exit(ENODEV)
 
-#define ntfs_unlock_drive_ctx       if (drive_ctx_valid) mutexUnlock(&(drive_ctx->mutex))
+#define ntfs_unlock_drive_ctx       if (drive_ctx_valid) usbHsFsManagerUnlockDriveContext(drive_ctx)
 
 #define ntfs_return(x)              return (ntfs_ended_with_error ? -1 : (x))
 #define ntfs_return_ptr(x)          return (ntfs_ended_with_error ? NULL : (x))
 #define ntfs_return_bool            return (ntfs_ended_with_error ? false : true)
 
+#define NTFS_CU_CACHE_ENTRIES       2   /* Enough to hold both compression units from a read straddling a compression unit boundary. */
+
 /* Type definitions. */
 
+/// Decompressed compression unit. Cached to avoid decompressing the same compression unit over and over again while reading compressed files in small chunks.
+typedef struct _ntfs_cu_cache_entry {
+    u8 *data;           ///< Decompressed compression unit data. NULL if this entry hasn't been allocated yet.
+    s64 offset;         ///< Compression unit offset within the file data.
+    u32 size;           ///< Decompressed data size. Zero if this entry holds no data.
+    u64 data_gen;       ///< Volume data generation this entry was filled at. Entries from older generations are stale.
+    u64 last_use;       ///< Cache tick from the last time this entry was used. Used to pick the least recently used entry.
+} ntfs_cu_cache_entry;
+
 /// NTFS file state.
 typedef struct _ntfs_file_state {
     ntfs_vd *vd;        ///< File volume descriptor.
@@ -59,14 +73,18 @@ typedef struct _ntfs_file_state {
     bool append;        ///< True if allowed to append to file.
     bool compressed;    ///< True if file data is compressed.
     bool encrypted;     ///< True if file data is encryted.
+    bool atime_pending; ///< True if the last access time update has been deferred until the file is closed.
     off_t pos;          ///< Current position within the file (in bytes).
     u64 len;            ///< Total file length (in bytes).
+    ntfs_cu_cache_entry cu_cache[NTFS_CU_CACHE_ENTRIES];    ///< Decompressed compression unit cache. Only used with compressed files.
+    u32 cu_cache_size;  ///< Size of each allocated compression unit cache buffer (in bytes).
+    u64 cu_cache_tick;  ///< Compression unit cache tick. Incremented on each cache access.
 } ntfs_file_state;
 
-/// NTFS directory entry.
+/// NTFS directory entry. Allocated from the directory state arena, along with its name.
 typedef struct _ntfs_dir_entry {
     u64 mref;                       ///< Entry record number.
-    char *name;                     ///< Entry name.
+    char *name;                     ///< Entry name. Stored right after the directory entry.
     struct _ntfs_dir_entry *next;   ///< Next entry in the directory.
 } ntfs_dir_entry;
 
@@ -77,6 +95,9 @@ typedef struct _ntfs_dir_state {
     s64 pos;                    ///< Current position in the directory.
     ntfs_dir_entry *first;      ///< The first entry in the directory.
     ntfs_dir_entry *current;    ///< The current entry in the directory.
+    ntfs_dir_entry *last;       ///< The last entry in the directory.
+    UsbHsFsPoolArena arena;     ///< Arena holding all directory entries. Released in a single step once the directory is reset or closed.
+    bool atime_pending;         ///< True if the last access time update has been deferred until the directory is closed.
 } ntfs_dir_state;
 
 /* Function prototypes. */
@@ -107,6 +128,11 @@ static int       ntfsdev_utimes(struct _reent *r, const char *filename, const st
 
 static bool ntfsdev_fixpath(struct _reent *r, const char *path, UsbHsFsDriveLogicalUnitFileSystemContext **fs_ctx, char *outpath);
 
+static s64 ntfsdev_attr_pread(ntfs_file_state *file, s64 offset, s64 len, void *buf);
+static void ntfsdev_free_cu_cache(ntfs_file_state *file);
+
+static ssize_t ntfsdev_positional_io(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset, bool write);
+
 static void ntfsdev_fill_stat(ntfs_vd *vd, ntfs_inode *ni, struct stat *st);
 
 static int ntfsdev_dirnext_filldir(void *dirent, const ntfschar *name, const int name_len, const int name_type, const s64 pos, const MFT_REF mref, const unsigned dt_type);
@@ -149,6 +175,47 @@ const devoptab_t *ntfsdev_get_devoptab()
     return &ntfsdev_devoptab;
 }
 
+void ntfsdev_release_file_state(void *fd)
+{
+    ntfs_file_state *file = (ntfs_file_state*)fd;
+    if (!file || !file->ni || !file->data) return;
+
+    /* Apply the deferred last access time update, if needed. */
+    if (file->atime_pending) ntfs_inode_update_times_filtered(file->vd, file->ni, NTFS_UPDATE_ATIME);
+
+    /* If the file is dirty, synchronize its data. */
+    if (NInoDirty(file->ni)) ntfs_inode_sync(file->ni);
+
+    /* Special case clean-ups for compressed and/or encrypted files. */
+    if (file->compressed) ntfs_attr_pclose(file->data);
+
+#ifdef HAVE_SETXATTR
+    if (file->encrypted) ntfs_efs_fixup_attribute(NULL, file->data);
+#endif
+
+    /* Free compression unit cache. */
+    ntfsdev_free_cu_cache(file);
+
+    /* Close file data attribute. */
+    ntfs_attr_close(file->data);
+
+    /* Close file node. */
+    ntfs_inode_close(file->ni);
+
+    /* Reset file state. */
+    memset(file, 0, sizeof(ntfs_file_state));
+}
+
+ssize_t ntfsdev_preadv(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset)
+{
+    return ntfsdev_positional_io(r, fd, iov, iov_count, offset, false);
+}
+
+ssize_t ntfsdev_pwritev(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset)
+{
+    return ntfsdev_positional_io(r, fd, iov, iov_count, offset, true);
+}
+
 static int ntfsdev_open(struct _reent *r, void *fd, const char *path, int flags, int mode)
 {
     NX_IGNORE_ARG(mode);
@@ -164,9 +231,27 @@ static int ntfsdev_open(struct _reent *r, void *fd, const char *path, int flags,
     /* Fix input path. */
     if (!ntfsdev_fixpath(r, path, &fs_ctx, NULL)) ntfs_end;
 
+    if (usbHsFsMountIsCacheableFileHandle(fs_ctx, flags))
+    {
+        /* Check if we can reuse a cached file handle. */
+        if (usbHsFsMountAcquireCachedFileHandle(fs_ctx, __usbhsfs_dev_path_buf, file))
+        {
+            USBHSFS_LOG_MSG("Reusing cached file handle for \"%s\" (\"%s\").", path, __usbhsfs_dev_path_buf);
+
+            /* Rewind file and defer last access time update. */
+            file->pos = 0;
+            file->atime_pending = true;
+            ntfs_end;
+        }
+    } else {
+        /* Release cached file handles for this file. */
+        usbHsFsMountInvalidateCachedFileHandles(fs_ctx, __usbhsfs_dev_path_buf);
+    }
+
     /* Setup file state. */
     memset(file, 0, sizeof(ntfs_file_state));
     file->vd = vd;
+    file->flags = flags;
 
     /* Check access mode. */
     switch(flags & O_ACCMODE)
@@ -237,6 +322,8 @@ static int ntfsdev_open(struct _reent *r, void *fd, const char *path, int flags,
     {
         USBHSFS_LOG_MSG("Truncating \"%s\".", __usbhsfs_dev_path_buf);
 
+        vd->data_gen++;
+
         if (!ntfs_attr_truncate(file->data, 0))
         {
             /* Mark the file as dirty. */
@@ -256,10 +343,16 @@ static int ntfsdev_open(struct _reent *r, void *fd, const char *path, int flags,
     file->pos = 0;
     file->len = file->data->data_size;
 
-    /* Update last access time. */
-    ntfs_inode_update_times_filtered(file->vd, file->ni, NTFS_UPDATE_ATIME);
+    /* Defer last access time update until the file is closed. Batches all accesses made through this handle into a single MFT record update. */
+    file->atime_pending = true;
+
+    /* Register file handle. */
+    usbHsFsMountRegisterFileHandle(fs_ctx, __usbhsfs_dev_path_buf, file, file->write);
 
 end:
+    /* Consume file size hint. Preallocation isn't supported on NTFS volumes. */
+    if ((flags & O_ACCMODE) != O_RDONLY) __usbhsfs_file_size_hint = 0;
+
     /* Clean up if something went wrong. */
     if (ntfs_ended_with_error && file)
     {
@@ -276,6 +369,8 @@ end:
 
 static int ntfsdev_close(struct _reent *r, void *fd)
 {
+    bool write = false;
+
     ntfs_declare_error_state;
     ntfs_declare_file_state;
     ntfs_lock_drive_ctx;
@@ -285,26 +380,24 @@ static int ntfsdev_close(struct _reent *r, void *fd)
 
     USBHSFS_LOG_MSG("Closing file %lu.", file->ni->mft_no);
 
-    /* If the file is dirty, synchronize its data. */
-    if (NInoDirty(file->ni)) ntfs_inode_sync(file->ni);
+    write = file->write;
 
-    /* Special case clean-ups for compressed and/or encrypted files. */
-    if (file->compressed) ntfs_attr_pclose(file->data);
+    /* Free compression unit cache. Cached file handles don't get to keep it, since nobody is reading from them. */
+    ntfsdev_free_cu_cache(file);
 
-#ifdef HAVE_SETXATTR
-    if (file->encrypted) ntfs_efs_fixup_attribute(NULL, file->data);
-#endif
+    /* Keep the file open if its file handle can be cached. */
+    if (usbHsFsMountUnregisterFileHandle(fs_ctx, file, write)) ntfs_end;
 
-    /* Close file data attribute. */
-    ntfs_attr_close(file->data);
+    /* Close file. */
+    ntfsdev_release_file_state(file);
 
-    /* Close file node. */
-    ntfs_inode_close(file->ni);
-
-    /* Reset file state. */
-    memset(file, 0, sizeof(ntfs_file_state));
+    /* Flush the write cache from the LUN, if needed. */
+    if (write && !usbHsFsScsiSynchronizeLogicalUnitCache(lun_ctx)) ntfs_set_error(EIO);
 
 end:
+    /* Don't leak the compression unit cache if the drive is gone. */
+    if (file && !drive_ctx_valid) ntfsdev_free_cu_cache(file);
+
     ntfs_unlock_drive_ctx;
     ntfs_return(0);
 }
@@ -326,6 +419,9 @@ static ssize_t ntfsdev_write(struct _reent *r, void *fd, const char *ptr, size_t
     /* Check if the append flag is enabled. */
     if (file->append) file->pos = file->len;
 
+    /* Invalidate decompressed compression units cached by any file handle. */
+    file->vd->data_gen++;
+
     /* Write file data until the requested length is satified. */
     /* This is done like this because writing to compressed files may return partial write sizes instead of the full size in a single call. */
     while(len > 0)
@@ -389,7 +485,7 @@ static ssize_t ntfsdev_read(struct _reent *r, void *fd, char *ptr, size_t len)
     {
         USBHSFS_LOG_MSG("Reading 0x%lX byte(s) from file %lu at offset 0x%lX.", len, file->ni->mft_no, file->pos);
 
-        s64 read = ntfs_attr_pread(file->data, (s64)file->pos, (s64)len, ptr);
+        s64 read = ntfsdev_attr_pread(file, (s64)file->pos, (s64)len, ptr);
         if (read <= 0 || read > (s64)len) ntfs_set_error_and_exit(errno);
 
         rd_sz += read;
@@ -524,6 +620,9 @@ static int ntfsdev_unlink(struct _reent *r, const char *name)
 
     USBHSFS_LOG_MSG("Deleting \"%s\" (\"%s\").", name, __usbhsfs_dev_path_buf);
 
+    /* Release cached file handles. */
+    usbHsFsMountInvalidateCachedFileHandles(fs_ctx, __usbhsfs_dev_path_buf);
+
     /* Unlink entry. */
     if (ntfs_inode_unlink(vd, __usbhsfs_dev_path_buf)) ntfs_set_error(errno);
 
@@ -596,6 +695,10 @@ static int ntfsdev_rename(struct _reent *r, const char *oldName, const char *new
 
     USBHSFS_LOG_MSG("Renaming \"%s\" (\"%s\") to \"%s\" (\"%s\").", oldName, old_path, newName, new_path);
 
+    /* Release cached file handles. */
+    usbHsFsMountInvalidateCachedFileHandles(fs_ctx, old_path);
+    usbHsFsMountInvalidateCachedFileHandles(fs_ctx, new_path);
+
     /* Link the old entry with the new one. */
     if (ntfs_inode_link(vd, old_path, new_path)) ntfs_set_error_and_exit(errno);
 
@@ -662,8 +765,8 @@ static DIR_ITER *ntfsdev_diropen(struct _reent *r, DIR_ITER *dirState, const cha
     /* Make sure this is indeed a directory. */
     if (!(dir->ni->mrec->flags & MFT_RECORD_IS_DIRECTORY)) ntfs_set_error_and_exit(ENOTDIR);
 
-    /* Update directory last access time. */
-    ntfs_inode_update_times_filtered(dir->vd, dir->ni, NTFS_UPDATE_ATIME);
+    /* Defer directory last access time update until the directory is closed. */
+    dir->atime_pending = true;
 
     /* Update return value. */
     ret = dirState;
@@ -700,15 +803,8 @@ static int ntfsdev_dirreset(struct _reent *r, DIR_ITER *dirState)
     dir->pos = 0;
 
     /* Free directory entries. */
-    while(dir->first)
-    {
-        ntfs_dir_entry *next = dir->first->next;
-        if (dir->first->name) free(dir->first->name);
-        free(dir->first);
-        dir->first = next;
-    }
-
-    dir->first = dir->current = NULL;
+    usbHsFsPoolArenaReset(&(dir->arena));
+    dir->first = dir->current = dir->last = NULL;
 
 end:
     ntfs_unlock_drive_ctx;
@@ -740,8 +836,8 @@ static int ntfsdev_dirnext(struct _reent *r, DIR_ITER *dirState, char *filename,
         /* Move to the first entry in the directory. */
         dir->current = dir->first;
 
-        /* Update directory last access time. */
-        ntfs_inode_update_times_filtered(dir->vd, dir->ni, NTFS_UPDATE_ATIME);
+        /* Defer directory last access time update until the directory is closed. */
+        dir->atime_pending = true;
     }
 
     /* Check if there's an entry waiting to be fetched (end of directory). */
@@ -786,16 +882,17 @@ static int ntfsdev_dirclose(struct _reent *r, DIR_ITER *dirState)
     USBHSFS_LOG_MSG("Closing directory %lu.", dir->ni->mft_no);
 
     /* Free directory entries. */
-    while(dir->first)
+    usbHsFsPoolArenaReset(&(dir->arena));
+    dir->first = dir->current = dir->last = NULL;
+
+    if (dir->ni)
     {
-        ntfs_dir_entry *next = dir->first->next;
-        if (dir->first->name) free(dir->first->name);
-        free(dir->first);
-        dir->first = next;
-    }
+        /* Apply the deferred last access time update, if needed. */
+        if (dir->atime_pending) ntfs_inode_update_times_filtered(dir->vd, dir->ni, NTFS_UPDATE_ATIME);
 
-    /* Close directory node. */
-    if (dir->ni) ntfs_inode_close(dir->ni);
+        /* Close directory node. */
+        ntfs_inode_close(dir->ni);
+    }
 
     /* Reset directory state. */
     memset(dir, 0, sizeof(ntfs_dir_state));
@@ -869,6 +966,8 @@ static int ntfsdev_ftruncate(struct _reent *r, void *fd, off_t len)
 
     USBHSFS_LOG_MSG("Truncating file in %lu to 0x%lX bytes.", file->ni->mft_no, len);
 
+    file->vd->data_gen++;
+
     if (len > file->data->initialized_size)
     {
         /* Expand file data attribute. */
@@ -916,6 +1015,9 @@ static int ntfsdev_fsync(struct _reent *r, void *fd)
     /* Clear dirty status from file. */
     NInoClearDirty(file->ni);
 
+    /* Flush the write cache from the LUN, if needed. */
+    if (!usbHsFsScsiSynchronizeLogicalUnitCache(lun_ctx)) ntfs_set_error_and_exit(EIO);
+
 end:
     ntfs_unlock_drive_ctx;
     ntfs_return(0);
@@ -960,6 +1062,9 @@ static int ntfsdev_utimes(struct _reent *r, const char *filename, const struct t
     /* Fix input path. */
     if (!ntfsdev_fixpath(r, filename, &fs_ctx, NULL)) ntfs_end;
 
+    /* Release cached file handles. */
+    usbHsFsMountInvalidateCachedFileHandles(fs_ctx, __usbhsfs_dev_path_buf);
+
     /* Get entry. */
     ni = ntfs_inode_open_from_path(vd, __usbhsfs_dev_path_buf);
     if (!ni) ntfs_set_error_and_exit(errno);
@@ -998,133 +1103,187 @@ end:
 
 static bool ntfsdev_fixpath(struct _reent *r, const char *path, UsbHsFsDriveLogicalUnitFileSystemContext **fs_ctx, char *outpath)
 {
-    const u8 *p = (const u8*)path;
-    ssize_t units = 0;
-    u32 code = 0;
-    size_t cwd_len = 0, full_len = 0, i = 0;
-    char *outptr = (outpath ? outpath : __usbhsfs_dev_path_buf), *cwd = NULL, *segment = NULL, *path_sep = NULL;
-    int depth = 0;
-    bool finished = false;
+    char *outptr = (outpath ? outpath : __usbhsfs_dev_path_buf);
+    int res = 0;
 
     ntfs_declare_error_state;
 
-    if (!r || !path || !*path || !fs_ctx || !*fs_ctx || !(cwd = (*fs_ctx)->cwd)) ntfs_set_error_and_exit(EINVAL);
+    if (!r || !path || !*path || !fs_ctx || !*fs_ctx || !(*fs_ctx)->ntfs) ntfs_set_error_and_exit(EINVAL);
 
     USBHSFS_LOG_MSG("Input path: \"%s\".", path);
 
-    /* Move the path pointer to the start of the actual path. */
-    do {
-        units = decode_utf8(&code, p);
-        if (units < 0) ntfs_set_error_and_exit(EILSEQ);
-        p += units;
-    } while(code >= ' ' && code != ':');
+    /* Generate fixed path. */
+    res = usbHsFsMountNormalizePath(*fs_ctx, path, outptr);
+    if (res) ntfs_set_error_and_exit(res);
 
-    /* We found a colon; p points to the actual path. */
-    if (code == ':') path = (const char*)p;
+    USBHSFS_LOG_MSG("Fixed path: \"%s\".", outptr);
 
-    /* Verify absolute path length. */
-    cwd_len = strlen(cwd);
-    full_len = strlen(path);
-    if (path[0] != '/') full_len += cwd_len;
+end:
+    ntfs_return_bool;
+}
+
+static s64 ntfsdev_attr_pread(ntfs_file_state *file, s64 offset, s64 len, void *buf)
+{
+    ntfs_attr *na = file->data;
+    u32 cu_size = na->compression_block_size;
+    s64 cu_offset = 0, cu_len = 0, cu_pos = 0;
+    ntfs_cu_cache_entry *entry = NULL, *victim = NULL;
 
-    if (full_len >= MAX_PATH_LENGTH) ntfs_set_error_and_exit(ENAMETOOLONG);
+    /* Only non-resident compressed data benefits from the compression unit cache. */
+    /* Reads spanning entire compression units are forwarded as well, since NTFS-3G decompresses each one of them exactly once. */
+    if (!file->compressed || !NAttrCompressed(na) || !NAttrNonResident(na) || !cu_size || (!(offset & (cu_size - 1)) && len >= (s64)cu_size)) return ntfs_attr_pread(na, offset, len, buf);
 
-    /* Follow path and build the fixed path. NTFS-3G doesn't seem to support dot entries in input paths. */
-    /* We'll also replace consecutive path separators with a single one, make sure there are no more colons nor NT path separators, and check if the remainder of the string is valid UTF-8. */
-    if (path[0] == '/')
+    cu_offset = (offset & ~((s64)cu_size - 1));
+
+    /* Look for the compression unit in the cache. Keep track of the least recently used entry in case we need to evict it. */
+    for(u32 i = 0; i < NTFS_CU_CACHE_ENTRIES; i++)
     {
-        sprintf(outptr, "/");
-        p = (const u8*)(path + 1);
-    } else {
-        sprintf(outptr, "%s", cwd);
-        p = (const u8*)path;
+        ntfs_cu_cache_entry *cur = &(file->cu_cache[i]);
 
-        for(i = 1; i < cwd_len; i++)
+        if (cur->size && cur->offset == cu_offset && cur->data_gen == file->vd->data_gen)
         {
-            if (cwd[i] == '/') depth++;
+            entry = cur;
+            break;
         }
-    }
 
-    i = strlen(outptr);
-    segment = (outptr + i);
+        if (!victim || cur->last_use < victim->last_use) victim = cur;
+    }
 
-    while(true)
+    if (!entry)
     {
-        do {
-            units = decode_utf8(&code, p);
+        entry = victim;
 
-            /* Don't tolerate invalid UTF-8, colons or NT path separators. */
-            if (units < 0) ntfs_set_error_and_exit(EILSEQ);
-            if (code == ':' || code == '\\') ntfs_set_error_and_exit(EINVAL);
+        /* Allocate cache buffer, if needed. Just read the data straight away if we can't. */
+        if (!entry->data)
+        {
+            if (!usbHsFsBudgetReserve(UsbHsFsMemoryCategory_VolumeCaches, cu_size)) return ntfs_attr_pread(na, offset, len, buf);
 
-            /* Copy character(s) if needed. */
-            if (code >= ' ' && code != '/')
+            entry->data = malloc(cu_size);
+            if (!entry->data)
             {
-                memcpy(outptr + i, p, units);
-                i += units;
-                p += units;
+                usbHsFsBudgetRelease(UsbHsFsMemoryCategory_VolumeCaches, cu_size);
+                return ntfs_attr_pread(na, offset, len, buf);
             }
-        } while(code >= ' ' && code != '/');
 
-        if (code < ' ')
-        {
-            /* Reached the end of the string. */
-            outptr[i] = '\0';
-            finished = true;
-        } else
-        if (code == '/')
+            file->cu_cache_size = cu_size;
+        }
+
+        /* Decompress the whole compression unit. NTFS-3G may return partial sizes here. */
+        cu_len = MIN((s64)cu_size, na->data_size - cu_offset);
+        entry->size = 0;
+
+        while(entry->size < cu_len)
         {
-            /* Found a path separator. Let's skip consecutive path separators if they exist. */
-            while(*p == '/') p++;
+            s64 read = ntfs_attr_pread(na, cu_offset + entry->size, cu_len - entry->size, entry->data + entry->size);
+            if (read <= 0 || read > (cu_len - entry->size))
+            {
+                if (read >= 0) errno = EIO;
+                entry->size = 0;
+                return -1;
+            }
+
+            entry->size += (u32)read;
         }
 
-        if (!strcmp(segment, "."))
+        entry->offset = cu_offset;
+        entry->data_gen = file->vd->data_gen;
+    }
+
+    entry->last_use = ++(file->cu_cache_tick);
+
+    /* Copy the requested data. Reads straddling a compression unit boundary are completed by the caller. */
+    cu_pos = (offset - cu_offset);
+    if (cu_pos >= entry->size) return 0;
+
+    len = MIN(len, entry->size - cu_pos);
+    memcpy(buf, entry->data + cu_pos, (size_t)len);
+
+    return len;
+}
+
+static void ntfsdev_free_cu_cache(ntfs_file_state *file)
+{
+    for(u32 i = 0; i < NTFS_CU_CACHE_ENTRIES; i++)
+    {
+        ntfs_cu_cache_entry *entry = &(file->cu_cache[i]);
+        if (!entry->data) continue;
+
+        free(entry->data);
+        usbHsFsBudgetRelease(UsbHsFsMemoryCategory_VolumeCaches, file->cu_cache_size);
+
+        memset(entry, 0, sizeof(ntfs_cu_cache_entry));
+    }
+
+    file->cu_cache_size = 0;
+}
+
+static ssize_t ntfsdev_positional_io(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset, bool write)
+{
+    size_t total = 0;
+
+    ntfs_declare_error_state;
+    ntfs_declare_file_state;
+    ntfs_lock_drive_ctx;
+
+    /* Sanity check. */
+    if (!file || !file->ni || !file->data || !iov || !iov_count || offset > (u64)INT64_MAX) ntfs_set_error_and_exit(EINVAL);
+
+    /* Check if the file was opened with the right access mode. */
+    if (!(write ? file->write : file->read)) ntfs_set_error_and_exit(EBADF);
+
+    /* Invalidate decompressed compression units cached by any file handle. */
+    if (write) file->vd->data_gen++;
+
+    /* Process I/O vector segments. NTFS-3G attribute I/O calls are already positional, so the file position is never touched. */
+    for(u32 i = 0; i < iov_count; i++)
+    {
+        u8 *ptr = (u8*)iov[i].data;
+        size_t len = iov[i].size;
+
+        if (!len) continue;
+        if (!ptr) ntfs_set_error_and_exit(EINVAL);
+
+        /* Don't read past EOF. */
+        if (!write)
         {
-            /* We're dealing with a current directory dot entry alias. */
-            /* We'll simply remove it from the fixed path. */
-            outptr[--i] = '\0';
-        } else
-        if (!strcmp(segment, ".."))
+            if (offset >= file->len) ntfs_end;
+            len = MIN(len, file->len - offset);
+        }
+
+        /* Transfer data until the requested length is satisfied. Compressed files may return partial sizes. */
+        while(len > 0)
         {
-            /* We're dealing with a parent directory dot entry alias. */
-            /* First check if we aren't currently at the root directory. */
-            if (depth <= 0) ntfs_set_error_and_exit(EINVAL);
-
-            /* Remove dot entry and path separator from the output string. */
-            outptr[i - 1] = outptr[i - 2] = outptr[i - 3] = '\0';
-            i -= 3;
-
-            /* Find previous ocurrence of a path separator in the output string. */
-            path_sep = strrchr(outptr + i, '/');
-            if (!path_sep) ntfs_set_error_and_exit(EINVAL);
-            *(++path_sep) = '\0';
-
-            /* Update current segment and directory depth. */
-            segment = path_sep;
-            depth--;
-        } else {
-            /* New entry in the directory tree. */
-            /* Check its length. */
-            if (strlen(segment) > NTFS_MAX_NAME_LEN) ntfs_set_error_and_exit(ENAMETOOLONG);
+            USBHSFS_LOG_MSG("%s 0x%lX byte(s) %s file %lu at offset 0x%lX.", write ? "Writing" : "Reading", len, write ? "to" : "from", file->ni->mft_no, offset);
 
-            /* Update output string, current segment and depth. */
-            outptr[i++] = '/';
-            outptr[i] = '\0';
+            s64 xfer = (write ? ntfs_attr_pwrite(file->data, (s64)offset, (s64)len, ptr) : ntfsdev_attr_pread(file, (s64)offset, (s64)len, ptr));
+            if (xfer <= 0 || xfer > (s64)len) ntfs_set_error_and_exit(errno);
 
-            segment = (outptr + i);
-            depth++;
+            total += xfer;
+            offset += xfer;
+            len -= xfer;
+            ptr += xfer;
         }
-
-        if (finished) break;
     }
 
-    /* Remove trailing path separator. */
-    if (i > 1 && outptr[i - 1] == '/') outptr[--i] = '\0';
+end:
+    /* Did we write anything? */
+    if (write && file && total > 0)
+    {
+        /* Mark the file as dirty. */
+        NInoSetDirty(file->ni);
 
-    USBHSFS_LOG_MSG("Fixed path: \"%s\".", outptr);
+        /* Mark the file for archiving. */
+        file->ni->flags |= FILE_ATTR_ARCHIVE;
 
-end:
-    ntfs_return_bool;
+        /* Update file last access and modify times. */
+        ntfs_inode_update_times_filtered(file->vd, file->ni, NTFS_UPDATE_AMCTIME);
+
+        /* Update the files data length. */
+        file->len = file->data->data_size;
+    }
+
+    ntfs_unlock_drive_ctx;
+    ntfs_return((ssize_t)total);
 }
 
 static void ntfsdev_fill_stat(ntfs_vd *vd, ntfs_inode *ni, struct stat *st)
@@ -1176,8 +1335,8 @@ static int ntfsdev_dirnext_filldir(void *dirent, const ntfschar *name, const int
     DIR_ITER *dirState = (DIR_ITER*)dirent;
     ntfs_inode *ni = NULL;
     ntfs_dir_entry *entry = NULL;
-    char *entry_name = NULL;
-    bool cleanup = false;
+    char entry_name_buf[MAX_PATH_LENGTH] = {0}, *entry_name = entry_name_buf;
+    int entry_name_len = 0;
 
     ntfs_declare_error_state;
     ntfs_declare_dir_state;
@@ -1185,19 +1344,16 @@ static int ntfsdev_dirnext_filldir(void *dirent, const ntfschar *name, const int
     /* Ignore DOS file names. */
     if (name_type == FILE_NAME_DOS) ntfs_end;
 
-    /* Convert the entry name from UTF-16LE into our current locale (UTF-8). */
-    if (ntfs_ucstombs(name, name_len, &entry_name, 0) <= 0)
+    /* Convert the entry name from UTF-16LE into our current locale (UTF-8). A stack buffer is used to avoid a heap allocation per entry. */
+    entry_name_len = ntfs_ucstombs(name, name_len, &entry_name, (int)sizeof(entry_name_buf));
+    if (entry_name_len <= 0)
     {
         _errno = errno;
         ntfs_end;
     }
 
     /* Skip parent and current directory entries (dot entries). */
-    if (!strcmp(entry_name, ".") || !strcmp(entry_name, ".."))
-    {
-        cleanup = true;
-        ntfs_end;
-    }
+    if (!strcmp(entry_name, ".") || !strcmp(entry_name, "..")) ntfs_end;
 
     /* Open entry. */
     ni = ntfs_pathname_to_inode(dir->vd->vol, dir->ni, entry_name);
@@ -1209,8 +1365,8 @@ static int ntfsdev_dirnext_filldir(void *dirent, const ntfschar *name, const int
 
     USBHSFS_LOG_MSG("Found entry \"%s\" with MREF %lu.", entry_name, mref);
 
-    /* Allocate a new directory entry. */
-    entry = malloc(sizeof(ntfs_dir_entry));
+    /* Allocate a new directory entry from the directory state arena, with enough room to hold the entry name. */
+    entry = usbHsFsPoolArenaAllocate(&(dir->arena), sizeof(ntfs_dir_entry) + (size_t)entry_name_len + 1);
     if (!entry)
     {
         _errno = ENOMEM;
@@ -1219,28 +1375,22 @@ static int ntfsdev_dirnext_filldir(void *dirent, const ntfschar *name, const int
 
     /* Setup the directory entry. */
     entry->mref = MREF(mref);
-    entry->name = entry_name;
+    entry->name = ((char*)entry + sizeof(ntfs_dir_entry));
     entry->next = NULL;
+    memcpy(entry->name, entry_name, (size_t)entry_name_len + 1);
 
     /* Link entry to the list of directory entries. */
     if (!dir->first)
     {
         dir->first = entry;
     } else {
-        ntfs_dir_entry *last = dir->first;
-        while(last->next) last = last->next;
-        last->next = entry;
+        dir->last->next = entry;
     }
 
+    dir->last = entry;
+
 end:
     if (ni) ntfs_inode_close(ni);
 
-    /* Cleanup if we failed to enumerate the entry or if it is meant to be skipped. */
-    if (ntfs_ended_with_error || cleanup)
-    {
-        if (entry_name) free(entry_name);
-        if (entry) free(entry);
-    }
-
     ntfs_return(0);
 }
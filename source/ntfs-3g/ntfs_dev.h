@@ -16,4 +16,11 @@
 
 const devoptab_t *ntfsdev_get_devoptab();
 
+/// Closes the provided devoptab file state without locking the drive context it belongs to. Used to release cached file handles.
+void ntfsdev_release_file_state(void *fd);
+
+/// Positional vectored I/O. The file position from the provided devoptab file state isn't modified.
+ssize_t ntfsdev_preadv(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset);
+ssize_t ntfsdev_pwritev(struct _reent *r, void *fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset);
+
 #endif  /* __NTFS_DEV_H__ */
@@ -9,12 +9,12 @@
  * Based on work from libntfs-wii (https://github.com/rhyskoedijk/libntfs-wii).
  */
 
-#include <math.h>
 #include <fcntl.h>
 
 #include "ntfs.h"
 
 #include "../usbhsfs_scsi.h"
+#include "../usbhsfs_pool.h"
 
 /* Function prototypes. */
 
@@ -33,6 +33,10 @@ static s64 ntfs_io_device_readbytes(struct ntfs_device *dev, s64 offset, s64 cou
 static s64 ntfs_io_device_writebytes(struct ntfs_device *dev, s64 offset, s64 count, const void *buf);
 static bool ntfs_io_device_readsectors(struct ntfs_device *dev, u64 start, u32 count, void *buf);
 static bool ntfs_io_device_writesectors(struct ntfs_device *dev, u64 start, u32 count, const void *buf);
+static bool ntfs_io_device_readsectorsv(struct ntfs_device *dev, UsbHsFsScsiBlockIoSegment *segments, u32 segment_count);
+static bool ntfs_io_device_writesectorsv(struct ntfs_device *dev, UsbHsFsScsiBlockIoSegment *segments, u32 segment_count);
+static u32 ntfs_io_device_build_segments(ntfs_dd *dd, u64 sec_start, u64 sec_count, u32 buffer_offset, s64 count, const void *buf, u8 *bounce, UsbHsFsScsiBlockIoSegment *segments, u32 *out_head_size, \
+                                         u32 *out_tail_size);
 
 /* Global variables. */
 
@@ -87,6 +91,7 @@ static int ntfs_io_device_open(struct ntfs_device *dev, int flags)
     /* Parse partition info from the boot sector. */
     dd->sector_offset = le32_to_cpu(dd->vbr.bpb.hidden_sectors);
     dd->sector_size = le16_to_cpu(dd->vbr.bpb.bytes_per_sector);
+    dd->sector_size_log2 = (u8)__builtin_ctz(dd->sector_size);    /* ntfs_boot_sector_is_ntfs() already made sure this is a power of two. */
     dd->sector_count = sle64_to_cpu(dd->vbr.number_of_sectors);
     dd->pos = 0;
     dd->len = ((u64)dd->sector_size * dd->sector_count);
@@ -222,15 +227,15 @@ static s64 ntfs_io_device_readbytes(struct ntfs_device *dev, s64 offset, s64 cou
 
     /* Fill values. */
     sec_start = dd->sector_start;
-    buffer_offset = (u32)(offset % dd->sector_size);
+    buffer_offset = (u32)(offset & (dd->sector_size - 1));
 
     /* Determine the range of sectors required for this read. */
-    if (offset > 0) sec_start += (u64)floor((double)offset / (double)dd->sector_size);
+    sec_start += ((u64)offset >> dd->sector_size_log2);
 
-    if ((buffer_offset + count) > dd->sector_size) sec_count = (u64)ceil((double)(buffer_offset + count) / (double)dd->sector_size);
+    if ((buffer_offset + count) > dd->sector_size) sec_count = (((u64)buffer_offset + (u64)count + dd->sector_size - 1) >> dd->sector_size_log2);
 
     /* Read data from device. */
-    if (!buffer_offset && !(count % dd->sector_size))
+    if (!buffer_offset && !(count & (dd->sector_size - 1)))
     {
         /* If this read happens to be on sector boundaries, then read straight into the destination buffer. */
         USBHSFS_LOG_MSG("Reading 0x%lX sector(s) at sector 0x%lX from device %p (direct read).", sec_count, sec_start, dev);
@@ -243,23 +248,28 @@ static s64 ntfs_io_device_readbytes(struct ntfs_device *dev, s64 offset, s64 cou
             errno = EIO;
         }
     } else {
-        /* Read data into a buffer and copy over only what was requested. */
+        /* Read the edge sectors into a bounce buffer, and all whole sectors in between straight into the destination buffer. */
         /* This shouldn't normally happen as NTFS-3G aligns addresses and sizes to sectors, but it's better to be safe than sorry. */
+        UsbHsFsScsiBlockIoSegment segments[3] = {0};
+        u32 segment_count = 0, head_size = 0, tail_size = 0;
 
-        /* Allocate a buffer to hold the read data. */
-        buffer = malloc(sec_count * (u64)dd->sector_size);
+        /* Allocate a bounce buffer to hold the edge sectors. */
+        buffer = usbHsFsPoolAllocate(UsbHsFsObjectPoolType_ScratchBuffer, 2 * (u64)dd->sector_size);
         if (!buffer)
         {
             errno = ENOMEM;
             goto end;
         }
 
-        /* Read data. */
-        USBHSFS_LOG_MSG("Reading 0x%lX sector(s) from sector 0x%lX in device %p (buffered read).", sec_count, sec_start, dev);
-        if (ntfs_io_device_readsectors(dev, sec_start, sec_count, buffer))
+        /* Read data. All segments are LBA-adjacent, so a single Read command will be issued for the whole range. */
+        segment_count = ntfs_io_device_build_segments(dd, sec_start, sec_count, buffer_offset, count, buf, buffer, segments, &head_size, &tail_size);
+
+        USBHSFS_LOG_MSG("Reading 0x%lX sector(s) from sector 0x%lX in device %p (buffered read, %u segment[s]).", sec_count, sec_start, dev, segment_count);
+        if (ntfs_io_device_readsectorsv(dev, segments, segment_count))
         {
-            /* Copy what was requested to the destination buffer. */
-            memcpy(buf, buffer + buffer_offset, count);
+            /* Copy what was requested from the edge sectors to the destination buffer. */
+            if (head_size) memcpy(buf, buffer + buffer_offset, head_size);
+            if (tail_size) memcpy((u8*)buf + count - tail_size, buffer + dd->sector_size, tail_size);
 
             /* Update return value. */
             ret = count;
@@ -270,7 +280,7 @@ static s64 ntfs_io_device_readbytes(struct ntfs_device *dev, s64 offset, s64 cou
     }
 
 end:
-    if (buffer) free(buffer);
+    if (buffer) usbHsFsPoolFree(UsbHsFsObjectPoolType_ScratchBuffer, buffer);
 
     return ret;
 }
@@ -308,15 +318,15 @@ static s64 ntfs_io_device_writebytes(struct ntfs_device *dev, s64 offset, s64 co
 
     /* Fill values. */
     sec_start = dd->sector_start;
-    buffer_offset = (u32)(offset % dd->sector_size);
+    buffer_offset = (u32)(offset & (dd->sector_size - 1));
 
     /* Determine the range of sectors required for this read. */
-    if (offset > 0) sec_start += (u64)floor((double)offset / (double)dd->sector_size);
+    sec_start += ((u64)offset >> dd->sector_size_log2);
 
-    if ((buffer_offset + count) > dd->sector_size) sec_count = (u64)ceil((double)(buffer_offset + count) / (double)dd->sector_size);
+    if ((buffer_offset + count) > dd->sector_size) sec_count = (((u64)buffer_offset + (u64)count + dd->sector_size - 1) >> dd->sector_size_log2);
 
     /* Write data to device. */
-    if (!buffer_offset && !(count % dd->sector_size))
+    if (!buffer_offset && !(count & (dd->sector_size - 1)))
     {
         /* If this write happens to be on sector boundaries, then write straight to the device. */
         USBHSFS_LOG_MSG("Writing 0x%lX sector(s) at sector 0x%lX from device %p (direct write).", sec_count, sec_start, dev);
@@ -329,39 +339,41 @@ static s64 ntfs_io_device_writebytes(struct ntfs_device *dev, s64 offset, s64 co
             errno = EIO;
         }
     } else {
-        /* Write data from a buffer aligned to the sector boundaries. */
+        /* Only the edge sectors need to be read and patched through a bounce buffer. All whole sectors in between are written straight from the source buffer. */
         /* This shouldn't normally happen as NTFS-3G aligns addresses and sizes to sectors, but it's better to be safe than sorry. */
+        UsbHsFsScsiBlockIoSegment segments[3] = {0}, edge_segments[2] = {0};
+        u32 segment_count = 0, edge_segment_count = 0, head_size = 0, tail_size = 0;
 
-        /* Allocate a buffer to hold the read data. */
-        buffer = malloc(sec_count * (u64)dd->sector_size);
+        /* Allocate a bounce buffer to hold the edge sectors. */
+        buffer = usbHsFsPoolAllocate(UsbHsFsObjectPoolType_ScratchBuffer, 2 * (u64)dd->sector_size);
         if (!buffer)
         {
             errno = ENOMEM;
             goto end;
         }
 
-        /* Read the first and last sectors of the buffer from the device (if required). */
-        /* This is done thwn the data doesn't line up with sector boundaries, so we just in the buffer edges where the data overlaps. */
-        if (buffer_offset != 0 && !ntfs_io_device_readsectors(dev, sec_start, 1, buffer))
+        segment_count = ntfs_io_device_build_segments(dd, sec_start, sec_count, buffer_offset, count, buf, buffer, segments, &head_size, &tail_size);
+
+        /* Read the edge sectors from the device. */
+        for(u32 i = 0; i < segment_count; i++)
         {
-            USBHSFS_LOG_MSG("Failed to read sector 0x%lX from device %p (first).", sec_start, dev);
-            errno = EIO;
-            goto end;
+            if (segments[i].buf == buffer || segments[i].buf == (buffer + dd->sector_size)) edge_segments[edge_segment_count++] = segments[i];
         }
 
-        if (((buffer_offset + count) % dd->sector_size) != 0 && !ntfs_io_device_readsectors(dev, sec_start + sec_count - 1, 1, buffer + ((sec_count - 1) * dd->sector_size)))
+        if (!ntfs_io_device_readsectorsv(dev, edge_segments, edge_segment_count))
         {
-            USBHSFS_LOG_MSG("Failed to read sector 0x%lX from device %p (last).", sec_start, dev);
+            USBHSFS_LOG_MSG("Failed to read edge sector(s) from device %p.", dev);
             errno = EIO;
             goto end;
         }
 
-        /* Copy data into the write buffer. */
-        memcpy(buffer + buffer_offset, buf, count);
+        /* Copy data into the edge sectors. */
+        if (head_size) memcpy(buffer + buffer_offset, buf, head_size);
+        if (tail_size) memcpy(buffer + dd->sector_size, (const u8*)buf + count - tail_size, tail_size);
 
-        /* Write data. */
-        USBHSFS_LOG_MSG("Writing 0x%lX sector(s) at sector 0x%lX from device %p (buffered write).", sec_count, sec_start, dev);
-        if (ntfs_io_device_writesectors(dev, sec_start, sec_count, buffer))
+        /* Write data. All segments are LBA-adjacent, so a single Write command will be issued for the whole range. */
+        USBHSFS_LOG_MSG("Writing 0x%lX sector(s) at sector 0x%lX from device %p (buffered write, %u segment[s]).", sec_count, sec_start, dev, segment_count);
+        if (ntfs_io_device_writesectorsv(dev, segments, segment_count))
         {
             /* Write successful. Mark the device as dirty. */
             NDevSetDirty(dev);
@@ -375,7 +387,7 @@ static s64 ntfs_io_device_writebytes(struct ntfs_device *dev, s64 offset, s64 co
     }
 
 end:
-    if (buffer) free(buffer);
+    if (buffer) usbHsFsPoolFree(UsbHsFsObjectPoolType_ScratchBuffer, buffer);
 
     return ret;
 }
@@ -402,6 +414,65 @@ static bool ntfs_io_device_writesectors(struct ntfs_device *dev, u64 start, u32
     return usbHsFsScsiWriteLogicalUnitBlocks(lun_ctx, buf, start, count);
 }
 
+static bool ntfs_io_device_readsectorsv(struct ntfs_device *dev, UsbHsFsScsiBlockIoSegment *segments, u32 segment_count)
+{
+    /* Get device descriptor. */
+    ntfs_dd *dd = (ntfs_dd*)dev->d_private;
+    if (!dd) return false;
+
+    /* Get LUN context and read sectors. */
+    UsbHsFsDriveLogicalUnitContext *lun_ctx = (UsbHsFsDriveLogicalUnitContext*)dd->lun_ctx;
+    return usbHsFsScsiReadLogicalUnitBlocksV(lun_ctx, segments, segment_count);
+}
+
+static bool ntfs_io_device_writesectorsv(struct ntfs_device *dev, UsbHsFsScsiBlockIoSegment *segments, u32 segment_count)
+{
+    /* Get device descriptor. */
+    ntfs_dd *dd = (ntfs_dd*)dev->d_private;
+    if (!dd) return false;
+
+    /* Get LUN context and write sectors. */
+    UsbHsFsDriveLogicalUnitContext *lun_ctx = (UsbHsFsDriveLogicalUnitContext*)dd->lun_ctx;
+    return usbHsFsScsiWriteLogicalUnitBlocksV(lun_ctx, segments, segment_count);
+}
+
+static u32 ntfs_io_device_build_segments(ntfs_dd *dd, u64 sec_start, u64 sec_count, u32 buffer_offset, s64 count, const void *buf, u8 *bounce, UsbHsFsScsiBlockIoSegment *segments, u32 *out_head_size, \
+                                         u32 *out_tail_size)
+{
+    u32 segment_count = 0, head_size = 0, tail_size = (u32)((buffer_offset + count) & (dd->sector_size - 1));
+    u64 mid_start = sec_start, mid_count = sec_count;
+
+    /* Handle ranges that fit within a single sector. */
+    if (sec_count == 1)
+    {
+        segments[segment_count++] = (UsbHsFsScsiBlockIoSegment){ .block_addr = sec_start, .block_count = 1, .buf = bounce };
+        *out_head_size = (u32)count;
+        *out_tail_size = 0;
+        return segment_count;
+    }
+
+    /* Redirect the first sector to the bounce buffer if the range doesn't start on a sector boundary. */
+    if (buffer_offset)
+    {
+        head_size = (dd->sector_size - buffer_offset);
+        segments[segment_count++] = (UsbHsFsScsiBlockIoSegment){ .block_addr = sec_start, .block_count = 1, .buf = bounce };
+        mid_start++;
+        mid_count--;
+    }
+
+    /* Whole sectors are transferred straight from/to the provided buffer. */
+    if (tail_size) mid_count--;
+    if (mid_count) segments[segment_count++] = (UsbHsFsScsiBlockIoSegment){ .block_addr = mid_start, .block_count = (u32)mid_count, .buf = ((u8*)buf + head_size) };
+
+    /* Redirect the last sector to the second half of the bounce buffer if the range doesn't end on a sector boundary. */
+    if (tail_size) segments[segment_count++] = (UsbHsFsScsiBlockIoSegment){ .block_addr = (sec_start + sec_count - 1), .block_count = 1, .buf = (bounce + dd->sector_size) };
+
+    *out_head_size = head_size;
+    *out_tail_size = tail_size;
+
+    return segment_count;
+}
+
 static int ntfs_io_device_sync(struct ntfs_device *dev)
 {
     int ret = -1;
@@ -415,7 +486,20 @@ static int ntfs_io_device_sync(struct ntfs_device *dev)
         goto end;
     }
 
-    /* TODO: implement write cache? */
+    /* Get device descriptor. */
+    ntfs_dd *dd = (ntfs_dd*)dev->d_private;
+    if (!dd)
+    {
+        errno = EBADF;
+        goto end;
+    }
+
+    /* Flush the write cache from the LUN, if needed. */
+    if (!usbHsFsScsiSynchronizeLogicalUnitCache((UsbHsFsDriveLogicalUnitContext*)dd->lun_ctx))
+    {
+        errno = EIO;
+        goto end;
+    }
 
     /* Mark the device as clean. */
     NDevClearDirty(dev);
@@ -533,6 +617,7 @@ static int ntfs_io_device_ioctl(struct ntfs_device *dev, unsigned long request,
 #ifdef BLKBSZSET
         case BLKBSZSET:     /* Set block device sector size. */
             dd->sector_size = *(int*)argp;
+            dd->sector_size_log2 = (u8)__builtin_ctz(dd->sector_size);
             ret = 0;
             break;
 #endif
@@ -21,6 +21,7 @@ typedef struct _ntfs_dd {
     u64 sector_start;       ///< LBA of partition start.
     u64 sector_offset;      ///< LBA offset to true partition start (as described by boot sector).
     u16 sector_size;        ///< Device sector size (in bytes).
+    u8 sector_size_log2;    ///< Device sector size shift. Used to convert between bytes and sectors.
     u64 sector_count;       ///< Total number of sectors in partition.
     u64 pos;                ///< Current position within the partition (in bytes).
     u64 len;                ///< Total length of partition (in bytes).
@@ -17,7 +17,8 @@
 #define USB_PROTOCOL_USB_ATTACHED_SCSI          0x62
 
 #define USB_XFER_BUF_ALIGNMENT                  0x1000              /* 4 KiB. */
-#define USB_XFER_BUF_SIZE                       0x800000            /* 8 MiB. */
+#define USB_XFER_BUF_SIZE                       0x800000            /* 8 MiB. Default size, used unless a memory budget has been set. */
+#define USB_XFER_BUF_MIN_SIZE                   0x40000             /* 256 KiB. Smallest size used under a tight memory budget. */
 
 #define USB_FEATURE_ENDPOINT_HALT               0x00
 
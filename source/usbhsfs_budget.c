@@ -0,0 +1,102 @@
+/*
+ * usbhsfs_budget.c
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#include "usbhsfs_utils.h"
+#include "usbhsfs_budget.h"
+
+#define BUDGET_DRIVE_VOLUME_RESERVE 0x100000    /* 1 MiB. Room left for the volumes and caches from each drive when sizing transfer buffers. */
+
+/* Global variables. */
+
+static Mutex g_budgetMutex = 0;
+
+static u64 g_budgetLimit = 0;
+static UsbHsFsMemoryUsage g_budgetUsage = { .xfer_buf_size = USB_XFER_BUF_SIZE };
+
+void usbHsFsBudgetSetLimit(u64 limit)
+{
+    SCOPED_LOCK(&g_budgetMutex) g_budgetLimit = limit;
+}
+
+bool usbHsFsBudgetGetUsage(UsbHsFsMemoryUsage *out_usage)
+{
+    if (!out_usage) return false;
+
+    SCOPED_LOCK(&g_budgetMutex)
+    {
+        memcpy(out_usage, &g_budgetUsage, sizeof(UsbHsFsMemoryUsage));
+        out_usage->budget = g_budgetLimit;
+    }
+
+    return true;
+}
+
+bool usbHsFsBudgetReserve(u8 category, u64 size)
+{
+    if (category >= UsbHsFsMemoryCategory_Count) return false;
+
+    bool ret = false;
+
+    SCOPED_LOCK(&g_budgetMutex)
+    {
+        if (g_budgetLimit && (g_budgetUsage.in_use + size) > g_budgetLimit)
+        {
+            USBHSFS_LOG_MSG("Reservation of 0x%lX byte(s) for category %u exceeds the memory budget! (0x%lX / 0x%lX).", size, category, g_budgetUsage.in_use, g_budgetLimit);
+            g_budgetUsage.refused_count++;
+            break;
+        }
+
+        g_budgetUsage.in_use += size;
+        g_budgetUsage.category_in_use[category] += size;
+        if (g_budgetUsage.in_use > g_budgetUsage.peak_in_use) g_budgetUsage.peak_in_use = g_budgetUsage.in_use;
+
+        ret = true;
+    }
+
+    return ret;
+}
+
+void usbHsFsBudgetRelease(u8 category, u64 size)
+{
+    if (category >= UsbHsFsMemoryCategory_Count) return;
+
+    SCOPED_LOCK(&g_budgetMutex)
+    {
+        /* Don't let mismatched releases wrap our counters around. */
+        if (size > g_budgetUsage.category_in_use[category]) size = g_budgetUsage.category_in_use[category];
+
+        g_budgetUsage.category_in_use[category] -= size;
+        g_budgetUsage.in_use -= size;
+    }
+}
+
+u32 usbHsFsBudgetGetXferBufferSize(u32 drive_count)
+{
+    u32 size = USB_XFER_BUF_SIZE;
+
+    if (!drive_count) drive_count = 1;
+
+    SCOPED_LOCK(&g_budgetMutex)
+    {
+        if (g_budgetLimit)
+        {
+            /* Leave room for the volumes from each drive, or for the ones already mounted, whichever is larger. */
+            u64 volume_usage = (g_budgetUsage.category_in_use[UsbHsFsMemoryCategory_VolumeContexts] + g_budgetUsage.category_in_use[UsbHsFsMemoryCategory_VolumeCaches]);
+            u64 volume_room = ((u64)drive_count * BUDGET_DRIVE_VOLUME_RESERVE);
+            u64 reserved = (g_budgetUsage.category_in_use[UsbHsFsMemoryCategory_ObjectPools] + (volume_usage > volume_room ? volume_usage : volume_room));
+
+            /* Split whatever is left evenly between all drives. */
+            u64 share = (g_budgetLimit > reserved ? ((g_budgetLimit - reserved) / drive_count) : 0);
+            while(size > USB_XFER_BUF_MIN_SIZE && size > share) size >>= 1;
+        }
+
+        g_budgetUsage.xfer_buf_size = size;
+    }
+
+    return size;
+}
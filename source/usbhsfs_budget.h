@@ -0,0 +1,33 @@
+/*
+ * usbhsfs_budget.h
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#pragma once
+
+#ifndef __USBHSFS_BUDGET_H__
+#define __USBHSFS_BUDGET_H__
+
+/// Unlike most other internal modules, all of these functions are thread safe.
+
+/// Sets the library-wide memory budget, in bytes. Zero means unlimited.
+void usbHsFsBudgetSetLimit(u64 limit);
+
+/// Fills the provided UsbHsFsMemoryUsage element.
+bool usbHsFsBudgetGetUsage(UsbHsFsMemoryUsage *out_usage);
+
+/// Charges `size` bytes against the memory budget using the provided UsbHsFsMemoryCategory.
+/// Returns false if the reservation would exceed the memory budget, in which case nothing is charged.
+bool usbHsFsBudgetReserve(u8 category, u64 size);
+
+/// Releases `size` bytes previously charged against the memory budget using the provided UsbHsFsMemoryCategory.
+void usbHsFsBudgetRelease(u8 category, u64 size);
+
+/// Returns the USB transfer buffer size that should be assigned to each drive if `drive_count` drives are connected.
+/// Always a power of two within the [USB_XFER_BUF_MIN_SIZE, USB_XFER_BUF_SIZE] range.
+u32 usbHsFsBudgetGetXferBufferSize(u32 drive_count);
+
+#endif  /* __USBHSFS_BUDGET_H__ */
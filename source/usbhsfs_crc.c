@@ -0,0 +1,124 @@
+/*
+ * usbhsfs_crc.c
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#include "usbhsfs_utils.h"
+#include "usbhsfs_crc.h"
+
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#define CRC32_POLYNOMIAL    0xEDB88320  /* Reflected 0x04C11DB7. */
+
+#if defined(__ARM_FEATURE_CRC32)
+
+u32 usbHsFsCrcUpdateCrc32(u32 crc, const void *data, size_t size)
+{
+    if (!data || !size) return crc;
+
+    const u8 *ptr = (const u8*)data;
+    u64 val = 0;
+
+    /* Process single bytes until we reach an 8-byte boundary. */
+    while(size && ((uintptr_t)ptr & 7))
+    {
+        crc = __crc32b(crc, *ptr++);
+        size--;
+    }
+
+    /* Process the bulk of the data using 64-bit loads. */
+    while(size >= 8)
+    {
+        memcpy(&val, ptr, sizeof(u64));
+        crc = __crc32d(crc, val);
+        ptr += 8;
+        size -= 8;
+    }
+
+    /* Process remaining bytes. */
+    while(size--) crc = __crc32b(crc, *ptr++);
+
+    return crc;
+}
+
+#else   /* __ARM_FEATURE_CRC32 */
+
+/* Global variables. */
+
+static u32 g_crc32Table[8][256] = {0};
+static bool g_crc32TableGenerated = false;
+static Mutex g_crc32TableMutex = 0;
+
+/* Function prototypes. */
+
+static void usbHsFsCrcGenerateTable(void);
+static u32 usbHsFsCrcUpdateSliceBy8(const u32 table[8][256], u32 crc, const u8 *data, size_t size);
+
+u32 usbHsFsCrcUpdateCrc32(u32 crc, const void *data, size_t size)
+{
+    if (!data || !size) return crc;
+    usbHsFsCrcGenerateTable();
+    return usbHsFsCrcUpdateSliceBy8(g_crc32Table, crc, (const u8*)data, size);
+}
+
+static void usbHsFsCrcGenerateTable(void)
+{
+    SCOPED_LOCK(&g_crc32TableMutex)
+    {
+        if (g_crc32TableGenerated) break;
+
+        /* Generate base table. */
+        for(u32 i = 0; i < 256; i++)
+        {
+            u32 crc = i;
+            for(u32 j = 0; j < 8; j++) crc = ((crc >> 1) ^ ((crc & 1) ? CRC32_POLYNOMIAL : 0));
+            g_crc32Table[0][i] = crc;
+        }
+
+        /* Generate slice tables. Each one of them advances the checksum by an additional byte. */
+        for(u32 i = 0; i < 256; i++)
+        {
+            for(u32 j = 1; j < 8; j++) g_crc32Table[j][i] = ((g_crc32Table[j - 1][i] >> 8) ^ g_crc32Table[0][g_crc32Table[j - 1][i] & 0xFF]);
+        }
+
+        g_crc32TableGenerated = true;
+    }
+}
+
+static u32 usbHsFsCrcUpdateSliceBy8(const u32 table[8][256], u32 crc, const u8 *data, size_t size)
+{
+    u32 lo = 0, hi = 0;
+
+    /* Process single bytes until we reach a 4-byte boundary. */
+    while(size && ((uintptr_t)data & 3))
+    {
+        crc = ((crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF]);
+        size--;
+    }
+
+    /* Process 8 bytes at a time. */
+    while(size >= 8)
+    {
+        memcpy(&lo, data, sizeof(u32));
+        memcpy(&hi, data + 4, sizeof(u32));
+        lo ^= crc;
+
+        crc = (table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^ \
+               table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24]);
+
+        data += 8;
+        size -= 8;
+    }
+
+    /* Process remaining bytes. */
+    while(size--) crc = ((crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF]);
+
+    return crc;
+}
+
+#endif  /* __ARM_FEATURE_CRC32 */
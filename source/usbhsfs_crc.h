@@ -0,0 +1,27 @@
+/*
+ * usbhsfs_crc.h
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#pragma once
+
+#ifndef __USBHSFS_CRC_H__
+#define __USBHSFS_CRC_H__
+
+#define CRC32_INIT_VALUE    0xFFFFFFFF
+
+/// Updates a raw CRC32 (reflected, polynomial 0x04C11DB7) checksum with the provided data.
+/// No pre- or post-conditioning is applied to the provided checksum value, which makes it possible to chain multiple calls together.
+/// Uses ARMv8 CRC32 instructions if they're available. Otherwise, a slice-by-8 software implementation is used.
+u32 usbHsFsCrcUpdateCrc32(u32 crc, const void *data, size_t size);
+
+/// Calculates a standard CRC32 checksum over the provided data (e.g. GPT headers and partition arrays).
+NX_INLINE u32 usbHsFsCrcCalculateCrc32(const void *data, size_t size)
+{
+    return ~usbHsFsCrcUpdateCrc32(CRC32_INIT_VALUE, data, size);
+}
+
+#endif  /* __USBHSFS_CRC_H__ */
@@ -11,6 +11,9 @@
 #include "usbhsfs_request.h"
 #include "usbhsfs_scsi.h"
 #include "usbhsfs_mount.h"
+#include "usbhsfs_drive_cache.h"
+#include "usbhsfs_quirks.h"
+#include "usbhsfs_budget.h"
 
 /* Function prototypes. */
 
@@ -24,6 +27,8 @@ static void usbHsFsDriveGetUtf8StringFromStringDescriptor(UsbHsClientIfSession *
 
 static void usbHsFsDriveDestroyLogicalUnitContext(UsbHsFsDriveLogicalUnitContext *lun_ctx, bool stop_lun);
 
+static void usbHsFsDriveFreeXferBuffer(UsbHsFsDriveContext *drive_ctx);
+
 bool usbHsFsDriveInitializeContext(UsbHsFsDriveContext *drive_ctx, UsbHsInterface *usb_if)
 {
     if (!drive_ctx || !usb_if)
@@ -37,9 +42,8 @@ bool usbHsFsDriveInitializeContext(UsbHsFsDriveContext *drive_ctx, UsbHsInterfac
     UsbHsFsDriveLogicalUnitContext **tmp_lun_ctx = NULL;
     bool ret = false;
 
-    /* Allocate memory for the USB transfer buffer. */
-    drive_ctx->xfer_buf = usbHsFsRequestAllocateXferBuffer();
-    if (!drive_ctx->xfer_buf)
+    /* Allocate memory for the USB transfer buffer. Its size is picked by the drive manager. */
+    if (!usbHsFsDriveResizeXferBuffer(drive_ctx, drive_ctx->xfer_buf_size))
     {
         USBHSFS_LOG_MSG("Failed to allocate USB transfer buffer! (interface %d).", usb_if->inf.ID);
         goto end;
@@ -67,8 +71,21 @@ bool usbHsFsDriveInitializeContext(UsbHsFsDriveContext *drive_ctx, UsbHsInterfac
     drive_ctx->pid = usb_if_session->inf.device_desc.idProduct;
     usbHsFsDriveGetDeviceStrings(drive_ctx);
 
+    /* Retrieve device quirks. */
+    UsbHsFsQuirksEntry quirks_entry = {0};
+    usbHsFsQuirksGetEntry(drive_ctx->vid, drive_ctx->pid, &quirks_entry);
+    drive_ctx->quirks = quirks_entry.quirks;
+    drive_ctx->max_block_count = quirks_entry.max_block_count;
+
     /* Retrieve max supported logical units from this storage device. */
-    rc = usbHsFsRequestGetMaxLogicalUnits(usb_if_session, &(drive_ctx->max_lun));
+    /* Some devices are known to lock up if they receive a Get Max LUN request, so we'll skip it altogether for them. */
+    if (drive_ctx->quirks & UsbHsFsDeviceQuirks_NoGetMaxLun)
+    {
+        drive_ctx->max_lun = 1;
+    } else {
+        rc = usbHsFsRequestGetMaxLogicalUnits(usb_if_session, &(drive_ctx->max_lun));
+    }
+
     if (R_FAILED(rc))
     {
         /* Fallback to a single logical unit. */
@@ -133,7 +150,11 @@ bool usbHsFsDriveInitializeContext(UsbHsFsDriveContext *drive_ctx, UsbHsInterfac
             USBHSFS_LOG_MSG("Failed to initialize filesystem contexts for LUN #%u! (interface %d).", i, drive_ctx->usb_if_id);
             usbHsFsDriveDestroyLogicalUnitContext(lun_ctx, true);
             (drive_ctx->lun_count)--;   /* Decrease LUN context count. */
+            continue;
         }
+
+        /* Update drive cache. */
+        usbHsFsDriveCacheUpdateLogicalUnit(lun_ctx);
     }
 
     if (!drive_ctx->lun_count)
@@ -222,11 +243,149 @@ void usbHsFsDriveDestroyContext(UsbHsFsDriveContext *drive_ctx, bool stop_lun)
     if (usbHsIfIsActive(usb_if_session)) usbHsIfClose(usb_if_session);
 
     /* Free dedicated USB transfer buffer. */
-    if (drive_ctx->xfer_buf)
+    usbHsFsDriveFreeXferBuffer(drive_ctx);
+}
+
+bool usbHsFsDriveResizeXferBuffer(UsbHsFsDriveContext *drive_ctx, u32 size)
+{
+    if (!drive_ctx || size < USB_XFER_BUF_MIN_SIZE || size > USB_XFER_BUF_SIZE)
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return false;
+    }
+
+    if (drive_ctx->xfer_buf && drive_ctx->xfer_buf_size == size) return true;
+
+    u8 *old_buf = drive_ctx->xfer_buf, *new_buf = NULL;
+    u32 old_size = (old_buf ? drive_ctx->xfer_buf_size : 0);
+
+    /* The current buffer is only replaced once the new one has been allocated. A live drive must never be left without a transfer buffer. */
+    while(true)
+    {
+        /* Only the size difference needs to be charged against the memory budget. */
+        u32 extra = (size > old_size ? (size - old_size) : 0);
+
+        if (!extra || usbHsFsBudgetReserve(UsbHsFsMemoryCategory_TransferBuffers, extra))
+        {
+            new_buf = usbHsFsRequestAllocateXferBuffer(size);
+            if (new_buf) break;
+
+            if (extra) usbHsFsBudgetRelease(UsbHsFsMemoryCategory_TransferBuffers, extra);
+        }
+
+        /* Try again with a smaller buffer, if possible. Don't bother growing the current buffer by less than we asked for if it's not possible. */
+        if (size <= USB_XFER_BUF_MIN_SIZE || (old_buf && size > old_size && (size >> 1) <= old_size)) break;
+        size >>= 1;
+    }
+
+    if (!new_buf)
+    {
+        USBHSFS_LOG_MSG("Unable to allocate a USB transfer buffer within the memory budget!");
+        return false;
+    }
+
+    /* Free the current buffer. */
+    if (old_buf)
+    {
+        free(old_buf);
+        if (old_size > size) usbHsFsBudgetRelease(UsbHsFsMemoryCategory_TransferBuffers, old_size - size);
+    }
+
+    drive_ctx->xfer_buf = new_buf;
+    drive_ctx->xfer_buf_size = size;
+    USBHSFS_LOG_MSG("USB transfer buffer size: 0x%X.", size);
+
+    return true;
+}
+
+bool usbHsFsDriveWarmStart(UsbHsInterface *usb_if)
+{
+    if (!usb_if)
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return false;
+    }
+
+    Result rc = 0;
+    UsbHsFsDriveContext drive_ctx = {0};
+    UsbHsClientIfSession *usb_if_session = &(drive_ctx.usb_if_session);
+    bool ret = false;
+
+    /* Allocate memory for the USB transfer buffer. We only need it to send a few commands, so the smallest size is used. */
+    if (!usbHsFsDriveResizeXferBuffer(&drive_ctx, USB_XFER_BUF_MIN_SIZE))
+    {
+        USBHSFS_LOG_MSG("Failed to allocate USB transfer buffer! (interface %d).", usb_if->inf.ID);
+        goto end;
+    }
+
+    /* Open current interface. */
+    rc = usbHsAcquireUsbIf(usb_if_session, usb_if);
+    if (R_FAILED(rc))
     {
-        free(drive_ctx->xfer_buf);
-        drive_ctx->xfer_buf = NULL;
+        USBHSFS_LOG_MSG("usbHsAcquireUsbIf failed! (0x%X) (interface %d).", rc, usb_if->inf.ID);
+        goto end;
+    }
+
+    /* Setup interface and endpoint descriptors. */
+    if (!usbHsFsDriveSetupInterfaceAndEndpointDescriptors(&drive_ctx))
+    {
+        USBHSFS_LOG_MSG("Failed to setup interface and endpoint descriptors! (interface %d).", usb_if->inf.ID);
+        goto end;
     }
+
+    drive_ctx.usb_if_id = usb_if_session->ID;
+    drive_ctx.uasp = (usb_if_session->inf.inf.interface_desc.bInterfaceProtocol == USB_PROTOCOL_USB_ATTACHED_SCSI);
+    drive_ctx.vid = usb_if_session->inf.device_desc.idVendor;
+    drive_ctx.pid = usb_if_session->inf.device_desc.idProduct;
+
+    /* Retrieve device quirks. */
+    UsbHsFsQuirksEntry quirks_entry = {0};
+    usbHsFsQuirksGetEntry(drive_ctx.vid, drive_ctx.pid, &quirks_entry);
+    drive_ctx.quirks = quirks_entry.quirks;
+
+    /* We don't support UASP interfaces (for now). */
+    if (drive_ctx.uasp) goto end;
+
+    /* Perform a BOT mass storage reset. This is much cheaper than a bus reset, which forces the device to go through enumeration again. */
+    rc = usbHsFsRequestMassStorageReset(usb_if_session);
+    if (R_FAILED(rc))
+    {
+        USBHSFS_LOG_MSG("BOT mass storage reset failed! (0x%X) (interface %d).", rc, drive_ctx.usb_if_id);
+        goto end;
+    }
+
+    /* Clear a possible STALL status from both endpoints. */
+    usbHsFsDriveClearStallStatus(&drive_ctx);
+
+    /* Retrieve max supported logical units from this storage device. */
+    if (drive_ctx.quirks & UsbHsFsDeviceQuirks_NoGetMaxLun)
+    {
+        drive_ctx.max_lun = 1;
+    } else {
+        rc = usbHsFsRequestGetMaxLogicalUnits(usb_if_session, &(drive_ctx.max_lun));
+    }
+
+    if (R_FAILED(rc))
+    {
+        /* Fallback to a single logical unit. */
+        drive_ctx.max_lun = 1;
+        if (R_MODULE(rc) != Module_Libnx) usbHsFsDriveClearStallStatus(&drive_ctx);
+    }
+
+    /* Make sure all LUNs are ready. LUNs stopped by a previous process (e.g. via a Start Stop Unit command) will most likely report a Not Ready status. */
+    for(u8 i = 0; i < drive_ctx.max_lun; i++)
+    {
+        if (!usbHsFsScsiCheckDriveLogicalUnitReady(&drive_ctx, i)) goto end;
+    }
+
+    /* Update return value. */
+    ret = true;
+
+end:
+    /* Close interface and endpoint sessions and free the USB transfer buffer. */
+    usbHsFsDriveDestroyContext(&drive_ctx, false);
+
+    return ret;
 }
 
 void usbHsFsDriveClearStallStatus(UsbHsFsDriveContext *drive_ctx)
@@ -609,10 +768,13 @@ static void usbHsFsDriveGetDeviceStrings(UsbHsFsDriveContext *drive_ctx)
 
     free(lang_ids);
 
+    /* Retrieve serial number string descriptor first. It's used to look for the rest of the strings in the drive cache. */
+    usbHsFsDriveGetUtf8StringFromStringDescriptor(usb_if_session, serial_number, sel_lang_id, &(drive_ctx->serial_number));
+    if (usbHsFsDriveCacheGetDeviceStrings(drive_ctx)) return;
+
     /* Retrieve string descriptors. */
     usbHsFsDriveGetUtf8StringFromStringDescriptor(usb_if_session, manufacturer, sel_lang_id, &(drive_ctx->manufacturer));
     usbHsFsDriveGetUtf8StringFromStringDescriptor(usb_if_session, product_name, sel_lang_id, &(drive_ctx->product_name));
-    usbHsFsDriveGetUtf8StringFromStringDescriptor(usb_if_session, serial_number, sel_lang_id, &(drive_ctx->serial_number));
 }
 
 static void usbHsFsDriveGetUtf8StringFromStringDescriptor(UsbHsClientIfSession *usb_if_session, u8 idx, u16 lang_id, char **out_buf)
@@ -690,3 +852,13 @@ static void usbHsFsDriveDestroyLogicalUnitContext(UsbHsFsDriveLogicalUnitContext
     /* Stop current LUN. */
     if (stop_lun) usbHsFsScsiStopDriveLogicalUnit(lun_ctx);
 }
+
+static void usbHsFsDriveFreeXferBuffer(UsbHsFsDriveContext *drive_ctx)
+{
+    if (!drive_ctx->xfer_buf) return;
+
+    free(drive_ctx->xfer_buf);
+    drive_ctx->xfer_buf = NULL;
+
+    usbHsFsBudgetRelease(UsbHsFsMemoryCategory_TransferBuffers, drive_ctx->xfer_buf_size);
+}
@@ -21,6 +21,9 @@
 #include "lwext4/ext.h"
 #endif
 
+#define LUN_LAYOUT_MAX_TABLE_BLOCKS 8
+#define LUN_LAYOUT_MAX_VOLUMES      16
+
 /// Used by filesystem contexts to determine which FS object to use.
 typedef enum {
     UsbHsFsDriveLogicalUnitFileSystemType_Invalid     = 0,  ///< Invalid boot signature.
@@ -30,6 +33,25 @@ typedef enum {
     UsbHsFsDriveLogicalUnitFileSystemType_EXT         = 4   ///< EXT* filesystem (EXT2, EXT3, EXT4).
 } UsbHsFsDriveLogicalUnitFileSystemType;
 
+/// Used by file handle cache entries to keep track of their current status.
+typedef enum {
+    UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Free   = 0,   ///< Entry isn't being used.
+    UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_InUse  = 1,   ///< Entry is linked to a file handle that's currently open.
+    UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Cached = 2    ///< Entry holds the file state from a read-only file handle that has already been closed.
+} UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus;
+
+/// Used to cache recently closed read-only file handles. Only used if UsbHsFsMountFlags_CacheFileHandles is enabled.
+typedef struct {
+    u8 status;      ///< UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus.
+    bool write;     ///< Set to true if the linked file handle was opened with write access. These are never cached.
+    bool stale;     ///< Set to true if this entry was invalidated while still in use. Its file state won't be cached once closed.
+    u32 hash;       ///< Fixed path hash.
+    u64 last_used;  ///< Value from the file handle cache counter the last time this entry was used. Used to evict the least recently used entry.
+    void *fd;       ///< Pointer to the devoptab file state linked to this entry. Only used if status == UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_InUse.
+    char *path;     ///< Pointer to the dynamically allocated fixed path string.
+    void *state;    ///< Pointer to a dynamically allocated copy of the devoptab file state. Only valid if status == UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Cached.
+} UsbHsFsDriveLogicalUnitFileSystemFileHandle;
+
 /// Used to handle filesystems from LUNs.
 typedef struct {
     void *lun_ctx;      ///< Pointer to the LUN context this filesystem belongs to.
@@ -47,9 +69,38 @@ typedef struct {
     u32 device_id;      ///< ID used as part of the mount name.
     char *name;         ///< Pointer to the dynamically allocated mount name string, without a trailing colon (:).
     char *cwd;          ///< Pointer to the dynamically allocated current working directory string.
+    char path_prefix[MOUNT_NAME_LENGTH];    ///< Filesystem-specific prefix prepended to all normalized paths (e.g. "0:" for FatFs, "/ums0" for lwext4). Empty for NTFS.
+    u8 path_prefix_len;                     ///< Path prefix length.
     devoptab_t *device; ///< Pointer to the dynamically allocated devoptab virtual device interface. Used to provide a way to use libcstd I/O calls on the mounted filesystem.
+    UsbHsFsDriveLogicalUnitFileSystemFileHandle *fh_cache;  ///< Dynamically allocated file handle cache. NULL if UsbHsFsMountFlags_CacheFileHandles wasn't enabled at mount time.
+    u64 fh_cache_counter;                                   ///< File handle cache usage counter.
+    u32 fh_cache_writers;                                   ///< Number of file handles opened with write access that couldn't be linked to a file handle cache entry. No file handles are cached while this is non-zero.
+    u32 budget_size;                                        ///< Memory charged against the memory budget for this volume, not including the file handle cache.
 } UsbHsFsDriveLogicalUnitFileSystemContext;
 
+/// Used to keep track of the volumes registered from a LUN.
+typedef struct {
+    u64 block_addr;     ///< Volume starting LBA.
+    u64 block_count;    ///< Volume block count.
+    u8 fs_type;         ///< UsbHsFsDriveLogicalUnitFileSystemType.
+    u8 reserved[0x7];
+} UsbHsFsDriveLogicalUnitVolume;
+
+LIB_ASSERT(UsbHsFsDriveLogicalUnitVolume, 0x18);
+
+/// Partition layout from a LUN, recorded at mount time. Used by the drive cache.
+typedef struct {
+    bool complete;                                                  ///< Set to false if the partition layout couldn't be fully recorded (too many partition table blocks or volumes).
+    u8 table_block_count;                                           ///< Number of partition table blocks (MBR, EBRs, GPT header) read while parsing the partition layout.
+    u8 volume_count;                                                ///< Number of registered volumes.
+    u8 reserved;
+    u32 table_crc32;                                                ///< Raw CRC32 checksum calculated over all partition table blocks, in order.
+    u64 table_block_addr[LUN_LAYOUT_MAX_TABLE_BLOCKS];              ///< Partition table block addresses.
+    UsbHsFsDriveLogicalUnitVolume volumes[LUN_LAYOUT_MAX_VOLUMES];  ///< Registered volumes.
+} UsbHsFsDriveLogicalUnitLayout;
+
+LIB_ASSERT(UsbHsFsDriveLogicalUnitLayout, 0x1C8);
+
 /// Used to handle LUNs from drives.
 typedef struct {
     void *drive_ctx;                                    ///< Pointer to the drive context this LUN belongs to.
@@ -60,21 +111,34 @@ typedef struct {
     bool eject_supported;                               ///< Set to true if ejection via Prevent/Allow Medium Removal + Start Stop Unit is supported.
     bool write_protect;                                 ///< Set to true if the Write Protect bit is set.
     bool fua_supported;                                 ///< Set to true if the Force Unit Access feature is supported.
+    bool write_cache_enabled;                           ///< Set to true if the WCE bit is set in the Caching mode page (volatile write cache enabled).
+    bool read_cache_disabled;                           ///< Set to true if the RCD bit is set in the Caching mode page (read cache disabled).
+    bool write_back;                                    ///< Set to true if Write commands are issued without FUA and the write cache is flushed via Synchronize Cache commands.
     char vendor_id[0x9];                                ///< Vendor identification string. Retrieved via SCSI Inquiry command. May be empty.
     char product_id[0x11];                              ///< Product identification string. Retrieved via SCSI Inquiry command. May be empty.
     char serial_number[0x40];                           ///< Serial number string. Retrieved via SCSI Inquiry command. May be empty.
     bool long_lba;                                      ///< Set to true if Read Capacity (16) was used to retrieve the LUN capacity.
     u64 block_count;                                    ///< Logical block count. Retrieved via SCSI Read Capacity command. Must be non-zero.
-    u32 block_length;                                   ///< Logical block length (bytes). Retrieved via SCSI Read Capacity command. Must be non-zero.
+    u32 block_length;                                   ///< Logical block length (bytes). Retrieved via SCSI Read Capacity command. Must be a power of two within the [BLKDEV_MIN_BLOCK_SIZE, BLKDEV_MAX_BLOCK_SIZE] range.
+    u8 block_length_log2;                               ///< Logical block length shift. Used to convert between bytes and logical blocks without multiplications or divisions.
     u64 capacity;                                       ///< LUN capacity (block count times block length).
+    u32 max_block_count;                                ///< Max number of logical blocks transferred by a single Read/Write command.
+    bool write_same_probed;                             ///< Set to true once Write Same support has been probed. Only done the first time logical blocks are zeroed.
+    bool write_same_supported;                          ///< Set to true if logical blocks can be zeroed using Write Same commands. Cleared if a Write Same command fails.
+    bool write_same_unmap;                              ///< Set to true if Write Same commands are issued with the Unmap bit. Only used if unmapped blocks are reported to read back as zeros (LBPRZ).
+    u32 max_write_same_block_count;                     ///< Max number of logical blocks zeroed by a single Write Same command.
+    bool formatting;                                    ///< Set to true while this LUN is being formatted through FatFs.
+    u8 format_pdrv;                                     ///< FatFs drive number used to format this LUN. Only valid if formatting is true.
     u32 fs_count;                                       ///< Number of mounted filesystems stored in this LUN.
     UsbHsFsDriveLogicalUnitFileSystemContext **fs_ctx;  ///< Dynamically allocated pointer array of fs_count filesystem contexts.
+    UsbHsFsDriveLogicalUnitLayout layout;               ///< Partition layout recorded while initializing filesystem contexts.
 } UsbHsFsDriveLogicalUnitContext;
 
 /// Used to handle drives.
 typedef struct {
     Mutex mutex;                                ///< Drive mutex.
     u8 *xfer_buf;                               ///< Dedicated transfer buffer for this drive.
+    u32 xfer_buf_size;                          ///< Transfer buffer size. Charged against the memory budget, and adjusted by usbHsFsDriveResizeXferBuffer().
     s32 usb_if_id;                              ///< USB interface ID. Exactly the same as usb_if_session.ID / usb_if_session.inf.inf.ID. Placed here for convenience.
     bool uasp;                                  ///< Set to true if USB Attached SCSI Protocol is being used with this drive.
     UsbHsClientIfSession usb_if_session;        ///< Interface session.
@@ -82,12 +146,16 @@ typedef struct {
     UsbHsClientEpSession usb_out_ep_session[2]; ///< Output endpoint sessions (host to device). BOT: 0 = Command & Data Out, 1 = Unused. UASP: 0 = Command, 1 = Data Out.
     u16 vid;                                    ///< Vendor ID. Retrieved from the device descriptor. Placed here for convenience.
     u16 pid;                                    ///< Product ID. Retrieved from the device descriptor. Placed here for convenience.
+    u32 quirks;                                 ///< UsbHsFsDeviceQuirks bitmask. Retrieved from the device quirks table using the VID and PID.
+    u32 max_block_count;                        ///< Max number of logical blocks transferred by a single Read/Write command. Retrieved from the device quirks table. Zero if the default value should be used.
     char *manufacturer;                         ///< Dynamically allocated, UTF-8 encoded manufacturer string. May be NULL if not provided by the USB device descriptor.
     char *product_name;                         ///< Dynamically allocated, UTF-8 encoded manufacturer string. May be NULL if not provided by the USB device descriptor.
     char *serial_number;                        ///< Dynamically allocated, UTF-8 encoded manufacturer string. May be NULL if not provided by the USB device descriptor.
     u8 max_lun;                                 ///< Max LUNs supported by this drive. Must be at least 1.
     u8 lun_count;                               ///< Initialized LUN count. May differ from the max LUN count.
     UsbHsFsDriveLogicalUnitContext **lun_ctx;   ///< Dynamically allocated pointer array of lun_count LUN contexts.
+    u32 io_waiters[UsbHsFsIoPriority_Count];    ///< Number of threads waiting to lock this drive context, per I/O priority class. Protected by the drive manager mutex.
+    u32 generation;                             ///< Unique drive context generation number. Lets waiters tell this drive context apart from a destroyed one at the same address.
 } UsbHsFsDriveContext;
 
 /// None of these functions are thread safe - make sure to (un)lock mutexes elsewhere.
@@ -98,6 +166,16 @@ bool usbHsFsDriveInitializeContext(UsbHsFsDriveContext *drive_ctx, UsbHsInterfac
 /// Destroys the provided drive context.
 void usbHsFsDriveDestroyContext(UsbHsFsDriveContext *drive_ctx, bool stop_lun);
 
+/// (Re)allocates the dedicated transfer buffer for the provided drive context. The current buffer is freed beforehand, if available.
+/// If `size` doesn't fit within the memory budget, progressively smaller sizes are tried down to USB_XFER_BUF_MIN_SIZE.
+/// Returns false if no transfer buffer could be allocated at all.
+bool usbHsFsDriveResizeXferBuffer(UsbHsFsDriveContext *drive_ctx, u32 size);
+
+/// Attempts to bring a drive that may have been stopped by a previous process back into a usable state without performing a bus reset.
+/// The provided interface is acquired, a BOT mass storage reset is performed and all LUNs are probed with Test Unit Ready commands. The interface is closed afterwards.
+/// Returns false if the drive didn't respond as expected, in which case a bus reset should be performed.
+bool usbHsFsDriveWarmStart(UsbHsInterface *usb_if);
+
 /// Wrapper for usbHsFsRequestClearEndpointHaltFeature() that clears a possible STALL status from all endpoints.
 void usbHsFsDriveClearStallStatus(UsbHsFsDriveContext *drive_ctx);
 
@@ -0,0 +1,355 @@
+/*
+ * usbhsfs_drive_cache.c
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#include "usbhsfs_utils.h"
+#include "usbhsfs_drive_cache.h"
+#include "usbhsfs_crc.h"
+
+#define DRIVE_CACHE_MAGIC       0x43444855  /* "UHDC". */
+#define DRIVE_CACHE_VERSION     1
+#define DRIVE_CACHE_MAX_ENTRIES 32
+
+/* Type definitions. */
+
+/// Drive cache file header.
+typedef struct {
+    u32 magic;          ///< DRIVE_CACHE_MAGIC.
+    u32 version;        ///< DRIVE_CACHE_VERSION.
+    u32 entry_count;    ///< Number of entries stored right after this header.
+    u32 entries_crc32;  ///< CRC32 checksum calculated over all entries.
+} DriveCacheHeader;
+
+LIB_ASSERT(DriveCacheHeader, 0x10);
+
+/// Drive cache entry. Each one of them holds data from a single LUN.
+typedef struct {
+    u16 vid;                                ///< Vendor ID. Used as part of the lookup key.
+    u16 pid;                                ///< Product ID. Used as part of the lookup key.
+    u8 lun;                                 ///< LUN index. Used as part of the lookup key.
+    bool removable;                         ///< Removable flag.
+    u8 reserved_1[0x2];
+    char usb_serial_number[0x80];           ///< USB device serial number string. Used as part of the lookup key.
+    char manufacturer[0x80];                ///< USB device manufacturer string. May be empty.
+    char product_name[0x80];                ///< USB device product name string. May be empty.
+    char vendor_id[0x9];                    ///< Vendor identification string. May be empty.
+    char product_id[0x11];                  ///< Product identification string. May be empty.
+    char serial_number[0x40];               ///< LUN serial number string. May be empty.
+    u8 reserved_2[0x6];
+    u64 block_count;                        ///< Logical block count.
+    u32 block_length;                       ///< Logical block length (bytes).
+    u32 reserved_3;
+    u64 last_used;                          ///< Value from the drive cache usage counter the last time this entry was used. Used to evict the least recently used entry.
+    UsbHsFsDriveLogicalUnitLayout layout;   ///< Partition layout. Only used if it's complete and at least one volume was registered.
+} DriveCacheEntry;
+
+LIB_ASSERT(DriveCacheEntry, 0x3C8);
+
+/* Global variables. */
+
+static char *g_driveCacheFilePath = NULL;
+static DriveCacheEntry *g_driveCacheEntries = NULL;
+static u32 g_driveCacheEntryCount = 0;
+static u64 g_driveCacheCounter = 0;
+static bool g_driveCacheDirty = false;
+
+/* Function prototypes. */
+
+static void usbHsFsDriveCacheLoadFile(void);
+static void usbHsFsDriveCacheSaveFile(void);
+static void usbHsFsDriveCacheFree(void);
+
+static DriveCacheEntry *usbHsFsDriveCacheFindEntry(UsbHsFsDriveContext *drive_ctx, u8 lun, bool any_lun);
+
+bool usbHsFsDriveCacheSetFilePath(const char *path)
+{
+    /* Write pending changes to the current drive cache file, then free the drive cache. */
+    usbHsFsDriveCacheFlush();
+    usbHsFsDriveCacheFree();
+
+    /* Check if the drive cache should be disabled. */
+    if (!path || !*path) return true;
+
+    if (*path != '/' || strlen(path) >= FS_MAX_PATH)
+    {
+        USBHSFS_LOG_MSG("Invalid drive cache file path!");
+        return false;
+    }
+
+    /* Allocate memory for the drive cache. */
+    g_driveCacheFilePath = strdup(path);
+    g_driveCacheEntries = calloc(DRIVE_CACHE_MAX_ENTRIES, sizeof(DriveCacheEntry));
+    if (!g_driveCacheFilePath || !g_driveCacheEntries)
+    {
+        USBHSFS_LOG_MSG("Failed to allocate memory for the drive cache!");
+        usbHsFsDriveCacheFree();
+        return false;
+    }
+
+    /* Load drive cache file. */
+    usbHsFsDriveCacheLoadFile();
+
+    return true;
+}
+
+void usbHsFsDriveCacheFlush(void)
+{
+    if (!g_driveCacheEntries || !g_driveCacheDirty) return;
+    usbHsFsDriveCacheSaveFile();
+    g_driveCacheDirty = false;
+}
+
+bool usbHsFsDriveCacheGetDeviceStrings(UsbHsFsDriveContext *drive_ctx)
+{
+    DriveCacheEntry *entry = usbHsFsDriveCacheFindEntry(drive_ctx, 0, true);
+    if (!entry) return false;
+
+    /* Duplicate cached strings. Empty strings mean the USB device doesn't provide them. */
+    if ((*(entry->manufacturer) && !(drive_ctx->manufacturer = strdup(entry->manufacturer))) || (*(entry->product_name) && !(drive_ctx->product_name = strdup(entry->product_name))))
+    {
+        if (drive_ctx->manufacturer)
+        {
+            free(drive_ctx->manufacturer);
+            drive_ctx->manufacturer = NULL;
+        }
+
+        return false;
+    }
+
+    USBHSFS_LOG_MSG("Retrieved device strings from drive cache (interface %d).", drive_ctx->usb_if_id);
+
+    return true;
+}
+
+bool usbHsFsDriveCacheGetLogicalUnitIdentity(UsbHsFsDriveLogicalUnitContext *lun_ctx)
+{
+    DriveCacheEntry *entry = usbHsFsDriveCacheFindEntry((UsbHsFsDriveContext*)lun_ctx->drive_ctx, lun_ctx->lun, false);
+    if (!entry) return false;
+
+    /* Update LUN context. */
+    lun_ctx->removable = entry->removable;
+    memcpy(lun_ctx->vendor_id, entry->vendor_id, sizeof(entry->vendor_id));
+    memcpy(lun_ctx->product_id, entry->product_id, sizeof(entry->product_id));
+    memcpy(lun_ctx->serial_number, entry->serial_number, sizeof(entry->serial_number));
+
+    /* Update usage counter. */
+    entry->last_used = ++g_driveCacheCounter;
+    g_driveCacheDirty = true;
+
+    USBHSFS_LOG_MSG("Retrieved identity data from drive cache (interface %d, LUN %u).", lun_ctx->usb_if_id, lun_ctx->lun);
+
+    return true;
+}
+
+bool usbHsFsDriveCacheGetLogicalUnitLayout(UsbHsFsDriveLogicalUnitContext *lun_ctx, UsbHsFsDriveLogicalUnitLayout *out_layout)
+{
+    DriveCacheEntry *entry = usbHsFsDriveCacheFindEntry((UsbHsFsDriveContext*)lun_ctx->drive_ctx, lun_ctx->lun, false);
+
+    /* The medium may have been replaced (e.g. card readers), so the LUN capacity must match as well. */
+    if (!entry || entry->block_count != lun_ctx->block_count || entry->block_length != lun_ctx->block_length || !entry->layout.complete || !entry->layout.volume_count) return false;
+
+    memcpy(out_layout, &(entry->layout), sizeof(UsbHsFsDriveLogicalUnitLayout));
+
+    return true;
+}
+
+void usbHsFsDriveCacheUpdateLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx)
+{
+    UsbHsFsDriveContext *drive_ctx = (UsbHsFsDriveContext*)lun_ctx->drive_ctx;
+    DriveCacheEntry new_entry = {0}, *entry = NULL;
+
+    /* Drives without a serial number string can't be told apart from other drives with the same VID and PID, so we won't cache them. */
+    if (!g_driveCacheEntries || !drive_ctx->serial_number || !*(drive_ctx->serial_number)) return;
+
+    /* Make sure all strings fit. */
+    if (strlen(drive_ctx->serial_number) >= sizeof(new_entry.usb_serial_number) || (drive_ctx->manufacturer && strlen(drive_ctx->manufacturer) >= sizeof(new_entry.manufacturer)) || \
+        (drive_ctx->product_name && strlen(drive_ctx->product_name) >= sizeof(new_entry.product_name)))
+    {
+        USBHSFS_LOG_MSG("Device strings are too long to be cached (interface %d, LUN %u).", lun_ctx->usb_if_id, lun_ctx->lun);
+        return;
+    }
+
+    /* Fill new entry. */
+    new_entry.vid = drive_ctx->vid;
+    new_entry.pid = drive_ctx->pid;
+    new_entry.lun = lun_ctx->lun;
+    new_entry.removable = lun_ctx->removable;
+
+    snprintf(new_entry.usb_serial_number, sizeof(new_entry.usb_serial_number), "%s", drive_ctx->serial_number);
+    if (drive_ctx->manufacturer) snprintf(new_entry.manufacturer, sizeof(new_entry.manufacturer), "%s", drive_ctx->manufacturer);
+    if (drive_ctx->product_name) snprintf(new_entry.product_name, sizeof(new_entry.product_name), "%s", drive_ctx->product_name);
+
+    snprintf(new_entry.vendor_id, sizeof(new_entry.vendor_id), "%s", lun_ctx->vendor_id);
+    snprintf(new_entry.product_id, sizeof(new_entry.product_id), "%s", lun_ctx->product_id);
+    snprintf(new_entry.serial_number, sizeof(new_entry.serial_number), "%s", lun_ctx->serial_number);
+
+    new_entry.block_count = lun_ctx->block_count;
+    new_entry.block_length = lun_ctx->block_length;
+
+    /* Incomplete partition layouts are left zeroed out. */
+    if (lun_ctx->layout.complete) memcpy(&(new_entry.layout), &(lun_ctx->layout), sizeof(UsbHsFsDriveLogicalUnitLayout));
+
+    /* Look for an existing entry. */
+    entry = usbHsFsDriveCacheFindEntry(drive_ctx, lun_ctx->lun, false);
+    if (!entry)
+    {
+        if (g_driveCacheEntryCount < DRIVE_CACHE_MAX_ENTRIES)
+        {
+            /* Use a free entry. */
+            entry = &(g_driveCacheEntries[g_driveCacheEntryCount++]);
+        } else {
+            /* Evict the least recently used entry. */
+            entry = &(g_driveCacheEntries[0]);
+
+            for(u32 i = 1; i < g_driveCacheEntryCount; i++)
+            {
+                if (g_driveCacheEntries[i].last_used < entry->last_used) entry = &(g_driveCacheEntries[i]);
+            }
+        }
+    }
+
+    /* Update entry. Only write the drive cache file right away if the cached data actually changed. */
+    new_entry.last_used = entry->last_used;
+
+    bool changed = (memcmp(entry, &new_entry, sizeof(DriveCacheEntry)) != 0);
+    if (changed) memcpy(entry, &new_entry, sizeof(DriveCacheEntry));
+
+    entry->last_used = ++g_driveCacheCounter;
+    g_driveCacheDirty = true;
+
+    if (changed) usbHsFsDriveCacheFlush();
+}
+
+static void usbHsFsDriveCacheLoadFile(void)
+{
+    Result rc = 0;
+    FsFileSystem *sdmc_fs = NULL;
+    FsFile file = {0};
+    DriveCacheHeader header = {0};
+    s64 file_size = 0;
+    u64 read_size = 0, entries_size = 0;
+    bool success = false;
+
+    /* Get SD card FsFileSystem object. */
+    sdmc_fs = fsdevGetDeviceFileSystem("sdmc:");
+    if (!sdmc_fs) return;
+
+    /* Open drive cache file. It may not exist yet. */
+    rc = fsFsOpenFile(sdmc_fs, g_driveCacheFilePath, FsOpenMode_Read, &file);
+    if (R_FAILED(rc))
+    {
+        USBHSFS_LOG_MSG("Unable to open drive cache file! (0x%X).", rc);
+        return;
+    }
+
+    /* Read and validate header. */
+    rc = fsFileGetSize(&file, &file_size);
+    if (R_FAILED(rc) || file_size < (s64)sizeof(DriveCacheHeader)) goto end;
+
+    rc = fsFileRead(&file, 0, &header, sizeof(DriveCacheHeader), FsReadOption_None, &read_size);
+    if (R_FAILED(rc) || read_size != sizeof(DriveCacheHeader)) goto end;
+
+    entries_size = ((u64)header.entry_count * sizeof(DriveCacheEntry));
+
+    if (header.magic != DRIVE_CACHE_MAGIC || header.version != DRIVE_CACHE_VERSION || header.entry_count > DRIVE_CACHE_MAX_ENTRIES || \
+        (u64)file_size != (sizeof(DriveCacheHeader) + entries_size)) goto end;
+
+    /* Read and validate entries. */
+    if (entries_size)
+    {
+        rc = fsFileRead(&file, sizeof(DriveCacheHeader), g_driveCacheEntries, entries_size, FsReadOption_None, &read_size);
+        if (R_FAILED(rc) || read_size != entries_size || usbHsFsCrcCalculateCrc32(g_driveCacheEntries, entries_size) != header.entries_crc32) goto end;
+    }
+
+    g_driveCacheEntryCount = header.entry_count;
+
+    /* Restore usage counter. */
+    for(u32 i = 0; i < g_driveCacheEntryCount; i++)
+    {
+        if (g_driveCacheEntries[i].last_used > g_driveCacheCounter) g_driveCacheCounter = g_driveCacheEntries[i].last_used;
+    }
+
+    success = true;
+
+    USBHSFS_LOG_MSG("Loaded %u entry(ies) from drive cache file.", g_driveCacheEntryCount);
+
+end:
+    if (!success)
+    {
+        USBHSFS_LOG_MSG("Invalid drive cache file! Discarding it.");
+        memset(g_driveCacheEntries, 0, DRIVE_CACHE_MAX_ENTRIES * sizeof(DriveCacheEntry));
+    }
+
+    fsFileClose(&file);
+}
+
+static void usbHsFsDriveCacheSaveFile(void)
+{
+    Result rc = 0;
+    FsFileSystem *sdmc_fs = NULL;
+    FsFile file = {0};
+    u64 entries_size = (g_driveCacheEntryCount * sizeof(DriveCacheEntry));
+    DriveCacheHeader header = { DRIVE_CACHE_MAGIC, DRIVE_CACHE_VERSION, g_driveCacheEntryCount, usbHsFsCrcCalculateCrc32(g_driveCacheEntries, entries_size) };
+
+    /* Get SD card FsFileSystem object. */
+    sdmc_fs = fsdevGetDeviceFileSystem("sdmc:");
+    if (!sdmc_fs) return;
+
+    /* Create file. This will fail if the drive cache file exists, so we don't check its return value. */
+    fsFsCreateFile(sdmc_fs, g_driveCacheFilePath, 0, 0);
+
+    /* Open drive cache file. */
+    rc = fsFsOpenFile(sdmc_fs, g_driveCacheFilePath, FsOpenMode_Write, &file);
+    if (R_FAILED(rc))
+    {
+        USBHSFS_LOG_MSG("Unable to open drive cache file! (0x%X).", rc);
+        return;
+    }
+
+    /* Write drive cache data. */
+    rc = fsFileSetSize(&file, (s64)(sizeof(DriveCacheHeader) + entries_size));
+    if (R_SUCCEEDED(rc)) rc = fsFileWrite(&file, 0, &header, sizeof(DriveCacheHeader), FsWriteOption_None);
+    if (R_SUCCEEDED(rc) && entries_size) rc = fsFileWrite(&file, sizeof(DriveCacheHeader), g_driveCacheEntries, entries_size, FsWriteOption_Flush);
+
+    if (R_FAILED(rc)) USBHSFS_LOG_MSG("Failed to write drive cache file! (0x%X).", rc);
+
+    fsFileClose(&file);
+    fsFsCommit(sdmc_fs);
+}
+
+static void usbHsFsDriveCacheFree(void)
+{
+    if (g_driveCacheFilePath)
+    {
+        free(g_driveCacheFilePath);
+        g_driveCacheFilePath = NULL;
+    }
+
+    if (g_driveCacheEntries)
+    {
+        free(g_driveCacheEntries);
+        g_driveCacheEntries = NULL;
+    }
+
+    g_driveCacheEntryCount = 0;
+    g_driveCacheCounter = 0;
+    g_driveCacheDirty = false;
+}
+
+static DriveCacheEntry *usbHsFsDriveCacheFindEntry(UsbHsFsDriveContext *drive_ctx, u8 lun, bool any_lun)
+{
+    if (!g_driveCacheEntries || !drive_ctx->serial_number || !*(drive_ctx->serial_number)) return NULL;
+
+    for(u32 i = 0; i < g_driveCacheEntryCount; i++)
+    {
+        DriveCacheEntry *entry = &(g_driveCacheEntries[i]);
+
+        if (entry->vid == drive_ctx->vid && entry->pid == drive_ctx->pid && (any_lun || entry->lun == lun) && !strcmp(entry->usb_serial_number, drive_ctx->serial_number)) return entry;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,42 @@
+/*
+ * usbhsfs_drive_cache.h
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#pragma once
+
+#ifndef __USBHSFS_DRIVE_CACHE_H__
+#define __USBHSFS_DRIVE_CACHE_H__
+
+#include "usbhsfs_drive.h"
+
+/// None of these functions are thread safe - make sure to (un)lock mutexes elsewhere.
+
+/// Sets the path to the drive cache file, which must be located on the SD card (e.g. "/switch/app/usbhsfs.cache").
+/// Pending changes are written to the previous drive cache file (if any), then the new file is loaded. If it doesn't exist or it's invalid, an empty drive cache is used.
+/// If a NULL pointer or an empty string is provided, the drive cache is disabled.
+bool usbHsFsDriveCacheSetFilePath(const char *path);
+
+/// Writes pending changes to the drive cache file, if needed.
+void usbHsFsDriveCacheFlush(void);
+
+/// Looks for cached manufacturer and product name strings matching the VID, PID and serial number string from the provided drive context.
+/// If found, they're duplicated into the drive context and true is returned.
+bool usbHsFsDriveCacheGetDeviceStrings(UsbHsFsDriveContext *drive_ctx);
+
+/// Looks for cached identity data (normally retrieved via SCSI Inquiry commands) for the provided LUN context.
+/// If found, the removable flag, vendor ID, product ID and serial number from the LUN context are updated and true is returned.
+bool usbHsFsDriveCacheGetLogicalUnitIdentity(UsbHsFsDriveLogicalUnitContext *lun_ctx);
+
+/// Looks for a cached partition layout for the provided LUN context. Its block count and length must match the cached values.
+/// The cached partition layout must still be validated against the partition table blocks before being used.
+bool usbHsFsDriveCacheGetLogicalUnitLayout(UsbHsFsDriveLogicalUnitContext *lun_ctx, UsbHsFsDriveLogicalUnitLayout *out_layout);
+
+/// Updates the drive cache using data from the provided LUN context, which must have already been fully initialized.
+/// The drive cache file is written right away if any of the cached data changed.
+void usbHsFsDriveCacheUpdateLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx);
+
+#endif  /* __USBHSFS_DRIVE_CACHE_H__ */
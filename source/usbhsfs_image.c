@@ -0,0 +1,414 @@
+/*
+ * usbhsfs_image.c
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#include "usbhsfs_utils.h"
+#include "usbhsfs_image.h"
+
+#ifdef GPL_BUILD
+#include <ntfs-3g/attrib.h>
+#include <ext4_block_group.h>
+#endif
+
+#define IMAGE_EXTENT_MIN_GAP        0x40000     /* 256 KiB. Free areas smaller than this are imaged anyway. */
+#define IMAGE_EXTENT_INITIAL_COUNT  0x400
+
+#define NTFS_BITMAP_BUF_SIZE        0x10000
+
+/* Type definitions. */
+
+/// Used by usbHsFsImageFatAllocationCallback().
+typedef struct {
+    UsbHsFsImageVolumeMap *map;
+    u64 data_offset;                        ///< Data area offset relative to the start of the volume, in bytes.
+    u64 cluster_size;                       ///< Cluster size, in bytes.
+} UsbHsFsImageFatContext;
+
+/* Function prototypes. */
+
+static bool usbHsFsImageGetFatVolumeMap(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, UsbHsFsImageVolumeMap *map);
+static void usbHsFsImageFatAllocationCallback(DWORD clst, DWORD ncl, void *arg);
+
+#ifdef GPL_BUILD
+static bool usbHsFsImageGetNtfsVolumeMap(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, UsbHsFsImageVolumeMap *map);
+
+static bool usbHsFsImageGetExtVolumeMap(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, UsbHsFsImageVolumeMap *map);
+static u64 usbHsFsImageGetExtDescriptorBlock(struct ext4_sblock *sblock, u32 bgid, u32 desc_per_block);
+#endif
+
+static void usbHsFsImageSetVolumeGeometry(UsbHsFsImageVolumeMap *map, u64 block_addr, u64 size);
+static bool usbHsFsImageAddExtent(UsbHsFsImageVolumeMap *map, u64 offset, u64 size);
+static void usbHsFsImageSortExtents(UsbHsFsImageVolumeMap *map);
+static int usbHsFsImageCompareExtents(const void *a, const void *b);
+
+bool usbHsFsImageGetVolumeMap(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, UsbHsFsImageVolumeMap *out_map)
+{
+    UsbHsFsDriveLogicalUnitContext *lun_ctx = NULL;
+    bool ret = false;
+
+    if (!fs_ctx || !(lun_ctx = (UsbHsFsDriveLogicalUnitContext*)fs_ctx->lun_ctx) || !out_map)
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return false;
+    }
+
+    memset(out_map, 0, sizeof(UsbHsFsImageVolumeMap));
+    out_map->block_length = lun_ctx->block_length;
+
+    switch(fs_ctx->fs_type)
+    {
+        case UsbHsFsDriveLogicalUnitFileSystemType_FAT:
+            ret = usbHsFsImageGetFatVolumeMap(fs_ctx, out_map);
+            break;
+#ifdef GPL_BUILD
+        case UsbHsFsDriveLogicalUnitFileSystemType_NTFS:
+            ret = usbHsFsImageGetNtfsVolumeMap(fs_ctx, out_map);
+            break;
+        case UsbHsFsDriveLogicalUnitFileSystemType_EXT:
+            ret = usbHsFsImageGetExtVolumeMap(fs_ctx, out_map);
+            break;
+#endif
+
+        /* TODO: populate this after adding support for additional filesystems. */
+
+        default:
+            break;
+    }
+
+    if (ret && !out_map->error)
+    {
+        /* Sort and merge extents. */
+        usbHsFsImageSortExtents(out_map);
+
+        USBHSFS_LOG_MSG("Volume map for \"%s\": 0x%lX byte(s) allocated out of 0x%lX, %u extent(s).", fs_ctx->name, out_map->data_size, out_map->size, out_map->extent_count);
+    } else {
+        USBHSFS_LOG_MSG("Failed to build volume map for \"%s\"!", fs_ctx->name);
+        usbHsFsImageFreeVolumeMap(out_map);
+        ret = false;
+    }
+
+    return ret;
+}
+
+void usbHsFsImageFreeVolumeMap(UsbHsFsImageVolumeMap *map)
+{
+    if (!map) return;
+    if (map->extents) free(map->extents);
+    memset(map, 0, sizeof(UsbHsFsImageVolumeMap));
+}
+
+static bool usbHsFsImageGetFatVolumeMap(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, UsbHsFsImageVolumeMap *map)
+{
+    FATFS *fatfs = fs_ctx->fatfs;
+    UsbHsFsImageFatContext fat_ctx = {0};
+    char name[MOUNT_NAME_LENGTH] = {0};
+    FRESULT res = FR_OK;
+
+    fat_ctx.map = map;
+    fat_ctx.data_offset = ((u64)(fatfs->database - fatfs->volbase) * fatfs->ssize);
+    fat_ctx.cluster_size = ((u64)fatfs->csize * fatfs->ssize);
+
+    /* The volume ends right after the last cluster from the data area. */
+    usbHsFsImageSetVolumeGeometry(map, fatfs->volbase, fat_ctx.data_offset + ((u64)(fatfs->n_fatent - 2) * fat_ctx.cluster_size));
+
+    /* Reserved sectors, FATs and the root directory (FAT12/16 only) are located before the data area. */
+    if (!usbHsFsImageAddExtent(map, 0, fat_ctx.data_offset)) return false;
+
+    /* Enumerate allocated clusters. */
+    sprintf(name, "%u:", fatfs->pdrv);
+
+    res = ff_getalloc(name, usbHsFsImageFatAllocationCallback, &fat_ctx);
+    if (res != FR_OK)
+    {
+        USBHSFS_LOG_MSG("Failed to enumerate allocated clusters from FAT volume \"%s\"! (%u).", name, res);
+        return false;
+    }
+
+    return true;
+}
+
+static void usbHsFsImageFatAllocationCallback(DWORD clst, DWORD ncl, void *arg)
+{
+    UsbHsFsImageFatContext *fat_ctx = (UsbHsFsImageFatContext*)arg;
+    usbHsFsImageAddExtent(fat_ctx->map, fat_ctx->data_offset + ((u64)(clst - 2) * fat_ctx->cluster_size), (u64)ncl * fat_ctx->cluster_size);
+}
+
+#ifdef GPL_BUILD
+
+static bool usbHsFsImageGetNtfsVolumeMap(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, UsbHsFsImageVolumeMap *map)
+{
+    ntfs_vd *vd = fs_ctx->ntfs;
+    ntfs_volume *vol = vd->vol;
+    ntfs_dd *dd = vd->dd;
+    u64 cluster_size = vol->cluster_size, cluster_count = (u64)vol->nr_clusters, run_start = 0, run_count = 0, lcn = 0;
+    s64 bitmap_size = (s64)((cluster_count + 7) / 8);
+    u8 *bitmap = NULL;
+    bool success = false;
+
+    /* The backup boot sector is located right after the last sector covered by the volume. */
+    usbHsFsImageSetVolumeGeometry(map, dd->sector_start, (dd->sector_count + 1) * (u64)dd->sector_size);
+
+    /* Allocate memory for the bitmap buffer. */
+    bitmap = malloc(NTFS_BITMAP_BUF_SIZE);
+    if (!bitmap)
+    {
+        USBHSFS_LOG_MSG("Failed to allocate memory for NTFS bitmap buffer!");
+        return false;
+    }
+
+    /* Read $Bitmap in chunks. Each bit represents a single cluster. */
+    for(s64 pos = 0, rd = 0; pos < bitmap_size; pos += rd)
+    {
+        rd = ntfs_attr_pread(vol->lcnbmp_na, pos, (bitmap_size - pos) > NTFS_BITMAP_BUF_SIZE ? NTFS_BITMAP_BUF_SIZE : (bitmap_size - pos), bitmap);
+        if (rd <= 0)
+        {
+            USBHSFS_LOG_MSG("Failed to read NTFS $Bitmap at offset 0x%lX! (%d).", pos, errno);
+            goto end;
+        }
+
+        for(s64 i = 0; i < rd; i++)
+        {
+            for(u8 j = 0; j < 8 && lcn < cluster_count; j++, lcn++)
+            {
+                if (bitmap[i] & (1 << j))
+                {
+                    /* Allocated cluster: extend current run. */
+                    if (!run_count) run_start = lcn;
+                    run_count++;
+                } else
+                if (run_count)
+                {
+                    /* Free cluster: add current run. */
+                    if (!usbHsFsImageAddExtent(map, run_start * cluster_size, run_count * cluster_size)) goto end;
+                    run_count = 0;
+                }
+            }
+        }
+    }
+
+    /* Add last run, as well as the area past the last cluster (which holds the backup boot sector). */
+    if (run_count && !usbHsFsImageAddExtent(map, run_start * cluster_size, run_count * cluster_size)) goto end;
+    if (!usbHsFsImageAddExtent(map, cluster_count * cluster_size, map->size - (cluster_count * cluster_size))) goto end;
+
+    success = true;
+
+end:
+    free(bitmap);
+
+    return success;
+}
+
+static bool usbHsFsImageGetExtVolumeMap(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, UsbHsFsImageVolumeMap *map)
+{
+    UsbHsFsDriveLogicalUnitContext *lun_ctx = (UsbHsFsDriveLogicalUnitContext*)fs_ctx->lun_ctx;
+    struct ext4_blockdev *bdev = fs_ctx->ext->bdev;
+    struct ext4_sblock *sblock = &(bdev->fs->sb);
+    struct ext4_block block = {0};
+
+    u64 block_size = ext4_sb_get_block_size(sblock), block_count = ext4_sb_get_blocks_cnt(sblock);
+    u32 bg_count = ext4_block_group_cnt(sblock), blocks_per_group = ext4_get32(sblock, blocks_per_group), first_data_block = ext4_get32(sblock, first_data_block);
+    u32 desc_size = ext4_sb_get_desc_size(sblock), desc_per_block = (u32)(block_size / desc_size);
+    u64 inode_table_size = ALIGN_UP((u64)ext4_get32(sblock, inodes_per_group) * ext4_get16(sblock, inode_size), block_size);
+
+    bool meta_bg = ext4_sb_feature_incom(sblock, EXT4_FINCOM_META_BG);
+    u32 gdt_blocks = (meta_bg ? ext4_get32(sblock, first_meta_bg) : ((bg_count + desc_per_block - 1) / desc_per_block));
+    u32 reserved_gdt_blocks = ext4_get16(sblock, s_reserved_gdt_blocks);
+
+    int ret = 0;
+
+    usbHsFsImageSetVolumeGeometry(map, bdev->part_offset >> lun_ctx->block_length_log2, block_count * block_size);
+
+    /* Block bitmaps represent clusters instead of blocks under bigalloc. Just image the whole volume. */
+    if (ext4_sb_feature_ro_com(sblock, EXT4_FRO_COM_BIGALLOC))
+    {
+        USBHSFS_LOG_MSG("Bigalloc EXT volume \"%s\" can't be imaged sparsely. Imaging the whole volume.", fs_ctx->name);
+        return usbHsFsImageAddExtent(map, 0, map->size);
+    }
+
+    /* Boot block and primary superblock. */
+    if (!usbHsFsImageAddExtent(map, 0, (first_data_block + 1) * block_size)) return false;
+
+    for(u32 bgid = 0; bgid < bg_count; bgid++)
+    {
+        struct ext4_bgroup *bg = NULL;
+        u64 bg_first_block = ((u64)bgid * blocks_per_group + first_data_block), block_bitmap = 0, inode_bitmap = 0, inode_table = 0, run_start = 0, run_count = 0;
+        u32 bg_block_count = ext4_blocks_in_group_cnt(sblock, bgid);
+        bool block_uninit = false, has_super = ext4_sb_is_super_in_bg(sblock, bgid);
+
+        /* Get block group descriptor. */
+        ret = ext4_block_get(bdev, &block, usbHsFsImageGetExtDescriptorBlock(sblock, bgid, desc_per_block));
+        if (ret)
+        {
+            USBHSFS_LOG_MSG("Failed to read descriptor for EXT block group %u! (%d).", bgid, ret);
+            return false;
+        }
+
+        bg = (struct ext4_bgroup*)(block.data + ((bgid % desc_per_block) * desc_size));
+        block_bitmap = ext4_bg_get_block_bitmap(bg, sblock);
+        inode_bitmap = ext4_bg_get_inode_bitmap(bg, sblock);
+        inode_table = ext4_bg_get_inode_table_first_block(bg, sblock);
+        block_uninit = ext4_bg_has_flag(bg, EXT4_BLOCK_GROUP_BLOCK_UNINIT);
+
+        ext4_block_set(bdev, &block);
+
+        /* Bitmaps and inode tables are always in use. They may be located in other block groups if flex_bg is enabled. */
+        if (!usbHsFsImageAddExtent(map, block_bitmap * block_size, block_size) || !usbHsFsImageAddExtent(map, inode_bitmap * block_size, block_size) || \
+            !usbHsFsImageAddExtent(map, inode_table * block_size, inode_table_size)) return false;
+
+        if (block_uninit)
+        {
+            /* The block bitmap hasn't been initialized. Only superblock and group descriptor backups may be in use within this block group. */
+            if (has_super && !usbHsFsImageAddExtent(map, bg_first_block * block_size, (1 + gdt_blocks + (meta_bg ? 0 : reserved_gdt_blocks)) * block_size)) return false;
+
+            /* Under meta_bg, group descriptor blocks are also stored in the first, second and last block groups from each meta group. */
+            if (meta_bg && (bgid / desc_per_block) >= gdt_blocks)
+            {
+                u32 idx = (bgid % desc_per_block);
+                if ((idx == 0 || idx == 1 || idx == (desc_per_block - 1)) && !usbHsFsImageAddExtent(map, (bg_first_block + (has_super ? 1 : 0)) * block_size, block_size)) return false;
+            }
+
+            continue;
+        }
+
+        /* Read block bitmap. Each bit represents a single block from this block group. */
+        ret = ext4_block_get(bdev, &block, block_bitmap);
+        if (ret)
+        {
+            USBHSFS_LOG_MSG("Failed to read block bitmap for EXT block group %u! (%d).", bgid, ret);
+            return false;
+        }
+
+        for(u32 i = 0; i < bg_block_count; i++)
+        {
+            if (block.data[i / 8] & (1 << (i % 8)))
+            {
+                /* Allocated block: extend current run. */
+                if (!run_count) run_start = (bg_first_block + i);
+                run_count++;
+            } else
+            if (run_count)
+            {
+                /* Free block: add current run. */
+                if (!usbHsFsImageAddExtent(map, run_start * block_size, run_count * block_size)) break;
+                run_count = 0;
+            }
+        }
+
+        ext4_block_set(bdev, &block);
+
+        /* Add last run. */
+        if (map->error || (run_count && !usbHsFsImageAddExtent(map, run_start * block_size, run_count * block_size))) return false;
+    }
+
+    return true;
+}
+
+static u64 usbHsFsImageGetExtDescriptorBlock(struct ext4_sblock *sblock, u32 bgid, u32 desc_per_block)
+{
+    u32 desc_block_idx = (bgid / desc_per_block), meta_bgid = 0;
+
+    /* Without meta_bg, all group descriptor blocks are located right after the primary superblock. */
+    if (!ext4_sb_feature_incom(sblock, EXT4_FINCOM_META_BG) || desc_block_idx < ext4_get32(sblock, first_meta_bg)) return (ext4_get32(sblock, first_data_block) + 1 + (u64)desc_block_idx);
+
+    /* Otherwise, each one is located at the start of the first block group from its meta group, right after the superblock backup (if any). */
+    meta_bgid = (desc_block_idx * desc_per_block);
+
+    return ((u64)meta_bgid * ext4_get32(sblock, blocks_per_group) + ext4_get32(sblock, first_data_block) + (ext4_sb_is_super_in_bg(sblock, meta_bgid) ? 1 : 0));
+}
+
+#endif  /* GPL_BUILD */
+
+static void usbHsFsImageSetVolumeGeometry(UsbHsFsImageVolumeMap *map, u64 block_addr, u64 size)
+{
+    map->block_addr = block_addr;
+    map->size = ALIGN_UP(size, (u64)map->block_length);
+}
+
+static bool usbHsFsImageAddExtent(UsbHsFsImageVolumeMap *map, u64 offset, u64 size)
+{
+    UsbHsFsSparseImageExtent *last = NULL, *tmp_extents = NULL;
+    u64 end = (offset + size);
+    u32 tmp_capacity = 0;
+
+    if (map->error) return false;
+
+    /* Clamp extent to the volume size. */
+    if (!size || offset >= map->size) return true;
+    if (end > map->size || end < offset) end = map->size;
+
+    /* Align extent to the LUN block length. */
+    offset = ALIGN_DOWN(offset, (u64)map->block_length);
+    end = ALIGN_UP(end, (u64)map->block_length);
+
+    /* Extents are mostly added in ascending order. Try to merge this one with the last extent first. */
+    if (map->extent_count)
+    {
+        last = &(map->extents[map->extent_count - 1]);
+        if (offset >= last->offset && offset <= (last->offset + last->size + IMAGE_EXTENT_MIN_GAP))
+        {
+            if (end > (last->offset + last->size)) last->size = (end - last->offset);
+            return true;
+        }
+    }
+
+    /* Reallocate extent array, if needed. */
+    if (map->extent_count >= map->extent_capacity)
+    {
+        tmp_capacity = (map->extent_capacity ? (map->extent_capacity * 2) : IMAGE_EXTENT_INITIAL_COUNT);
+
+        tmp_extents = realloc(map->extents, tmp_capacity * sizeof(UsbHsFsSparseImageExtent));
+        if (!tmp_extents)
+        {
+            USBHSFS_LOG_MSG("Failed to reallocate extent array! (%u).", tmp_capacity);
+            map->error = true;
+            return false;
+        }
+
+        map->extents = tmp_extents;
+        map->extent_capacity = tmp_capacity;
+        tmp_extents = NULL;
+    }
+
+    map->extents[map->extent_count++] = (UsbHsFsSparseImageExtent){ .offset = offset, .size = (end - offset) };
+
+    return true;
+}
+
+static void usbHsFsImageSortExtents(UsbHsFsImageVolumeMap *map)
+{
+    u32 count = 0;
+
+    map->data_size = 0;
+    if (!map->extent_count) return;
+
+    /* Sort extents by offset. */
+    qsort(map->extents, map->extent_count, sizeof(UsbHsFsSparseImageExtent), usbHsFsImageCompareExtents);
+
+    /* Merge overlapping extents, as well as extents separated by small free areas. */
+    for(u32 i = 1; i < map->extent_count; i++)
+    {
+        UsbHsFsSparseImageExtent *cur = &(map->extents[count]), *next = &(map->extents[i]);
+        u64 cur_end = (cur->offset + cur->size), next_end = (next->offset + next->size);
+
+        if (next->offset <= (cur_end + IMAGE_EXTENT_MIN_GAP))
+        {
+            if (next_end > cur_end) cur->size = (next_end - cur->offset);
+        } else {
+            map->extents[++count] = *next;
+        }
+    }
+
+    map->extent_count = (count + 1);
+
+    for(u32 i = 0; i < map->extent_count; i++) map->data_size += map->extents[i].size;
+}
+
+static int usbHsFsImageCompareExtents(const void *a, const void *b)
+{
+    const UsbHsFsSparseImageExtent *extent_a = (const UsbHsFsSparseImageExtent*)a, *extent_b = (const UsbHsFsSparseImageExtent*)b;
+    return (extent_a->offset < extent_b->offset ? -1 : (extent_a->offset > extent_b->offset ? 1 : 0));
+}
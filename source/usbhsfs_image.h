@@ -0,0 +1,38 @@
+/*
+ * usbhsfs_image.h
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#pragma once
+
+#ifndef __USBHSFS_IMAGE_H__
+#define __USBHSFS_IMAGE_H__
+
+#include "usbhsfs_drive.h"
+
+/// Allocated areas from a mounted volume. Built by usbHsFsImageGetVolumeMap().
+typedef struct {
+    u64 block_addr;                         ///< Volume starting LBA.
+    u64 size;                               ///< Volume size, in bytes. Aligned to the LUN block length.
+    u32 block_length;                       ///< LUN block length. All extent offsets and sizes are aligned to this value.
+    u32 extent_count;                       ///< Number of extents.
+    u32 extent_capacity;                    ///< Number of extents that fit in the extent array.
+    bool error;                             ///< Set to true if an extent couldn't be added.
+    UsbHsFsSparseImageExtent *extents;      ///< Dynamically allocated extent array. Sorted by offset, with no overlapping extents. Offsets are relative to the start of the volume.
+    u64 data_size;                          ///< Sum of all extent sizes, in bytes.
+} UsbHsFsImageVolumeMap;
+
+/// None of these functions are thread safe - make sure to (un)lock mutexes elsewhere.
+
+/// Builds a map of the allocated areas from the volume represented by the provided filesystem context, using its allocation bitmaps (or the FAT, on FAT12/16/32 volumes).
+/// Filesystem metadata areas are always included. Pending filesystem metadata should be committed beforehand.
+/// Small free areas between allocated areas are included as well, which keeps the number of extents low and transfers large.
+bool usbHsFsImageGetVolumeMap(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, UsbHsFsImageVolumeMap *out_map);
+
+/// Frees a volume map built by usbHsFsImageGetVolumeMap().
+void usbHsFsImageFreeVolumeMap(UsbHsFsImageVolumeMap *map);
+
+#endif  /* __USBHSFS_IMAGE_H__ */
@@ -8,18 +8,98 @@
  * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
 #include "usbhsfs_utils.h"
 #include "usbhsfs_manager.h"
 #include "usbhsfs_mount.h"
+#include "usbhsfs_request.h"
+#include "usbhsfs_scsi.h"
+#include "usbhsfs_drive_cache.h"
+#include "usbhsfs_quirks.h"
+#include "usbhsfs_image.h"
+#include "usbhsfs_pool.h"
+#include "usbhsfs_budget.h"
 #include "sxos/usbfs_dev.h"
+#include "fatfs/ff_dev.h"
 
 #if defined(DEBUG) && defined(GPL_BUILD)
 #include "ntfs-3g/ntfs.h"
 #include "lwext4/ext.h"
 #endif
 
+#ifdef GPL_BUILD
+#include "ntfs-3g/ntfs_dev.h"
+#include "lwext4/ext_dev.h"
+#endif
+
 #define MAX_USB_INTERFACES  0x20
 
+#define IO_SCHED_WAIT_TIMEOUT_NS    5000000UL       /* 5 ms. Drive context mutex unlocks don't take the drive manager mutex, so a wakeup may be missed. */
+#define IO_SCHED_BULK_DEADLINE_NS   200000000UL     /* 200 ms. Max time a bulk I/O thread yields to interactive I/O threads. */
+
+#define COPY_FILE_BUF_COUNT             2
+#define COPY_FILE_READER_STACK_SIZE     0x4000
+
+#define SPARSE_IMAGE_BUF_COUNT          2
+#define SPARSE_IMAGE_MAX_SEGMENTS       64      /* Max number of extent pieces packed into a single transfer buffer. */
+#define SPARSE_IMAGE_READER_STACK_SIZE  0x4000
+
+#define RAW_LUN_QUEUE_DEPTH             64
+#define RAW_LUN_MAX_BATCH_SIZE          16      /* Max number of contiguous requests merged into a single vectored transfer. */
+#define RAW_LUN_WORKER_STACK_SIZE       0x4000
+
+/* Type definitions. */
+
+/// Shared by usbHsFsCopyFile() and its reader thread.
+typedef struct {
+    int fd;                                 ///< Source file descriptor.
+    u8 priority;                            ///< I/O priority class for the reader thread.
+    u8 *buf[COPY_FILE_BUF_COUNT];           ///< Transfer buffers.
+    ssize_t size[COPY_FILE_BUF_COUNT];      ///< Bytes read into each transfer buffer. Zero means EOF was reached, -1 means a read error occurred.
+    int read_errno;                         ///< errno value from the reader thread if a read error occurs.
+    Semaphore free_sem;                     ///< Signaled whenever a transfer buffer can be filled by the reader thread.
+    Semaphore full_sem;                     ///< Signaled whenever a transfer buffer is ready to be written by the calling thread.
+    bool abort;                             ///< Set by the calling thread if a write error occurs.
+} UsbHsFsCopyFileContext;
+
+/// Shared by usbHsFsCreateSparseVolumeImage() and its reader thread.
+typedef struct {
+    UsbHsFsDriveContext *drive_ctx;                 ///< Drive context the volume belongs to. Validated before each read, since it may be destroyed at any time.
+    u32 generation;                                 ///< Drive context generation number. Used to make sure the drive context pointer wasn't reused by another drive context.
+    u8 lun;                                         ///< Drive LUN index.
+    u8 priority;                                    ///< I/O priority class for the reader thread.
+    const UsbHsFsImageVolumeMap *map;               ///< Volume map.
+    u8 *buf[SPARSE_IMAGE_BUF_COUNT];                ///< Transfer buffers.
+    ssize_t size[SPARSE_IMAGE_BUF_COUNT];           ///< Bytes read into each transfer buffer. Zero means all extents were read, -1 means a read error occurred.
+    Semaphore free_sem;                             ///< Signaled whenever a transfer buffer can be filled by the reader thread.
+    Semaphore full_sem;                             ///< Signaled whenever a transfer buffer is ready to be written by the calling thread.
+    bool abort;                                     ///< Set by the calling thread if a write error occurs.
+} UsbHsFsSparseImageContext;
+
+/// Raw block I/O handle. Opaque to users.
+struct UsbHsFsRawLogicalUnit {
+    UsbHsFsDriveContext *drive_ctx;                 ///< Drive context the logical unit belongs to. Validated before each transfer, since it may be destroyed at any time.
+    s32 usb_if_id;                                  ///< USB interface ID from the drive context.
+    u32 generation;                                 ///< Drive context generation number. Used to make sure the drive context pointer wasn't reused by another drive context.
+    u8 lun;                                         ///< Drive LUN index.
+    u8 priority;                                    ///< I/O priority class for the worker thread.
+    bool dirty;                                     ///< Set to true by the worker thread after processing write requests. Used to flush the write cache before exiting.
+    bool exit;                                      ///< Set by usbHsFsRawCloseLogicalUnit() to make the worker thread exit.
+    u32 block_length;                               ///< Logical block length.
+    u64 block_count;                                ///< Logical block count.
+    Mutex mutex;                                    ///< Protects the request queue.
+    CondVar queue_cond;                             ///< Signaled whenever a request is queued, or when the worker thread must exit.
+    CondVar idle_cond;                              ///< Signaled whenever the worker thread finishes processing a batch of requests.
+    UsbHsFsRawRequest *queue[RAW_LUN_QUEUE_DEPTH];  ///< Circular request queue.
+    u32 queue_head;                                 ///< Index of the oldest queued request.
+    u32 queue_count;                                ///< Number of queued requests.
+    u32 busy_count;                                 ///< Number of requests being processed by the worker thread.
+    Thread thread;                                  ///< Worker thread.
+};
+
 /* Global variables. */
 
 static Mutex g_managerMutex = 0;
@@ -39,26 +119,49 @@ static Thread g_usbDriveManagerThread = {0};
 static UEvent g_usbDriveManagerThreadExitEvent = {0};
 
 static UsbHsFsDriveContext **g_driveContexts = NULL;
-static u32 g_driveCount = 0;
+static u32 g_driveCount = 0, g_driveGeneration = 0;
 
 static UEvent g_usbStatusChangeEvent = {0};
 
 static UsbHsFsPopulateCb g_populateCb = NULL;
 static void *g_populateCbUserData = NULL;
 
+static CondVar g_driveIoCondVar = 0;
+static __thread u8 g_threadIoPriority = UsbHsFsIoPriority_Interactive;
+
 /* Function prototypes. */
 
 static Result usbHsFsCreateDriveManagerThread(void);
 static Result usbHsFsCloseDriveManagerThread(void);
 
+static ssize_t usbHsFsPositionalFileIo(int fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset, bool write);
+
+static bool usbHsFsIsFatFsFileDescriptor(int fd);
+static bool usbHsFsIsSameFile(const char *src_path, const struct stat *src_st, const char *dst_path);
+static bool usbHsFsGetAbsolutePath(const char *path, char *outpath, char *cwd);
+static bool usbHsFsAppendPathSegments(char *outpath, size_t root, size_t *pos, const char *path);
+static bool usbHsFsWriteFileFully(int fd, const void *buf, size_t size);
+static void usbHsFsCopyFileReaderThreadFunc(void *arg);
+
+static void usbHsFsSparseImageReaderThreadFunc(void *arg);
+
+static UsbHsFsDriveLogicalUnitContext *usbHsFsGetLogicalUnitContext(UsbHsFsDriveContext *drive_ctx, u32 generation, u8 lun);
+
+static void usbHsFsRawLogicalUnitWorkerThreadFunc(void *arg);
+static u8 usbHsFsRawProcessRequests(UsbHsFsRawLogicalUnit *raw_lun, UsbHsFsRawRequest **batch, UsbHsFsScsiBlockIoSegment *segments, u32 batch_count);
+static bool usbHsFsRawIsWriteAllowed(UsbHsFsDriveLogicalUnitContext *lun_ctx);
+static void usbHsFsRawCompleteRequest(UsbHsFsRawRequest *request, u8 status);
+
 static void usbHsFsDriveManagerThreadFuncSXOS(void *arg);
 
 static void usbHsFsDriveManagerThreadFuncAtmosphere(void *arg);
 static void usbHsFsResetDrives(void);
 static bool usbHsFsUpdateDriveContexts(bool remove);
+static void usbHsFsCommitDriveContexts(bool force);
 
 static void usbHsFsRemoveDriveContextFromListByIndex(u32 drive_ctx_idx, bool stop_lun);
 static bool usbHsFsAddDriveContextToList(UsbHsInterface *usb_if);
+static void usbHsFsRebalanceXferBuffers(u32 drive_count);
 
 static void usbHsFsExecutePopulateCallback(void);
 static u32 usbHsFsPopulateDeviceList(UsbHsFsDevice *out, u32 device_count, u32 max_count);
@@ -189,6 +292,9 @@ Result usbHsFsInitialize(u8 event_idx)
             sprintf(g_sxOSDevice.name, USBFS_MOUNT_NAME ":");
         }
 
+        /* Preallocate object pools. */
+        usbHsFsPoolInitialize();
+
         /* Create user-mode drive manager thread exit event. */
         ueventCreate(&g_usbDriveManagerThreadExitEvent, true);
 
@@ -222,6 +328,8 @@ end:
                 g_usbInterfaces = NULL;
             }
 
+            usbHsFsPoolExit();
+
 #ifdef DEBUG
             usbHsFsLogCloseLogFile();
 #endif
@@ -258,6 +366,12 @@ void usbHsFsExit(void)
             usbFsExit();
         }
 
+        /* Write pending changes to the drive cache file. */
+        usbHsFsDriveCacheFlush();
+
+        /* Free object pools. */
+        usbHsFsPoolExit();
+
         /* Clear user-provided callback. */
         g_populateCb = NULL;
         g_populateCbUserData = NULL;
@@ -391,6 +505,85 @@ bool usbHsFsUnmountDevice(const UsbHsFsDevice *device, bool signal_status_event)
     return ret;
 }
 
+bool usbHsFsFormatDevice(const UsbHsFsDevice *device, u8 fs_type, u32 cluster_size)
+{
+    UsbHsFsDriveContext *drive_ctx = NULL;
+    UsbHsFsDriveLogicalUnitContext *lun_ctx = NULL;
+    u32 generation = 0;
+    bool ret = false, formatting = false;
+
+    SCOPED_LOCK(&g_managerMutex)
+    {
+        if (!g_usbHsFsInitialized || g_isSXOS || (!g_isSXOS && (!g_driveCount || !g_driveContexts)) || !device)
+        {
+            USBHSFS_LOG_MSG("Invalid parameters!");
+            break;
+        }
+
+        /* Locate drive context. */
+        for(u32 i = 0; i < g_driveCount; i++)
+        {
+            UsbHsFsDriveContext *cur_drive_ctx = g_driveContexts[i];
+            if (!cur_drive_ctx || cur_drive_ctx->usb_if_id != device->usb_if_id) continue;
+
+            drive_ctx = cur_drive_ctx;
+            generation = drive_ctx->generation;
+            break;
+        }
+
+        if (!drive_ctx) USBHSFS_LOG_MSG("Unable to find a matching drive context with USB interface ID %d.", device->usb_if_id);
+    }
+
+    /* Lock drive context. The drive manager mutex is released while waiting for it, and we bail out if the drive context is destroyed in the meantime. */
+    /* FatFs threads holding the drive mutex need the drive manager mutex to complete their requests, so we must never block on the drive mutex while holding it. */
+    if (!drive_ctx || !usbHsFsManagerIsDriveContextPointerValid(drive_ctx)) goto end;
+
+    SCOPED_LOCK(&g_managerMutex)
+    {
+        /* Locate LUN context and mark it as being formatted. Its filesystem contexts are destroyed in the process. */
+        lun_ctx = usbHsFsGetLogicalUnitContext(drive_ctx, generation, device->lun);
+        if (lun_ctx)
+        {
+            formatting = usbHsFsMountBeginLogicalUnitFormat(lun_ctx, fs_type, cluster_size);
+        } else {
+            USBHSFS_LOG_MSG("Unable to find a matching LUN context with USB interface ID %d and LUN %u.", device->usb_if_id, device->lun);
+        }
+    }
+
+    if (formatting)
+    {
+        /* Format the LUN without holding the drive manager mutex, so other drives and hotplug handling aren't held back in the meantime. */
+        ret = usbHsFsMountFormatLogicalUnit(lun_ctx, fs_type, cluster_size);
+
+        /* Mount the new volume. */
+        SCOPED_LOCK(&g_managerMutex) ret = usbHsFsMountEndLogicalUnitFormat(lun_ctx, ret);
+
+        if (ret) USBHSFS_LOG_MSG("Successfully formatted LUN #%u from UMS device with ID %d.", device->lun, device->usb_if_id);
+    }
+
+    usbHsFsManagerUnlockDriveContext(drive_ctx);
+
+    if (!lun_ctx) goto end;
+
+    SCOPED_LOCK(&g_managerMutex)
+    {
+        /* Filesystem contexts from this LUN may have been destroyed, regardless of the result. */
+        USBHSFS_LOG_MSG("Signaling status change event.");
+        ueventSignal(&g_usbStatusChangeEvent);
+
+        /* Execute user-provided callback. */
+        usbHsFsExecutePopulateCallback();
+    }
+
+end:
+#ifdef DEBUG
+    /* Flush logfile. */
+    usbHsFsLogFlushLogFile();
+#endif
+
+    return ret;
+}
+
 u32 usbHsFsGetFileSystemMountFlags(void)
 {
     u32 flags = 0;
@@ -400,36 +593,746 @@ u32 usbHsFsGetFileSystemMountFlags(void)
 
 void usbHsFsSetFileSystemMountFlags(u32 flags)
 {
-    SCOPED_LOCK(&g_managerMutex) usbHsFsMountSetFileSystemMountFlags(flags & UsbHsFsMountFlags_All);
+    SCOPED_LOCK(&g_managerMutex) usbHsFsMountSetFileSystemMountFlags(flags & UsbHsFsMountFlags_All);
+}
+
+u32 usbHsFsGetExtJournalCommitInterval(void)
+{
+    u32 seconds = 0;
+    SCOPED_LOCK(&g_managerMutex) seconds = usbHsFsMountGetExtJournalCommitInterval();
+    return seconds;
+}
+
+void usbHsFsSetExtJournalCommitInterval(u32 seconds)
+{
+    SCOPED_LOCK(&g_managerMutex) usbHsFsMountSetExtJournalCommitInterval(seconds);
+}
+
+bool usbHsFsSetDriveCacheFilePath(const char *path)
+{
+    bool ret = false;
+    SCOPED_LOCK(&g_managerMutex) ret = usbHsFsDriveCacheSetFilePath(path);
+    return ret;
+}
+
+bool usbHsFsGetDriveWriteCache(void)
+{
+    bool ret = false;
+    SCOPED_LOCK(&g_managerMutex) ret = usbHsFsScsiGetEnableWriteCache();
+    return ret;
+}
+
+void usbHsFsSetDriveWriteCache(bool enable)
+{
+    SCOPED_LOCK(&g_managerMutex) usbHsFsScsiSetEnableWriteCache(enable);
+}
+
+bool usbHsFsSetObjectPoolCapacity(UsbHsFsObjectPoolType type, u32 capacity)
+{
+    bool ret = false;
+
+    SCOPED_LOCK(&g_managerMutex)
+    {
+        /* Object pools are preallocated by usbHsFsInitialize(). */
+        if (g_usbHsFsInitialized)
+        {
+            USBHSFS_LOG_MSG("Object pool capacities can't be changed after initialization!");
+            break;
+        }
+
+        ret = usbHsFsPoolSetCapacity(type, capacity);
+    }
+
+    return ret;
+}
+
+bool usbHsFsGetObjectPoolStats(UsbHsFsObjectPoolType type, UsbHsFsObjectPoolStats *out_stats)
+{
+    return usbHsFsPoolGetStats(type, out_stats);
+}
+
+bool usbHsFsSetMemoryBudget(u64 budget)
+{
+    bool ret = false;
+
+    SCOPED_LOCK(&g_managerMutex)
+    {
+        /* Object pools and transfer buffers are sized right from the start, so the budget must be known beforehand. */
+        if (g_usbHsFsInitialized)
+        {
+            USBHSFS_LOG_MSG("The memory budget can't be changed after initialization!");
+            break;
+        }
+
+        usbHsFsBudgetSetLimit(budget);
+        ret = true;
+    }
+
+    return ret;
+}
+
+bool usbHsFsGetMemoryUsage(UsbHsFsMemoryUsage *out_usage)
+{
+    return usbHsFsBudgetGetUsage(out_usage);
+}
+
+bool usbHsFsAddDeviceQuirks(u16 vid, u16 pid, u32 quirks, u32 max_block_count)
+{
+    if (!vid)
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return false;
+    }
+
+    bool ret = false;
+    SCOPED_LOCK(&g_managerMutex) ret = usbHsFsQuirksAddEntry(vid, pid, quirks, max_block_count);
+    return ret;
+}
+
+bool usbHsFsPreallocateFile(int fd, u64 size)
+{
+    struct _reent *r = _REENT;
+    __handle *handle = NULL;
+    const devoptab_t *devoptab = NULL;
+    int ret = -1;
+
+    /* Get devoptab file handle. */
+    handle = __get_handle(fd);
+    if (!handle || !handle->fileStruct || handle->device < 0 || !(devoptab = devoptab_list[handle->device]))
+    {
+        r->_errno = EBADF;
+        return false;
+    }
+
+#ifdef GPL_BUILD
+    if (devoptab->open_r == extdev_get_devoptab()->open_r)
+    {
+        /* Replicate what newlib does before calling devoptab functions. */
+        r->deviceData = devoptab->deviceData;
+        ret = extdev_preallocate(r, handle->fileStruct, size);
+    } else
+#endif
+    {
+#ifndef GPL_BUILD
+        NX_IGNORE_ARG(devoptab);
+        NX_IGNORE_ARG(size);
+#endif
+        r->_errno = ENOTSUP;
+    }
+
+    return (ret == 0);
+}
+
+void usbHsFsSetFileSizeHint(u64 size)
+{
+    __usbhsfs_file_size_hint = size;
+}
+
+ssize_t usbHsFsReadFileAt(int fd, void *buf, size_t size, u64 offset)
+{
+    UsbHsFsIoVector iov = { .data = buf, .size = size };
+    return usbHsFsPositionalFileIo(fd, &iov, 1, offset, false);
+}
+
+ssize_t usbHsFsWriteFileAt(int fd, const void *buf, size_t size, u64 offset)
+{
+    UsbHsFsIoVector iov = { .data = (void*)buf, .size = size };
+    return usbHsFsPositionalFileIo(fd, &iov, 1, offset, true);
+}
+
+ssize_t usbHsFsReadFileVectored(int fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset)
+{
+    return usbHsFsPositionalFileIo(fd, iov, iov_count, offset, false);
+}
+
+ssize_t usbHsFsWriteFileVectored(int fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset)
+{
+    return usbHsFsPositionalFileIo(fd, iov, iov_count, offset, true);
+}
+
+bool usbHsFsCopyFile(const char *src_path, const char *dst_path)
+{
+    UsbHsFsCopyFileContext ctx = {0};
+    Thread reader_thread = {0};
+    struct stat st = {0};
+    int dst_fd = -1, err = 0;
+    s32 thread_prio = 0x2C;
+    u64 copied = 0;
+    bool thread_started = false, success = false;
+    Result rc = 0;
+
+    if (!src_path || !*src_path || !dst_path || !*dst_path)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    ctx.fd = -1;
+    ctx.priority = g_threadIoPriority;
+
+    /* Get source file size. */
+    if (stat(src_path, &st) < 0) goto end;
+
+    if (S_ISDIR(st.st_mode))
+    {
+        errno = EISDIR;
+        goto end;
+    }
+
+    /* Don't truncate the source file by opening it as the destination. Bail out if we can't tell. */
+    if (usbHsFsIsSameFile(src_path, &st, dst_path))
+    {
+        errno = EINVAL;
+        goto end;
+    }
+
+    /* Open source file. */
+    ctx.fd = open(src_path, O_RDONLY);
+    if (ctx.fd < 0) goto end;
+
+    /* Open destination file. EXT filesystems will preallocate data blocks using the provided file size hint. */
+    /* Make sure the hint is always cleared afterwards, since it isn't consumed if the destination file isn't located on a UMS filesystem. */
+    usbHsFsSetFileSizeHint((u64)st.st_size);
+    dst_fd = open(dst_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    usbHsFsSetFileSizeHint(0);
+    if (dst_fd < 0) goto end;
+
+    /* Expand the whole cluster chain in a single pass under FatFs. Failures aren't fatal. */
+    if (st.st_size > 0 && usbHsFsIsFatFsFileDescriptor(dst_fd) && ftruncate(dst_fd, st.st_size) < 0) USBHSFS_LOG_MSG("Failed to preallocate destination file! (%d).", errno);
+
+    /* Allocate transfer buffers. */
+    for(u32 i = 0; i < COPY_FILE_BUF_COUNT; i++)
+    {
+        ctx.buf[i] = usbHsFsRequestAllocateXferBuffer(USB_XFER_BUF_SIZE);
+        if (!ctx.buf[i])
+        {
+            errno = ENOMEM;
+            goto end;
+        }
+    }
+
+    /* Initialize semaphores. All transfer buffers are initially available to the reader thread. */
+    semaphoreInit(&(ctx.free_sem), COPY_FILE_BUF_COUNT);
+    semaphoreInit(&(ctx.full_sem), 0);
+
+    /* Create and start reader thread using the same priority as the calling thread. */
+    svcGetThreadPriority(&thread_prio, CUR_THREAD_HANDLE);
+
+    rc = threadCreate(&reader_thread, usbHsFsCopyFileReaderThreadFunc, &ctx, NULL, COPY_FILE_READER_STACK_SIZE, thread_prio, -2);
+    if (R_SUCCEEDED(rc))
+    {
+        rc = threadStart(&reader_thread);
+        if (R_FAILED(rc)) threadClose(&reader_thread);
+    }
+
+    if (R_FAILED(rc))
+    {
+        USBHSFS_LOG_MSG("Failed to start reader thread! (0x%X).", rc);
+        errno = EAGAIN;
+        goto end;
+    }
+
+    thread_started = true;
+
+    /* Write data as soon as it's read by the reader thread. */
+    for(u32 i = 0; ; i = ((i + 1) % COPY_FILE_BUF_COUNT))
+    {
+        semaphoreWait(&(ctx.full_sem));
+
+        /* Check if EOF was reached or if a read error occurred. */
+        if (ctx.size[i] <= 0)
+        {
+            if (ctx.size[i] < 0) errno = ctx.read_errno;
+            success = (ctx.size[i] == 0);
+            break;
+        }
+
+        /* Write data. */
+        if (!usbHsFsWriteFileFully(dst_fd, ctx.buf[i], (size_t)ctx.size[i])) ctx.abort = true;
+
+        /* Hand the transfer buffer back to the reader thread. It'll bail out if we're aborting. */
+        semaphoreSignal(&(ctx.free_sem));
+        if (ctx.abort) break;
+
+        copied += (u64)ctx.size[i];
+    }
+
+    /* Get rid of preallocated space if the source file shrank while it was being copied. */
+    if (success && copied != (u64)st.st_size && ftruncate(dst_fd, (off_t)copied) < 0) success = false;
+
+end:
+    if (!success) err = errno;
+
+    if (thread_started)
+    {
+        threadWaitForExit(&reader_thread);
+        threadClose(&reader_thread);
+    }
+
+    for(u32 i = 0; i < COPY_FILE_BUF_COUNT; i++)
+    {
+        if (ctx.buf[i]) free(ctx.buf[i]);
+    }
+
+    if (ctx.fd >= 0) close(ctx.fd);
+
+    if (dst_fd >= 0)
+    {
+        if (close(dst_fd) < 0 && success)
+        {
+            err = errno;
+            success = false;
+        }
+
+        /* Remove destination file if something went wrong. */
+        if (!success) unlink(dst_path);
+    }
+
+    if (!success) errno = err;
+
+    return success;
+}
+
+bool usbHsFsCreateSparseVolumeImage(const UsbHsFsDevice *device, const char *dst_path)
+{
+    UsbHsFsSparseImageContext ctx = {0};
+    UsbHsFsImageVolumeMap map = {0};
+    UsbHsFsSparseImageHeader header = {0};
+    UsbHsFsDriveLogicalUnitContext *lun_ctx = NULL;
+    UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx = NULL;
+    Thread reader_thread = {0};
+    int dst_fd = -1, err = 0;
+    s32 thread_prio = 0x2C;
+    u64 extent_table_size = 0, written = 0;
+    bool map_ready = false, thread_started = false, success = false;
+    Result rc = 0;
+
+    if (!device || !dst_path || !*dst_path)
+    {
+        errno = EINVAL;
+        return false;
+    }
+
+    SCOPED_LOCK(&g_managerMutex)
+    {
+        if (!g_usbHsFsInitialized || g_isSXOS || !g_driveCount || !g_driveContexts) break;
+
+        /* Locate the drive context this device belongs to. */
+        for(u32 i = 0; i < g_driveCount; i++)
+        {
+            UsbHsFsDriveContext *drive_ctx = g_driveContexts[i];
+            if (!drive_ctx || drive_ctx->usb_if_id != device->usb_if_id) continue;
+
+            ctx.drive_ctx = drive_ctx;
+            ctx.generation = drive_ctx->generation;
+            break;
+        }
+    }
+
+    if (!ctx.drive_ctx)
+    {
+        errno = (g_isSXOS ? ENOTSUP : ENODEV);
+        return false;
+    }
+
+    ctx.lun = device->lun;
+    ctx.priority = g_threadIoPriority;
+    ctx.map = &map;
+
+    /* Lock drive context. */
+    if (!usbHsFsManagerIsDriveContextPointerValid(ctx.drive_ctx))
+    {
+        errno = ENODEV;
+        return false;
+    }
+
+    /* Locate the filesystem context for this device. */
+    lun_ctx = usbHsFsGetLogicalUnitContext(ctx.drive_ctx, ctx.generation, ctx.lun);
+    for(u32 i = 0; lun_ctx && i < lun_ctx->fs_count; i++)
+    {
+        if (lun_ctx->fs_ctx[i] && lun_ctx->fs_ctx[i]->fs_idx == device->fs_idx)
+        {
+            fs_ctx = lun_ctx->fs_ctx[i];
+            break;
+        }
+    }
+
+    if (fs_ctx)
+    {
+        /* Commit pending metadata, then build the volume map. */
+        usbHsFsMountCommitLogicalUnitFileSystemContexts(lun_ctx, true);
+        map_ready = usbHsFsImageGetVolumeMap(fs_ctx, &map);
+        if (!map_ready) errno = EIO;
+    } else {
+        errno = ENODEV;
+    }
+
+    usbHsFsManagerUnlockDriveContext(ctx.drive_ctx);
+
+    if (!map_ready) return false;
+
+    /* Fill header. */
+    extent_table_size = ((u64)map.extent_count * sizeof(UsbHsFsSparseImageExtent));
+
+    header.magic = LIBUSBHSFS_SPARSE_IMAGE_MAGIC;
+    header.version = LIBUSBHSFS_SPARSE_IMAGE_VERSION;
+    header.block_length = map.block_length;
+    header.extent_count = map.extent_count;
+    header.volume_size = map.size;
+    header.data_size = map.data_size;
+    header.fs_type = device->fs_type;
+
+    /* Open destination file. EXT filesystems will preallocate data blocks using the provided file size hint. */
+    usbHsFsSetFileSizeHint(sizeof(UsbHsFsSparseImageHeader) + extent_table_size + map.data_size);
+    dst_fd = open(dst_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    usbHsFsSetFileSizeHint(0);
+    if (dst_fd < 0) goto end;
+
+    /* Expand the whole cluster chain in a single pass under FatFs. Failures aren't fatal. */
+    if (usbHsFsIsFatFsFileDescriptor(dst_fd) && ftruncate(dst_fd, (off_t)(sizeof(UsbHsFsSparseImageHeader) + extent_table_size + map.data_size)) < 0) USBHSFS_LOG_MSG("Failed to preallocate image file! (%d).", errno);
+
+    /* Write header and extent table. */
+    if (!usbHsFsWriteFileFully(dst_fd, &header, sizeof(UsbHsFsSparseImageHeader)) || !usbHsFsWriteFileFully(dst_fd, map.extents, (size_t)extent_table_size)) goto end;
+
+    /* Allocate transfer buffers. */
+    for(u32 i = 0; i < SPARSE_IMAGE_BUF_COUNT; i++)
+    {
+        ctx.buf[i] = usbHsFsRequestAllocateXferBuffer(USB_XFER_BUF_SIZE);
+        if (!ctx.buf[i])
+        {
+            errno = ENOMEM;
+            goto end;
+        }
+    }
+
+    /* Initialize semaphores. All transfer buffers are initially available to the reader thread. */
+    semaphoreInit(&(ctx.free_sem), SPARSE_IMAGE_BUF_COUNT);
+    semaphoreInit(&(ctx.full_sem), 0);
+
+    /* Create and start reader thread using the same priority as the calling thread. */
+    svcGetThreadPriority(&thread_prio, CUR_THREAD_HANDLE);
+
+    rc = threadCreate(&reader_thread, usbHsFsSparseImageReaderThreadFunc, &ctx, NULL, SPARSE_IMAGE_READER_STACK_SIZE, thread_prio, -2);
+    if (R_SUCCEEDED(rc))
+    {
+        rc = threadStart(&reader_thread);
+        if (R_FAILED(rc)) threadClose(&reader_thread);
+    }
+
+    if (R_FAILED(rc))
+    {
+        USBHSFS_LOG_MSG("Failed to start reader thread! (0x%X).", rc);
+        errno = EAGAIN;
+        goto end;
+    }
+
+    thread_started = true;
+
+    /* Write extent data as soon as it's read by the reader thread. */
+    for(u32 i = 0; ; i = ((i + 1) % SPARSE_IMAGE_BUF_COUNT))
+    {
+        semaphoreWait(&(ctx.full_sem));
+
+        /* Check if all extents were read or if a read error occurred. */
+        if (ctx.size[i] <= 0)
+        {
+            success = (ctx.size[i] == 0 && written == map.data_size);
+            if (!success) errno = EIO;
+            break;
+        }
+
+        /* Write data. */
+        if (!usbHsFsWriteFileFully(dst_fd, ctx.buf[i], (size_t)ctx.size[i])) ctx.abort = true;
+
+        /* Hand the transfer buffer back to the reader thread. It'll bail out if we're aborting. */
+        semaphoreSignal(&(ctx.free_sem));
+        if (ctx.abort) break;
+
+        written += (u64)ctx.size[i];
+    }
+
+end:
+    if (!success) err = errno;
+
+    if (thread_started)
+    {
+        threadWaitForExit(&reader_thread);
+        threadClose(&reader_thread);
+    }
+
+    for(u32 i = 0; i < SPARSE_IMAGE_BUF_COUNT; i++)
+    {
+        if (ctx.buf[i]) free(ctx.buf[i]);
+    }
+
+    if (dst_fd >= 0)
+    {
+        if (close(dst_fd) < 0 && success)
+        {
+            err = errno;
+            success = false;
+        }
+
+        /* Remove image file if something went wrong. */
+        if (!success) unlink(dst_path);
+    }
+
+    usbHsFsImageFreeVolumeMap(&map);
+
+    if (!success) errno = err;
+
+    return success;
+}
+
+UsbHsFsIoPriority usbHsFsGetThreadIoPriority(void)
+{
+    return (UsbHsFsIoPriority)g_threadIoPriority;
+}
+
+void usbHsFsSetThreadIoPriority(UsbHsFsIoPriority priority)
+{
+    if (priority < UsbHsFsIoPriority_Count) g_threadIoPriority = (u8)priority;
+}
+
+UsbHsFsRawLogicalUnit *usbHsFsRawOpenLogicalUnit(const UsbHsFsDevice *device)
+{
+    UsbHsFsRawLogicalUnit *raw_lun = NULL;
+    s32 thread_prio = 0x2C;
+    bool found = false, success = false;
+    Result rc = 0;
+
+    if (!device)
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return NULL;
+    }
+
+    /* Allocate memory for the raw block I/O handle. */
+    raw_lun = calloc(1, sizeof(UsbHsFsRawLogicalUnit));
+    if (!raw_lun)
+    {
+        USBHSFS_LOG_MSG("Failed to allocate memory for raw block I/O handle!");
+        return NULL;
+    }
+
+    SCOPED_LOCK(&g_managerMutex)
+    {
+        if (!g_usbHsFsInitialized || g_isSXOS || !g_driveCount || !g_driveContexts) break;
+
+        /* Locate the LUN context this device belongs to. */
+        for(u32 i = 0; i < g_driveCount && !found; i++)
+        {
+            UsbHsFsDriveContext *drive_ctx = g_driveContexts[i];
+            if (!drive_ctx || drive_ctx->usb_if_id != device->usb_if_id) continue;
+
+            for(u8 j = 0; j < drive_ctx->lun_count; j++)
+            {
+                UsbHsFsDriveLogicalUnitContext *lun_ctx = drive_ctx->lun_ctx[j];
+                if (!lun_ctx || lun_ctx->lun != device->lun) continue;
+
+                raw_lun->drive_ctx = drive_ctx;
+                raw_lun->usb_if_id = drive_ctx->usb_if_id;
+                raw_lun->generation = drive_ctx->generation;
+                raw_lun->lun = lun_ctx->lun;
+                raw_lun->block_length = lun_ctx->block_length;
+                raw_lun->block_count = lun_ctx->block_count;
+
+                found = true;
+                break;
+            }
+        }
+    }
+
+    if (!found)
+    {
+        USBHSFS_LOG_MSG("Unable to find a matching LUN context! (interface %d, LUN %u).", device->usb_if_id, device->lun);
+        goto end;
+    }
+
+    raw_lun->priority = g_threadIoPriority;
+    mutexInit(&(raw_lun->mutex));
+    condvarInit(&(raw_lun->queue_cond));
+    condvarInit(&(raw_lun->idle_cond));
+
+    /* Create and start worker thread using the same priority as the calling thread. */
+    svcGetThreadPriority(&thread_prio, CUR_THREAD_HANDLE);
+
+    rc = threadCreate(&(raw_lun->thread), usbHsFsRawLogicalUnitWorkerThreadFunc, raw_lun, NULL, RAW_LUN_WORKER_STACK_SIZE, thread_prio, -2);
+    if (R_SUCCEEDED(rc))
+    {
+        rc = threadStart(&(raw_lun->thread));
+        if (R_FAILED(rc)) threadClose(&(raw_lun->thread));
+    }
+
+    if (R_FAILED(rc))
+    {
+        USBHSFS_LOG_MSG("Failed to start raw block I/O worker thread! (0x%X).", rc);
+        goto end;
+    }
+
+    USBHSFS_LOG_MSG("Opened raw block I/O handle %p (interface %d, LUN %u).", raw_lun, raw_lun->usb_if_id, raw_lun->lun);
+
+    success = true;
+
+end:
+    if (!success)
+    {
+        free(raw_lun);
+        raw_lun = NULL;
+    }
+
+    return raw_lun;
+}
+
+void usbHsFsRawCloseLogicalUnit(UsbHsFsRawLogicalUnit *raw_lun)
+{
+    if (!raw_lun) return;
+
+    SCOPED_LOCK(&(raw_lun->mutex))
+    {
+        /* Cancel all queued requests. */
+        for(; raw_lun->queue_count > 0; raw_lun->queue_count--)
+        {
+            usbHsFsRawCompleteRequest(raw_lun->queue[raw_lun->queue_head], UsbHsFsRawRequestStatus_Cancelled);
+            raw_lun->queue_head = ((raw_lun->queue_head + 1) % RAW_LUN_QUEUE_DEPTH);
+        }
+
+        /* Tell the worker thread to exit as soon as it's done with the requests it's currently processing. */
+        raw_lun->exit = true;
+        condvarWakeAll(&(raw_lun->queue_cond));
+        condvarWakeAll(&(raw_lun->idle_cond));
+    }
+
+    /* Wait for the worker thread to exit. */
+    threadWaitForExit(&(raw_lun->thread));
+    threadClose(&(raw_lun->thread));
+
+    USBHSFS_LOG_MSG("Closed raw block I/O handle %p (interface %d, LUN %u).", raw_lun, raw_lun->usb_if_id, raw_lun->lun);
+
+    free(raw_lun);
+}
+
+void usbHsFsRawGetLogicalUnitGeometry(UsbHsFsRawLogicalUnit *raw_lun, u32 *out_block_length, u64 *out_block_count)
+{
+    if (!raw_lun) return;
+    if (out_block_length) *out_block_length = raw_lun->block_length;
+    if (out_block_count) *out_block_count = raw_lun->block_count;
+}
+
+bool usbHsFsRawSubmitRequest(UsbHsFsRawLogicalUnit *raw_lun, UsbHsFsRawRequest *request)
+{
+    bool ret = false;
+
+    if (!raw_lun || !request || request->type > UsbHsFsRawRequestType_Write || !request->block_count || !request->buf || request->block_addr >= raw_lun->block_count || \
+        request->block_count > (raw_lun->block_count - request->block_addr))
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return false;
+    }
+
+    SCOPED_LOCK(&(raw_lun->mutex))
+    {
+        /* Bail out if the request queue is full. */
+        if (raw_lun->exit || raw_lun->queue_count >= RAW_LUN_QUEUE_DEPTH) break;
+
+        /* Queue request and wake up the worker thread. */
+        __atomic_store_n(&(request->status), UsbHsFsRawRequestStatus_Pending, __ATOMIC_RELEASE);
+        raw_lun->queue[(raw_lun->queue_head + raw_lun->queue_count) % RAW_LUN_QUEUE_DEPTH] = request;
+        raw_lun->queue_count++;
+        condvarWakeOne(&(raw_lun->queue_cond));
+
+        ret = true;
+    }
+
+    return ret;
+}
+
+UsbHsFsRawRequestStatus usbHsFsRawGetRequestStatus(const UsbHsFsRawRequest *request)
+{
+    return (request ? (UsbHsFsRawRequestStatus)__atomic_load_n(&(request->status), __ATOMIC_ACQUIRE) : UsbHsFsRawRequestStatus_Failed);
+}
+
+void usbHsFsRawWaitIdle(UsbHsFsRawLogicalUnit *raw_lun)
+{
+    if (!raw_lun) return;
+
+    SCOPED_LOCK(&(raw_lun->mutex))
+    {
+        while(!raw_lun->exit && (raw_lun->queue_count || raw_lun->busy_count)) condvarWait(&(raw_lun->idle_cond), &(raw_lun->mutex));
+    }
 }
 
 /* Non-static function not meant to be disclosed to users. */
 bool usbHsFsManagerIsDriveContextPointerValid(UsbHsFsDriveContext *drive_ctx)
 {
-    bool ret = false;
+    u8 priority = g_threadIoPriority;
+    u64 wait_start = armGetSystemTick();
+    u32 generation = 0;
+    bool ret = false, waiting = false;
 
     SCOPED_LOCK(&g_managerMutex)
     {
-        /* Try to find a drive context in our pointer array that matches the provided drive context. */
-        for(u32 i = 0; i < g_driveCount; i++)
+        while(true)
         {
-            UsbHsFsDriveContext *cur_drive_ctx = g_driveContexts[i];
-            if (!cur_drive_ctx) continue;
+            ret = false;
 
-            if (cur_drive_ctx == drive_ctx)
+            /* Try to find a drive context in our pointer array that matches the provided drive context. */
+            /* This must be done on every iteration: the drive context may have been destroyed while we were waiting. */
+            for(u32 i = 0; i < g_driveCount; i++)
             {
-                ret = true;
-                break;
+                UsbHsFsDriveContext *cur_drive_ctx = g_driveContexts[i];
+                if (!cur_drive_ctx) continue;
+
+                if (cur_drive_ctx == drive_ctx)
+                {
+                    ret = true;
+                    break;
+                }
             }
-        }
 
-        /* Lock drive context mutex if we found a match. */
-        if (ret) mutexLock(&(drive_ctx->mutex));
+            if (!ret) break;
+
+            if (waiting)
+            {
+                /* A new drive context may have been allocated at the same address after the one we were waiting for got destroyed. */
+                /* Its waiter counts don't include us, so we must bail out right away. */
+                if (drive_ctx->generation != generation)
+                {
+                    ret = false;
+                    break;
+                }
+
+                drive_ctx->io_waiters[priority]--;
+                waiting = false;
+            }
+
+            /* Bulk I/O threads yield to interactive I/O threads waiting for the same drive, unless their deadline has already expired. */
+            bool yield = (priority == UsbHsFsIoPriority_Bulk && drive_ctx->io_waiters[UsbHsFsIoPriority_Interactive] > 0 && \
+                          armTicksToNs(armGetSystemTick() - wait_start) < IO_SCHED_BULK_DEADLINE_NS);
+
+            /* Lock drive context mutex if it's available. */
+            if (!yield && mutexTryLock(&(drive_ctx->mutex))) break;
+
+            /* Wait for the drive context mutex to be released. The drive manager mutex is released in the meantime, so other drives remain accessible. */
+            drive_ctx->io_waiters[priority]++;
+            generation = drive_ctx->generation;
+            waiting = true;
+            condvarWaitTimeout(&g_driveIoCondVar, &g_managerMutex, IO_SCHED_WAIT_TIMEOUT_NS);
+        }
     }
 
     return ret;
 }
 
+/* Non-static function not meant to be disclosed to users. */
+void usbHsFsManagerUnlockDriveContext(UsbHsFsDriveContext *drive_ctx)
+{
+    mutexUnlock(&(drive_ctx->mutex));
+
+    /* Wake up threads waiting for a drive context. */
+    condvarWakeAll(&g_driveIoCondVar);
+}
+
 /* Non-static function not meant to be disclosed to users. */
 UsbHsFsDriveLogicalUnitContext *usbHsFsManagerGetLogicalUnitContextForFatFsDriveNumber(u8 pdrv)
 {
@@ -452,6 +1355,13 @@ UsbHsFsDriveLogicalUnitContext *usbHsFsManagerGetLogicalUnitContextForFatFsDrive
             {
                 UsbHsFsDriveLogicalUnitContext *lun_ctx = drive_ctx->lun_ctx[j];
 
+                /* LUNs being formatted have no filesystem contexts. Check the FatFs drive number reserved for the format operation. */
+                if (lun_ctx->formatting && lun_ctx->format_pdrv == pdrv)
+                {
+                    ret = lun_ctx;
+                    goto end;
+                }
+
                 for(u32 k = 0; k < lun_ctx->fs_count; k++)
                 {
                     UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx = lun_ctx->fs_ctx[k];
@@ -545,6 +1455,412 @@ end:
     return rc;
 }
 
+static ssize_t usbHsFsPositionalFileIo(int fd, const UsbHsFsIoVector *iov, u32 iov_count, u64 offset, bool write)
+{
+    struct _reent *r = _REENT;
+    __handle *handle = NULL;
+    const devoptab_t *devoptab = NULL;
+    ssize_t ret = -1;
+
+    /* Get devoptab file handle. */
+    handle = __get_handle(fd);
+    if (!handle || !handle->fileStruct || handle->device < 0 || !(devoptab = devoptab_list[handle->device]))
+    {
+        r->_errno = EBADF;
+        return -1;
+    }
+
+    /* Sanity check. */
+    if (!iov && iov_count)
+    {
+        r->_errno = EINVAL;
+        return -1;
+    }
+
+    /* Nothing to do. */
+    if (!iov_count) return 0;
+
+    /* Replicate what newlib does before calling devoptab functions. */
+    r->deviceData = devoptab->deviceData;
+
+    /* Call the positional I/O function from the right devoptab interface. */
+    if (devoptab->open_r == ffdev_get_devoptab()->open_r)
+    {
+        ret = (write ? ffdev_pwritev(r, handle->fileStruct, iov, iov_count, offset) : ffdev_preadv(r, handle->fileStruct, iov, iov_count, offset));
+    } else
+#ifdef GPL_BUILD
+    if (devoptab->open_r == ntfsdev_get_devoptab()->open_r)
+    {
+        ret = (write ? ntfsdev_pwritev(r, handle->fileStruct, iov, iov_count, offset) : ntfsdev_preadv(r, handle->fileStruct, iov, iov_count, offset));
+    } else
+    if (devoptab->open_r == extdev_get_devoptab()->open_r)
+    {
+        ret = (write ? extdev_pwritev(r, handle->fileStruct, iov, iov_count, offset) : extdev_preadv(r, handle->fileStruct, iov, iov_count, offset));
+    } else
+#endif
+    {
+        /* SX OS devoptab interface. */
+        r->_errno = ENOTSUP;
+    }
+
+    return ret;
+}
+
+static bool usbHsFsIsFatFsFileDescriptor(int fd)
+{
+    __handle *handle = __get_handle(fd);
+    const devoptab_t *devoptab = ((handle && handle->device >= 0) ? devoptab_list[handle->device] : NULL);
+    return (devoptab && devoptab->open_r == ffdev_get_devoptab()->open_r);
+}
+
+static bool usbHsFsIsSameFile(const char *src_path, const struct stat *src_st, const char *dst_path)
+{
+    struct stat dst_st = {0};
+    int device = FindDevice(src_path);
+    const devoptab_t *devoptab = NULL;
+    UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx = NULL;
+    UsbHsFsDriveLogicalUnitContext *lun_ctx = NULL;
+    UsbHsFsDriveContext *drive_ctx = NULL;
+    char *src_fixed = NULL, *dst_fixed = NULL, *tmp = NULL;
+    bool ret = true;
+
+    /* Files located on different devoptab devices can't be the same. */
+    if (device < 0 || device != FindDevice(dst_path) || !(devoptab = devoptab_list[device])) return false;
+
+    /* Compare inode numbers if they're provided by the filesystem (e.g. NTFS and EXT). */
+    if (src_st->st_ino) return (stat(dst_path, &dst_st) == 0 && dst_st.st_dev == src_st->st_dev && dst_st.st_ino == src_st->st_ino);
+
+    /* Compare normalized paths instead. We'll assume both paths point to the same file if we can't normalize them. */
+    /* Filenames are compared in a case-insensitive manner, since that's what FAT filesystems (e.g. sdmc:) do. */
+    src_fixed = calloc(3, MAX_PATH_LENGTH);
+    if (!src_fixed) return true;
+
+    dst_fixed = (src_fixed + MAX_PATH_LENGTH);
+    tmp = (dst_fixed + MAX_PATH_LENGTH);
+
+    if (devoptab->open_r == ffdev_get_devoptab()->open_r && (fs_ctx = (UsbHsFsDriveLogicalUnitFileSystemContext*)devoptab->deviceData))
+    {
+        /* Lock the drive context, since the current working directory from the FatFs volume may be changed at any time. */
+        lun_ctx = (UsbHsFsDriveLogicalUnitContext*)fs_ctx->lun_ctx;
+        drive_ctx = (UsbHsFsDriveContext*)lun_ctx->drive_ctx;
+        if (usbHsFsManagerIsDriveContextPointerValid(drive_ctx))
+        {
+            if (!usbHsFsMountNormalizePath(fs_ctx, src_path, src_fixed) && !usbHsFsMountNormalizePath(fs_ctx, dst_path, dst_fixed)) ret = !strcasecmp(src_fixed, dst_fixed);
+            usbHsFsManagerUnlockDriveContext(drive_ctx);
+        }
+    } else {
+        /* Other devoptab devices (e.g. sdmc:). Resolve both paths using the current working directory. */
+        if (usbHsFsGetAbsolutePath(src_path, src_fixed, tmp) && usbHsFsGetAbsolutePath(dst_path, dst_fixed, tmp)) ret = !strcasecmp(src_fixed, dst_fixed);
+    }
+
+    free(src_fixed);
+
+    return ret;
+}
+
+static bool usbHsFsGetAbsolutePath(const char *path, char *outpath, char *cwd)
+{
+    const char *colon = strchr(path, ':');
+    size_t root = 0, pos = 0;
+
+    if (colon)
+    {
+        /* Copy mount name, including the colon. Relative paths with a mount name can't be resolved, since we don't know the working directory for that device. */
+        root = pos = (size_t)(colon - path + 1);
+        if (root >= MAX_PATH_LENGTH || colon[1] != '/') return false;
+
+        memcpy(outpath, path, root);
+        return usbHsFsAppendPathSegments(outpath, root, &pos, colon + 1);
+    }
+
+    /* Paths without a mount name are relative to the current working directory from the default devoptab device, which always holds a mount name. */
+    if (!getcwd(cwd, MAX_PATH_LENGTH) || !(colon = strchr(cwd, ':'))) return false;
+
+    root = pos = (size_t)(colon - cwd + 1);
+    memcpy(outpath, cwd, root);
+
+    if (*path != '/' && !usbHsFsAppendPathSegments(outpath, root, &pos, colon + 1)) return false;
+
+    return usbHsFsAppendPathSegments(outpath, root, &pos, path);
+}
+
+static bool usbHsFsAppendPathSegments(char *outpath, size_t root, size_t *pos, const char *path)
+{
+    while(*path)
+    {
+        size_t len = strcspn(path, "/");
+        const char *end = (path + len);
+
+        if (len == 2 && path[0] == '.' && path[1] == '.')
+        {
+            /* Parent directory dot entry alias. Remove the previous segment, unless we're already at the root directory. */
+            while(*pos > root && outpath[--(*pos)] != '/') continue;
+        } else
+        if (len && (len != 1 || path[0] != '.'))
+        {
+            /* New entry in the directory tree. Current directory dot entry aliases and empty segments are skipped. */
+            if ((*pos + len + 1) >= MAX_PATH_LENGTH) return false;
+
+            outpath[(*pos)++] = '/';
+            memcpy(outpath + *pos, path, len);
+            *pos += len;
+        }
+
+        path = (*end ? (end + 1) : end);
+    }
+
+    outpath[*pos] = '\0';
+
+    return true;
+}
+
+static bool usbHsFsWriteFileFully(int fd, const void *buf, size_t size)
+{
+    for(size_t offset = 0; offset < size;)
+    {
+        ssize_t wr = write(fd, (const u8*)buf + offset, size - offset);
+        if (wr <= 0)
+        {
+            if (!wr) errno = ENOSPC;
+            return false;
+        }
+
+        offset += (size_t)wr;
+    }
+
+    return true;
+}
+
+static void usbHsFsCopyFileReaderThreadFunc(void *arg)
+{
+    UsbHsFsCopyFileContext *ctx = (UsbHsFsCopyFileContext*)arg;
+
+    /* Use the same I/O priority class as the thread that called usbHsFsCopyFile(). */
+    g_threadIoPriority = ctx->priority;
+
+    for(u32 i = 0; ; i = ((i + 1) % COPY_FILE_BUF_COUNT))
+    {
+        /* Wait until this transfer buffer is available. */
+        semaphoreWait(&(ctx->free_sem));
+        if (ctx->abort) break;
+
+        /* Read data. */
+        ctx->size[i] = read(ctx->fd, ctx->buf[i], USB_XFER_BUF_SIZE);
+        if (ctx->size[i] < 0) ctx->read_errno = errno;
+
+        /* Hand the transfer buffer over to the writer. */
+        semaphoreSignal(&(ctx->full_sem));
+
+        /* Stop if EOF was reached or if a read error occurred. */
+        if (ctx->size[i] <= 0) break;
+    }
+}
+
+static void usbHsFsSparseImageReaderThreadFunc(void *arg)
+{
+    UsbHsFsSparseImageContext *ctx = (UsbHsFsSparseImageContext*)arg;
+    const UsbHsFsImageVolumeMap *map = ctx->map;
+    UsbHsFsScsiBlockIoSegment segments[SPARSE_IMAGE_MAX_SEGMENTS] = {0};
+    u32 extent_idx = 0;
+    u64 extent_pos = 0;
+
+    /* Use the same I/O priority class as the thread that called usbHsFsCreateSparseVolumeImage(). */
+    g_threadIoPriority = ctx->priority;
+
+    for(u32 i = 0; ; i = ((i + 1) % SPARSE_IMAGE_BUF_COUNT))
+    {
+        u32 segment_count = 0;
+        u64 buf_size = 0;
+        bool read_ok = false;
+
+        /* Wait until this transfer buffer is available. */
+        semaphoreWait(&(ctx->free_sem));
+        if (ctx->abort) break;
+
+        /* Pack as many extents as possible into this transfer buffer. Big extents are split across multiple transfer buffers. */
+        while(extent_idx < map->extent_count && segment_count < SPARSE_IMAGE_MAX_SEGMENTS && buf_size < USB_XFER_BUF_SIZE)
+        {
+            const UsbHsFsSparseImageExtent *extent = &(map->extents[extent_idx]);
+            u64 size = (extent->size - extent_pos);
+            if (size > (USB_XFER_BUF_SIZE - buf_size)) size = (USB_XFER_BUF_SIZE - buf_size);
+
+            segments[segment_count++] = (UsbHsFsScsiBlockIoSegment){ .block_addr = (map->block_addr + ((extent->offset + extent_pos) / map->block_length)), \
+                                                                     .block_count = (u32)(size / map->block_length), .buf = (ctx->buf[i] + buf_size) };
+
+            buf_size += size;
+            extent_pos += size;
+
+            if (extent_pos >= extent->size)
+            {
+                extent_idx++;
+                extent_pos = 0;
+            }
+        }
+
+        ctx->size[i] = (ssize_t)buf_size;
+
+        /* Read data. The drive context is only locked while the SCSI commands are being issued. */
+        if (segment_count)
+        {
+            if (usbHsFsManagerIsDriveContextPointerValid(ctx->drive_ctx))
+            {
+                UsbHsFsDriveLogicalUnitContext *lun_ctx = usbHsFsGetLogicalUnitContext(ctx->drive_ctx, ctx->generation, ctx->lun);
+                read_ok = (lun_ctx && usbHsFsScsiReadLogicalUnitBlocksV(lun_ctx, segments, segment_count));
+                usbHsFsManagerUnlockDriveContext(ctx->drive_ctx);
+            }
+
+            if (!read_ok) ctx->size[i] = -1;
+        }
+
+        /* Hand the transfer buffer over to the writer. */
+        semaphoreSignal(&(ctx->full_sem));
+
+        /* Stop if all extents were read or if a read error occurred. */
+        if (ctx->size[i] <= 0) break;
+    }
+}
+
+static UsbHsFsDriveLogicalUnitContext *usbHsFsGetLogicalUnitContext(UsbHsFsDriveContext *drive_ctx, u32 generation, u8 lun)
+{
+    /* Make sure the drive context pointer wasn't reused by another drive context. */
+    if (drive_ctx->generation != generation) return NULL;
+
+    for(u8 i = 0; i < drive_ctx->lun_count; i++)
+    {
+        UsbHsFsDriveLogicalUnitContext *lun_ctx = drive_ctx->lun_ctx[i];
+        if (lun_ctx && lun_ctx->lun == lun) return lun_ctx;
+    }
+
+    return NULL;
+}
+
+static void usbHsFsRawLogicalUnitWorkerThreadFunc(void *arg)
+{
+    UsbHsFsRawLogicalUnit *raw_lun = (UsbHsFsRawLogicalUnit*)arg;
+    UsbHsFsRawRequest *batch[RAW_LUN_MAX_BATCH_SIZE] = {0};
+    UsbHsFsScsiBlockIoSegment segments[RAW_LUN_MAX_BATCH_SIZE] = {0};
+
+    /* Use the same I/O priority class as the thread that opened the raw block I/O handle. */
+    g_threadIoPriority = raw_lun->priority;
+
+    while(true)
+    {
+        u32 batch_count = 0;
+        u8 status = UsbHsFsRawRequestStatus_Failed;
+
+        SCOPED_LOCK(&(raw_lun->mutex))
+        {
+            /* Wait until a request is queued. */
+            while(!raw_lun->queue_count && !raw_lun->exit) condvarWait(&(raw_lun->queue_cond), &(raw_lun->mutex));
+            if (raw_lun->exit) break;
+
+            /* Dequeue the oldest request, as well as all subsequent requests of the same type that target contiguous logical blocks. */
+            /* This lets a single SCSI command cover multiple requests, regardless of where their data buffers are located in memory. */
+            while(raw_lun->queue_count && batch_count < RAW_LUN_MAX_BATCH_SIZE)
+            {
+                UsbHsFsRawRequest *request = raw_lun->queue[raw_lun->queue_head], *prev_request = (batch_count ? batch[batch_count - 1] : NULL);
+                if (prev_request && (request->type != prev_request->type || request->block_addr != (prev_request->block_addr + prev_request->block_count))) break;
+
+                batch[batch_count++] = request;
+                raw_lun->queue_head = ((raw_lun->queue_head + 1) % RAW_LUN_QUEUE_DEPTH);
+                raw_lun->queue_count--;
+            }
+
+            raw_lun->busy_count = batch_count;
+        }
+
+        if (!batch_count) break;
+
+        /* Process requests. The request queue remains available to other threads in the meantime. */
+        status = usbHsFsRawProcessRequests(raw_lun, batch, segments, batch_count);
+
+        SCOPED_LOCK(&(raw_lun->mutex))
+        {
+            for(u32 i = 0; i < batch_count; i++) usbHsFsRawCompleteRequest(batch[i], status);
+
+            raw_lun->busy_count = 0;
+            condvarWakeAll(&(raw_lun->idle_cond));
+        }
+    }
+
+    /* Flush the write cache from the LUN if we wrote any data to it. */
+    if (raw_lun->dirty && usbHsFsManagerIsDriveContextPointerValid(raw_lun->drive_ctx))
+    {
+        UsbHsFsDriveLogicalUnitContext *lun_ctx = usbHsFsGetLogicalUnitContext(raw_lun->drive_ctx, raw_lun->generation, raw_lun->lun);
+        if (lun_ctx) usbHsFsScsiSynchronizeLogicalUnitCache(lun_ctx);
+        usbHsFsManagerUnlockDriveContext(raw_lun->drive_ctx);
+    }
+}
+
+static u8 usbHsFsRawProcessRequests(UsbHsFsRawLogicalUnit *raw_lun, UsbHsFsRawRequest **batch, UsbHsFsScsiBlockIoSegment *segments, u32 batch_count)
+{
+    UsbHsFsDriveContext *drive_ctx = raw_lun->drive_ctx;
+    UsbHsFsDriveLogicalUnitContext *lun_ctx = NULL;
+    bool write = (batch[0]->type == UsbHsFsRawRequestType_Write);
+    u64 block_count = 0;
+    u8 status = UsbHsFsRawRequestStatus_Failed;
+
+    /* Fill block I/O segments. */
+    for(u32 i = 0; i < batch_count; i++)
+    {
+        segments[i] = (UsbHsFsScsiBlockIoSegment){ .block_addr = batch[i]->block_addr, .block_count = batch[i]->block_count, .buf = batch[i]->buf };
+        block_count += batch[i]->block_count;
+    }
+
+    /* Lock drive context. Bail out if it's no longer available. */
+    if (!usbHsFsManagerIsDriveContextPointerValid(drive_ctx))
+    {
+        USBHSFS_LOG_MSG("Drive context for raw block I/O handle %p is no longer available.", raw_lun);
+        return status;
+    }
+
+    /* Get LUN context. */
+    lun_ctx = usbHsFsGetLogicalUnitContext(raw_lun->drive_ctx, raw_lun->generation, raw_lun->lun);
+    if (!lun_ctx)
+    {
+        USBHSFS_LOG_MSG("LUN context for raw block I/O handle %p is no longer available.", raw_lun);
+        goto end;
+    }
+
+    /* Make sure we're not about to overwrite data from mounted volumes. */
+    if (write && !usbHsFsRawIsWriteAllowed(lun_ctx))
+    {
+        USBHSFS_LOG_MSG("Write request denied! (0x%lX block[s] at LBA 0x%lX) (interface %d, LUN %u).", block_count, segments[0].block_addr, lun_ctx->usb_if_id, lun_ctx->lun);
+        status = UsbHsFsRawRequestStatus_Denied;
+        goto end;
+    }
+
+    /* Transfer data. */
+    if (write)
+    {
+        if (usbHsFsScsiWriteLogicalUnitBlocksV(lun_ctx, segments, batch_count)) status = UsbHsFsRawRequestStatus_Success;
+        raw_lun->dirty = true;
+    } else {
+        if (usbHsFsScsiReadLogicalUnitBlocksV(lun_ctx, segments, batch_count)) status = UsbHsFsRawRequestStatus_Success;
+    }
+
+end:
+    usbHsFsManagerUnlockDriveContext(drive_ctx);
+
+    return status;
+}
+
+static bool usbHsFsRawIsWriteAllowed(UsbHsFsDriveLogicalUnitContext *lun_ctx)
+{
+    /* Logical units with mounted volumes are read-only. Partition table blocks and filesystem metadata may be located anywhere (e.g. backup GPT headers), */
+    /* so there's no reliable way to tell if a write request would corrupt a mounted volume. Logical units being formatted are off-limits as well. */
+    return (!lun_ctx->write_protect && !lun_ctx->fs_count && !lun_ctx->formatting);
+}
+
+static void usbHsFsRawCompleteRequest(UsbHsFsRawRequest *request, u8 status)
+{
+    /* Retrieve the event pointer first. The request may be reused by its owner as soon as its status is updated. */
+    UEvent *event = request->event;
+
+    __atomic_store_n(&(request->status), status, __ATOMIC_RELEASE);
+    if (event) ueventSignal(event);
+}
+
 static void usbHsFsDriveManagerThreadFuncSXOS(void *arg)
 {
     NX_IGNORE_ARG(arg);
@@ -616,6 +1932,7 @@ static void usbHsFsDriveManagerThreadFuncAtmosphere(void *arg)
 
     Result rc = 0;
     int idx = 0;
+    u32 commit_interval = 0;
 
     Waiter usb_if_available_waiter = waiterForEvent(&g_usbInterfaceAvailableEvent);
     Waiter usb_if_state_change_waiter = waiterForEvent(g_usbInterfaceStateChangeEvent);
@@ -629,7 +1946,7 @@ static void usbHsFsDriveManagerThreadFuncAtmosphere(void *arg)
 
         /* Reset each UMS device so we can safely issue Start Unit commands later on (if needed). */
         /* A Stop Unit command could have been issued before for each UMS device (e.g. if an app linked against this library was previously launched, but the UMS devices weren't disconnected). */
-        /* Performing a bus reset on each one makes it possible to re-use them. */
+        /* A BOT mass storage reset is tried first for each one. Devices with LUNs that don't report a ready status afterwards get a bus reset, which makes it possible to re-use them. */
         SCOPED_LOCK(&g_managerMutex) usbHsFsResetDrives();
 
 #ifdef DEBUG
@@ -640,8 +1957,18 @@ static void usbHsFsDriveManagerThreadFuncAtmosphere(void *arg)
 
     while(true)
     {
+        /* Get EXT journal commit interval. */
+        SCOPED_LOCK(&g_managerMutex) commit_interval = usbHsFsMountGetExtJournalCommitInterval();
+
         /* Wait until an event is triggered. */
-        rc = waitMulti(&idx, -1, usb_if_available_waiter, usb_if_state_change_waiter, thread_exit_waiter);
+        /* If an EXT journal commit interval has been set, we'll also wake up periodically to commit pending metadata from mounted filesystems. */
+        rc = waitMulti(&idx, commit_interval ? (commit_interval * (u64)1000000000) : UINT64_MAX, usb_if_available_waiter, usb_if_state_change_waiter, thread_exit_waiter);
+        if (R_VALUE(rc) == KERNELRESULT(TimedOut))
+        {
+            SCOPED_LOCK(&g_managerMutex) usbHsFsCommitDriveContexts(false);
+            continue;
+        }
+
         if (R_FAILED(rc)) continue;
 
 #ifdef DEBUG
@@ -756,6 +2083,24 @@ static void usbHsFsResetDrives(void)
             continue;
         }
 
+        /* Retrieve device quirks. */
+        UsbHsFsQuirksEntry quirks_entry = {0};
+        usbHsFsQuirksGetEntry(usb_if->device_desc.idVendor, usb_if->device_desc.idProduct, &quirks_entry);
+
+        /* Leave this UMS device alone if it's known to misbehave after a bus reset. */
+        if (quirks_entry.quirks & UsbHsFsDeviceQuirks_NoBusReset)
+        {
+            USBHSFS_LOG_MSG("Skipping reset for USB Mass Storage device with interface %d (quirk).", usb_if->inf.ID);
+            continue;
+        }
+
+        /* Try to reuse this UMS device without a bus reset first. This avoids a full re-enumeration, which can take a long time with some devices. */
+        if (!(quirks_entry.quirks & UsbHsFsDeviceQuirks_NoWarmStart) && usbHsFsDriveWarmStart(usb_if))
+        {
+            USBHSFS_LOG_MSG("Warm start succeeded for USB Mass Storage device with interface %d.", usb_if->inf.ID);
+            continue;
+        }
+
         USBHSFS_LOG_MSG("Resetting USB Mass Storage device with interface %d.", usb_if->inf.ID);
 
         /* Open current interface. */
@@ -864,6 +2209,7 @@ static bool usbHsFsUpdateDriveContexts(bool remove)
             }
 
             /* Add current interface to the drive context list. */
+            /* Transfer buffers from other drives may be shrunk in the process. */
             if (usbHsFsAddDriveContextToList(usb_if))
             {
                 USBHSFS_LOG_MSG("Successfully added drive with ID %d to drive context list.", usb_if->inf.ID);
@@ -876,6 +2222,9 @@ static bool usbHsFsUpdateDriveContexts(bool remove)
 
     USBHSFS_LOG_MSG("%s %u drive context(s).", remove ? "Removed" : "Added", ctx_count);
 
+    /* Apportion the memory budget between the drives we're left with. */
+    usbHsFsRebalanceXferBuffers(g_driveCount);
+
     /* Update return value. */
     ret = (ctx_count > 0);
 
@@ -883,6 +2232,25 @@ end:
     return ret;
 }
 
+static void usbHsFsCommitDriveContexts(bool force)
+{
+    if (!g_driveContexts || !g_driveCount) return;
+
+    for(u32 i = 0; i < g_driveCount; i++)
+    {
+        UsbHsFsDriveContext *drive_ctx = g_driveContexts[i];
+        if (!drive_ctx) continue;
+
+        /* Skip busy drives instead of blocking on their mutexes while holding the drive manager mutex, since FatFs threads holding a drive mutex may need it. */
+        /* Writing devoptab operations commit pending metadata on their own once the commit interval has elapsed, so nothing gets left behind. */
+        if (!mutexTryLock(&(drive_ctx->mutex))) continue;
+
+        for(u8 j = 0; j < drive_ctx->lun_count; j++) usbHsFsMountCommitLogicalUnitFileSystemContexts(drive_ctx->lun_ctx[j], force);
+
+        usbHsFsManagerUnlockDriveContext(drive_ctx);
+    }
+}
+
 static void usbHsFsRemoveDriveContextFromListByIndex(u32 drive_ctx_idx, bool stop_lun)
 {
     UsbHsFsDriveContext *drive_ctx = NULL, **tmp_drive_ctx = NULL;
@@ -938,6 +2306,10 @@ static bool usbHsFsAddDriveContextToList(UsbHsInterface *usb_if)
 
     USBHSFS_LOG_MSG("Adding drive context for interface %d.", usb_if->inf.ID);
 
+    /* Make room for the new drive within the memory budget. */
+    /* This must be done before touching the drive context pointer array, since the drive manager mutex may be temporarily released. */
+    usbHsFsRebalanceXferBuffers(g_driveCount + 1);
+
     /* Reallocate drive context pointer array. */
     USBHSFS_LOG_MSG("Reallocating drive context pointer array from %u to %u (interface %d).", g_driveCount, g_driveCount + 1, usb_if->inf.ID);
     tmp_drive_ctx = realloc(g_driveContexts, (g_driveCount + 1) * sizeof(UsbHsFsDriveContext*));
@@ -959,6 +2331,10 @@ static bool usbHsFsAddDriveContextToList(UsbHsInterface *usb_if)
     }
 
     drive_ctx = g_driveContexts[g_driveCount++];    /* Increase drive count. */
+    drive_ctx->generation = ++g_driveGeneration;
+
+    /* Pick transfer buffer size for the new drive. */
+    drive_ctx->xfer_buf_size = usbHsFsBudgetGetXferBufferSize(g_driveCount);
 
     /* Initialize drive context. */
     /* We don't need to lock its mutex - it's a new drive context the user knows nothing about. */
@@ -993,6 +2369,57 @@ end:
     return ret;
 }
 
+static void usbHsFsRebalanceXferBuffers(u32 drive_count)
+{
+    if (!g_driveContexts || !g_driveCount) return;
+
+    u32 xfer_buf_size = usbHsFsBudgetGetXferBufferSize(drive_count);
+
+    /* Shrink oversized transfer buffers first, so undersized ones can use the memory they release. */
+    for(u8 pass = 0; pass < 2; pass++)
+    {
+        bool shrink = (pass == 0);
+        u32 i = 0;
+
+        while(i < g_driveCount)
+        {
+            UsbHsFsDriveContext *drive_ctx = g_driveContexts[i];
+            bool locked = false;
+
+            if (!drive_ctx || !drive_ctx->xfer_buf || drive_ctx->xfer_buf_size == xfer_buf_size || (drive_ctx->xfer_buf_size > xfer_buf_size) != shrink)
+            {
+                i++;
+                continue;
+            }
+
+            /* Wait for any in-flight I/O to complete before swapping buffers. */
+            /* Don't block on the drive context mutex: I/O threads holding it may need the drive manager mutex to complete their requests, so it's released while we wait. */
+            while(!(locked = mutexTryLock(&(drive_ctx->mutex))))
+            {
+                condvarWaitTimeout(&g_driveIoCondVar, &g_managerMutex, IO_SCHED_WAIT_TIMEOUT_NS);
+
+                /* The drive context pointer array may have been modified while we were waiting. */
+                if (i >= g_driveCount || g_driveContexts[i] != drive_ctx) break;
+            }
+
+            if (!locked)
+            {
+                /* Start over. Drives that have already been resized are skipped. */
+                i = 0;
+                continue;
+            }
+
+            USBHSFS_LOG_MSG("%s USB transfer buffer from 0x%X to 0x%X (interface %d).", shrink ? "Shrinking" : "Growing", drive_ctx->xfer_buf_size, xfer_buf_size, drive_ctx->usb_if_id);
+
+            if (!usbHsFsDriveResizeXferBuffer(drive_ctx, xfer_buf_size)) USBHSFS_LOG_MSG("Failed to resize USB transfer buffer! (interface %d).", drive_ctx->usb_if_id);
+
+            usbHsFsManagerUnlockDriveContext(drive_ctx);
+
+            i++;
+        }
+    }
+}
+
 static void usbHsFsExecutePopulateCallback(void)
 {
     /* Don't proceed if there's no valid callback pointer. */
@@ -1079,6 +2506,8 @@ static void usbHsFsFillDeviceElement(UsbHsFsDriveContext *drive_ctx, UsbHsFsDriv
     device->lun = lun_ctx->lun;
     device->fs_idx = fs_ctx->fs_idx;
     device->write_protect = lun_ctx->write_protect;
+    device->write_cache = lun_ctx->write_cache_enabled;
+    device->read_cache = !lun_ctx->read_cache_disabled;
     device->vid = drive_ctx->vid;
     device->pid = drive_ctx->pid;
 
@@ -16,9 +16,14 @@
 
 /// Locks the drive manager mutex to prevent the background thread from updating drive contexts while working with them, then tries to find a match for the provided drive context in the pointer array.
 /// If a match is found, the drive context mutex is locked. The drive manager mutex is unlocked right before this function returns.
+/// If the drive context mutex is already locked by another thread, the drive manager mutex is released while waiting for it. Waiting threads are served according to their I/O priority class.
 /// This function is thread-safe.
 bool usbHsFsManagerIsDriveContextPointerValid(UsbHsFsDriveContext *drive_ctx);
 
+/// Unlocks a drive context mutex previously locked by usbHsFsManagerIsDriveContextPointerValid(), then wakes up any threads waiting for it.
+/// This function is thread-safe.
+void usbHsFsManagerUnlockDriveContext(UsbHsFsDriveContext *drive_ctx);
+
 /// Locks the drive manager mutex to prevent the background thread from updating drive contexts while working with them.
 /// Then looks for a filesystem context with a FatFs object that holds a physical drive number matching the provided one. If a match is found, its parent LUN context is returned.
 /// Otherwise, this function returns NULL. The drive manager mutex is unlocked right before this function returns.
@@ -12,6 +12,10 @@
 #include "usbhsfs_manager.h"
 #include "usbhsfs_mount.h"
 #include "usbhsfs_scsi.h"
+#include "usbhsfs_crc.h"
+#include "usbhsfs_drive_cache.h"
+#include "usbhsfs_pool.h"
+#include "usbhsfs_budget.h"
 #include "fatfs/ff_dev.h"
 
 #ifdef GPL_BUILD
@@ -25,8 +29,21 @@
 
 #define MBR_PARTITION_COUNT     4
 
+#define GPT_MAX_PARTITION_ARRAY_SIZE    0x100000    /* 8192 partition entries. */
+
 #define DEVOPTAB_INVALID_ID     UINT32_MAX
 
+#define FILE_HANDLE_CACHE_SIZE  16
+#define FILE_HANDLE_CACHE_MEMORY_SIZE   (FILE_HANDLE_CACHE_SIZE * sizeof(UsbHsFsDriveLogicalUnitFileSystemFileHandle))
+
+#define NTFS_LIBRARY_MEMORY_ESTIMATE    0x40000 /* 256 KiB. NTFS-3G keeps the full upcase table (128 KiB) in memory, plus MFT record buffers and inode/attribute caches. */
+#define EXT_LIBRARY_MEMORY_ESTIMATE     0x40000 /* 256 KiB. Covers the lwext4 block cache and journal buffers for 4 KiB blocks. */
+
+#define PATH_MAX_NAME_LENGTH    255         /* In UTF-16 code units. Matches the limits from all supported filesystems. */
+
+#define MOUNT_FORMAT_WORK_BUF_SIZE  0x100000    /* 1 MiB. Larger buffers mean fewer Write commands while initializing filesystem metadata. */
+#define MOUNT_FORMAT_ALIGNMENT      0x100000    /* 1 MiB. */
+
 #ifdef DEBUG
 #define FS_TYPE_STR(x)          ((x) == UsbHsFsDriveLogicalUnitFileSystemType_FAT ? "FAT" : ((x) == UsbHsFsDriveLogicalUnitFileSystemType_NTFS ? "NTFS" : "EXT"))
 #endif
@@ -197,10 +214,18 @@ static const u8 g_linuxFilesystemDataGuid[0x10] = { 0xAF, 0x3D, 0xC6, 0x0F, 0x83
 
 static u32 g_fileSystemMountFlags = UsbHsFsMountFlags_Default;
 
+static u32 g_extJournalCommitInterval = 0;
+
 __thread char __usbhsfs_dev_path_buf[MAX_PATH_LENGTH] = {0};
+__thread u64 __usbhsfs_file_size_hint = 0;
 
 /* Function prototypes. */
 
+static void usbHsFsMountResetLayout(UsbHsFsDriveLogicalUnitContext *lun_ctx);
+static void usbHsFsMountRecordLayoutTableBlock(UsbHsFsDriveLogicalUnitContext *lun_ctx, const u8 *block, u64 block_addr);
+static bool usbHsFsMountRegisterCachedLayout(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 *block, const UsbHsFsDriveLogicalUnitLayout *layout);
+static void usbHsFsMountDestroyLogicalUnitFileSystemContexts(UsbHsFsDriveLogicalUnitContext *lun_ctx);
+
 static bool usbHsFsMountParseMasterBootRecord(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 *block);
 static void usbHsFsMountParseMasterBootRecordPartitionEntry(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 *block, u8 type, u64 lba, u64 size, bool parse_ebr_gpt);
 
@@ -213,6 +238,7 @@ static void usbHsFsMountParseExtendedBootRecord(UsbHsFsDriveLogicalUnitContext *
 static void usbHsFsMountParseGuidPartitionTable(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 *block, u64 gpt_lba);
 
 static bool usbHsFsMountRegisterVolume(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 *block, u64 block_addr, u64 block_count, u8 fs_type);
+static u32 usbHsFsMountGetVolumeMemoryEstimate(u8 fs_type);
 
 static bool usbHsFsMountRegisterFatVolume(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, u8 *block, u64 block_addr);
 static void usbHsFsMountUnregisterFatVolume(char *name, UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx);
@@ -230,6 +256,12 @@ static u32 usbHsFsMountGetAvailableDevoptabDeviceId(void);
 
 static void usbHsFsMountUnsetDefaultDevoptabDevice(u32 device_id);
 
+static bool usbHsFsMountIsCaseInsensitiveFileSystem(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx);
+static int usbHsFsMountComparePaths(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path1, const char *path2, size_t len);
+static u32 usbHsFsMountGetPathHash(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path);
+static void usbHsFsMountReleaseCachedFileHandle(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, UsbHsFsDriveLogicalUnitFileSystemFileHandle *entry);
+static void usbHsFsMountFreeFileHandleCache(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx);
+
 bool usbHsFsMountInitializeLogicalUnitFileSystemContexts(UsbHsFsDriveLogicalUnitContext *lun_ctx)
 {
     if (!usbHsFsDriveIsValidLogicalUnitContext(lun_ctx))
@@ -240,18 +272,34 @@ bool usbHsFsMountInitializeLogicalUnitFileSystemContexts(UsbHsFsDriveLogicalUnit
 
     u8 *block = NULL;
     u8 fs_type = 0;
+    UsbHsFsDriveLogicalUnitLayout cached_layout = {0};
     bool ret = false;
 
     /* Allocate memory to hold data from a single logical block. */
-    block = malloc(lun_ctx->block_length);
+    block = usbHsFsPoolAllocate(UsbHsFsObjectPoolType_ScratchBuffer, lun_ctx->block_length);
     if (!block)
     {
         USBHSFS_LOG_MSG("Failed to allocate memory to hold logical block data! (interface %d, LUN %u).", lun_ctx->usb_if_id, lun_ctx->lun);
         goto end;
     }
 
+    /* Reset partition layout. */
+    usbHsFsMountResetLayout(lun_ctx);
+
+    /* Mount volumes right away if a valid partition layout for this LUN is available in the drive cache. */
+    if (usbHsFsDriveCacheGetLogicalUnitLayout(lun_ctx, &cached_layout))
+    {
+        ret = usbHsFsMountRegisterCachedLayout(lun_ctx, block, &cached_layout);
+        if (ret) goto end;
+
+        /* Fall back to parsing the partition layout. */
+        usbHsFsMountResetLayout(lun_ctx);
+    }
+
     /* Check if we're dealing with a SFD-formatted logical unit with a Microsoft VBR at LBA 0. */
     fs_type = usbHsFsMountInspectVolumeBootRecord(lun_ctx, block, 0);
+    usbHsFsMountRecordLayoutTableBlock(lun_ctx, block, 0);
+
     if (fs_type > UsbHsFsDriveLogicalUnitFileSystemType_Unsupported)
     {
         /* Mount volume at LBA 0 right away. */
@@ -278,7 +326,7 @@ bool usbHsFsMountInitializeLogicalUnitFileSystemContexts(UsbHsFsDriveLogicalUnit
     }
 
 end:
-    if (block) free(block);
+    if (block) usbHsFsPoolFree(UsbHsFsObjectPoolType_ScratchBuffer, block);
 
     return ret;
 }
@@ -293,6 +341,9 @@ void usbHsFsMountDestroyLogicalUnitFileSystemContext(UsbHsFsDriveLogicalUnitFile
     /* Unset default devoptab device. */
     usbHsFsMountUnsetDefaultDevoptabDevice(fs_ctx->device_id);
 
+    /* Release cached file handles. */
+    usbHsFsMountFreeFileHandleCache(fs_ctx);
+
     /* Unregister devoptab interface. */
     sprintf(name, "%s:", fs_ctx->name);
     RemoveDevice(name);
@@ -360,6 +411,10 @@ void usbHsFsMountDestroyLogicalUnitFileSystemContext(UsbHsFsDriveLogicalUnitFile
         default:
             break;
     }
+
+    /* Release this volume from the memory budget. */
+    usbHsFsBudgetRelease(UsbHsFsMemoryCategory_VolumeContexts, fs_ctx->budget_size);
+    fs_ctx->budget_size = 0;
 }
 
 u32 usbHsFsMountGetDevoptabDeviceCount(void)
@@ -433,6 +488,533 @@ void usbHsFsMountSetFileSystemMountFlags(u32 flags)
     g_fileSystemMountFlags = flags;
 }
 
+u32 usbHsFsMountGetExtJournalCommitInterval(void)
+{
+    return g_extJournalCommitInterval;
+}
+
+void usbHsFsMountSetExtJournalCommitInterval(u32 seconds)
+{
+    g_extJournalCommitInterval = seconds;
+}
+
+void usbHsFsMountCommitLogicalUnitFileSystemContexts(UsbHsFsDriveLogicalUnitContext *lun_ctx, bool force)
+{
+#ifdef GPL_BUILD
+    if (!usbHsFsDriveIsValidLogicalUnitContext(lun_ctx)) return;
+
+    for(u32 i = 0; i < lun_ctx->fs_count; i++)
+    {
+        UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx = lun_ctx->fs_ctx[i];
+        if (!fs_ctx || fs_ctx->fs_type != UsbHsFsDriveLogicalUnitFileSystemType_EXT || !fs_ctx->ext) continue;
+
+        /* Commit EXT block cache contents. */
+        ext_commit(fs_ctx->ext, force);
+    }
+#else
+    NX_IGNORE_ARG(lun_ctx);
+    NX_IGNORE_ARG(force);
+#endif
+}
+
+bool usbHsFsMountBeginLogicalUnitFormat(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 fs_type, u32 cluster_size)
+{
+    if (!usbHsFsDriveIsValidLogicalUnitContext(lun_ctx) || lun_ctx->formatting || (fs_type != UsbHsFsDeviceFileSystemType_FAT32 && fs_type != UsbHsFsDeviceFileSystemType_exFAT) || \
+        (cluster_size && (cluster_size < lun_ctx->block_length || (cluster_size & (cluster_size - 1)))))
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return false;
+    }
+
+    u8 pdrv = 0;
+
+    /* Make sure write protection is disabled. */
+    if (lun_ctx->write_protect)
+    {
+        USBHSFS_LOG_MSG("Error: write protection enabled! (interface %d, LUN %u).", lun_ctx->usb_if_id, lun_ctx->lun);
+        return false;
+    }
+
+    /* Check if there's a free FatFs volume slot. ff_mkfs() uses it as the physical drive number for all disk I/O operations. */
+    for(pdrv = 0; pdrv < FF_VOLUMES; pdrv++)
+    {
+        if (!g_fatFsVolumeTable[pdrv]) break;
+    }
+
+    if (pdrv == FF_VOLUMES)
+    {
+        USBHSFS_LOG_MSG("Failed to locate a free FatFs volume slot! (interface %d, LUN %u).", lun_ctx->usb_if_id, lun_ctx->lun);
+        return false;
+    }
+
+    /* Destroy filesystem contexts. This also unregisters their devoptab devices. */
+    usbHsFsMountDestroyLogicalUnitFileSystemContexts(lun_ctx);
+
+    /* Reset partition layout. */
+    usbHsFsMountResetLayout(lun_ctx);
+
+    /* Reserve FatFs volume slot. */
+    g_fatFsVolumeTable[pdrv] = true;
+    lun_ctx->format_pdrv = pdrv;
+    lun_ctx->formatting = true;
+
+    return true;
+}
+
+bool usbHsFsMountFormatLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 fs_type, u32 cluster_size)
+{
+    if (!usbHsFsDriveIsValidLogicalUnitContext(lun_ctx) || !lun_ctx->formatting)
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return false;
+    }
+
+    void *work_buf = NULL;
+    MKFS_PARM mkfs_parm = {0};
+    FRESULT ff_res = FR_DISK_ERR;
+
+    /* Allocate memory for the FatFs work buffer. */
+    work_buf = malloc(MOUNT_FORMAT_WORK_BUF_SIZE);
+    if (!work_buf)
+    {
+        USBHSFS_LOG_MSG("Failed to allocate memory for the FatFs work buffer! (interface %d, LUN %u).", lun_ctx->usb_if_id, lun_ctx->lun);
+        return false;
+    }
+
+    /* Create a single partition spanning the whole LUN, then format it. */
+    /* The data area is aligned to a 1 MiB boundary, which matches the partition alignment and the erase block size from most flash based media. */
+    mkfs_parm.fmt = (fs_type == UsbHsFsDeviceFileSystemType_FAT32 ? FM_FAT32 : FM_EXFAT);
+    mkfs_parm.n_fat = 2;
+    mkfs_parm.align = (MOUNT_FORMAT_ALIGNMENT >> lun_ctx->block_length_log2);
+    mkfs_parm.au_size = cluster_size;
+
+    USBHSFS_LOG_MSG("Formatting LUN as %s (cluster size: 0x%X) (interface %d, LUN %u).", LIBUSBHSFS_FS_TYPE_STR(fs_type), cluster_size, lun_ctx->usb_if_id, lun_ctx->lun);
+
+    ff_res = ff_mkfs(lun_ctx->format_pdrv, &mkfs_parm, work_buf, MOUNT_FORMAT_WORK_BUF_SIZE);
+
+    free(work_buf);
+
+    if (ff_res != FR_OK)
+    {
+        USBHSFS_LOG_MSG("Failed to format LUN! (%u) (interface %d, LUN %u).", ff_res, lun_ctx->usb_if_id, lun_ctx->lun);
+        return false;
+    }
+
+    return true;
+}
+
+bool usbHsFsMountEndLogicalUnitFormat(UsbHsFsDriveLogicalUnitContext *lun_ctx, bool formatted)
+{
+    if (!usbHsFsDriveIsValidLogicalUnitContext(lun_ctx) || !lun_ctx->formatting)
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return false;
+    }
+
+    bool ret = false;
+
+    /* Release FatFs volume slot. */
+    g_fatFsVolumeTable[lun_ctx->format_pdrv] = false;
+    lun_ctx->formatting = false;
+
+    if (!formatted) return false;
+
+    /* Mount the new volume. */
+    ret = usbHsFsMountInitializeLogicalUnitFileSystemContexts(lun_ctx);
+    if (ret)
+    {
+        /* Update drive cache. */
+        usbHsFsDriveCacheUpdateLogicalUnit(lun_ctx);
+    } else {
+        USBHSFS_LOG_MSG("Failed to mount formatted volume! (interface %d, LUN %u).", lun_ctx->usb_if_id, lun_ctx->lun);
+    }
+
+    return ret;
+}
+
+bool usbHsFsMountAcquireCachedFileHandle(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path, void *fd)
+{
+    if (!fs_ctx || !fs_ctx->fh_cache || !fs_ctx->device || !path || !*path || !fd) return false;
+
+    UsbHsFsDriveLogicalUnitFileSystemFileHandle *entry = NULL;
+    u32 hash = usbHsFsMountGetPathHash(fs_ctx, path);
+
+    /* Look for a cached file handle with a matching path. */
+    for(u32 i = 0; i < FILE_HANDLE_CACHE_SIZE; i++)
+    {
+        entry = &(fs_ctx->fh_cache[i]);
+        if (entry->status != UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Cached || entry->hash != hash || usbHsFsMountComparePaths(fs_ctx, entry->path, path, MAX_PATH_LENGTH) != 0) continue;
+
+        USBHSFS_LOG_MSG("Reusing cached file handle for \"%s\" (entry #%u).", path, i);
+
+        /* Restore file state and link this entry to the provided file descriptor. */
+        memcpy(fd, entry->state, fs_ctx->device->structSize);
+
+        entry->status = UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_InUse;
+        entry->fd = fd;
+        entry->last_used = ++(fs_ctx->fh_cache_counter);
+
+        return true;
+    }
+
+    return false;
+}
+
+void usbHsFsMountRegisterFileHandle(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path, void *fd, bool write)
+{
+    if (!fs_ctx || !fs_ctx->fh_cache || !path || !*path || !fd) return;
+
+    UsbHsFsDriveLogicalUnitFileSystemFileHandle *entry = NULL;
+
+    /* Look for a free entry. If there are none, we'll evict the least recently used cached file handle. */
+    for(u32 i = 0; i < FILE_HANDLE_CACHE_SIZE; i++)
+    {
+        UsbHsFsDriveLogicalUnitFileSystemFileHandle *cur_entry = &(fs_ctx->fh_cache[i]);
+
+        if (cur_entry->status == UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Free)
+        {
+            entry = cur_entry;
+            break;
+        }
+
+        if (cur_entry->status == UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Cached && (!entry || cur_entry->last_used < entry->last_used)) entry = cur_entry;
+    }
+
+    if (entry && entry->status == UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Cached) usbHsFsMountReleaseCachedFileHandle(fs_ctx, entry);
+
+    /* Allocate memory for the path buffer, if needed. */
+    if (entry && !entry->path)
+    {
+        entry->path = usbHsFsPoolAllocate(UsbHsFsObjectPoolType_NameBuffer, MAX_PATH_LENGTH);
+        if (entry->path) memset(entry->path, 0, MAX_PATH_LENGTH);
+    }
+
+    if (!entry || !entry->path)
+    {
+        /* We can't keep track of this file handle. */
+        /* If it was opened with write access, we'll disable caching altogether until it's closed. */
+        if (write) fs_ctx->fh_cache_writers++;
+        return;
+    }
+
+    /* Link this entry to the provided file descriptor. */
+    sprintf(entry->path, "%s", path);
+
+    entry->status = UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_InUse;
+    entry->write = write;
+    entry->stale = false;
+    entry->hash = usbHsFsMountGetPathHash(fs_ctx, path);
+    entry->last_used = ++(fs_ctx->fh_cache_counter);
+    entry->fd = fd;
+}
+
+bool usbHsFsMountUnregisterFileHandle(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, void *fd, bool write)
+{
+    if (!fs_ctx || !fs_ctx->fh_cache || !fs_ctx->device || !fd) return false;
+
+    UsbHsFsDriveLogicalUnitFileSystemFileHandle *entry = NULL;
+    bool cache = false;
+
+    /* Look for the entry linked to the provided file descriptor. */
+    for(u32 i = 0; i < FILE_HANDLE_CACHE_SIZE; i++)
+    {
+        if (fs_ctx->fh_cache[i].status == UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_InUse && fs_ctx->fh_cache[i].fd == fd)
+        {
+            entry = &(fs_ctx->fh_cache[i]);
+            break;
+        }
+    }
+
+    if (!entry)
+    {
+        /* Untracked file handle. */
+        if (write && fs_ctx->fh_cache_writers) fs_ctx->fh_cache_writers--;
+        return false;
+    }
+
+    /* Only cache read-only file handles that weren't invalidated, and only if there are no untracked file handles with write access. */
+    cache = (!entry->write && !entry->stale && !fs_ctx->fh_cache_writers);
+
+    /* Don't cache this file handle if the same file is currently opened with write access. */
+    for(u32 i = 0; cache && i < FILE_HANDLE_CACHE_SIZE; i++)
+    {
+        UsbHsFsDriveLogicalUnitFileSystemFileHandle *cur_entry = &(fs_ctx->fh_cache[i]);
+        if (cur_entry->status == UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_InUse && cur_entry->write && !usbHsFsMountComparePaths(fs_ctx, cur_entry->path, entry->path, MAX_PATH_LENGTH)) cache = false;
+    }
+
+    /* Allocate memory for the file state copy, if needed. */
+    if (cache && !entry->state)
+    {
+        entry->state = usbHsFsPoolAllocate(UsbHsFsObjectPoolType_FileState, fs_ctx->device->structSize);
+        cache = (entry->state != NULL);
+    }
+
+    entry->fd = NULL;
+
+    if (!cache)
+    {
+        /* Free entry. */
+        entry->status = UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Free;
+        entry->write = entry->stale = false;
+        return false;
+    }
+
+    USBHSFS_LOG_MSG("Caching file handle for \"%s\".", entry->path);
+
+    /* Copy file state and reset the file descriptor. */
+    memcpy(entry->state, fd, fs_ctx->device->structSize);
+    memset(fd, 0, fs_ctx->device->structSize);
+
+    entry->status = UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Cached;
+    entry->last_used = ++(fs_ctx->fh_cache_counter);
+
+    return true;
+}
+
+void usbHsFsMountInvalidateCachedFileHandles(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path)
+{
+    if (!fs_ctx || !fs_ctx->fh_cache) return;
+
+    size_t path_len = (path ? strlen(path) : 0);
+
+    for(u32 i = 0; i < FILE_HANDLE_CACHE_SIZE; i++)
+    {
+        UsbHsFsDriveLogicalUnitFileSystemFileHandle *entry = &(fs_ctx->fh_cache[i]);
+        if (entry->status == UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Free || entry->write) continue;
+
+        /* Check if this entry matches the provided path or if it's located below it. */
+        if (path && (usbHsFsMountComparePaths(fs_ctx, entry->path, path, path_len) != 0 || (entry->path[path_len] != '\0' && entry->path[path_len] != '/'))) continue;
+
+        if (entry->status == UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_InUse)
+        {
+            /* The file handle is still open. Make sure it doesn't get cached once it's closed. */
+            entry->stale = true;
+        } else {
+            /* Close the cached file handle. */
+            usbHsFsMountReleaseCachedFileHandle(fs_ctx, entry);
+        }
+    }
+}
+
+int usbHsFsMountNormalizePath(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path, char *outpath)
+{
+    if (!fs_ctx || !fs_ctx->cwd || !path || !*path || !outpath) return EINVAL;
+
+    const char *colon = NULL;
+    const u8 *p = NULL;
+    size_t root = 0, pos = 0, seg = 0, seg_len = 0, cwd_len = 0;
+    ssize_t units = 0;
+    u32 code = 0, name_len = 0;
+
+    /* FatFs also accepts NT path separators. NTFS-3G doesn't, and lwext4 treats them as regular characters. */
+    bool nt_sep_is_sep = (fs_ctx->fs_type == UsbHsFsDriveLogicalUnitFileSystemType_FAT);
+    bool nt_sep_is_invalid = (fs_ctx->fs_type == UsbHsFsDriveLogicalUnitFileSystemType_NTFS);
+
+    /* Skip the mount name, if available. Any other colons will be rejected further below. */
+    colon = strchr(path, ':');
+    if (colon) path = (colon + 1);
+
+    /* Copy filesystem-specific path prefix, followed by the root directory separator. */
+    memcpy(outpath, fs_ctx->path_prefix, fs_ctx->path_prefix_len);
+    root = fs_ctx->path_prefix_len;
+    outpath[root] = '/';
+    pos = (root + 1);
+
+    if (*path != '/' && (!nt_sep_is_sep || *path != '\\'))
+    {
+        /* Relative path. The current working directory has already been normalized, and it always starts and ends with a path separator. */
+        cwd_len = strlen(fs_ctx->cwd);
+        if ((pos + cwd_len - 1) >= MAX_PATH_LENGTH) return ENAMETOOLONG;
+
+        memcpy(outpath + pos, fs_ctx->cwd + 1, cwd_len - 1);
+        pos += (cwd_len - 1);
+    }
+
+    /* Validate, copy and resolve path segments in a single pass. */
+    p = (const u8*)path;
+    seg = pos;
+
+    while(true)
+    {
+        /* Only decode multi-byte UTF-8 sequences. */
+        code = *p;
+        units = 1;
+
+        if (code >= 0x80)
+        {
+            units = decode_utf8(&code, p);
+            if (units < 0) return EILSEQ;
+        }
+
+        if (code < ' ' || code == '/' || (code == '\\' && nt_sep_is_sep))
+        {
+            /* Reached the end of the current segment. */
+            seg_len = (pos - seg);
+
+            if (seg_len == 1 && outpath[seg] == '.')
+            {
+                /* Current directory dot entry alias. Remove it. */
+                pos = seg;
+            } else
+            if (seg_len == 2 && outpath[seg] == '.' && outpath[seg + 1] == '.')
+            {
+                /* Parent directory dot entry alias. Remove it along with the previous segment, unless we're already at the root directory. */
+                pos = seg;
+
+                if (pos > (root + 1))
+                {
+                    pos--;
+                    while(outpath[pos - 1] != '/') pos--;
+                }
+            } else
+            if (seg_len)
+            {
+                /* New entry in the directory tree. Check its length and append a path separator. */
+                if (name_len > PATH_MAX_NAME_LENGTH || (pos + 1) >= MAX_PATH_LENGTH) return ENAMETOOLONG;
+                outpath[pos++] = '/';
+            }
+
+            /* Reached the end of the string. */
+            if (code < ' ') break;
+
+            /* Skip path separator and start a new segment. */
+            p += units;
+            seg = pos;
+            name_len = 0;
+            continue;
+        }
+
+        /* Don't tolerate colons. NT path separators are also rejected for NTFS. */
+        if (code == ':' || (code == '\\' && nt_sep_is_invalid)) return EINVAL;
+
+        /* Copy character. */
+        if ((pos + (size_t)units) >= MAX_PATH_LENGTH) return ENAMETOOLONG;
+
+        memcpy(outpath + pos, p, units);
+        pos += (size_t)units;
+        p += units;
+
+        name_len += (code >= 0x10000 ? 2 : 1);
+    }
+
+    /* Remove trailing path separator, unless it's the root directory separator. */
+    if (pos > (root + 1)) pos--;
+    outpath[pos] = '\0';
+
+    return 0;
+}
+
+static void usbHsFsMountResetLayout(UsbHsFsDriveLogicalUnitContext *lun_ctx)
+{
+    memset(&(lun_ctx->layout), 0, sizeof(UsbHsFsDriveLogicalUnitLayout));
+    lun_ctx->layout.complete = true;
+}
+
+static void usbHsFsMountRecordLayoutTableBlock(UsbHsFsDriveLogicalUnitContext *lun_ctx, const u8 *block, u64 block_addr)
+{
+    UsbHsFsDriveLogicalUnitLayout *layout = &(lun_ctx->layout);
+
+    if (layout->table_block_count >= LUN_LAYOUT_MAX_TABLE_BLOCKS)
+    {
+        layout->complete = false;
+        return;
+    }
+
+    layout->table_block_addr[(layout->table_block_count)++] = block_addr;
+    layout->table_crc32 = usbHsFsCrcUpdateCrc32(layout->table_crc32, block, lun_ctx->block_length);
+}
+
+static bool usbHsFsMountRegisterCachedLayout(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 *block, const UsbHsFsDriveLogicalUnitLayout *layout)
+{
+    u32 table_crc32 = 0;
+
+    /* Make sure the partition table blocks haven't changed. */
+    for(u8 i = 0; i < layout->table_block_count; i++)
+    {
+        if (!usbHsFsScsiReadLogicalUnitBlocks(lun_ctx, block, layout->table_block_addr[i], 1))
+        {
+            USBHSFS_LOG_MSG("Failed to read block at LBA 0x%lX! (interface %d, LUN %u).", layout->table_block_addr[i], lun_ctx->usb_if_id, lun_ctx->lun);
+            return false;
+        }
+
+        table_crc32 = usbHsFsCrcUpdateCrc32(table_crc32, block, lun_ctx->block_length);
+    }
+
+    if (table_crc32 != layout->table_crc32)
+    {
+        USBHSFS_LOG_MSG("Cached partition layout is outdated (interface %d, LUN %u).", lun_ctx->usb_if_id, lun_ctx->lun);
+        return false;
+    }
+
+    /* Keep track of the partition table blocks. Volumes are recorded by usbHsFsMountRegisterVolume(). */
+    lun_ctx->layout.table_block_count = layout->table_block_count;
+    lun_ctx->layout.table_crc32 = layout->table_crc32;
+    memcpy(lun_ctx->layout.table_block_addr, layout->table_block_addr, sizeof(layout->table_block_addr));
+
+    /* Inspect cached volumes before registering any of them, since filesystems may be reformatted without modifying the partition table. */
+    /* Any mismatch means the cached layout can't be trusted anymore, so we'll just fall back to a full parse. */
+    for(u8 i = 0; i < layout->volume_count; i++)
+    {
+        const UsbHsFsDriveLogicalUnitVolume *volume = &(layout->volumes[i]);
+        u8 fs_type = UsbHsFsDriveLogicalUnitFileSystemType_Invalid;
+
+#ifdef GPL_BUILD
+        if (volume->fs_type == UsbHsFsDriveLogicalUnitFileSystemType_EXT)
+        {
+            fs_type = usbHsFsMountInspectExtSuperBlock(lun_ctx, block, volume->block_addr);
+        } else {
+            fs_type = usbHsFsMountInspectVolumeBootRecord(lun_ctx, block, volume->block_addr);
+        }
+#else
+        fs_type = usbHsFsMountInspectVolumeBootRecord(lun_ctx, block, volume->block_addr);
+#endif
+
+        if (fs_type != volume->fs_type)
+        {
+            USBHSFS_LOG_MSG("Cached %s volume at LBA 0x%lX no longer matches (interface %d, LUN %u).", FS_TYPE_STR(volume->fs_type), volume->block_addr, lun_ctx->usb_if_id, lun_ctx->lun);
+            return false;
+        }
+    }
+
+    /* Register cached volumes. */
+    for(u8 i = 0; i < layout->volume_count; i++)
+    {
+        const UsbHsFsDriveLogicalUnitVolume *volume = &(layout->volumes[i]);
+
+        if (!usbHsFsMountRegisterVolume(lun_ctx, block, volume->block_addr, volume->block_count, volume->fs_type))
+        {
+            /* Undo everything we've done so far. The full parse will register these volumes once again. */
+            USBHSFS_LOG_MSG("Failed to register cached %s volume at LBA 0x%lX (interface %d, LUN %u).", FS_TYPE_STR(volume->fs_type), volume->block_addr, lun_ctx->usb_if_id, lun_ctx->lun);
+            usbHsFsMountDestroyLogicalUnitFileSystemContexts(lun_ctx);
+            return false;
+        }
+
+        USBHSFS_LOG_MSG("Successfully registered cached %s volume at LBA 0x%lX (interface %d, LUN %u).", FS_TYPE_STR(volume->fs_type), volume->block_addr, lun_ctx->usb_if_id, lun_ctx->lun);
+    }
+
+    return (lun_ctx->fs_count > 0);
+}
+
+static void usbHsFsMountDestroyLogicalUnitFileSystemContexts(UsbHsFsDriveLogicalUnitContext *lun_ctx)
+{
+    if (lun_ctx->fs_ctx)
+    {
+        for(u32 i = 0; i < lun_ctx->fs_count; i++)
+        {
+            UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx = lun_ctx->fs_ctx[i];
+            if (!fs_ctx) continue;
+
+            usbHsFsMountDestroyLogicalUnitFileSystemContext(fs_ctx);
+            free(fs_ctx);
+        }
+
+        free(lun_ctx->fs_ctx);
+        lun_ctx->fs_ctx = NULL;
+    }
+
+    lun_ctx->fs_count = 0;
+}
+
 static bool usbHsFsMountParseMasterBootRecord(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 *block)
 {
     MasterBootRecord mbr = {0};
@@ -585,8 +1167,8 @@ end:
 static u8 usbHsFsMountInspectExtSuperBlock(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 *block, u64 block_addr)
 {
     u32 block_length = lun_ctx->block_length;
-    u32 block_read_addr = (block_addr + (EXT4_SUPERBLOCK_OFFSET / block_length));
-    u32 block_read_count = (block_length >= EXT4_SUPERBLOCK_SIZE ? 1 : (EXT4_SUPERBLOCK_SIZE / block_length));
+    u32 block_read_addr = (block_addr + (EXT4_SUPERBLOCK_OFFSET >> lun_ctx->block_length_log2));
+    u32 block_read_count = (block_length >= EXT4_SUPERBLOCK_SIZE ? 1 : (EXT4_SUPERBLOCK_SIZE >> lun_ctx->block_length_log2));
     struct ext4_sblock superblock = {0};
     u8 ret = UsbHsFsDriveLogicalUnitFileSystemType_Invalid;
 
@@ -634,6 +1216,9 @@ static void usbHsFsMountParseExtendedBootRecord(UsbHsFsDriveLogicalUnitContext *
             break;
         }
 
+        /* Keep track of this EBR in the partition layout. */
+        usbHsFsMountRecordLayoutTableBlock(lun_ctx, block, ebr_lba + next_ebr_lba);
+
         /* Copy EBR data to struct. */
         memcpy(&ebr, block, sizeof(ExtendedBootRecord));
 
@@ -656,8 +1241,9 @@ static void usbHsFsMountParseExtendedBootRecord(UsbHsFsDriveLogicalUnitContext *
 static void usbHsFsMountParseGuidPartitionTable(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 *block, u64 gpt_lba)
 {
     GuidPartitionTableHeader gpt_header = {0};
-    u32 header_crc32 = 0, header_crc32_calc = 0, part_count = 0, part_per_block = 0, part_array_block_count = 0;
-    u64 part_lba = 0;
+    u32 header_crc32 = 0, header_crc32_calc = 0, part_array_crc32_calc = 0, part_count = 0, part_array_block_count = 0;
+    u64 part_lba = 0, part_array_size = 0;
+    u8 *part_array = NULL;
 
     /* Read block where the GPT header is located. */
     if (!usbHsFsScsiReadLogicalUnitBlocks(lun_ctx, block, gpt_lba, 1))
@@ -666,6 +1252,9 @@ static void usbHsFsMountParseGuidPartitionTable(UsbHsFsDriveLogicalUnitContext *
         return;
     }
 
+    /* Keep track of the GPT header in the partition layout. Its CRC32 checksum field covers the partition array as well. */
+    usbHsFsMountRecordLayoutTableBlock(lun_ctx, block, gpt_lba);
+
     /* Copy GPT header data. */
     memcpy(&gpt_header, block, sizeof(GuidPartitionTableHeader));
 
@@ -679,7 +1268,7 @@ static void usbHsFsMountParseGuidPartitionTable(UsbHsFsDriveLogicalUnitContext *
     /* Verify GPT header CRC32 checksum. */
     header_crc32 = gpt_header.header_crc32;
     gpt_header.header_crc32 = 0;
-    header_crc32_calc = crc32Calculate(&gpt_header, gpt_header.header_size);
+    header_crc32_calc = usbHsFsCrcCalculateCrc32(&gpt_header, gpt_header.header_size);
     gpt_header.header_crc32 = header_crc32;
 
     if (header_crc32_calc != header_crc32)
@@ -703,7 +1292,7 @@ static void usbHsFsMountParseGuidPartitionTable(UsbHsFsDriveLogicalUnitContext *
         /* Verify backup GPT header CRC32 checksum. */
         header_crc32 = gpt_header.header_crc32;
         gpt_header.header_crc32 = 0;
-        header_crc32_calc = crc32Calculate(&gpt_header, gpt_header.header_size);
+        header_crc32_calc = usbHsFsCrcCalculateCrc32(&gpt_header, gpt_header.header_size);
         gpt_header.header_crc32 = header_crc32;
 
         if (header_crc32_calc != header_crc32)
@@ -724,74 +1313,93 @@ static void usbHsFsMountParseGuidPartitionTable(UsbHsFsDriveLogicalUnitContext *
         return;
     }
 
+    /* Check GPT partition array size. */
+    part_array_size = ((u64)gpt_header.partition_array_count * sizeof(GuidPartitionTableEntry));
+    if (!part_array_size || part_array_size > GPT_MAX_PARTITION_ARRAY_SIZE)
+    {
+        USBHSFS_LOG_MSG("Invalid GPT partition array size in GPT header at LBA 0x%lX! (0x%lX) (interface %d, LUN %u).", gpt_lba, part_array_size, lun_ctx->usb_if_id, lun_ctx->lun);
+        return;
+    }
+
+    /* Allocate memory for the whole GPT partition array. */
+    part_lba = gpt_header.partition_array_lba;
+    part_array_block_count = (u32)((part_array_size + lun_ctx->block_length - 1) >> lun_ctx->block_length_log2);
+
+    part_array = malloc((u64)part_array_block_count << lun_ctx->block_length_log2);
+    if (!part_array)
+    {
+        USBHSFS_LOG_MSG("Failed to allocate memory for GPT partition array! (interface %d, LUN %u).", lun_ctx->usb_if_id, lun_ctx->lun);
+        return;
+    }
+
+    /* Read the whole GPT partition array using a single request. */
+    if (!usbHsFsScsiReadLogicalUnitBlocks(lun_ctx, part_array, part_lba, part_array_block_count))
+    {
+        USBHSFS_LOG_MSG("Failed to read %u GPT partition array block(s) from LBA 0x%lX! (interface %d, LUN %u).", part_array_block_count, part_lba, lun_ctx->usb_if_id, lun_ctx->lun);
+        goto end;
+    }
+
+    /* Verify GPT partition array CRC32 checksum. */
+    part_array_crc32_calc = usbHsFsCrcCalculateCrc32(part_array, part_array_size);
+    if (part_array_crc32_calc != gpt_header.partition_array_crc32)
+    {
+        USBHSFS_LOG_MSG("Invalid CRC32 checksum for GPT partition array at LBA 0x%lX! (%08X != %08X) (interface %d, LUN %u).", part_lba, part_array_crc32_calc, gpt_header.partition_array_crc32, \
+                    lun_ctx->usb_if_id, lun_ctx->lun);
+        goto end;
+    }
+
     /* Get GPT partition entry count. Only process the first 128 entries if there's more than that. */
     part_count = gpt_header.partition_array_count;
     if (part_count > 128) part_count = 128;
 
-    /* Calculate number of partition entries per block and the total block count for the whole partition array. */
-    part_lba = gpt_header.partition_array_lba;
-    part_per_block = (lun_ctx->block_length / (u32)sizeof(GuidPartitionTableEntry));
-    part_array_block_count = (part_count / part_per_block);
-
     /* Parse GPT partition entries. */
-    for(u32 i = 0; i < part_array_block_count; i++)
+    for(u32 i = 0; i < part_count; i++)
     {
-        /* Read current partition array block. */
-        if (!usbHsFsScsiReadLogicalUnitBlocks(lun_ctx, block, part_lba + i, 1))
-        {
-            USBHSFS_LOG_MSG("Failed to read GPT partition array block #%u from LBA 0x%lX! (interface %d, LUN %u).", i, part_lba + i, lun_ctx->usb_if_id, lun_ctx->lun);
-            break;
-        }
+        GuidPartitionTableEntry *gpt_entry = (GuidPartitionTableEntry*)(part_array + (i * sizeof(GuidPartitionTableEntry)));
+        u64 entry_lba = gpt_entry->lba_start;
+        u64 entry_size = ((gpt_entry->lba_end + 1) - gpt_entry->lba_start);
+        u8 fs_type = UsbHsFsDriveLogicalUnitFileSystemType_Invalid;
 
-        for(u32 j = 0; j < part_per_block; j++)
+        if (!memcmp(gpt_entry->type_guid, g_microsoftBasicDataPartitionGuid, sizeof(g_microsoftBasicDataPartitionGuid)))
         {
-            GuidPartitionTableEntry *gpt_entry = (GuidPartitionTableEntry*)(block + (j * sizeof(GuidPartitionTableEntry)));
-            u64 entry_lba = gpt_entry->lba_start;
-            u64 entry_size = ((gpt_entry->lba_end + 1) - gpt_entry->lba_start);
-            u8 fs_type = UsbHsFsDriveLogicalUnitFileSystemType_Invalid;
-
-            if (!memcmp(gpt_entry->type_guid, g_microsoftBasicDataPartitionGuid, sizeof(g_microsoftBasicDataPartitionGuid)))
-            {
-                /* We're dealing with a Microsoft Basic Data Partition entry. */
-                USBHSFS_LOG_MSG("Found Microsoft Basic Data Partition entry at LBA 0x%lX (interface %d, LUN %u).", entry_lba, lun_ctx->usb_if_id, lun_ctx->lun);
+            /* We're dealing with a Microsoft Basic Data Partition entry. */
+            USBHSFS_LOG_MSG("Found Microsoft Basic Data Partition entry at LBA 0x%lX (interface %d, LUN %u).", entry_lba, lun_ctx->usb_if_id, lun_ctx->lun);
 
-                /* Inspect Microsoft VBR. Register the volume if we detect a supported VBR. */
-                fs_type = usbHsFsMountInspectVolumeBootRecord(lun_ctx, block, entry_lba);
+            /* Inspect Microsoft VBR. Register the volume if we detect a supported VBR. */
+            fs_type = usbHsFsMountInspectVolumeBootRecord(lun_ctx, block, entry_lba);
 #ifdef GPL_BUILD
-                if (fs_type == UsbHsFsDriveLogicalUnitFileSystemType_Invalid)
-                {
-                    /* We may be dealing with a EXT volume. Check if we can find a valid EXT superblock. */
-                    /* Certain tools set the type GUID from EXT volumes to the one from Microsoft. */
-                    fs_type = usbHsFsMountInspectExtSuperBlock(lun_ctx, block, entry_lba);
-                }
-#endif
-            } else
-            if (!memcmp(gpt_entry->type_guid, g_linuxFilesystemDataGuid, sizeof(g_linuxFilesystemDataGuid)))
+            if (fs_type == UsbHsFsDriveLogicalUnitFileSystemType_Invalid)
             {
-                /* We're dealing with a Linux Filesystem Data entry. */
-                USBHSFS_LOG_MSG("Found Linux Filesystem Data entry at LBA 0x%lX (interface %d, LUN %u).", entry_lba, lun_ctx->usb_if_id, lun_ctx->lun);
+                /* We may be dealing with a EXT volume. Check if we can find a valid EXT superblock. */
+                /* Certain tools set the type GUID from EXT volumes to the one from Microsoft. */
+                fs_type = usbHsFsMountInspectExtSuperBlock(lun_ctx, block, entry_lba);
+            }
+#endif
+        } else
+        if (!memcmp(gpt_entry->type_guid, g_linuxFilesystemDataGuid, sizeof(g_linuxFilesystemDataGuid)))
+        {
+            /* We're dealing with a Linux Filesystem Data entry. */
+            USBHSFS_LOG_MSG("Found Linux Filesystem Data entry at LBA 0x%lX (interface %d, LUN %u).", entry_lba, lun_ctx->usb_if_id, lun_ctx->lun);
 
 #ifdef GPL_BUILD
-                /* Check if this LBA points to a valid EXT superblock. Register the EXT volume if so. */
-                fs_type = usbHsFsMountInspectExtSuperBlock(lun_ctx, block, entry_lba);
+            /* Check if this LBA points to a valid EXT superblock. Register the EXT volume if so. */
+            fs_type = usbHsFsMountInspectExtSuperBlock(lun_ctx, block, entry_lba);
 #endif
-            }
+        }
 
-            /* Register volume. */
-            if (fs_type > UsbHsFsDriveLogicalUnitFileSystemType_Unsupported && usbHsFsMountRegisterVolume(lun_ctx, block, entry_lba, entry_size, fs_type))
-            {
-                USBHSFS_LOG_MSG("Successfully registered %s volume at LBA 0x%lX (interface %d, LUN %u).", FS_TYPE_STR(fs_type), entry_lba, lun_ctx->usb_if_id, lun_ctx->lun);
-            }
+        /* Register volume. */
+        if (fs_type > UsbHsFsDriveLogicalUnitFileSystemType_Unsupported && usbHsFsMountRegisterVolume(lun_ctx, block, entry_lba, entry_size, fs_type))
+        {
+            USBHSFS_LOG_MSG("Successfully registered %s volume at LBA 0x%lX (interface %d, LUN %u).", FS_TYPE_STR(fs_type), entry_lba, lun_ctx->usb_if_id, lun_ctx->lun);
         }
     }
+
+end:
+    if (part_array) free(part_array);
 }
 
 static bool usbHsFsMountRegisterVolume(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 *block, u64 block_addr, u64 block_count, u8 fs_type)
 {
-#ifndef GPL_BUILD
-    NX_IGNORE_ARG(block_count);
-#endif
-
     UsbHsFsDriveLogicalUnitFileSystemContext **tmp_fs_ctx = NULL, *fs_ctx = NULL;
     bool ret = false, free_entry = false;
 
@@ -821,6 +1429,17 @@ static bool usbHsFsMountRegisterVolume(UsbHsFsDriveLogicalUnitContext *lun_ctx,
     fs_ctx->fs_type = fs_type;
     fs_ctx->flags = g_fileSystemMountFlags;
 
+    fs_ctx->budget_size = usbHsFsMountGetVolumeMemoryEstimate(fs_type);
+
+    /* Charge this volume against the memory budget. */
+    if (!usbHsFsBudgetReserve(UsbHsFsMemoryCategory_VolumeContexts, fs_ctx->budget_size))
+    {
+        USBHSFS_LOG_MSG("Filesystem context entry #%u doesn't fit within the memory budget! (interface %d, LUN %u).", lun_ctx->fs_count, lun_ctx->usb_if_id, lun_ctx->lun);
+        free(fs_ctx);
+        fs_ctx = NULL;
+        goto end;
+    }
+
     /* Set filesystem context entry pointer and update filesystem context count. */
     lun_ctx->fs_ctx[(lun_ctx->fs_count)++] = fs_ctx;
 
@@ -847,11 +1466,21 @@ static bool usbHsFsMountRegisterVolume(UsbHsFsDriveLogicalUnitContext *lun_ctx,
     }
 
 end:
+    /* Keep track of this volume in the partition layout. */
+    /* Volumes that fail to register make the partition layout incomplete, so it never gets cached without them. */
+    if (ret && lun_ctx->layout.volume_count < LUN_LAYOUT_MAX_VOLUMES)
+    {
+        lun_ctx->layout.volumes[(lun_ctx->layout.volume_count)++] = (UsbHsFsDriveLogicalUnitVolume){ .block_addr = block_addr, .block_count = block_count, .fs_type = fs_type };
+    } else {
+        lun_ctx->layout.complete = false;
+    }
+
     if (!ret && free_entry)
     {
         /* Free filesystem context. */
         if (fs_ctx)
         {
+            usbHsFsBudgetRelease(UsbHsFsMemoryCategory_VolumeContexts, fs_ctx->budget_size);
             free(fs_ctx);
 
             /* Update filesystem context count and clear filesystem context entry pointer. */
@@ -877,6 +1506,30 @@ end:
     return ret;
 }
 
+static u32 usbHsFsMountGetVolumeMemoryEstimate(u8 fs_type)
+{
+    u32 ret = (u32)(sizeof(UsbHsFsDriveLogicalUnitFileSystemContext) + sizeof(devoptab_t) + MOUNT_NAME_LENGTH + MAX_PATH_LENGTH);
+
+    switch(fs_type)
+    {
+        case UsbHsFsDriveLogicalUnitFileSystemType_FAT:     /* FAT12/FAT16/FAT32/exFAT. */
+            ret += (u32)sizeof(FATFS);
+            break;
+#ifdef GPL_BUILD
+        case UsbHsFsDriveLogicalUnitFileSystemType_NTFS:    /* NTFS. */
+            ret += (u32)(sizeof(ntfs_vd) + sizeof(ntfs_dd) + NTFS_LIBRARY_MEMORY_ESTIMATE);
+            break;
+        case UsbHsFsDriveLogicalUnitFileSystemType_EXT:     /* EXT2/3/4. */
+            ret += (u32)(sizeof(ext_vd) + EXT_LIBRARY_MEMORY_ESTIMATE);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    return ret;
+}
+
 static bool usbHsFsMountRegisterFatVolume(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, u8 *block, u64 block_addr)
 {
     UsbHsFsDriveLogicalUnitContext *lun_ctx = (UsbHsFsDriveLogicalUnitContext*)fs_ctx->lun_ctx;
@@ -928,6 +1581,9 @@ static bool usbHsFsMountRegisterFatVolume(UsbHsFsDriveLogicalUnitFileSystemConte
         goto end;
     }
 
+    /* Set path prefix. */
+    fs_ctx->path_prefix_len = (u8)sprintf(fs_ctx->path_prefix, "%s", name);
+
     /* Register devoptab device. */
     if (!usbHsFsMountRegisterDevoptabDevice(fs_ctx)) goto end;
 
@@ -1012,6 +1668,7 @@ static bool usbHsFsMountRegisterNtfsVolume(UsbHsFsDriveLogicalUnitFileSystemCont
     /* Setup NTFS volume descriptor. */
     fs_ctx->ntfs->id = fs_ctx->device_id;
     fs_ctx->ntfs->update_access_times = (flags & UsbHsFsMountFlags_UpdateAccessTimes);
+    fs_ctx->ntfs->relative_access_times = (flags & UsbHsFsMountFlags_RelativeAccessTimes);
     fs_ctx->ntfs->ignore_read_only_attr = (flags & UsbHsFsMountFlags_IgnoreFileReadOnlyAttribute);
 
     if ((flags & UsbHsFsMountFlags_ReadOnly) || lun_ctx->write_protect) fs_ctx->ntfs->flags |= NTFS_MNT_RDONLY;
@@ -1126,6 +1783,7 @@ static bool usbHsFsMountRegisterExtVolume(UsbHsFsDriveLogicalUnitFileSystemConte
     sprintf(fs_ctx->ext->dev_name, MOUNT_NAME_PREFIX "%u", fs_ctx->device_id);
     fs_ctx->ext->flags = fs_ctx->flags;
     fs_ctx->ext->id = fs_ctx->device_id;
+    fs_ctx->ext->commit_interval = g_extJournalCommitInterval;
 
     /* Try to mount EXT volume. */
     if (!ext_mount(fs_ctx->ext))
@@ -1136,6 +1794,9 @@ static bool usbHsFsMountRegisterExtVolume(UsbHsFsDriveLogicalUnitFileSystemConte
 
     vol_mounted = true;
 
+    /* Set path prefix. lwext4 expects paths to start with the mount point name. */
+    fs_ctx->path_prefix_len = (u8)sprintf(fs_ctx->path_prefix, "/%s", fs_ctx->ext->dev_name);
+
     /* Register devoptab device. */
     if (!usbHsFsMountRegisterDevoptabDevice(fs_ctx)) goto end;
 
@@ -1163,6 +1824,9 @@ end:
 
 static void usbHsFsMountUnregisterExtVolume(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx)
 {
+    /* Write data buffered by files that are still open. */
+    extdev_release_volume_buffers(fs_ctx->ext);
+
     /* Unmount EXT volume. */
     ext_umount(fs_ctx->ext);
 
@@ -1213,6 +1877,18 @@ static bool usbHsFsMountRegisterDevoptabDevice(UsbHsFsDriveLogicalUnitFileSystem
 
     fs_ctx->cwd[0] = '/';   /* Always start at the root directory. */
 
+    /* Allocate memory for the file handle cache, if needed. Failures aren't fatal - file handles just won't be cached. */
+    /* The cache is skipped altogether if it doesn't fit within the memory budget. */
+    if ((fs_ctx->flags & UsbHsFsMountFlags_CacheFileHandles) && usbHsFsBudgetReserve(UsbHsFsMemoryCategory_VolumeCaches, FILE_HANDLE_CACHE_MEMORY_SIZE))
+    {
+        fs_ctx->fh_cache = calloc(FILE_HANDLE_CACHE_SIZE, sizeof(UsbHsFsDriveLogicalUnitFileSystemFileHandle));
+        if (!fs_ctx->fh_cache)
+        {
+            USBHSFS_LOG_MSG("Failed to allocate memory for the file handle cache! (interface %d, LUN %u, FS %u).", lun_ctx->usb_if_id, lun_ctx->lun, fs_ctx->fs_idx);
+            usbHsFsBudgetRelease(UsbHsFsMemoryCategory_VolumeCaches, FILE_HANDLE_CACHE_MEMORY_SIZE);
+        }
+    }
+
     /* Allocate memory for our devoptab virtual device interface. */
     fs_ctx->device = calloc(1, sizeof(devoptab_t));
     if (!fs_ctx->device)
@@ -1288,6 +1964,13 @@ end:
             fs_ctx->device = NULL;
         }
 
+        if (fs_ctx->fh_cache)
+        {
+            free(fs_ctx->fh_cache);
+            fs_ctx->fh_cache = NULL;
+            usbHsFsBudgetRelease(UsbHsFsMemoryCategory_VolumeCaches, FILE_HANDLE_CACHE_MEMORY_SIZE);
+        }
+
         if (fs_ctx->cwd)
         {
             free(fs_ctx->cwd);
@@ -1351,3 +2034,81 @@ static void usbHsFsMountUnsetDefaultDevoptabDevice(u32 device_id)
         g_devoptabDefaultDeviceId = DEVOPTAB_INVALID_ID;
     }
 }
+
+static bool usbHsFsMountIsCaseInsensitiveFileSystem(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx)
+{
+    /* FatFs always ignores case. ntfs-3g only does so if requested at mount time. lwext4 never does. */
+    return (fs_ctx->fs_type == UsbHsFsDriveLogicalUnitFileSystemType_FAT || \
+            (fs_ctx->fs_type == UsbHsFsDriveLogicalUnitFileSystemType_NTFS && (fs_ctx->flags & UsbHsFsMountFlags_IgnoreCaseSensitivity)));
+}
+
+static int usbHsFsMountComparePaths(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path1, const char *path2, size_t len)
+{
+    /* Paths must be compared the same way the filesystem resolves them. Otherwise, a cached file handle could be reused for a different file, */
+    /* or survive the removal of the file it belongs to. */
+    return (usbHsFsMountIsCaseInsensitiveFileSystem(fs_ctx) ? strncasecmp(path1, path2, len) : strncmp(path1, path2, len));
+}
+
+static u32 usbHsFsMountGetPathHash(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path)
+{
+    u32 hash = 0x811C9DC5; /* FNV-1a offset basis. */
+    bool ignore_case = usbHsFsMountIsCaseInsensitiveFileSystem(fs_ctx);
+
+    /* Paths that compare equal must always yield the same hash. */
+    while(*path)
+    {
+        hash ^= (u8)(ignore_case ? tolower((u8)*path) : *path);
+        path++;
+        hash *= 0x01000193; /* FNV-1a prime. */
+    }
+
+    return hash;
+}
+
+static void usbHsFsMountReleaseCachedFileHandle(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, UsbHsFsDriveLogicalUnitFileSystemFileHandle *entry)
+{
+    USBHSFS_LOG_MSG("Releasing cached file handle for \"%s\".", entry->path);
+
+    /* Close the cached file handle. */
+    switch(fs_ctx->fs_type)
+    {
+        case UsbHsFsDriveLogicalUnitFileSystemType_FAT:     /* FAT12/FAT16/FAT32/exFAT. */
+            ffdev_release_file_state(entry->state);
+            break;
+#ifdef GPL_BUILD
+        case UsbHsFsDriveLogicalUnitFileSystemType_NTFS:    /* NTFS. */
+            ntfsdev_release_file_state(entry->state);
+            break;
+        case UsbHsFsDriveLogicalUnitFileSystemType_EXT:     /* EXT2/3/4. */
+            extdev_release_file_state(entry->state);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    /* Free entry. */
+    entry->status = UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Free;
+    entry->write = entry->stale = false;
+}
+
+static void usbHsFsMountFreeFileHandleCache(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx)
+{
+    if (!fs_ctx->fh_cache) return;
+
+    for(u32 i = 0; i < FILE_HANDLE_CACHE_SIZE; i++)
+    {
+        UsbHsFsDriveLogicalUnitFileSystemFileHandle *entry = &(fs_ctx->fh_cache[i]);
+
+        /* Close cached file handles. Open file handles will be closed by the user, once they realize the filesystem is gone. */
+        if (entry->status == UsbHsFsDriveLogicalUnitFileSystemFileHandleStatus_Cached) usbHsFsMountReleaseCachedFileHandle(fs_ctx, entry);
+
+        if (entry->path) usbHsFsPoolFree(UsbHsFsObjectPoolType_NameBuffer, entry->path);
+        if (entry->state) usbHsFsPoolFree(UsbHsFsObjectPoolType_FileState, entry->state);
+    }
+
+    free(fs_ctx->fh_cache);
+    fs_ctx->fh_cache = NULL;
+
+    usbHsFsBudgetRelease(UsbHsFsMemoryCategory_VolumeCaches, FILE_HANDLE_CACHE_MEMORY_SIZE);
+}
@@ -12,9 +12,12 @@
 #ifndef __USBHSFS_MOUNT_H__
 #define __USBHSFS_MOUNT_H__
 
+#include <fcntl.h>
+
 #include "usbhsfs_drive.h"
 
 extern __thread char __usbhsfs_dev_path_buf[MAX_PATH_LENGTH];
+extern __thread u64 __usbhsfs_file_size_hint;
 
 /// None of these functions are thread safe - make sure to (un)lock mutexes elsewhere.
 
@@ -38,4 +41,55 @@ u32 usbHsFsMountGetFileSystemMountFlags(void);
 /// Takes an input bitmask with the desired filesystem mount flags, which will be used for all mount operations.
 void usbHsFsMountSetFileSystemMountFlags(u32 flags);
 
+/// Returns the current EXT journal commit interval, in seconds.
+u32 usbHsFsMountGetExtJournalCommitInterval(void);
+
+/// Sets the EXT journal commit interval, in seconds, which will be used for all subsequent EXT mount operations.
+void usbHsFsMountSetExtJournalCommitInterval(u32 seconds);
+
+/// Commits pending filesystem metadata from all filesystem contexts in the provided LUN context, if needed.
+/// If `force` is false, metadata is only committed if the configured commit interval has elapsed.
+void usbHsFsMountCommitLogicalUnitFileSystemContexts(UsbHsFsDriveLogicalUnitContext *lun_ctx, bool force);
+
+/// Prepares the LUN represented by the provided LUN context to be formatted by usbHsFsMountFormatLogicalUnit().
+/// `fs_type` must be either UsbHsFsDeviceFileSystemType_FAT32 or UsbHsFsDeviceFileSystemType_exFAT. If `cluster_size` is zero, a cluster size is automatically chosen.
+/// All filesystem contexts from the LUN are destroyed, and a FatFs volume slot is reserved. The LUN is marked as being formatted until usbHsFsMountEndLogicalUnitFormat() is called.
+bool usbHsFsMountBeginLogicalUnitFormat(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 fs_type, u32 cluster_size);
+
+/// Formats the LUN represented by the provided LUN context using FatFs, creating a single partition that spans the whole LUN (MBR, or GPT if the LUN holds more than 2^32 blocks).
+/// Must be called between usbHsFsMountBeginLogicalUnitFormat() and usbHsFsMountEndLogicalUnitFormat(), using the same arguments. Only the drive mutex needs to be held, since no global state is modified.
+bool usbHsFsMountFormatLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx, u8 fs_type, u32 cluster_size);
+
+/// Releases the FatFs volume slot reserved by usbHsFsMountBeginLogicalUnitFormat(). If `formatted` is true, the new volume is mounted.
+/// Returns false if `formatted` is false, or if the new volume couldn't be mounted.
+bool usbHsFsMountEndLogicalUnitFormat(UsbHsFsDriveLogicalUnitContext *lun_ctx, bool formatted);
+
+/// Normalizes the provided devoptab path using the current working directory from the provided filesystem context, and stores the result in `outpath` (which must be at least MAX_PATH_LENGTH bytes long).
+/// Validates UTF-8 sequences, strips the mount name, resolves dot entries, collapses consecutive path separators and prepends the filesystem-specific path prefix - all in a single pass.
+/// Returns 0 if successful, or an errno value otherwise.
+int usbHsFsMountNormalizePath(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path, char *outpath);
+
+/// Looks for a cached read-only file handle matching the provided fixed path in the file handle cache from the provided filesystem context.
+/// If found, its file state is copied to `fd`, the cache entry is linked to `fd` and true is returned. The calling function must reset the file position on its own.
+/// Must be called by devoptab open() functions after fixing the input path, and only if usbHsFsMountIsCacheableFileHandle() returns true for the provided open flags.
+bool usbHsFsMountAcquireCachedFileHandle(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path, void *fd);
+
+/// Registers a successfully opened file handle in the file handle cache from the provided filesystem context.
+/// Handles opened with write access invalidate cached file handles for the provided path and keep caching disabled until they're closed.
+void usbHsFsMountRegisterFileHandle(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path, void *fd, bool write);
+
+/// Unregisters a file handle from the file handle cache from the provided filesystem context.
+/// Returns true if the file state from `fd` was moved to the cache, in which case the calling devoptab close() function must not close the file.
+bool usbHsFsMountUnregisterFileHandle(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, void *fd, bool write);
+
+/// Invalidates cached file handles from the provided filesystem context matching the provided fixed path, as well as any other handles for entries located below it.
+/// If `path` is NULL, all cached file handles are invalidated.
+void usbHsFsMountInvalidateCachedFileHandles(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, const char *path);
+
+/// Checks if a file handle opened with the provided open flags may be cached.
+NX_INLINE bool usbHsFsMountIsCacheableFileHandle(UsbHsFsDriveLogicalUnitFileSystemContext *fs_ctx, int flags)
+{
+    return (fs_ctx->fh_cache && (flags & (O_ACCMODE | O_CREAT | O_TRUNC | O_APPEND)) == O_RDONLY);
+}
+
 #endif  /* __USBHSFS_MOUNT_H__ */
@@ -0,0 +1,241 @@
+/*
+ * usbhsfs_pool.c
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#include "usbhsfs_utils.h"
+#include "usbhsfs_pool.h"
+#include "usbhsfs_budget.h"
+#include "fatfs/ff.h"
+
+#define POOL_FILE_STATE_SIZE        ALIGN_UP(sizeof(FIL), 0x10) /* FatFs file objects hold a full sector buffer, so they're by far the largest file state from all supported filesystems. */
+#define POOL_DIR_ENTRY_BATCH_SIZE   0x4000                      /* 16 KiB. Holds about a hundred NTFS directory entries with average-length names. */
+#define POOL_NAME_BUFFER_SIZE       0x480                       /* FatFs LFN working buffers take 1120 bytes with exFAT support enabled. Also fits MAX_PATH_LENGTH path buffers. */
+#define POOL_SCRATCH_BUFFER_SIZE    (BLKDEV_MAX_BLOCK_SIZE * 2) /* Enough for the two edge blocks from an unaligned transfer. */
+
+/* Type definitions. */
+
+/// Fixed-size object pool. All objects are carved out of a single contiguous storage block, which makes ownership checks trivial.
+typedef struct {
+    u32 object_size;                ///< Object size, in bytes.
+    u32 capacity;                   ///< Number of objects to preallocate. Applied by usbHsFsPoolInitialize().
+    u8 *storage;                    ///< Storage block. NULL if this pool hasn't been preallocated.
+    u32 storage_capacity;           ///< Number of objects held by the storage block.
+    void *free_list;                ///< Singly linked list of free objects. Each free object starts with a pointer to the next one.
+    UsbHsFsObjectPoolStats stats;   ///< Allocation statistics.
+} UsbHsFsObjectPool;
+
+/* Global variables. */
+
+static Mutex g_poolMutex = 0;
+
+static UsbHsFsObjectPool g_objectPools[UsbHsFsObjectPoolType_Count] = {
+    [UsbHsFsObjectPoolType_FileState]     = { .object_size = POOL_FILE_STATE_SIZE,      .capacity = 16 },
+    [UsbHsFsObjectPoolType_DirEntryBatch] = { .object_size = POOL_DIR_ENTRY_BATCH_SIZE, .capacity = 4 },
+    [UsbHsFsObjectPoolType_NameBuffer]    = { .object_size = POOL_NAME_BUFFER_SIZE,     .capacity = 16 },
+    [UsbHsFsObjectPoolType_ScratchBuffer] = { .object_size = POOL_SCRATCH_BUFFER_SIZE,  .capacity = 8 }
+};
+
+/* Function prototypes. */
+
+static bool usbHsFsPoolOwnsObject(UsbHsFsObjectPool *pool, void *ptr);
+
+void usbHsFsPoolInitialize(void)
+{
+    SCOPED_LOCK(&g_poolMutex)
+    {
+        for(u8 i = 0; i < UsbHsFsObjectPoolType_Count; i++)
+        {
+            UsbHsFsObjectPool *pool = &(g_objectPools[i]);
+
+            /* Skip pools left behind by usbHsFsPoolExit() because their objects were still in use. */
+            if (pool->storage) continue;
+
+            /* Reset statistics. */
+            memset(&(pool->stats), 0, sizeof(UsbHsFsObjectPoolStats));
+
+            if (!pool->capacity) continue;
+
+            /* Charge the storage block against the memory budget. Pools that don't fit are left disabled. */
+            size_t storage_size = ((size_t)pool->capacity * pool->object_size);
+            if (!usbHsFsBudgetReserve(UsbHsFsMemoryCategory_ObjectPools, storage_size))
+            {
+                USBHSFS_LOG_MSG("Object pool #%u doesn't fit within the memory budget! (%u object[s]).", i, pool->capacity);
+                continue;
+            }
+
+            /* Allocate storage block. */
+            pool->storage = malloc(storage_size);
+            if (!pool->storage)
+            {
+                USBHSFS_LOG_MSG("Failed to preallocate object pool #%u! (%u object[s]).", i, pool->capacity);
+                usbHsFsBudgetRelease(UsbHsFsMemoryCategory_ObjectPools, storage_size);
+                continue;
+            }
+
+            pool->storage_capacity = pool->stats.capacity = pool->capacity;
+
+            /* Build free list. */
+            pool->free_list = NULL;
+
+            for(u32 j = pool->storage_capacity; j > 0; j--)
+            {
+                void *obj = (pool->storage + ((size_t)(j - 1) * pool->object_size));
+                *((void**)obj) = pool->free_list;
+                pool->free_list = obj;
+            }
+        }
+    }
+}
+
+void usbHsFsPoolExit(void)
+{
+    SCOPED_LOCK(&g_poolMutex)
+    {
+        for(u8 i = 0; i < UsbHsFsObjectPoolType_Count; i++)
+        {
+            UsbHsFsObjectPool *pool = &(g_objectPools[i]);
+
+            /* Keep the storage block around if any of its objects are still in use. Freeing them later on must still work. */
+            if (pool->stats.in_use)
+            {
+                USBHSFS_LOG_MSG("Object pool #%u still has %u object(s) in use!", i, pool->stats.in_use);
+                continue;
+            }
+
+            if (pool->storage)
+            {
+                free(pool->storage);
+                pool->storage = NULL;
+                usbHsFsBudgetRelease(UsbHsFsMemoryCategory_ObjectPools, (size_t)pool->storage_capacity * pool->object_size);
+            }
+
+            pool->storage_capacity = pool->stats.capacity = 0;
+            pool->free_list = NULL;
+        }
+    }
+}
+
+bool usbHsFsPoolSetCapacity(u8 type, u32 capacity)
+{
+    if (type >= UsbHsFsObjectPoolType_Count) return false;
+    SCOPED_LOCK(&g_poolMutex) g_objectPools[type].capacity = capacity;
+    return true;
+}
+
+bool usbHsFsPoolGetStats(u8 type, UsbHsFsObjectPoolStats *out_stats)
+{
+    if (type >= UsbHsFsObjectPoolType_Count || !out_stats) return false;
+
+    SCOPED_LOCK(&g_poolMutex)
+    {
+        memcpy(out_stats, &(g_objectPools[type].stats), sizeof(UsbHsFsObjectPoolStats));
+        out_stats->object_size = g_objectPools[type].object_size;
+    }
+
+    return true;
+}
+
+void *usbHsFsPoolAllocate(u8 type, size_t size)
+{
+    if (type >= UsbHsFsObjectPoolType_Count || !size) return NULL;
+
+    UsbHsFsObjectPool *pool = &(g_objectPools[type]);
+    void *ret = NULL;
+
+    /* Oversized requests aren't this pool's business. */
+    if (size > pool->object_size) return malloc(size);
+
+    SCOPED_LOCK(&g_poolMutex)
+    {
+        pool->stats.alloc_count++;
+
+        if (pool->free_list)
+        {
+            /* Pop the first free object. */
+            ret = pool->free_list;
+            pool->free_list = *((void**)ret);
+
+            pool->stats.in_use++;
+            if (pool->stats.in_use > pool->stats.peak_in_use) pool->stats.peak_in_use = pool->stats.in_use;
+        } else {
+            /* The pool is either exhausted or disabled. */
+            pool->stats.heap_alloc_count++;
+        }
+    }
+
+    /* Fall back to the heap if needed. */
+    if (!ret) ret = malloc(size);
+
+    return ret;
+}
+
+void usbHsFsPoolFree(u8 type, void *ptr)
+{
+    if (type >= UsbHsFsObjectPoolType_Count || !ptr) return;
+
+    UsbHsFsObjectPool *pool = &(g_objectPools[type]);
+    bool owned = false;
+
+    SCOPED_LOCK(&g_poolMutex)
+    {
+        owned = usbHsFsPoolOwnsObject(pool, ptr);
+        if (!owned) break;
+
+        /* Push object back into the free list. */
+        *((void**)ptr) = pool->free_list;
+        pool->free_list = ptr;
+        pool->stats.in_use--;
+    }
+
+    if (!owned) free(ptr);
+}
+
+void *usbHsFsPoolArenaAllocate(UsbHsFsPoolArena *arena, size_t size)
+{
+    if (!arena || !size || size > (POOL_DIR_ENTRY_BATCH_SIZE - sizeof(void*))) return NULL;
+
+    void *ret = NULL;
+
+    size = ALIGN_UP(size, 8);
+
+    /* Add a new chunk if there's not enough room left in the current one. */
+    if (!arena->chunk || (arena->offset + size) > POOL_DIR_ENTRY_BATCH_SIZE)
+    {
+        void *chunk = usbHsFsPoolAllocate(UsbHsFsObjectPoolType_DirEntryBatch, POOL_DIR_ENTRY_BATCH_SIZE);
+        if (!chunk) return NULL;
+
+        /* Link it to the previous chunk. */
+        *((void**)chunk) = arena->chunk;
+        arena->chunk = chunk;
+        arena->offset = ALIGN_UP(sizeof(void*), 8);
+    }
+
+    ret = ((u8*)arena->chunk + arena->offset);
+    arena->offset += (u32)size;
+
+    return ret;
+}
+
+void usbHsFsPoolArenaReset(UsbHsFsPoolArena *arena)
+{
+    if (!arena) return;
+
+    while(arena->chunk)
+    {
+        void *prev = *((void**)arena->chunk);
+        usbHsFsPoolFree(UsbHsFsObjectPoolType_DirEntryBatch, arena->chunk);
+        arena->chunk = prev;
+    }
+
+    arena->offset = 0;
+}
+
+static bool usbHsFsPoolOwnsObject(UsbHsFsObjectPool *pool, void *ptr)
+{
+    u8 *ptr_u8 = (u8*)ptr;
+    return (pool->storage && ptr_u8 >= pool->storage && ptr_u8 < (pool->storage + ((size_t)pool->storage_capacity * pool->object_size)));
+}
@@ -0,0 +1,48 @@
+/*
+ * usbhsfs_pool.h
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#pragma once
+
+#ifndef __USBHSFS_POOL_H__
+#define __USBHSFS_POOL_H__
+
+/// Arena allocator backed by UsbHsFsObjectPoolType_DirEntryBatch objects. Must be zeroed out before being used.
+/// Allocations can't be freed individually. usbHsFsPoolArenaReset() must be used to release all memory held by the arena.
+typedef struct {
+    void *chunk;    ///< Most recently added chunk. Each chunk starts with a pointer to the previous one.
+    u32 offset;     ///< Offset to the first free byte within the most recently added chunk.
+} UsbHsFsPoolArena;
+
+/// Unlike most other internal modules, all of these functions are thread safe.
+
+/// Preallocates all object pools using the capacities set through usbHsFsPoolSetCapacity(). Failing to preallocate a pool isn't fatal: its objects are allocated from the heap instead.
+void usbHsFsPoolInitialize(void);
+
+/// Frees all object pools. Objects allocated from them must no longer be in use.
+void usbHsFsPoolExit(void);
+
+/// Sets the number of objects preallocated by usbHsFsPoolInitialize() for the provided UsbHsFsObjectPoolType.
+bool usbHsFsPoolSetCapacity(u8 type, u32 capacity);
+
+/// Retrieves allocation statistics for the provided UsbHsFsObjectPoolType.
+bool usbHsFsPoolGetStats(u8 type, UsbHsFsObjectPoolStats *out_stats);
+
+/// Allocates an object from the pool for the provided UsbHsFsObjectPoolType.
+/// Requests larger than the pool object size, as well as requests issued while all preallocated objects are in use, are served by the heap.
+void *usbHsFsPoolAllocate(u8 type, size_t size);
+
+/// Frees an object allocated by usbHsFsPoolAllocate() using the same UsbHsFsObjectPoolType. NULL pointers are ignored.
+void usbHsFsPoolFree(u8 type, void *ptr);
+
+/// Allocates a 8-byte aligned memory block from the provided arena. Returns NULL if `size` exceeds the usable size of a single arena chunk.
+void *usbHsFsPoolArenaAllocate(UsbHsFsPoolArena *arena, size_t size);
+
+/// Releases all memory held by the provided arena, which can then be reused right away.
+void usbHsFsPoolArenaReset(UsbHsFsPoolArena *arena);
+
+#endif  /* __USBHSFS_POOL_H__ */
@@ -0,0 +1,92 @@
+/*
+ * usbhsfs_quirks.c
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#include "usbhsfs_utils.h"
+#include "usbhsfs_quirks.h"
+
+/* Global variables. */
+
+/// Built-in device quirks table.
+static const UsbHsFsQuirksEntry g_builtInQuirks[] = {
+    /* Seagate. Some tests with 4 TB drives show that only up to 0x10000 blocks can be transferred at once using Read/Write (16) commands. */
+    { 0x0BC2, 0x0000, UsbHsFsDeviceQuirks_None, 0x10000 }
+};
+
+static const u32 g_builtInQuirksCount = (u32)(sizeof(g_builtInQuirks) / sizeof(g_builtInQuirks[0]));
+
+/// Runtime device quirks table. Populated via usbHsFsAddDeviceQuirks().
+static UsbHsFsQuirksEntry *g_runtimeQuirks = NULL;
+static u32 g_runtimeQuirksCount = 0;
+
+/* Function prototypes. */
+
+static const UsbHsFsQuirksEntry *usbHsFsQuirksFindEntry(const UsbHsFsQuirksEntry *table, u32 count, u16 vid, u16 pid, bool exact);
+
+bool usbHsFsQuirksAddEntry(u16 vid, u16 pid, u32 quirks, u32 max_block_count)
+{
+    UsbHsFsQuirksEntry *entry = (UsbHsFsQuirksEntry*)usbHsFsQuirksFindEntry(g_runtimeQuirks, g_runtimeQuirksCount, vid, pid, true), *tmp_quirks = NULL;
+
+    if (!entry)
+    {
+        /* Reallocate runtime device quirks table. */
+        tmp_quirks = realloc(g_runtimeQuirks, (g_runtimeQuirksCount + 1) * sizeof(UsbHsFsQuirksEntry));
+        if (!tmp_quirks)
+        {
+            USBHSFS_LOG_MSG("Failed to reallocate runtime device quirks table!");
+            return false;
+        }
+
+        g_runtimeQuirks = tmp_quirks;
+        tmp_quirks = NULL;
+
+        entry = &(g_runtimeQuirks[g_runtimeQuirksCount++]);
+    }
+
+    entry->vid = vid;
+    entry->pid = pid;
+    entry->quirks = (quirks & UsbHsFsDeviceQuirks_All);
+    entry->max_block_count = max_block_count;
+
+    USBHSFS_LOG_MSG("Device quirks set for %04X:%04X (0x%X, 0x%X).", vid, pid, entry->quirks, max_block_count);
+
+    return true;
+}
+
+void usbHsFsQuirksGetEntry(u16 vid, u16 pid, UsbHsFsQuirksEntry *out_entry)
+{
+    const UsbHsFsQuirksEntry *entry = NULL;
+
+    /* Look for an exact match first, then for an entry matching all products from this vendor. */
+    for(u8 i = 0; i < 2 && !entry; i++)
+    {
+        bool exact = (i == 0);
+        entry = usbHsFsQuirksFindEntry(g_runtimeQuirks, g_runtimeQuirksCount, vid, (exact ? pid : 0), exact);
+        if (!entry) entry = usbHsFsQuirksFindEntry(g_builtInQuirks, g_builtInQuirksCount, vid, (exact ? pid : 0), exact);
+    }
+
+    if (entry)
+    {
+        memcpy(out_entry, entry, sizeof(UsbHsFsQuirksEntry));
+        USBHSFS_LOG_MSG("Found device quirks for %04X:%04X (0x%X, 0x%X).", vid, pid, entry->quirks, entry->max_block_count);
+    } else {
+        memset(out_entry, 0, sizeof(UsbHsFsQuirksEntry));
+    }
+}
+
+static const UsbHsFsQuirksEntry *usbHsFsQuirksFindEntry(const UsbHsFsQuirksEntry *table, u32 count, u16 vid, u16 pid, bool exact)
+{
+    if (!table || !count) return NULL;
+
+    for(u32 i = 0; i < count; i++)
+    {
+        const UsbHsFsQuirksEntry *entry = &(table[i]);
+        if (entry->vid == vid && entry->pid == pid && (exact || !entry->pid)) return entry;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,31 @@
+/*
+ * usbhsfs_quirks.h
+ *
+ * Copyright (c) 2020-2023, DarkMatterCore <pabloacurielz@gmail.com>.
+ *
+ * This file is part of libusbhsfs (https://github.com/DarkMatterCore/libusbhsfs).
+ */
+
+#pragma once
+
+#ifndef __USBHSFS_QUIRKS_H__
+#define __USBHSFS_QUIRKS_H__
+
+/// Device quirks table entry.
+typedef struct {
+    u16 vid;                ///< Vendor ID.
+    u16 pid;                ///< Product ID. Zero matches all devices from the provided vendor ID.
+    u32 quirks;             ///< UsbHsFsDeviceQuirks bitmask.
+    u32 max_block_count;    ///< Max number of logical blocks transferred by a single Read/Write command. Zero if the default value should be used.
+} UsbHsFsQuirksEntry;
+
+/// None of these functions are thread safe - make sure to (un)lock mutexes elsewhere.
+
+/// Adds an entry to the runtime device quirks table, or replaces an existing entry with the same VID and PID.
+bool usbHsFsQuirksAddEntry(u16 vid, u16 pid, u32 quirks, u32 max_block_count);
+
+/// Looks for a device quirks entry matching the provided VID and PID, and stores it in `out_entry`. If none is found, `out_entry` is zeroed out (no quirks).
+/// Runtime entries take precedence over built-in ones, and exact matches take precedence over entries that match all products from a vendor.
+void usbHsFsQuirksGetEntry(u16 vid, u16 pid, UsbHsFsQuirksEntry *out_entry);
+
+#endif  /* __USBHSFS_QUIRKS_H__ */
@@ -13,9 +13,9 @@
 
 static Result __usbHsEpSubmitRequest(UsbHsClientEpSession *usb_ep_session, void *buf, u32 size, u32 timeout_ms, u32 *xfer_size);
 
-void *usbHsFsRequestAllocateXferBuffer(void)
+void *usbHsFsRequestAllocateXferBuffer(u32 size)
 {
-    return memalign(USB_XFER_BUF_ALIGNMENT, USB_XFER_BUF_SIZE);
+    return memalign(USB_XFER_BUF_ALIGNMENT, size);
 }
 
 /* Reference: https://www.usb.org/sites/default/files/usbmassbulk_10.pdf (page 7). */
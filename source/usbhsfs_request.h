@@ -14,7 +14,7 @@
 /// None of these functions are thread safe - make sure to (un)lock mutexes elsewhere.
 
 /// Returns a pointer to a dynamic, memory-aligned buffer suitable for USB transfers.
-void *usbHsFsRequestAllocateXferBuffer(void);
+void *usbHsFsRequestAllocateXferBuffer(u32 size);
 
 /// Performs a get max logical units class-specific request.
 Result usbHsFsRequestGetMaxLogicalUnits(UsbHsClientIfSession *usb_if_session, u8 *out);
@@ -10,27 +10,39 @@
 #include "usbhsfs_utils.h"
 #include "usbhsfs_request.h"
 #include "usbhsfs_scsi.h"
+#include "usbhsfs_drive_cache.h"
 
 #define SCSI_CBW_SIGNATURE                      0x55534243      /* "USBC". */
 #define SCSI_CSW_SIGNATURE                      0x55534253      /* "USBS". */
 
 #define SCSI_ASC_MEDIUM_NOT_PRESENT             0x3A
 
+#define SCSI_MODE_PAGE_CODE_CACHING             0x08
 #define SCSI_MODE_PAGE_CODE_ALL                 0x3F
 #define SCSI_MODE_SUBPAGE_CODE_ALL_NO_SUBPAGES  0x00
 
+#define SCSI_MODE_PARAMETER_BUF_SIZE            0x40
+#define SCSI_CACHING_MODE_PAGE_LENGTH           0x12
+
 #define SCSI_READ_CAPACITY_10_MAX_LBA           UINT32_MAX
 
 #define SCSI_RW10_MAX_BLOCK_COUNT               UINT16_MAX
 
 #define SCSI_SERVICE_ACTION_IN_READ_CAPACITY_16 0x10
 
+#define SCSI_WARM_START_TUR_ATTEMPTS            3
+
+#define SCSI_VPD_PAGE_BUF_SIZE                  0x104
+
+#define SCSI_WRITE_SAME_MAX_SIZE                0x4000000   /* 64 MiB. Keeps the time spent by the LUN on a single Write Same command reasonably low. */
+
 /* Type definitions. */
 
 typedef enum {
     ScsiCommandOperationCode_TestUnitReady             = 0x00,
     ScsiCommandOperationCode_RequestSense              = 0x03,
     ScsiCommandOperationCode_Inquiry                   = 0x12,
+    ScsiCommandOperationCode_ModeSelect6               = 0x15,
     ScsiCommandOperationCode_ModeSense6                = 0x1A,
     ScsiCommandOperationCode_StartStopUnit             = 0x1B,
     ScsiCommandOperationCode_PreventAllowMediumRemoval = 0x1E,
@@ -38,10 +50,13 @@ typedef enum {
     ScsiCommandOperationCode_Read10                    = 0x28,
     ScsiCommandOperationCode_Write10                   = 0x2A,
     ScsiCommandOperationCode_SynchronizeCache10        = 0x35,
+    ScsiCommandOperationCode_WriteSame10               = 0x41,
+    ScsiCommandOperationCode_ModeSelect10              = 0x55,
     ScsiCommandOperationCode_ModeSense10               = 0x5A,
     ScsiCommandOperationCode_Read16                    = 0x88,
     ScsiCommandOperationCode_Write16                   = 0x8A,
     ScsiCommandOperationCode_SynchronizeCache16        = 0x91,
+    ScsiCommandOperationCode_WriteSame16               = 0x93,
     ScsiCommandOperationCode_ServiceActionIn           = 0x9E
 } ScsiCommandOperationCode;
 
@@ -268,6 +283,51 @@ typedef struct {
     u8 page_length;
 } ScsiInquiryUnitSerialNumberPageHeader;
 
+/// Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (Block Limits VPD page).
+#pragma pack(push, 1)
+typedef struct {
+    ScsiInquiryUnitSerialNumberPageHeader header;   ///< Same layout as the Unit Serial Number VPD page header. Page length must be at least 0x3C to hold the max Write Same length.
+    struct {
+        u8 wsnz       : 1;                          ///< Write Same No Zero.
+        u8 reserved_1 : 7;
+    };
+    u8 max_compare_and_write_length;
+    u16 optimal_transfer_length_granularity;        ///< Stored using big endian byte ordering.
+    u32 max_transfer_length;                        ///< Stored using big endian byte ordering.
+    u32 optimal_transfer_length;                    ///< Stored using big endian byte ordering.
+    u32 max_prefetch_length;                        ///< Stored using big endian byte ordering.
+    u32 max_unmap_lba_count;                        ///< Stored using big endian byte ordering.
+    u32 max_unmap_block_descriptor_count;           ///< Stored using big endian byte ordering.
+    u32 optimal_unmap_granularity;                  ///< Stored using big endian byte ordering.
+    u32 unmap_granularity_alignment;                ///< Stored using big endian byte ordering.
+    u64 max_write_same_length;                      ///< Stored using big endian byte ordering. Zero if not reported.
+    u8 reserved_2[0x14];
+} ScsiInquiryBlockLimitsPage;
+#pragma pack(pop)
+
+LIB_ASSERT(ScsiInquiryBlockLimitsPage, 0x40);
+
+/// Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (Logical Block Provisioning VPD page).
+typedef struct {
+    ScsiInquiryUnitSerialNumberPageHeader header;   ///< Same layout as the Unit Serial Number VPD page header.
+    u8 threshold_exponent;
+    struct {
+        u8 dp      : 1;                             ///< Provisioning group descriptor present.
+        u8 anc_sup : 1;                             ///< Anchor supported.
+        u8 lbprz   : 3;                             ///< Logical Block Provisioning Read Zeros. Non-zero if unmapped blocks read back as zeros.
+        u8 lbpws10 : 1;                             ///< Unmapping via Write Same (10) supported.
+        u8 lbpws   : 1;                             ///< Unmapping via Write Same (16) supported.
+        u8 lbpu    : 1;                             ///< Unmap command supported.
+    };
+    struct {
+        u8 provisioning_type  : 3;
+        u8 minimum_percentage : 5;
+    };
+    u8 threshold_percentage;
+} ScsiInquiryLogicalBlockProvisioningPage;
+
+LIB_ASSERT(ScsiInquiryLogicalBlockProvisioningPage, 0x8);
+
 LIB_ASSERT(ScsiInquiryUnitSerialNumberPageHeader, 0x4);
 
 /// Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (page 111).
@@ -313,6 +373,29 @@ typedef struct {
 
 LIB_ASSERT(ScsiModeParameterHeader10, 0x8);
 
+/// Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (Caching Mode page).
+typedef struct {
+    struct {
+        u8 page_code : 6;
+        u8 spf       : 1;   ///< SubPage Format.
+        u8 ps        : 1;   ///< Parameters Saveable.
+    };
+    u8 page_length;         ///< Length of the rest of the page (excluding this field). Must be SCSI_CACHING_MODE_PAGE_LENGTH.
+    struct {
+        u8 rcd       : 1;   ///< Read Cache Disable.
+        u8 mf        : 1;   ///< Multiplication Factor.
+        u8 wce       : 1;   ///< Write Cache Enable.
+        u8 size      : 1;   ///< Size Enable.
+        u8 disc      : 1;   ///< Discontinuity.
+        u8 cap       : 1;   ///< Caching Analysis Permitted.
+        u8 abpf      : 1;   ///< Abort Pre-Fetch.
+        u8 ic        : 1;   ///< Initiator Control.
+    };
+    u8 reserved[0x11];      ///< Retention priorities, pre-fetch and cache segment parameters. Left untouched.
+} ScsiCachingModePage;
+
+LIB_ASSERT(ScsiCachingModePage, 0x14);
+
 /// Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (page 156).
 typedef struct {
     u32 block_count;    ///< Stored using big endian byte ordering.
@@ -345,10 +428,23 @@ typedef struct {
 
 LIB_ASSERT(ScsiReadCapacity16Data, 0x20);
 
+/// Data buffer used during the data transfer stage of a SCSI command.
+/// Either a single flat buffer, or a list of LBA-contiguous block I/O segments with buffers scattered in memory.
+typedef struct {
+    void *buf;                                  ///< Flat data buffer. Only used if segment_count is zero.
+    const UsbHsFsScsiBlockIoSegment *segments;  ///< Block I/O segments.
+    u32 segment_count;                          ///< Number of block I/O segments.
+    u8 block_length_log2;                       ///< Logical block length shift used to calculate segment sizes.
+    u64 offset;                                 ///< Byte offset within the data described by this buffer at which the data transfer stage begins.
+    bool zero;                                  ///< Set to true to send zero-filled data without a backing buffer. Only valid while sending data.
+} ScsiDataBuffer;
+
 /* Global variables. */
 
 static __thread bool g_mediumPresent = true;
 
+static bool g_enableWriteCache = false;
+
 /* Function prototypes. */
 
 static bool usbHsFsScsiSendTestUnitReadyCommand(UsbHsFsDriveContext *drive_ctx, u8 lun);
@@ -358,17 +454,33 @@ static bool usbHsFsScsiSendModeSense6Command(UsbHsFsDriveContext *drive_ctx, u8
 static bool usbHsFsScsiSendStartStopUnitCommand(UsbHsFsDriveContext *drive_ctx, u8 lun, bool start);
 static bool usbHsFsScsiSendPreventAllowMediumRemovalCommand(UsbHsFsDriveContext *drive_ctx, u8 lun, bool prevent);
 static bool usbHsFsScsiSendReadCapacity10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, ScsiReadCapacity10Data *read_capacity_10_data);
-static bool usbHsFsScsiSendRead10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, void *buf, u32 block_addr, u16 block_count, u32 block_length, bool fua);
-static bool usbHsFsScsiSendWrite10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, void *buf, u32 block_addr, u16 block_count, u32 block_length, bool fua);
+static bool usbHsFsScsiSendRead10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u32 block_addr, u16 block_count, u32 block_length, bool fua);
+static bool usbHsFsScsiSendWrite10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u32 block_addr, u16 block_count, u32 block_length, bool fua);
 static bool usbHsFsScsiSendSynchronizeCache10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, u32 block_addr, u16 block_count);
 static bool usbHsFsScsiSendModeSense10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, bool long_lba, u8 page_control, u8 page_code, u8 subpage_code, u16 allocation_length, void *buf);
-static bool usbHsFsScsiSendRead16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, void *buf, u64 block_addr, u32 block_count, u32 block_length, bool fua);
-static bool usbHsFsScsiSendWrite16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, void *buf, u64 block_addr, u32 block_count, u32 block_length, bool fua);
+static bool usbHsFsScsiSendRead16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u64 block_addr, u32 block_count, u32 block_length, bool fua);
+static bool usbHsFsScsiSendWrite16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u64 block_addr, u32 block_count, u32 block_length, bool fua);
 static bool usbHsFsScsiSendSynchronizeCache16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, u64 block_addr, u32 block_count);
 static bool usbHsFsScsiSendReadCapacity16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, ScsiReadCapacity16Data *read_capacity_16_data);
+static bool usbHsFsScsiSendModeSelect6Command(UsbHsFsDriveContext *drive_ctx, u8 lun, u8 parameter_list_length, void *buf);
+static bool usbHsFsScsiSendModeSelect10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, u16 parameter_list_length, void *buf);
+static bool usbHsFsScsiSendWriteSame10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u32 block_addr, u16 block_count, u32 block_length, bool unmap);
+static bool usbHsFsScsiSendWriteSame16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u64 block_addr, u32 block_count, u32 block_length, bool unmap);
+
+static bool usbHsFsScsiGetVitalProductDataPage(UsbHsFsDriveContext *drive_ctx, u8 lun, u8 page_code, void *buf, u16 buf_size, u16 *out_size);
+static void usbHsFsScsiProbeLogicalUnitWriteSame(UsbHsFsDriveLogicalUnitContext *lun_ctx);
+
+static bool usbHsFsScsiGetCachingModePage(UsbHsFsDriveContext *drive_ctx, u8 lun, bool mode_sense_10, ScsiCachingModePage *out_page);
+static bool usbHsFsScsiSetCachingModePage(UsbHsFsDriveContext *drive_ctx, u8 lun, bool mode_sense_10, const ScsiCachingModePage *page);
 
 static void usbHsFsScsiPrepareCommandBlockWrapper(ScsiCommandBlockWrapper *cbw, u32 data_size, bool data_in, u8 lun, u8 cb_size);
 static bool usbHsFsScsiTransferCommand(UsbHsFsDriveContext *drive_ctx, ScsiCommandBlockWrapper *cbw, void *buf);
+static bool usbHsFsScsiTransferCommandEx(UsbHsFsDriveContext *drive_ctx, ScsiCommandBlockWrapper *cbw, const ScsiDataBuffer *data);
+static void usbHsFsScsiCopyDataBuffer(const ScsiDataBuffer *data, u64 offset, void *ptr, u64 size, bool to_data_buf);
+
+static bool usbHsFsScsiTransferLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, const UsbHsFsScsiBlockIoSegment *segments, u32 segment_count, bool write);
+static void usbHsFsScsiSortBlockIoSegments(UsbHsFsScsiBlockIoSegment *segments, u32 segment_count);
+static bool usbHsFsScsiWriteZeroedLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, u64 block_addr, u64 block_count);
 
 static bool usbHsFsScsiSendCommandBlockWrapper(UsbHsFsDriveContext *drive_ctx, ScsiCommandBlockWrapper *cbw);
 static bool usbHsFsScsiReceiveCommandStatusWrapper(UsbHsFsDriveContext *drive_ctx, ScsiCommandBlockWrapper *cbw, ScsiCommandStatusWrapper *out_csw);
@@ -387,6 +499,7 @@ bool usbHsFsScsiStartDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx)
     }
 
     ScsiInquiryStandardData inquiry_data = {0};
+    char vendor_id[0x9] = {0}, product_id[0x11] = {0};
 
     u8 inquiry_vpd_buf[0x110] = {0};
     char *serial_number = NULL;
@@ -394,19 +507,25 @@ bool usbHsFsScsiStartDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx)
 
     ScsiModeParameterHeader6 mode_parameter_header_6 = {0};
     ScsiModeParameterHeader10 mode_parameter_header_10 = {0};
+    bool mode_sense_supported = false, mode_sense_10 = false;
+
+    ScsiCachingModePage caching_mode_page = {0};
+    bool write_cache_enabled = false, read_cache_disabled = false, write_back = false;
 
     ScsiReadCapacity10Data read_capacity_10_data = {0};
     ScsiReadCapacity16Data read_capacity_16_data = {0};
     u64 block_count = 0, block_length = 0, capacity = 0;
+    u8 block_length_log2 = 0;
+    u32 max_block_count = 0;
 
-    bool ret = false, eject_supported = false, write_protect = false, fua_supported = false, long_lba = false;
+    bool ret = false, identity_cached = false, removable = false, eject_supported = false, write_protect = false, fua_supported = false, long_lba = false;
 
     USBHSFS_LOG_MSG("Starting LUN #%u from drive with interface ID %d.", lun, drive_ctx->usb_if_id);
 
     /* Reset medium present flag. */
     g_mediumPresent = true;
 
-    /* Send standard Inquiry SCSI command. */
+    /* Send standard Inquiry SCSI command. This is always done, even if identity data for this LUN is cached - many USB bridges expect it before any other command. */
     if (!usbHsFsScsiSendInquiryCommand(drive_ctx, lun, false, ScsiInquiryVitalProductDataPageCode_None, sizeof(ScsiInquiryStandardData), &inquiry_data))
     {
         USBHSFS_LOG_MSG("Inquiry failed! (interface %d, LUN %d).", drive_ctx->usb_if_id, lun);
@@ -415,9 +534,36 @@ bool usbHsFsScsiStartDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx)
 
     USBHSFS_LOG_DATA(&inquiry_data, sizeof(ScsiInquiryStandardData), "Standard Inquiry data (interface %d, LUN %u):", drive_ctx->usb_if_id, lun);
 
-    /* Send Unit Serial Number VPD Inquiry SCSI command. */
+    /* Check if we're dealing with an available Direct Access Block device. */
+    if (inquiry_data.peripheral_qualifier != ScsiInquiryPeripheralQualifier_Connected || inquiry_data.peripheral_device_type != ScsiInquiryPeripheralDeviceType_DirectAccessBlock)
+    {
+        USBHSFS_LOG_MSG("Unsupported peripheral qualifier and/or device type! (0x%02X) (interface %d, LUN %d).", *((u8*)&inquiry_data), drive_ctx->usb_if_id, lun);
+        goto end;
+    }
+
+    /* Check if the SPC standard version is valid. */
+    if (inquiry_data.version > ScsiInquirySPCVersion_SPC5)
+    {
+        USBHSFS_LOG_MSG("Invalid SPC standard version value! (0x%02X) (interface %d, LUN %d).", inquiry_data.version, drive_ctx->usb_if_id, lun);
+        goto end;
+    }
+
+    removable = inquiry_data.rmb;
+
+    /* Get vendor and product identification strings. */
+    memcpy(vendor_id, inquiry_data.vendor_id, sizeof(inquiry_data.vendor_id));
+    usbHsFsUtilsTrimString(vendor_id);
+
+    memcpy(product_id, inquiry_data.product_id, sizeof(inquiry_data.product_id));
+    usbHsFsUtilsTrimString(product_id);
+
+    /* Skip the Unit Serial Number VPD Inquiry commands if identity data for this LUN is available in the drive cache, as long as it matches the standard Inquiry data. */
+    identity_cached = (usbHsFsDriveCacheGetLogicalUnitIdentity(lun_ctx) && lun_ctx->removable == removable && !strcmp(lun_ctx->vendor_id, vendor_id) && !strcmp(lun_ctx->product_id, product_id));
+    if (identity_cached) goto start_unit;
+
+    /* Send Unit Serial Number VPD Inquiry SCSI command, unless this device is known to choke on VPD Inquiry commands. */
     /* We'll first retrieve the Unit Serial Number VPD page header (in order to get the serial number length), then we'll retrieve the full VPD page. */
-    if (usbHsFsScsiSendInquiryCommand(drive_ctx, lun, true, ScsiInquiryVitalProductDataPageCode_UnitSerialNumber, sizeof(ScsiInquiryUnitSerialNumberPageHeader), inquiry_vpd_buf))
+    if (!(drive_ctx->quirks & UsbHsFsDeviceQuirks_NoVpdInquiry) && usbHsFsScsiSendInquiryCommand(drive_ctx, lun, true, ScsiInquiryVitalProductDataPageCode_UnitSerialNumber, sizeof(ScsiInquiryUnitSerialNumberPageHeader), inquiry_vpd_buf))
     {
         USBHSFS_LOG_DATA(inquiry_vpd_buf, sizeof(ScsiInquiryUnitSerialNumberPageHeader), "Unit Serial Number VPD Inquiry data (partial) (interface %d, LUN %u):", drive_ctx->usb_if_id, lun);
 
@@ -441,23 +587,10 @@ bool usbHsFsScsiStartDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx)
         serial_number_length = strnlen(serial_number, sizeof(inquiry_data.serial_number));
     }
 
-    /* Check if we're dealing with an available Direct Access Block device. */
-    if (inquiry_data.peripheral_qualifier != ScsiInquiryPeripheralQualifier_Connected || inquiry_data.peripheral_device_type != ScsiInquiryPeripheralDeviceType_DirectAccessBlock)
-    {
-        USBHSFS_LOG_MSG("Unsupported peripheral qualifier and/or device type! (0x%02X) (interface %d, LUN %d).", *((u8*)&inquiry_data), drive_ctx->usb_if_id, lun);
-        goto end;
-    }
-
-    /* Check if the SPC standard version is valid. */
-    if (inquiry_data.version > ScsiInquirySPCVersion_SPC5)
-    {
-        USBHSFS_LOG_MSG("Invalid SPC standard version value! (0x%02X) (interface %d, LUN %d).", inquiry_data.version, drive_ctx->usb_if_id, lun);
-        goto end;
-    }
-
+start_unit:
     /* Perform necessary steps for removable LUNs. */
     /* Reference: https://t10.org/ftp/t10/document.05/05-344r0.pdf (page 26). */
-    if (inquiry_data.rmb)
+    if (removable)
     {
         /* Send Prevent/Allow Medium Removal SCSI command. Not supported by all devices. We're OK if it fails. */
         if (usbHsFsScsiSendPreventAllowMediumRemovalCommand(drive_ctx, lun, true))
@@ -477,18 +610,22 @@ bool usbHsFsScsiStartDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx)
         }
     }
 
-    /* Send Mode Sense (6) SCSI command. */
+    /* Send Mode Sense (6) SCSI command, unless this device is known to not support it (or Mode Sense commands altogether). */
     /* We'll only request the mode parameter header to determine if there's write protection in place and if the FUA feature is supported. */
-    if (usbHsFsScsiSendModeSense6Command(drive_ctx, lun, ScsiModeSensePageControl_CurrentValues, SCSI_MODE_PAGE_CODE_ALL, SCSI_MODE_SUBPAGE_CODE_ALL_NO_SUBPAGES, \
-                                         sizeof(ScsiModeParameterHeader6), &mode_parameter_header_6))
+    if (drive_ctx->quirks & UsbHsFsDeviceQuirks_NoModeSense)
+    {
+        USBHSFS_LOG_MSG("Skipping Mode Sense commands (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
+    } else if (!(drive_ctx->quirks & UsbHsFsDeviceQuirks_NoModeSense6) && usbHsFsScsiSendModeSense6Command(drive_ctx, lun, ScsiModeSensePageControl_CurrentValues, SCSI_MODE_PAGE_CODE_ALL, \
+                                                                                                           SCSI_MODE_SUBPAGE_CODE_ALL_NO_SUBPAGES, sizeof(ScsiModeParameterHeader6), &mode_parameter_header_6))
     {
         USBHSFS_LOG_DATA(&mode_parameter_header_6, sizeof(ScsiModeParameterHeader6), "Mode Sense (6) data (interface %d, LUN %u):", drive_ctx->usb_if_id, lun);
 
         /* Update Write Protect and FUA supported flags. */
         write_protect = (mode_parameter_header_6.wp == 1);
         fua_supported = (mode_parameter_header_6.dpofua == 1);
+        mode_sense_supported = true;
     } else {
-        USBHSFS_LOG_MSG("Mode Sense (6) failed! (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
+        if (!(drive_ctx->quirks & UsbHsFsDeviceQuirks_NoModeSense6)) USBHSFS_LOG_MSG("Mode Sense (6) failed! (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
 
         /* Send Mode Sense (10) SCSI command. */
         /* Odds are we're dealing with a device that doesn't support Mode Sense (6). */
@@ -500,12 +637,45 @@ bool usbHsFsScsiStartDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx)
             /* Update Write Protect and FUA supported flags. */
             write_protect = (mode_parameter_header_10.wp == 1);
             fua_supported = (mode_parameter_header_10.dpofua == 1);
+            mode_sense_supported = mode_sense_10 = true;
         } else {
             /* Nothing else to do - Mode Sense commands most likely aren't supported at all. */
             USBHSFS_LOG_MSG("Mode Sense (10) failed! (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
         }
     }
 
+    /* Retrieve the Caching mode page using the same Mode Sense command variant. Not supported by all devices. We're OK if it fails. */
+    if (mode_sense_supported && usbHsFsScsiGetCachingModePage(drive_ctx, lun, mode_sense_10, &caching_mode_page))
+    {
+        /* Update Write Cache Enable and Read Cache Disable flags. */
+        write_cache_enabled = (caching_mode_page.wce == 1);
+        read_cache_disabled = (caching_mode_page.rcd == 1);
+
+        /* Enable the volatile write cache if requested. Some USB bridges ship with it disabled, which makes them write at a fraction of their capable speed. */
+        /* Saved parameters are left untouched, so the drive reverts to its previous configuration after a power cycle. */
+        if (g_enableWriteCache && !write_cache_enabled && !write_protect)
+        {
+            caching_mode_page.wce = 1;
+
+            if (usbHsFsScsiSetCachingModePage(drive_ctx, lun, mode_sense_10, &caching_mode_page) && usbHsFsScsiGetCachingModePage(drive_ctx, lun, mode_sense_10, &caching_mode_page))
+            {
+                write_cache_enabled = (caching_mode_page.wce == 1);
+                USBHSFS_LOG_MSG("Write cache %s (interface %d, LUN %u).", write_cache_enabled ? "enabled" : "couldn't be enabled", drive_ctx->usb_if_id, lun);
+            } else {
+                USBHSFS_LOG_MSG("Failed to enable write cache! (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
+            }
+        }
+    }
+
+    /* If the write cache is enabled and write caching was requested, issue Write commands without FUA and flush the write cache with Synchronize Cache commands instead. */
+    write_back = (g_enableWriteCache && write_cache_enabled && !write_protect);
+
+    /* Don't use FUA with devices known to report support for it without handling it properly. */
+    if (drive_ctx->quirks & UsbHsFsDeviceQuirks_NoFua) fua_supported = false;
+
+    /* Give slow devices some extra time to spin up before sending a Test Unit Ready command. */
+    if (drive_ctx->quirks & UsbHsFsDeviceQuirks_TestUnitReadyDelay) usbHsFsUtilsSleep(1);
+
     /* Send Test Unit Ready SCSI command. */
     if (!usbHsFsScsiSendTestUnitReadyCommand(drive_ctx, lun))
     {
@@ -545,15 +715,17 @@ bool usbHsFsScsiStartDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx)
         block_length = __builtin_bswap32(read_capacity_10_data.block_length);
     }
 
-    /* Verify block length. */
-    if (!block_length || (block_length % BLKDEV_MIN_BLOCK_SIZE) != 0 || block_length > BLKDEV_MAX_BLOCK_SIZE)
+    /* Verify block length. It must be a power of two, so we can use shifts instead of multiplications and divisions everywhere else. */
+    if (block_length < BLKDEV_MIN_BLOCK_SIZE || block_length > BLKDEV_MAX_BLOCK_SIZE || (block_length & (block_length - 1)))
     {
         USBHSFS_LOG_MSG("Invalid block length! (0x%lX) (interface %d, LUN %u).", block_length, drive_ctx->usb_if_id, lun);
         goto end;
     }
 
+    block_length_log2 = (u8)__builtin_ctzl(block_length);
+
     /* Calculate LUN capacity. */
-    capacity = (block_count * block_length);
+    capacity = (block_count << block_length_log2);
     if (!capacity)
     {
         USBHSFS_LOG_MSG("Capacity is zero! (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
@@ -562,29 +734,42 @@ bool usbHsFsScsiStartDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx)
 
     USBHSFS_LOG_MSG("Capacity (interface %d, LUN %u): 0x%lX byte(s).", drive_ctx->usb_if_id, lun, capacity);
 
-    /* Fill LUN context. */
-    lun_ctx->removable = inquiry_data.rmb;
+    /* Set max block count per Read/Write command. */
+    /* Short LBA LUNs: this is just SCSI_RW10_MAX_BLOCK_COUNT. */
+    /* Long LBA LUNs: up to UINT32_MAX blocks should be supported, but some tests with 4 TB drives show that only up to SCSI_RW10_MAX_BLOCK_COUNT + 1 blocks can be transferred at once. */
+    /* The device quirks table may override this value, but it must never exceed what the command itself can hold. */
+    max_block_count = (long_lba ? (SCSI_RW10_MAX_BLOCK_COUNT + 1) : SCSI_RW10_MAX_BLOCK_COUNT);
+    if (drive_ctx->max_block_count) max_block_count = ((long_lba || drive_ctx->max_block_count < SCSI_RW10_MAX_BLOCK_COUNT) ? drive_ctx->max_block_count : SCSI_RW10_MAX_BLOCK_COUNT);
+
+    /* Fill LUN context. Identity data has already been filled if it was retrieved from the drive cache. */
+    lun_ctx->removable = removable;
     lun_ctx->eject_supported = eject_supported;
     lun_ctx->write_protect = write_protect;
     lun_ctx->fua_supported = fua_supported;
+    lun_ctx->write_cache_enabled = write_cache_enabled;
+    lun_ctx->read_cache_disabled = read_cache_disabled;
+    lun_ctx->write_back = write_back;
 
-    memcpy(lun_ctx->vendor_id, inquiry_data.vendor_id, sizeof(inquiry_data.vendor_id));
-    usbHsFsUtilsTrimString(lun_ctx->vendor_id);
-
-    memcpy(lun_ctx->product_id, inquiry_data.product_id, sizeof(inquiry_data.product_id));
-    usbHsFsUtilsTrimString(lun_ctx->product_id);
-
-    /* We'll only copy the serial number string if it holds printable data. */
-    if (usbHsFsUtilsIsAsciiString(serial_number, serial_number_length))
+    if (!identity_cached)
     {
-        snprintf(lun_ctx->serial_number, sizeof(lun_ctx->serial_number), "%.*s", (int)serial_number_length, serial_number);
-        usbHsFsUtilsTrimString(lun_ctx->serial_number);
+        snprintf(lun_ctx->vendor_id, sizeof(lun_ctx->vendor_id), "%s", vendor_id);
+        snprintf(lun_ctx->product_id, sizeof(lun_ctx->product_id), "%s", product_id);
+
+        /* We'll only copy the serial number string if it holds printable data. */
+        memset(lun_ctx->serial_number, 0, sizeof(lun_ctx->serial_number));
+        if (usbHsFsUtilsIsAsciiString(serial_number, serial_number_length))
+        {
+            snprintf(lun_ctx->serial_number, sizeof(lun_ctx->serial_number), "%.*s", (int)serial_number_length, serial_number);
+            usbHsFsUtilsTrimString(lun_ctx->serial_number);
+        }
     }
 
     lun_ctx->long_lba = long_lba;
     lun_ctx->block_count = block_count;
     lun_ctx->block_length = block_length;
+    lun_ctx->block_length_log2 = block_length_log2;
     lun_ctx->capacity = capacity;
+    lun_ctx->max_block_count = max_block_count;
 
     /* Update return value. */
     ret = true;
@@ -595,7 +780,7 @@ end:
     /* Stop removable LUN if we successfully started it but the overall process failed. */
     /* Send Prevent/Allow Medium Removal SCSI command first. */
     /* Reference: https://t10.org/ftp/t10/document.05/05-344r0.pdf (page 26). */
-    if (!ret && inquiry_data.rmb && eject_supported && usbHsFsScsiSendPreventAllowMediumRemovalCommand(drive_ctx, lun, false))
+    if (!ret && removable && eject_supported && usbHsFsScsiSendPreventAllowMediumRemovalCommand(drive_ctx, lun, false))
     {
         /* Send Start Stop Unit SCSI command. */
         usbHsFsScsiSendStartStopUnitCommand(drive_ctx, lun, false);
@@ -607,8 +792,13 @@ end:
 /* Reference: https://t10.org/ftp/t10/document.05/05-344r0.pdf (page 26). */
 void usbHsFsScsiStopDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx)
 {
-    /* Only perform these steps on valid LUNs that are removable and support ejection. */
-    if (!usbHsFsDriveIsValidLogicalUnitContext(lun_ctx) || !lun_ctx->removable || !lun_ctx->eject_supported) return;
+    if (!usbHsFsDriveIsValidLogicalUnitContext(lun_ctx)) return;
+
+    /* Flush the write cache, if needed. */
+    usbHsFsScsiSynchronizeLogicalUnitCache(lun_ctx);
+
+    /* Only perform these steps on LUNs that are removable and support ejection. */
+    if (!lun_ctx->removable || !lun_ctx->eject_supported) return;
 
     /* Retrieve LUN context. */
     UsbHsFsDriveContext *drive_ctx = (UsbHsFsDriveContext*)lun_ctx->drive_ctx;
@@ -621,51 +811,116 @@ void usbHsFsScsiStopDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx)
     }
 }
 
-bool usbHsFsScsiReadLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, void *buf, u64 block_addr, u32 block_count)
+bool usbHsFsScsiCheckDriveLogicalUnitReady(UsbHsFsDriveContext *drive_ctx, u8 lun)
 {
-    UsbHsFsDriveContext *drive_ctx = (UsbHsFsDriveContext*)lun_ctx->drive_ctx;
-    u8 lun = lun_ctx->lun, *data_buf = (u8*)buf;
-    u64 cur_block_addr = block_addr, data_transferred = 0;
-    u32 block_length = lun_ctx->block_length, cmd_max_block_count = 0, buf_block_count = (USB_XFER_BUF_SIZE / block_length), max_block_count_per_loop = 0;
-    bool fua = lun_ctx->fua_supported, long_lba = lun_ctx->long_lba, cmd = false;
-
-    /* Set max block count per Read command. */
-    /* Short LBA LUNs: this is just SCSI_RW10_MAX_BLOCK_COUNT. */
-    /* Long LBA LUNs: up to UINT32_MAX blocks should be supported, but some tests with 4 TB Seagate drives show that only up to SCSI_RW10_MAX_BLOCK_COUNT + 1 blocks can be read at once. */
-    cmd_max_block_count = (long_lba ? (SCSI_RW10_MAX_BLOCK_COUNT + 1) : SCSI_RW10_MAX_BLOCK_COUNT);
+    if (!usbHsFsDriveIsValidContext(drive_ctx) || lun >= UMS_MAX_LUN)
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return false;
+    }
 
-    /* Optimize reads by issuing commands with block counts aligned to the transfer buffer size. Reserve short packets for the last Read command (if needed). */
-    max_block_count_per_loop = ALIGN_DOWN(cmd_max_block_count, buf_block_count);
+    ScsiCommandBlockWrapper cbw = {0};
+    ScsiCommandStatusWrapper csw = {0};
+    ScsiRequestSenseDataFixedFormat sense_data = {0};
 
-    /* Read data using a loop. */
-    while(block_count)
+    for(u8 i = 0; i < SCSI_WARM_START_TUR_ATTEMPTS; i++)
     {
-        /* Determine number of blocks to read based on our limit. */
-        u32 xfer_block_count = (block_count > max_block_count_per_loop ? max_block_count_per_loop : block_count);
-        u64 xfer_size = ((u64)xfer_block_count * (u64)block_length);
+        /* Prepare CBW. */
+        usbHsFsScsiPrepareCommandBlockWrapper(&cbw, 0, false, lun, 6);
 
-        /* Read blocks. */
-        USBHSFS_LOG_MSG("Reading 0x%X block(s) from LBA 0x%lX (0x%lX byte[s]) (interface %d, LUN %u).", xfer_block_count, cur_block_addr, xfer_size, lun_ctx->usb_if_id, lun);
-        cmd = (long_lba ? usbHsFsScsiSendRead16Command(drive_ctx, lun, data_buf + data_transferred, cur_block_addr, xfer_block_count, block_length, fua) : \
-                          usbHsFsScsiSendRead10Command(drive_ctx, lun, data_buf + data_transferred, (u32)cur_block_addr, (u16)xfer_block_count, block_length, fua));
-        if (!cmd) break;
+        /* Prepare CB. */
+        cbw.CBWCB[0] = ScsiCommandOperationCode_TestUnitReady;  /* Operation code. */
 
-        /* Update data. */
-        data_transferred += xfer_size;
-        cur_block_addr += xfer_block_count;
-        block_count -= xfer_block_count;
+        /* Send Test Unit Ready SCSI command. */
+        /* usbHsFsScsiTransferCommand() isn't used here because we don't want to wait for a LUN that isn't ready. The caller is expected to perform a bus reset in that case. */
+        USBHSFS_LOG_MSG("Sending command (interface %d, LUN %u, attempt #%u).", drive_ctx->usb_if_id, lun, i + 1);
+        if (!usbHsFsScsiSendCommandBlockWrapper(drive_ctx, &cbw) || !usbHsFsScsiReceiveCommandStatusWrapper(drive_ctx, &cbw, &csw)) break;
+
+        if (csw.bCSWStatus == ScsiCommandStatus_Passed) return true;
+        if (csw.bCSWStatus != ScsiCommandStatus_Failed) break;
+
+        /* Send Request Sense SCSI command. This also clears any pending Unit Attention condition. */
+        if (!usbHsFsScsiSendRequestSenseCommand(drive_ctx, lun, &sense_data)) break;
+
+        USBHSFS_LOG_DATA(&sense_data, sizeof(ScsiRequestSenseDataFixedFormat), "Request Sense data (interface %d, LUN %u):", drive_ctx->usb_if_id, lun);
+
+        /* A Unit Attention condition is to be expected right after a reset, so we'll just try again. Anything else means the LUN isn't ready. */
+        if (sense_data.sense_key != ScsiSenseKey_UnitAttention) break;
+    }
+
+    USBHSFS_LOG_MSG("LUN isn't ready (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
+
+    return false;
+}
+
+bool usbHsFsScsiSynchronizeLogicalUnitCache(UsbHsFsDriveLogicalUnitContext *lun_ctx)
+{
+    if (!usbHsFsDriveIsValidLogicalUnitContext(lun_ctx))
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return false;
     }
 
-    return (block_count == 0);
+    /* Nothing to do if writes aren't being cached by the LUN. */
+    if (!lun_ctx->write_back) return true;
+
+    UsbHsFsDriveContext *drive_ctx = (UsbHsFsDriveContext*)lun_ctx->drive_ctx;
+    bool ret = false;
+
+    /* Send Synchronize Cache SCSI command. A zero block count covers all blocks from the provided LBA to the end of the medium. */
+    ret = (lun_ctx->long_lba ? usbHsFsScsiSendSynchronizeCache16Command(drive_ctx, lun_ctx->lun, 0, 0) : usbHsFsScsiSendSynchronizeCache10Command(drive_ctx, lun_ctx->lun, 0, 0));
+    if (!ret) USBHSFS_LOG_MSG("Synchronize Cache failed! (interface %d, LUN %u).", lun_ctx->usb_if_id, lun_ctx->lun);
+
+    return ret;
+}
+
+bool usbHsFsScsiGetEnableWriteCache(void)
+{
+    return g_enableWriteCache;
+}
+
+void usbHsFsScsiSetEnableWriteCache(bool enable)
+{
+    g_enableWriteCache = enable;
+}
+
+bool usbHsFsScsiReadLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, void *buf, u64 block_addr, u32 block_count)
+{
+    UsbHsFsScsiBlockIoSegment segment = { .block_addr = block_addr, .block_count = block_count, .buf = buf };
+    return usbHsFsScsiTransferLogicalUnitBlocks(lun_ctx, &segment, 1, false);
 }
 
 bool usbHsFsScsiWriteLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, const void *buf, u64 block_addr, u32 block_count)
 {
+    UsbHsFsScsiBlockIoSegment segment = { .block_addr = block_addr, .block_count = block_count, .buf = (void*)buf };
+    return usbHsFsScsiTransferLogicalUnitBlocks(lun_ctx, &segment, 1, true);
+}
+
+bool usbHsFsScsiReadLogicalUnitBlocksV(UsbHsFsDriveLogicalUnitContext *lun_ctx, UsbHsFsScsiBlockIoSegment *segments, u32 segment_count)
+{
+    usbHsFsScsiSortBlockIoSegments(segments, segment_count);
+    return usbHsFsScsiTransferLogicalUnitBlocks(lun_ctx, segments, segment_count, false);
+}
+
+bool usbHsFsScsiWriteLogicalUnitBlocksV(UsbHsFsDriveLogicalUnitContext *lun_ctx, UsbHsFsScsiBlockIoSegment *segments, u32 segment_count)
+{
+    usbHsFsScsiSortBlockIoSegments(segments, segment_count);
+    return usbHsFsScsiTransferLogicalUnitBlocks(lun_ctx, segments, segment_count, true);
+}
+
+bool usbHsFsScsiZeroLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, u64 block_addr, u64 block_count)
+{
+    if (!usbHsFsDriveIsValidLogicalUnitContext(lun_ctx) || !block_count || block_addr >= lun_ctx->block_count || block_count > (lun_ctx->block_count - block_addr))
+    {
+        USBHSFS_LOG_MSG("Invalid parameters!");
+        return false;
+    }
+
     UsbHsFsDriveContext *drive_ctx = (UsbHsFsDriveContext*)lun_ctx->drive_ctx;
-    u8 lun = lun_ctx->lun, *data_buf = (u8*)buf;
-    u64 cur_block_addr = block_addr, data_transferred = 0;
-    u32 block_length = lun_ctx->block_length, cmd_max_block_count = 0, buf_block_count = (USB_XFER_BUF_SIZE / block_length), max_block_count_per_loop = 0;
-    bool fua = lun_ctx->fua_supported, long_lba = lun_ctx->long_lba, cmd = false;
+    u8 lun = lun_ctx->lun;
+    u32 block_length = lun_ctx->block_length;
+    u64 cur_block_addr = block_addr, rest_block_count = block_count;
+    bool long_lba = lun_ctx->long_lba, write_same_used = false, ret = false;
 
     /* Make sure write protection is disabled. */
     if (lun_ctx->write_protect)
@@ -674,34 +929,48 @@ bool usbHsFsScsiWriteLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx,
         return false;
     }
 
-    /* Set max block count per Write command. */
-    /* Short LBA LUNs: this is just SCSI_RW10_MAX_BLOCK_COUNT. */
-    /* Long LBA LUNs: up to UINT32_MAX blocks should be supported, but some tests with 4 TB Seagate drives show that only up to SCSI_RW10_MAX_BLOCK_COUNT + 1 blocks can be written at once. */
-    cmd_max_block_count = (long_lba ? (SCSI_RW10_MAX_BLOCK_COUNT + 1) : SCSI_RW10_MAX_BLOCK_COUNT);
-
-    /* Optimize writes by issuing commands with block counts aligned to the transfer buffer size. Reserve short packets for the last Write command (if needed). */
-    max_block_count_per_loop = ALIGN_DOWN(cmd_max_block_count, buf_block_count);
+    /* Probe Write Same support the first time this LUN is zeroed out. */
+    if (!lun_ctx->write_same_probed) usbHsFsScsiProbeLogicalUnitWriteSame(lun_ctx);
 
-    /* Write data using a loop. */
-    while(block_count)
+    if (lun_ctx->write_same_supported)
     {
-        /* Determine number of blocks to write based on our limit. */
-        u32 xfer_block_count = (block_count > max_block_count_per_loop ? max_block_count_per_loop : block_count);
-        u64 xfer_size = ((u64)xfer_block_count * (u64)block_length);
+        /* A single zeroed out block is sent with each Write Same command, which the LUN replicates across the whole LBA range by itself. */
+        /* Unmapped blocks are requested instead if they're known to read back as zeros, which is usually much faster on flash based media. */
+        ScsiDataBuffer data = { .buf = NULL, .segments = NULL, .segment_count = 0, .block_length_log2 = lun_ctx->block_length_log2, .offset = 0, .zero = true };
+        u32 max_block_count_per_loop = lun_ctx->max_write_same_block_count;
+        bool unmap = lun_ctx->write_same_unmap;
 
-        /* Write blocks. */
-        USBHSFS_LOG_MSG("Writing 0x%X block(s) to LBA 0x%lX (0x%lX byte[s]) (interface %d, LUN %u).", xfer_block_count, cur_block_addr, xfer_size, lun_ctx->usb_if_id, lun);
-        cmd = (long_lba ? usbHsFsScsiSendWrite16Command(drive_ctx, lun, data_buf + data_transferred, cur_block_addr, xfer_block_count, block_length, fua) : \
-                          usbHsFsScsiSendWrite10Command(drive_ctx, lun, data_buf + data_transferred, (u32)cur_block_addr, (u16)xfer_block_count, block_length, fua));
-        if (!cmd) break;
+        while(rest_block_count)
+        {
+            u32 xfer_block_count = (u32)(rest_block_count > max_block_count_per_loop ? max_block_count_per_loop : rest_block_count);
 
-        /* Update data. */
-        data_transferred += xfer_size;
-        cur_block_addr += xfer_block_count;
-        block_count -= xfer_block_count;
+            USBHSFS_LOG_MSG("Zeroing 0x%X block(s) at LBA 0x%lX via Write Same (unmap: %u) (interface %d, LUN %u).", xfer_block_count, cur_block_addr, unmap, lun_ctx->usb_if_id, lun);
+
+            if (!(long_lba ? usbHsFsScsiSendWriteSame16Command(drive_ctx, lun, &data, cur_block_addr, xfer_block_count, block_length, unmap) : \
+                             usbHsFsScsiSendWriteSame10Command(drive_ctx, lun, &data, (u32)cur_block_addr, (u16)xfer_block_count, block_length, unmap)))
+            {
+                /* Don't use Write Same commands with this LUN anymore. Zero out the rest of the blocks using regular Write commands. */
+                USBHSFS_LOG_MSG("Write Same failed! Disabling it (interface %d, LUN %u).", lun_ctx->usb_if_id, lun);
+                lun_ctx->write_same_supported = false;
+                break;
+            }
+
+            cur_block_addr += xfer_block_count;
+            rest_block_count -= xfer_block_count;
+            write_same_used = true;
+        }
+    }
+
+    ret = (!rest_block_count || usbHsFsScsiWriteZeroedLogicalUnitBlocks(lun_ctx, cur_block_addr, rest_block_count));
+
+    /* Write Same commands have no FUA bit. Flush the write cache if it's enabled and we're not using write-back caching, which relies on explicit flushes. */
+    if (ret && write_same_used && lun_ctx->write_cache_enabled && !lun_ctx->write_back)
+    {
+        ret = (long_lba ? usbHsFsScsiSendSynchronizeCache16Command(drive_ctx, lun, 0, 0) : usbHsFsScsiSendSynchronizeCache10Command(drive_ctx, lun, 0, 0));
+        if (!ret) USBHSFS_LOG_MSG("Synchronize Cache failed! (interface %d, LUN %u).", lun_ctx->usb_if_id, lun);
     }
 
-    return (block_count == 0);
+    return ret;
 }
 
 /* Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (page 230). */
@@ -828,7 +1097,7 @@ static bool usbHsFsScsiSendReadCapacity10Command(UsbHsFsDriveContext *drive_ctx,
 }
 
 /* Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (page 136). */
-static bool usbHsFsScsiSendRead10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, void *buf, u32 block_addr, u16 block_count, u32 block_length, bool fua)
+static bool usbHsFsScsiSendRead10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u32 block_addr, u16 block_count, u32 block_length, bool fua)
 {
     /* Prepare CBW. */
     ScsiCommandBlockWrapper cbw = {0};
@@ -846,11 +1115,11 @@ static bool usbHsFsScsiSendRead10Command(UsbHsFsDriveContext *drive_ctx, u8 lun,
 
     /* Send command. */
     USBHSFS_LOG_MSG("Sending command (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
-    return usbHsFsScsiTransferCommand(drive_ctx, &cbw, buf);
+    return usbHsFsScsiTransferCommandEx(drive_ctx, &cbw, data);
 }
 
 /* Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (page 249). */
-static bool usbHsFsScsiSendWrite10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, void *buf, u32 block_addr, u16 block_count, u32 block_length, bool fua)
+static bool usbHsFsScsiSendWrite10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u32 block_addr, u16 block_count, u32 block_length, bool fua)
 {
     /* Prepare CBW. */
     ScsiCommandBlockWrapper cbw = {0};
@@ -868,7 +1137,7 @@ static bool usbHsFsScsiSendWrite10Command(UsbHsFsDriveContext *drive_ctx, u8 lun
 
     /* Send command. */
     USBHSFS_LOG_MSG("Sending command (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
-    return usbHsFsScsiTransferCommand(drive_ctx, &cbw, buf);
+    return usbHsFsScsiTransferCommandEx(drive_ctx, &cbw, data);
 }
 
 /* Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (page 227). */
@@ -916,7 +1185,7 @@ static bool usbHsFsScsiSendModeSense10Command(UsbHsFsDriveContext *drive_ctx, u8
 }
 
 /* Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (page 141). */
-static bool usbHsFsScsiSendRead16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, void *buf, u64 block_addr, u32 block_count, u32 block_length, bool fua)
+static bool usbHsFsScsiSendRead16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u64 block_addr, u32 block_count, u32 block_length, bool fua)
 {
     /* Prepare CBW. */
     ScsiCommandBlockWrapper cbw = {0};
@@ -934,11 +1203,11 @@ static bool usbHsFsScsiSendRead16Command(UsbHsFsDriveContext *drive_ctx, u8 lun,
 
     /* Send command. */
     USBHSFS_LOG_MSG("Sending command (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
-    return usbHsFsScsiTransferCommand(drive_ctx, &cbw, buf);
+    return usbHsFsScsiTransferCommandEx(drive_ctx, &cbw, data);
 }
 
 /* Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (page 254). */
-static bool usbHsFsScsiSendWrite16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, void *buf, u64 block_addr, u32 block_count, u32 block_length, bool fua)
+static bool usbHsFsScsiSendWrite16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u64 block_addr, u32 block_count, u32 block_length, bool fua)
 {
     /* Prepare CBW. */
     ScsiCommandBlockWrapper cbw = {0};
@@ -956,7 +1225,7 @@ static bool usbHsFsScsiSendWrite16Command(UsbHsFsDriveContext *drive_ctx, u8 lun
 
     /* Send command. */
     USBHSFS_LOG_MSG("Sending command (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
-    return usbHsFsScsiTransferCommand(drive_ctx, &cbw, buf);
+    return usbHsFsScsiTransferCommandEx(drive_ctx, &cbw, data);
 }
 
 /* Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (page 229). */
@@ -1001,6 +1270,238 @@ static bool usbHsFsScsiSendReadCapacity16Command(UsbHsFsDriveContext *drive_ctx,
     return usbHsFsScsiTransferCommand(drive_ctx, &cbw, read_capacity_16_data);
 }
 
+/* Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (Mode Select (6) command). */
+static bool usbHsFsScsiSendModeSelect6Command(UsbHsFsDriveContext *drive_ctx, u8 lun, u8 parameter_list_length, void *buf)
+{
+    /* Prepare CBW. */
+    ScsiCommandBlockWrapper cbw = {0};
+    usbHsFsScsiPrepareCommandBlockWrapper(&cbw, parameter_list_length, false, lun, 6);
+
+    /* Prepare CB. */
+    cbw.CBWCB[0] = ScsiCommandOperationCode_ModeSelect6;    /* Operation code. */
+    cbw.CBWCB[1] = (1 << 4);                                /* Set PF bit, always clear SP bit. */
+    cbw.CBWCB[4] = parameter_list_length;                   /* Set parameter list length. */
+
+    /* Send command. */
+    USBHSFS_LOG_MSG("Sending command (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
+    return usbHsFsScsiTransferCommand(drive_ctx, &cbw, buf);
+}
+
+/* Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (Mode Select (10) command). */
+static bool usbHsFsScsiSendModeSelect10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, u16 parameter_list_length, void *buf)
+{
+    /* Prepare CBW. */
+    ScsiCommandBlockWrapper cbw = {0};
+    usbHsFsScsiPrepareCommandBlockWrapper(&cbw, parameter_list_length, false, lun, 10);
+
+    /* Byteswap data. */
+    parameter_list_length = __builtin_bswap16(parameter_list_length);
+
+    /* Prepare CB. */
+    cbw.CBWCB[0] = ScsiCommandOperationCode_ModeSelect10;           /* Operation code. */
+    cbw.CBWCB[1] = (1 << 4);                                        /* Set PF bit, always clear SP bit. */
+    memcpy(&(cbw.CBWCB[7]), &parameter_list_length, sizeof(u16));   /* Parameter list length (big endian). */
+
+    /* Send command. */
+    USBHSFS_LOG_MSG("Sending command (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
+    return usbHsFsScsiTransferCommand(drive_ctx, &cbw, buf);
+}
+
+/* Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (Write Same (10) command). */
+static bool usbHsFsScsiSendWriteSame10Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u32 block_addr, u16 block_count, u32 block_length, bool unmap)
+{
+    /* Prepare CBW. A single logical block is transferred, regardless of the number of blocks being written. */
+    ScsiCommandBlockWrapper cbw = {0};
+    usbHsFsScsiPrepareCommandBlockWrapper(&cbw, block_length, false, lun, 10);
+
+    /* Byteswap data. */
+    block_addr = __builtin_bswap32(block_addr);
+    block_count = __builtin_bswap16(block_count);
+
+    /* Prepare CB. */
+    cbw.CBWCB[0] = ScsiCommandOperationCode_WriteSame10;    /* Operation code. */
+    cbw.CBWCB[1] = (unmap ? (1 << 3) : 0);                  /* Request unmapped blocks (if needed). */
+    memcpy(&(cbw.CBWCB[2]), &block_addr, sizeof(u32));      /* LBA (big endian). */
+    memcpy(&(cbw.CBWCB[7]), &block_count, sizeof(u16));     /* Number of logical blocks (big endian). */
+
+    /* Send command. */
+    USBHSFS_LOG_MSG("Sending command (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
+    return usbHsFsScsiTransferCommandEx(drive_ctx, &cbw, data);
+}
+
+/* Reference: https://www.seagate.com/files/staticfiles/support/docs/manual/Interface%20manuals/100293068j.pdf (Write Same (16) command). */
+static bool usbHsFsScsiSendWriteSame16Command(UsbHsFsDriveContext *drive_ctx, u8 lun, const ScsiDataBuffer *data, u64 block_addr, u32 block_count, u32 block_length, bool unmap)
+{
+    /* Prepare CBW. A single logical block is transferred, regardless of the number of blocks being written. */
+    ScsiCommandBlockWrapper cbw = {0};
+    usbHsFsScsiPrepareCommandBlockWrapper(&cbw, block_length, false, lun, 16);
+
+    /* Byteswap data. */
+    block_addr = __builtin_bswap64(block_addr);
+    block_count = __builtin_bswap32(block_count);
+
+    /* Prepare CB. */
+    cbw.CBWCB[0] = ScsiCommandOperationCode_WriteSame16;    /* Operation code. */
+    cbw.CBWCB[1] = (unmap ? (1 << 3) : 0);                  /* Request unmapped blocks (if needed). */
+    memcpy(&(cbw.CBWCB[2]), &block_addr, sizeof(u64));      /* LBA (big endian). */
+    memcpy(&(cbw.CBWCB[10]), &block_count, sizeof(u32));    /* Number of logical blocks (big endian). */
+
+    /* Send command. */
+    USBHSFS_LOG_MSG("Sending command (interface %d, LUN %u).", drive_ctx->usb_if_id, lun);
+    return usbHsFsScsiTransferCommandEx(drive_ctx, &cbw, data);
+}
+
+static bool usbHsFsScsiGetVitalProductDataPage(UsbHsFsDriveContext *drive_ctx, u8 lun, u8 page_code, void *buf, u16 buf_size, u16 *out_size)
+{
+    u16 page_size = 0;
+
+    if (buf_size < sizeof(ScsiInquiryUnitSerialNumberPageHeader)) return false;
+
+    /* We'll first retrieve the VPD page header (in order to get the page length), then we'll retrieve the full VPD page. */
+    if (!usbHsFsScsiSendInquiryCommand(drive_ctx, lun, true, page_code, sizeof(ScsiInquiryUnitSerialNumberPageHeader), buf)) return false;
+
+    ScsiInquiryUnitSerialNumberPageHeader *header = (ScsiInquiryUnitSerialNumberPageHeader*)buf;
+    if (header->page_code != page_code) return false;
+
+    page_size = (sizeof(ScsiInquiryUnitSerialNumberPageHeader) + header->page_length);
+    if (page_size > buf_size) page_size = buf_size;
+
+    if (page_size > sizeof(ScsiInquiryUnitSerialNumberPageHeader) && !usbHsFsScsiSendInquiryCommand(drive_ctx, lun, true, page_code, page_size, buf)) return false;
+
+    USBHSFS_LOG_DATA(buf, page_size, "VPD page 0x%02X data (interface %d, LUN %u):", page_code, drive_ctx->usb_if_id, lun);
+
+    *out_size = page_size;
+
+    return true;
+}
+
+static void usbHsFsScsiProbeLogicalUnitWriteSame(UsbHsFsDriveLogicalUnitContext *lun_ctx)
+{
+    UsbHsFsDriveContext *drive_ctx = (UsbHsFsDriveContext*)lun_ctx->drive_ctx;
+    u8 lun = lun_ctx->lun;
+
+    u8 vpd_buf[SCSI_VPD_PAGE_BUF_SIZE] = {0};
+    u16 vpd_size = 0;
+    bool block_limits_supported = false, lbp_supported = false;
+
+    ScsiInquiryBlockLimitsPage block_limits_page = {0};
+    ScsiInquiryLogicalBlockProvisioningPage lbp_page = {0};
+    u64 max_write_same_length = 0;
+
+    lun_ctx->write_same_probed = true;
+    lun_ctx->write_same_supported = lun_ctx->write_same_unmap = false;
+    lun_ctx->max_write_same_block_count = 0;
+
+    /* Write Same commands are optional and poorly supported by USB bridges. Only use them if the LUN explicitly reports a max Write Same length through the Block Limits VPD page. */
+    if (drive_ctx->quirks & UsbHsFsDeviceQuirks_NoVpdInquiry) return;
+
+    /* Check which VPD pages are supported by this LUN. */
+    if (!usbHsFsScsiGetVitalProductDataPage(drive_ctx, lun, ScsiInquiryVitalProductDataPageCode_SupportedVpdPages, vpd_buf, sizeof(vpd_buf), &vpd_size)) return;
+
+    for(u16 i = sizeof(ScsiInquiryUnitSerialNumberPageHeader); i < vpd_size; i++)
+    {
+        if (vpd_buf[i] == ScsiInquiryVitalProductDataPageCode_BlockLimits) block_limits_supported = true;
+        if (vpd_buf[i] == ScsiInquiryVitalProductDataPageCode_LogicalBlockProvisioning) lbp_supported = true;
+    }
+
+    if (!block_limits_supported) return;
+
+    /* Get Block Limits VPD page. */
+    memset(vpd_buf, 0, sizeof(vpd_buf));
+    if (!usbHsFsScsiGetVitalProductDataPage(drive_ctx, lun, ScsiInquiryVitalProductDataPageCode_BlockLimits, vpd_buf, sizeof(vpd_buf), &vpd_size) || \
+        vpd_size < (offsetof(ScsiInquiryBlockLimitsPage, max_write_same_length) + sizeof(u64))) return;
+
+    memcpy(&block_limits_page, vpd_buf, (vpd_size > sizeof(ScsiInquiryBlockLimitsPage) ? sizeof(ScsiInquiryBlockLimitsPage) : vpd_size));
+
+    max_write_same_length = __builtin_bswap64(block_limits_page.max_write_same_length);
+    if (!max_write_same_length) return;
+
+    /* Cap the number of blocks per command using the CDB limits and our own size limit. */
+    if (max_write_same_length > (lun_ctx->long_lba ? UINT32_MAX : UINT16_MAX)) max_write_same_length = (lun_ctx->long_lba ? UINT32_MAX : UINT16_MAX);
+    if (max_write_same_length > ((u32)SCSI_WRITE_SAME_MAX_SIZE >> lun_ctx->block_length_log2)) max_write_same_length = ((u32)SCSI_WRITE_SAME_MAX_SIZE >> lun_ctx->block_length_log2);
+
+    lun_ctx->max_write_same_block_count = (u32)max_write_same_length;
+    lun_ctx->write_same_supported = true;
+
+    /* Get Logical Block Provisioning VPD page. Unmapping is only requested if unmapped blocks are guaranteed to read back as zeros. */
+    memset(vpd_buf, 0, sizeof(vpd_buf));
+    if (lbp_supported && usbHsFsScsiGetVitalProductDataPage(drive_ctx, lun, ScsiInquiryVitalProductDataPageCode_LogicalBlockProvisioning, vpd_buf, sizeof(vpd_buf), &vpd_size) && \
+        vpd_size >= sizeof(ScsiInquiryLogicalBlockProvisioningPage))
+    {
+        memcpy(&lbp_page, vpd_buf, sizeof(ScsiInquiryLogicalBlockProvisioningPage));
+        lun_ctx->write_same_unmap = (lbp_page.lbprz && (lun_ctx->long_lba ? lbp_page.lbpws : lbp_page.lbpws10));
+    }
+
+    USBHSFS_LOG_MSG("Write Same supported (max block count: 0x%X, unmap: %u) (interface %d, LUN %u).", lun_ctx->max_write_same_block_count, lun_ctx->write_same_unmap, drive_ctx->usb_if_id, lun);
+}
+
+static bool usbHsFsScsiGetCachingModePage(UsbHsFsDriveContext *drive_ctx, u8 lun, bool mode_sense_10, ScsiCachingModePage *out_page)
+{
+    u8 mode_buf[SCSI_MODE_PARAMETER_BUF_SIZE] = {0};
+    u32 header_size = (mode_sense_10 ? sizeof(ScsiModeParameterHeader10) : sizeof(ScsiModeParameterHeader6)), data_size = 0, page_offset = 0, page_size = 0;
+    ScsiCachingModePage *page = NULL;
+
+    /* We'll first retrieve the mode parameter header (in order to get the mode data length), then we'll retrieve the full mode parameter data. */
+    for(u8 i = 0; i < 2; i++)
+    {
+        u32 allocation_length = (i == 0 ? header_size : data_size);
+
+        if (mode_sense_10)
+        {
+            if (!usbHsFsScsiSendModeSense10Command(drive_ctx, lun, false, ScsiModeSensePageControl_CurrentValues, SCSI_MODE_PAGE_CODE_CACHING, SCSI_MODE_SUBPAGE_CODE_ALL_NO_SUBPAGES, \
+                                                   (u16)allocation_length, mode_buf)) return false;
+
+            ScsiModeParameterHeader10 *mode_parameter_header_10 = (ScsiModeParameterHeader10*)mode_buf;
+            if (i == 0) data_size = (__builtin_bswap16(mode_parameter_header_10->mode_data_length) + sizeof(u16));
+            page_offset = (header_size + __builtin_bswap16(mode_parameter_header_10->block_desc_length));
+        } else {
+            if (!usbHsFsScsiSendModeSense6Command(drive_ctx, lun, ScsiModeSensePageControl_CurrentValues, SCSI_MODE_PAGE_CODE_CACHING, SCSI_MODE_SUBPAGE_CODE_ALL_NO_SUBPAGES, \
+                                                  (u8)allocation_length, mode_buf)) return false;
+
+            ScsiModeParameterHeader6 *mode_parameter_header_6 = (ScsiModeParameterHeader6*)mode_buf;
+            if (i == 0) data_size = (mode_parameter_header_6->mode_data_length + sizeof(u8));
+            page_offset = (header_size + mode_parameter_header_6->block_desc_length);
+        }
+
+        /* Make sure the mode parameter data fits in our buffer and that it actually holds a mode page. */
+        if (data_size > sizeof(mode_buf)) data_size = sizeof(mode_buf);
+        if ((page_offset + 3) > data_size) return false;
+    }
+
+    USBHSFS_LOG_DATA(mode_buf, data_size, "Caching mode page data (interface %d, LUN %u):", drive_ctx->usb_if_id, lun);
+
+    /* Check the mode page. */
+    page = (ScsiCachingModePage*)(mode_buf + page_offset);
+    if (page->page_code != SCSI_MODE_PAGE_CODE_CACHING) return false;
+
+    /* Copy the mode page. The page length doesn't account for the page code and page length fields. */
+    page_size = (page->page_length + 2);
+    if (page_size > (data_size - page_offset)) page_size = (data_size - page_offset);
+    if (page_size > sizeof(ScsiCachingModePage)) page_size = sizeof(ScsiCachingModePage);
+
+    memset(out_page, 0, sizeof(ScsiCachingModePage));
+    memcpy(out_page, page, page_size);
+
+    return true;
+}
+
+static bool usbHsFsScsiSetCachingModePage(UsbHsFsDriveContext *drive_ctx, u8 lun, bool mode_sense_10, const ScsiCachingModePage *page)
+{
+    /* Only send mode pages with the standard length. Any other length would most likely get rejected. */
+    if (page->page_length != SCSI_CACHING_MODE_PAGE_LENGTH) return false;
+
+    u8 mode_buf[SCSI_MODE_PARAMETER_BUF_SIZE] = {0};
+    u32 header_size = (mode_sense_10 ? sizeof(ScsiModeParameterHeader10) : sizeof(ScsiModeParameterHeader6)), data_size = (header_size + sizeof(ScsiCachingModePage));
+    ScsiCachingModePage *out_page = (ScsiCachingModePage*)(mode_buf + header_size);
+
+    /* The mode parameter header is left zeroed out, without block descriptors. The PS bit is reserved in Mode Select parameter data. */
+    memcpy(out_page, page, sizeof(ScsiCachingModePage));
+    out_page->ps = 0;
+
+    /* Send Mode Select SCSI command using the same variant as the Mode Sense command used to retrieve the mode page. */
+    return (mode_sense_10 ? usbHsFsScsiSendModeSelect10Command(drive_ctx, lun, (u16)data_size, mode_buf) : usbHsFsScsiSendModeSelect6Command(drive_ctx, lun, (u8)data_size, mode_buf));
+}
+
 static void usbHsFsScsiPrepareCommandBlockWrapper(ScsiCommandBlockWrapper *cbw, u32 data_size, bool data_in, u8 lun, u8 cb_size)
 {
     if (!cbw) return;
@@ -1014,15 +1515,20 @@ static void usbHsFsScsiPrepareCommandBlockWrapper(ScsiCommandBlockWrapper *cbw,
 
 static bool usbHsFsScsiTransferCommand(UsbHsFsDriveContext *drive_ctx, ScsiCommandBlockWrapper *cbw, void *buf)
 {
-    if (!drive_ctx || !cbw || (cbw->dCBWDataTransferLength && !buf))
+    ScsiDataBuffer data = { .buf = buf };
+    return usbHsFsScsiTransferCommandEx(drive_ctx, cbw, &data);
+}
+
+static bool usbHsFsScsiTransferCommandEx(UsbHsFsDriveContext *drive_ctx, ScsiCommandBlockWrapper *cbw, const ScsiDataBuffer *data)
+{
+    if (!drive_ctx || !cbw || !data || (cbw->dCBWDataTransferLength && !data->buf && !data->segment_count && !data->zero))
     {
         USBHSFS_LOG_MSG("Invalid parameters!");
         return false;
     }
 
     Result rc = 0;
-    u8 *data_buf = (u8*)buf;
-    u32 blksize = USB_XFER_BUF_SIZE;
+    u32 blksize = drive_ctx->xfer_buf_size;
     u32 data_size = cbw->dCBWDataTransferLength, data_transferred = 0;
 
     ScsiCommandStatusWrapper csw = {0};
@@ -1045,7 +1551,7 @@ static bool usbHsFsScsiTransferCommand(UsbHsFsDriveContext *drive_ctx, ScsiComma
         bool xfer_success = false;
 
         /* If we're sending data, copy it to the USB transfer buffer. */
-        if (!receive) memcpy(xfer_buf, data_buf + data_transferred, xfer_size);
+        if (!receive) usbHsFsScsiCopyDataBuffer(data, data_transferred, xfer_buf, xfer_size, false);
 
         /* Transfer data. */
         rc = usbHsFsRequestPostBuffer(usb_if_session, usb_ep_session, xfer_buf, xfer_size, &rest_size, false);
@@ -1088,7 +1594,7 @@ static bool usbHsFsScsiTransferCommand(UsbHsFsDriveContext *drive_ctx, ScsiComma
             {
                 /* If we're receiving data, copy it to the provided buffer. */
                 /* Otherwise, we'll lose any potential meaningful data while trying to retrieve a CSW in the next step. */
-                if (receive && rest_size) memcpy(data_buf + data_transferred, xfer_buf, rest_size);
+                if (receive && rest_size) usbHsFsScsiCopyDataBuffer(data, data_transferred, xfer_buf, rest_size, true);
 
                 /* Try to receive a CSW. */
                 /* TODO: some devices STALL their endpoints if dCBWDataTransferLength exceeds the amount of data that can be provided for the current SCSI command. */
@@ -1114,7 +1620,7 @@ static bool usbHsFsScsiTransferCommand(UsbHsFsDriveContext *drive_ctx, ScsiComma
                     data_size = progress;
                     data_transferred += rest_size;
 
-                    if (receive && diff) memset(data_buf + progress, 0, diff);
+                    if (receive && diff) usbHsFsScsiCopyDataBuffer(data, progress, NULL, diff, true);
                 }
 
                 /* Break out of the loop and go into the Request Sense section, regardless of the meaningful data condition. */
@@ -1129,7 +1635,7 @@ static bool usbHsFsScsiTransferCommand(UsbHsFsDriveContext *drive_ctx, ScsiComma
         }
 
         /* If we're receiving data, copy it to the provided buffer. */
-        if (receive) memcpy(data_buf + data_transferred, xfer_buf, xfer_size);
+        if (receive) usbHsFsScsiCopyDataBuffer(data, data_transferred, xfer_buf, xfer_size, true);
 
         /* Update transferred data size. */
         data_transferred += xfer_size;
@@ -1180,7 +1686,7 @@ req_sense:
             case ScsiSenseKey_AbortedCommand:
                 /* Retry command once more. */
                 USBHSFS_LOG_MSG("Retrying command 0x%02X (0x%X) (interface %d, LUN %u).", cbw->CBWCB[0], sense_data.sense_key, drive_ctx->usb_if_id, cbw->bCBWLUN);
-                ret = usbHsFsScsiTransferCommand(drive_ctx, cbw, buf);
+                ret = usbHsFsScsiTransferCommandEx(drive_ctx, cbw, data);
                 break;
             default:
                 /* Unrecoverable error. */
@@ -1194,6 +1700,171 @@ end:
     return ret;
 }
 
+static void usbHsFsScsiCopyDataBuffer(const ScsiDataBuffer *data, u64 offset, void *ptr, u64 size, bool to_data_buf)
+{
+    u8 *ptr_u8 = (u8*)ptr;
+
+    /* Zero-filled data buffers have no backing memory. */
+    if (data->zero)
+    {
+        if (!to_data_buf && ptr_u8) memset(ptr_u8, 0, size);
+        return;
+    }
+
+    offset += data->offset;
+
+    for(u32 i = 0; i < (data->segment_count ? data->segment_count : 1) && size; i++)
+    {
+        /* Flat buffers are handled as a single segment with no size limit. */
+        const UsbHsFsScsiBlockIoSegment *segment = (data->segment_count ? &(data->segments[i]) : NULL);
+        u64 segment_size = (segment ? ((u64)segment->block_count << data->block_length_log2) : (offset + size)), chunk_size = 0;
+        u8 *buf = (u8*)(segment ? segment->buf : data->buf);
+
+        /* Skip segments located before the provided offset. */
+        if (offset >= segment_size)
+        {
+            offset -= segment_size;
+            continue;
+        }
+
+        chunk_size = ((segment_size - offset) > size ? size : (segment_size - offset));
+        buf += offset;
+
+        if (to_data_buf)
+        {
+            /* A NULL pointer means the data buffer region must be zeroed out. */
+            if (ptr_u8)
+            {
+                memcpy(buf, ptr_u8, chunk_size);
+            } else {
+                memset(buf, 0, chunk_size);
+            }
+        } else {
+            memcpy(ptr_u8, buf, chunk_size);
+        }
+
+        if (ptr_u8) ptr_u8 += chunk_size;
+        size -= chunk_size;
+        offset = 0;
+    }
+}
+
+static bool usbHsFsScsiTransferLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, const UsbHsFsScsiBlockIoSegment *segments, u32 segment_count, bool write)
+{
+    UsbHsFsDriveContext *drive_ctx = (UsbHsFsDriveContext*)lun_ctx->drive_ctx;
+    u8 lun = lun_ctx->lun;
+    u32 block_length = lun_ctx->block_length, cmd_max_block_count = lun_ctx->max_block_count, buf_block_count = (drive_ctx->xfer_buf_size >> lun_ctx->block_length_log2), max_block_count_per_loop = 0;
+    bool fua = (lun_ctx->fua_supported && !lun_ctx->write_back), long_lba = lun_ctx->long_lba, cmd = false;
+
+    /* Make sure write protection is disabled. */
+    if (write && lun_ctx->write_protect)
+    {
+        USBHSFS_LOG_MSG("Error: write protection enabled! (interface %d, LUN %u).", lun_ctx->usb_if_id, lun);
+        return false;
+    }
+
+    /* Optimize transfers by issuing commands with block counts aligned to the transfer buffer size. Reserve short packets for the last Read/Write command (if needed). */
+    /* Max block counts smaller than the transfer buffer (set through the device quirks table) are used as-is. */
+    max_block_count_per_loop = (cmd_max_block_count >= buf_block_count ? ALIGN_DOWN(cmd_max_block_count, buf_block_count) : cmd_max_block_count);
+
+    for(u32 i = 0; i < segment_count;)
+    {
+        /* Merge LBA-adjacent segments into a single run. Their buffers don't need to be contiguous in memory. */
+        /* This lets us issue a single Read/Write command for the whole run instead of one command per segment. */
+        u64 cur_block_addr = segments[i].block_addr, block_count = segments[i].block_count, data_transferred = 0;
+        u32 run_count = 1;
+
+        while((i + run_count) < segment_count && segments[i + run_count].block_addr == (cur_block_addr + block_count))
+        {
+            block_count += segments[i + run_count].block_count;
+            run_count++;
+        }
+
+        ScsiDataBuffer data = { .buf = NULL, .segments = &(segments[i]), .segment_count = run_count, .block_length_log2 = lun_ctx->block_length_log2, .offset = 0 };
+
+        /* Transfer data using a loop. */
+        while(block_count)
+        {
+            /* Determine number of blocks to transfer based on our limit. */
+            u32 xfer_block_count = (u32)(block_count > max_block_count_per_loop ? max_block_count_per_loop : block_count);
+            u64 xfer_size = ((u64)xfer_block_count << lun_ctx->block_length_log2);
+
+            data.offset = data_transferred;
+
+            if (write)
+            {
+                /* Write blocks. */
+                USBHSFS_LOG_MSG("Writing 0x%X block(s) to LBA 0x%lX (0x%lX byte[s], %u segment[s]) (interface %d, LUN %u).", xfer_block_count, cur_block_addr, xfer_size, run_count, lun_ctx->usb_if_id, lun);
+                cmd = (long_lba ? usbHsFsScsiSendWrite16Command(drive_ctx, lun, &data, cur_block_addr, xfer_block_count, block_length, fua) : \
+                                  usbHsFsScsiSendWrite10Command(drive_ctx, lun, &data, (u32)cur_block_addr, (u16)xfer_block_count, block_length, fua));
+            } else {
+                /* Read blocks. */
+                USBHSFS_LOG_MSG("Reading 0x%X block(s) from LBA 0x%lX (0x%lX byte[s], %u segment[s]) (interface %d, LUN %u).", xfer_block_count, cur_block_addr, xfer_size, run_count, lun_ctx->usb_if_id, lun);
+                cmd = (long_lba ? usbHsFsScsiSendRead16Command(drive_ctx, lun, &data, cur_block_addr, xfer_block_count, block_length, fua) : \
+                                  usbHsFsScsiSendRead10Command(drive_ctx, lun, &data, (u32)cur_block_addr, (u16)xfer_block_count, block_length, fua));
+            }
+
+            if (!cmd) return false;
+
+            /* Update data. */
+            data_transferred += xfer_size;
+            cur_block_addr += xfer_block_count;
+            block_count -= xfer_block_count;
+        }
+
+        i += run_count;
+    }
+
+    return true;
+}
+
+static void usbHsFsScsiSortBlockIoSegments(UsbHsFsScsiBlockIoSegment *segments, u32 segment_count)
+{
+    /* Stable insertion sort by LBA. Segment lists are usually short and mostly sorted already. */
+    for(u32 i = 1; i < segment_count; i++)
+    {
+        UsbHsFsScsiBlockIoSegment tmp = segments[i];
+        u32 j = i;
+
+        while(j > 0 && segments[j - 1].block_addr > tmp.block_addr)
+        {
+            segments[j] = segments[j - 1];
+            j--;
+        }
+
+        segments[j] = tmp;
+    }
+}
+
+static bool usbHsFsScsiWriteZeroedLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, u64 block_addr, u64 block_count)
+{
+    UsbHsFsDriveContext *drive_ctx = (UsbHsFsDriveContext*)lun_ctx->drive_ctx;
+    u8 lun = lun_ctx->lun;
+    u32 block_length = lun_ctx->block_length, cmd_max_block_count = lun_ctx->max_block_count, buf_block_count = (drive_ctx->xfer_buf_size >> lun_ctx->block_length_log2), max_block_count_per_loop = 0;
+    bool fua = (lun_ctx->fua_supported && !lun_ctx->write_back), long_lba = lun_ctx->long_lba;
+
+    /* Zeroed out data is generated straight into the USB transfer buffer, so no source buffer is needed. */
+    ScsiDataBuffer data = { .buf = NULL, .segments = NULL, .segment_count = 0, .block_length_log2 = lun_ctx->block_length_log2, .offset = 0, .zero = true };
+
+    /* Use the same block count limits as regular Write commands. */
+    max_block_count_per_loop = (cmd_max_block_count >= buf_block_count ? ALIGN_DOWN(cmd_max_block_count, buf_block_count) : cmd_max_block_count);
+
+    while(block_count)
+    {
+        u32 xfer_block_count = (u32)(block_count > max_block_count_per_loop ? max_block_count_per_loop : block_count);
+
+        USBHSFS_LOG_MSG("Zeroing 0x%X block(s) at LBA 0x%lX via Write (interface %d, LUN %u).", xfer_block_count, block_addr, lun_ctx->usb_if_id, lun);
+
+        if (!(long_lba ? usbHsFsScsiSendWrite16Command(drive_ctx, lun, &data, block_addr, xfer_block_count, block_length, fua) : \
+                         usbHsFsScsiSendWrite10Command(drive_ctx, lun, &data, (u32)block_addr, (u16)xfer_block_count, block_length, fua))) return false;
+
+        block_addr += xfer_block_count;
+        block_count -= xfer_block_count;
+    }
+
+    return true;
+}
+
 /* Reference: https://www.usb.org/sites/default/files/usbmassbulk_10.pdf (pages 17 through 22). */
 static bool usbHsFsScsiSendCommandBlockWrapper(UsbHsFsDriveContext *drive_ctx, ScsiCommandBlockWrapper *cbw)
 {
@@ -14,14 +14,37 @@
 
 #include "usbhsfs_manager.h"
 
+/// Block I/O segment used with usbHsFsScsiReadLogicalUnitBlocksV() and usbHsFsScsiWriteLogicalUnitBlocksV().
+typedef struct {
+    u64 block_addr;     ///< Starting LBA.
+    u32 block_count;    ///< Number of logical blocks.
+    void *buf;          ///< Data buffer. Must be at least (block_count * block_length) bytes long.
+} UsbHsFsScsiBlockIoSegment;
+
 /// None of these functions are thread safe - make sure to (un)lock mutexes elsewhere.
 
 /// Starts the LUN represented by the provided LUN context using SCSI commands and fills the LUN context.
 bool usbHsFsScsiStartDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx);
 
 /// Stops the LUN represented by the provided LUN context using SCSI commands, as long as it's removable (returns right away if it isn't).
+/// The write cache from the LUN is flushed beforehand if write-back caching is in use, regardless of the removable status.
 void usbHsFsScsiStopDriveLogicalUnit(UsbHsFsDriveLogicalUnitContext *lun_ctx);
 
+/// Sends a Test Unit Ready command to the provided LUN, retrying a few times if a Unit Attention condition is reported.
+/// Unlike the rest of the SCSI command handling code, this doesn't wait for LUNs that aren't ready. Used to probe drives without a full LUN context.
+bool usbHsFsScsiCheckDriveLogicalUnitReady(UsbHsFsDriveContext *drive_ctx, u8 lun);
+
+/// Flushes the volatile write cache from the LUN represented by the provided LUN context using a Synchronize Cache command.
+/// Returns true right away if write-back caching isn't in use by this LUN (see usbHsFsScsiSetEnableWriteCache()). Suitable for filesystem libraries.
+bool usbHsFsScsiSynchronizeLogicalUnitCache(UsbHsFsDriveLogicalUnitContext *lun_ctx);
+
+/// Returns the current write caching setting.
+bool usbHsFsScsiGetEnableWriteCache(void);
+
+/// Sets the write caching setting used by usbHsFsScsiStartDriveLogicalUnit(). If enabled, the volatile write cache from LUNs started afterwards is enabled via Mode Select if needed,
+/// Write commands are issued without FUA and the write cache is only flushed via usbHsFsScsiSynchronizeLogicalUnitCache().
+void usbHsFsScsiSetEnableWriteCache(bool enable);
+
 /// Reads logical blocks from a LUN using the provided LUN context. Suitable for filesystem libraries.
 /// In order to speed up transfers, this function performs no checks on the provided arguments.
 bool usbHsFsScsiReadLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, void *buf, u64 block_addr, u32 block_count);
@@ -30,4 +53,18 @@ bool usbHsFsScsiReadLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, v
 /// In order to speed up transfers, this function performs no checks on the provided arguments.
 bool usbHsFsScsiWriteLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, const void *buf, u64 block_addr, u32 block_count);
 
+/// Vectored (scatter-gather) version of usbHsFsScsiReadLogicalUnitBlocks(). Suitable for filesystem libraries.
+/// The provided segment list is sorted in place by LBA, and LBA-adjacent segments are merged into a single Read command regardless of where their buffers are located in memory.
+/// Segments must not overlap. In order to speed up transfers, this function performs no checks on the provided arguments.
+bool usbHsFsScsiReadLogicalUnitBlocksV(UsbHsFsDriveLogicalUnitContext *lun_ctx, UsbHsFsScsiBlockIoSegment *segments, u32 segment_count);
+
+/// Vectored (scatter-gather) version of usbHsFsScsiWriteLogicalUnitBlocks(). Suitable for filesystem libraries.
+/// The provided segment list is sorted in place by LBA, and LBA-adjacent segments are merged into a single Write command regardless of where their buffers are located in memory.
+/// Segments must not overlap. In order to speed up transfers, this function performs no checks on the provided arguments.
+bool usbHsFsScsiWriteLogicalUnitBlocksV(UsbHsFsDriveLogicalUnitContext *lun_ctx, UsbHsFsScsiBlockIoSegment *segments, u32 segment_count);
+
+/// Zeroes out logical blocks from a LUN using the provided LUN context.
+/// Write Same commands are used if the LUN reports support for them, requesting unmapped blocks if they're guaranteed to read back as zeros. Falls back to regular Write commands otherwise.
+bool usbHsFsScsiZeroLogicalUnitBlocks(UsbHsFsDriveLogicalUnitContext *lun_ctx, u64 block_addr, u64 block_count);
+
 #endif  /* __USBHSFS_SCSI_H__ */
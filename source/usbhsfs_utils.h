@@ -27,6 +27,7 @@
 #include "usbhsfs_log.h"
 
 #define ALIGN_DOWN(x, y)        ((x) & ~((y) - 1))
+#define ALIGN_UP(x, y)          (((x) + ((y) - 1)) & ~((y) - 1))
 
 #define SCOPED_LOCK(mtx)        for(UsbHsFsUtilsScopedLock scoped_lock __attribute__((__cleanup__(usbHsFsUtilsUnlockScope))) = usbHsFsUtilsLockScope(mtx); scoped_lock.cond; scoped_lock.cond = 0)
 